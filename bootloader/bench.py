@@ -0,0 +1,355 @@
+#!/usr/bin/env python3
+# -*- coding: utf-8 -*-
+
+# bench.py - cycle-count benchmark for the ISP bootloader under ucsim (s51)
+#
+# Copyright (c) 2023-2024 Nikita Lita
+#
+# Permission is hereby granted, free of charge, to any person obtaining
+# a copy of this software and associated documentation files (the
+# "Software"), to deal in the Software without restriction, including
+# without limitation the rights to use, copy, modify, merge, publish,
+# distribute, sublicense, and/or sell copies of the Software, and to
+# permit persons to whom the Software is furnished to do so, subject to
+# the following conditions:
+#
+# The above copyright notice and this permission notice shall be included
+# in all copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+# EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+# MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+# IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+# CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+# TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+# SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+# Runs the built bootloader .ihx under s51, feeds it a scripted ISP session
+# through the simulated UART0 and reports, for every command:
+#   proc: clocks from the ISR for the last received byte to the start of the reply
+#         (i.e. the cost of the command itself: update(), dump(), Package_checksum(), ...)
+#   send: clocks spent in Send_64byte_To_UART0() until the main loop is back
+#         (mostly waiting for TI at the simulated baud rate)
+# followed by the code size of the image.
+#
+# s51 models a classic 12T 8051, not the 1T core of the N76E003, so the counts are
+# only meaningful relative to each other, e.g. before and after a change.
+
+import getopt
+import os
+import queue
+import re
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+CMD_UPDATE_APROM = 0xa0
+CMD_UPDATE_CONFIG = 0xa1
+CMD_READ_CONFIG = 0xa2
+CMD_ERASE_ALL = 0xa3
+CMD_GET_FWVER = 0xa6
+CMD_CONNECT = 0xae
+CMD_GET_DEVICEID = 0xb1
+CMD_GET_FLASHMODE = 0xca
+CMD_FORMAT2_CONTINUATION = 0x00
+CMD_READ_ROM = 0xa5
+CMD_GET_UID = 0xb2
+CMD_GET_CID = 0xb3
+CMD_GET_UCID = 0xb4
+CMD_ISP_PAGE_ERASE = 0xd5
+
+PACKSIZE = 64
+INITIAL_UPDATE_PKT_SIZE = 48
+SEQ_UPDATE_PKT_SIZE = 56
+DUMP_DATA_SIZE = 56
+CODE_SIZE = 2048
+
+# packets of data following the initial UPDATE_APROM / READ_ROM packet
+UPDATE_PACKETS = 8
+DUMP_PACKETS = 8
+
+SYMBOLS = ["_Serial_ISR", "_Send_64byte_To_UART0"]
+
+STEP_TIMEOUT = 30
+
+
+def pack_u32(val):
+    return bytes([val & 0xff, (val >> 8) & 0xff, (val >> 16) & 0xff, (val >> 24) & 0xff])
+
+
+def make_packet(cmd, seq, data=bytes()):
+    pkt = pack_u32(cmd) + pack_u32(seq) + data
+    return pkt + bytes(PACKSIZE - len(pkt))
+
+
+def isp_script():
+    """
+    The benchmark session as a list of (label, cmd, data)
+    """
+    update_size = INITIAL_UPDATE_PKT_SIZE + UPDATE_PACKETS * SEQ_UPDATE_PKT_SIZE
+    dump_size = (DUMP_PACKETS + 1) * DUMP_DATA_SIZE
+    image = bytes((i * 7 + 3) & 0xff for i in range(update_size))
+    addr_len = lambda addr, size: pack_u32(addr) + pack_u32(size)
+
+    script = [
+        ("CONNECT", CMD_CONNECT, bytes()),
+        ("GET_FWVER", CMD_GET_FWVER, bytes()),
+        ("GET_DEVICEID", CMD_GET_DEVICEID, bytes()),
+        ("GET_UID", CMD_GET_UID, bytes()),
+        ("GET_CID", CMD_GET_CID, bytes()),
+        ("GET_UCID", CMD_GET_UCID, bytes()),
+        ("GET_FLASHMODE", CMD_GET_FLASHMODE, bytes()),
+        ("READ_CONFIG", CMD_READ_CONFIG, bytes()),
+        ("UPDATE_CONFIG", CMD_UPDATE_CONFIG, bytes([0xff, 0xff, 0xff, 0xff, 0xff])),
+        ("ISP_PAGE_ERASE", CMD_ISP_PAGE_ERASE, addr_len(0, 128)),
+        ("ERASE_ALL", CMD_ERASE_ALL, bytes()),
+        ("UPDATE_APROM", CMD_UPDATE_APROM, addr_len(0, update_size) + image[:INITIAL_UPDATE_PKT_SIZE]),
+    ]
+    for i in range(UPDATE_PACKETS):
+        start = INITIAL_UPDATE_PKT_SIZE + i * SEQ_UPDATE_PKT_SIZE
+        script.append(("UPDATE_APROM (cont)", CMD_FORMAT2_CONTINUATION, image[start:start + SEQ_UPDATE_PKT_SIZE]))
+    script.append(("READ_ROM", CMD_READ_ROM, addr_len(0, dump_size)))
+    for i in range(DUMP_PACKETS):
+        script.append(("READ_ROM (cont)", CMD_FORMAT2_CONTINUATION, bytes()))
+    return script
+
+
+def read_symbols(map_file):
+    syms = {}
+    sym_re = re.compile(r"^\s*(?:C:)?\s*([0-9A-Fa-f]{4,8})\s+(_\w+)\b")
+    with open(map_file, "r") as f:
+        for line in f:
+            m = sym_re.match(line)
+            if m and m.group(2) in SYMBOLS and m.group(2) not in syms:
+                syms[m.group(2)] = int(m.group(1), 16)
+    return syms
+
+
+def code_size(ihx_file):
+    """
+    Returns (bytes used, end address) of the code in an Intel HEX file
+    """
+    used = 0
+    end = 0
+    base = 0
+    with open(ihx_file, "r") as f:
+        for line in f:
+            line = line.strip()
+            if not line.startswith(":"):
+                continue
+            rec = bytes.fromhex(line[1:])
+            count, addr, rtype = rec[0], (rec[1] << 8) | rec[2], rec[3]
+            if rtype == 0x00:
+                used += count
+                end = max(end, base + addr + count)
+            elif rtype == 0x04:
+                base = ((rec[4] << 8) | rec[5]) << 16
+            elif rtype == 0x01:
+                break
+    return used, end
+
+
+class S51:
+    """
+    Drives the s51 command console over a pipe
+    """
+
+    def __init__(self, s51, ihx_file, serial_in, serial_out):
+        args = [s51, "-t", "8051", "-S", "in={},out={}".format(serial_in, serial_out), ihx_file]
+        self.proc = subprocess.Popen(args, stdin=subprocess.PIPE, stdout=subprocess.PIPE,
+                                     stderr=subprocess.STDOUT, bufsize=0)
+        self.output = queue.Queue()
+        self.buf = ""
+        threading.Thread(target=self._reader, daemon=True).start()
+
+    def _reader(self):
+        while True:
+            data = self.proc.stdout.read(1)
+            if not data:
+                self.output.put(None)
+                return
+            self.output.put(data.decode("latin-1"))
+
+    def expect(self, pattern, timeout=STEP_TIMEOUT):
+        regex = re.compile(pattern)
+        deadline = time.monotonic() + timeout
+        while True:
+            m = regex.search(self.buf)
+            if m:
+                self.buf = self.buf[m.end():]
+                return m
+            remaining = deadline - time.monotonic()
+            if remaining <= 0:
+                raise TimeoutError("s51: timed out waiting for '{}'".format(pattern))
+            try:
+                data = self.output.get(timeout=remaining)
+            except queue.Empty:
+                continue
+            if data is None:
+                raise EOFError("s51 exited:\n" + self.buf)
+            self.buf += data
+
+    def command(self, cmd):
+        self.proc.stdin.write((cmd + "\n").encode())
+
+    def set_break(self, addr):
+        self.command("break 0x{:x}".format(addr))
+        self.expect(r"Breakpoint \d+ at")
+
+    def run(self):
+        """
+        Runs until the next breakpoint; returns (pc, clocks)
+        """
+        self.command("run")
+        pc = int(self.expect(r"Stop at 0x([0-9a-fA-F]+)").group(1), 16)
+        self.command("state")
+        clks = int(self.expect(r"Total time since last reset=.*?\((\d+) clks\)").group(1))
+        return pc, clks
+
+    def close(self):
+        try:
+            self.command("kill")
+            self.command("quit")
+            self.proc.stdin.close()
+            self.proc.wait(timeout=5)
+        except Exception:
+            self.proc.kill()
+
+
+def open_writer(fifo, sim, timeout=STEP_TIMEOUT):
+    # s51 opens the other end once it has loaded the image; don't block forever if it never does
+    deadline = time.monotonic() + timeout
+    while True:
+        try:
+            return os.open(fifo, os.O_WRONLY | os.O_NONBLOCK)
+        except OSError:
+            if sim.proc.poll() is not None or time.monotonic() > deadline:
+                sim.close()
+                raise Exception("s51 did not open the serial input")
+            time.sleep(0.01)
+
+
+def read_reply(fd, timeout=STEP_TIMEOUT):
+    reply = b""
+    deadline = time.monotonic() + timeout
+    while len(reply) < PACKSIZE and time.monotonic() < deadline:
+        try:
+            data = os.read(fd, PACKSIZE - len(reply))
+        except BlockingIOError:
+            data = b""
+        if not data:
+            time.sleep(0.01)
+        reply += data
+    return reply
+
+
+def run_bench(s51_path, ihx_file, map_file):
+    syms = read_symbols(map_file)
+    for sym in SYMBOLS:
+        if sym not in syms:
+            raise Exception("Symbol {} not found in {}".format(sym, map_file))
+    isr = syms["_Serial_ISR"]
+    send = syms["_Send_64byte_To_UART0"]
+
+    results = []
+    with tempfile.TemporaryDirectory() as tmpdir:
+        serial_in = os.path.join(tmpdir, "uart_in")
+        serial_out = os.path.join(tmpdir, "uart_out")
+        os.mkfifo(serial_in)
+        os.mkfifo(serial_out)
+        out_fd = os.open(serial_out, os.O_RDONLY | os.O_NONBLOCK)
+        sim = S51(s51_path, ihx_file, serial_in, serial_out)
+        in_fd = open_writer(serial_in, sim)
+        try:
+            sim.set_break(isr)
+            sim.set_break(send)
+            seq = 0
+            for label, cmd, data in isp_script():
+                # the bootloader expects the number after the one in its last reply
+                seq = 0 if cmd == CMD_CONNECT else seq + 1
+                pkt = make_packet(cmd, seq, data)
+                os.write(in_fd, pkt)
+                last_rx = None
+                while True:
+                    pc, clks = sim.run()
+                    if pc == isr:
+                        last_rx = clks
+                    elif pc == send:
+                        send_start = clks
+                        break
+                # The reply leaves TI set, so the first interrupt after the main loop re-enables EA marks the end
+                while True:
+                    pc, clks = sim.run()
+                    if pc == isr:
+                        break
+                reply = read_reply(out_fd)
+                if len(reply) != PACKSIZE:
+                    raise Exception("{}: got {} byte reply".format(label, len(reply)))
+                if (reply[0] | (reply[1] << 8)) != sum(pkt) & 0xffff:
+                    raise Exception("{}: bad checksum in reply".format(label))
+                seq = reply[4] | (reply[5] << 8)
+                results.append((label, send_start - last_rx, clks - send_start))
+        finally:
+            sim.close()
+            os.close(in_fd)
+            os.close(out_fd)
+    return results
+
+
+def print_results(results, ihx_file):
+    rows = {}
+    for label, proc, send in results:
+        rows.setdefault(label, []).append((proc, send))
+
+    print("{:<22}{:>6}{:>12}{:>12}{:>12}{:>12}".format("Command", "pkts", "proc avg", "proc min", "proc max", "send avg"))
+    for label, samples in rows.items():
+        procs = [p for p, _ in samples]
+        sends = [s for _, s in samples]
+        print("{:<22}{:>6}{:>12}{:>12}{:>12}{:>12}".format(label, len(samples), sum(procs) // len(procs),
+                                                         min(procs), max(procs), sum(sends) // len(sends)))
+    used, end = code_size(ihx_file)
+    print("\nCode size: {} bytes (ends at 0x{:04x}), {} of {} bytes free".format(used, end, CODE_SIZE - end, CODE_SIZE))
+
+
+def usage():
+    print("Usage: bench.py [-s <s51 path>] [-m <map file>] <bootloader.ihx>")
+    print("Runs a scripted ISP session against the bootloader under s51 and prints clocks per packet and code size.")
+
+
+def main():
+    try:
+        opts, args = getopt.getopt(sys.argv[1:], "s:m:h", ["s51=", "map=", "help"])
+    except getopt.GetoptError as err:
+        print(err)
+        usage()
+        return 2
+    s51_path = "s51"
+    map_file = None
+    for opt, arg in opts:
+        if opt in ("-h", "--help"):
+            usage()
+            return 0
+        elif opt in ("-s", "--s51"):
+            s51_path = arg
+        elif opt in ("-m", "--map"):
+            map_file = arg
+    if len(args) != 1:
+        usage()
+        return 2
+    ihx_file = args[0]
+    if map_file is None:
+        map_file = os.path.splitext(ihx_file)[0] + ".map"
+
+    try:
+        results = run_bench(s51_path, ihx_file, map_file)
+    except Exception as e:
+        print("Benchmark failed: {}".format(e), file=sys.stderr)
+        return 1
+    print_results(results, ihx_file)
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -209,13 +209,21 @@ def build(setup_kwargs):
                 {
                     "sources": [
                         "nuvo51icp/n51_icp.c",
+                        "nuvo51icp/n51_plan.c",
+                        "nuvo51icp/n51_hostprof.c",
+                        "nuvo51icp/n51_gang.c",
+                        "nuvo51icp/n51_resetcache.c",
+                        "nuvo51icp/n51_station.c",
+                        "nuvo51icp/n51_job.c",
+                        "nuvo51icp/n51_devcache.c",
+                        "nuvo51icp/n51_sweep.c",
                         "nuvo51icp/rpi.c",
                         "nuvo51icp/main.c",
                     ],
                     "shared": True,
                     "cflags": ["-g", "-DRPI",  "-DPRINT_CONFIG_EN"],
                     # "include_dir": ...
-                    "libraries": ["gpiod"]
+                    "libraries": ["gpiod", "pthread", "dl"]
                 },
             ),
             (
@@ -223,13 +231,21 @@ def build(setup_kwargs):
                 {
                     "sources": [
                         "nuvo51icp/n51_icp.c",
+                        "nuvo51icp/n51_plan.c",
+                        "nuvo51icp/n51_hostprof.c",
+                        "nuvo51icp/n51_gang.c",
+                        "nuvo51icp/n51_resetcache.c",
+                        "nuvo51icp/n51_station.c",
+                        "nuvo51icp/n51_job.c",
+                        "nuvo51icp/n51_devcache.c",
+                        "nuvo51icp/n51_sweep.c",
                         "nuvo51icp/rpi-pigpio.c",
                         "nuvo51icp/main.c",
                     ],
                     "shared": True,
                     "cflags": ["-g", "-DRPI", "-DPRINT_CONFIG_EN", "-DUSE_PIGPIO"],
                     # "include_dir": ...
-                    "libraries": ["pigpio"]
+                    "libraries": ["pigpio", "pthread", "dl"]
                 },
             )
         ],
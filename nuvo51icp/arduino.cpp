@@ -1,6 +1,7 @@
 #include <Arduino.h>
 
 #include "n51_pgm.h"
+#include "fastpin.h"
 /* Lolin(WeMOS) D1 mini */
 /* 80MHz: 1 cycle = 12.5ns */
 #ifndef ARDUINO_AVR_MEGA2560
@@ -14,67 +15,160 @@
 #endif
 extern "C" {
 
-int N51PGM_init(void)
+struct _n51pgm_ctx {
+  n51pgm_pins pins;
+  uint8_t fast; // the pins are DAT, RST and CLK, which FastPin drives through the port registers
+};
+
+static n51pgm_ctx default_ctx = {{DAT, RST, CLK, -1}, 1};
+
+n51pgm_ctx *N51PGM_ctx_create(const n51pgm_pins *pins)
+{
+  n51pgm_ctx *ctx = (n51pgm_ctx *)malloc(sizeof(n51pgm_ctx));
+  if (!ctx)
+    return NULL;
+  ctx->pins = pins ? *pins : default_ctx.pins;
+  ctx->fast = ctx->pins.dat == DAT && ctx->pins.rst == RST && ctx->pins.clk == CLK;
+  return ctx;
+}
+
+void N51PGM_ctx_free(n51pgm_ctx *ctx)
 {
-  pinMode(CLK, OUTPUT);
-  pinMode(DAT, INPUT);
-  pinMode(RST, OUTPUT);
-  digitalWrite(CLK, LOW);
+  if (ctx != &default_ctx)
+    free(ctx);
+}
+
+n51pgm_ctx *N51PGM_default_ctx(void)
+{
+  return &default_ctx;
+}
+
+int N51PGM_ctx_init(n51pgm_ctx *ctx)
+{
+  pinMode(ctx->pins.clk, OUTPUT);
+  pinMode(ctx->pins.dat, INPUT);
+  pinMode(ctx->pins.rst, OUTPUT);
+  digitalWrite(ctx->pins.clk, LOW);
 
   return 0;
 }
 
+void N51PGM_ctx_set_dat(n51pgm_ctx *ctx, uint8_t val)
+{
+  if (ctx->fast)
+    FastPin<DAT>::write(val);
+  else
+    digitalWrite(ctx->pins.dat, val);
+}
+
+uint8_t N51PGM_ctx_get_dat(n51pgm_ctx *ctx)
+{
+  if (ctx->fast)
+    return FastPin<DAT>::read();
+  return digitalRead(ctx->pins.dat);
+}
+
+void N51PGM_ctx_set_rst(n51pgm_ctx *ctx, uint8_t val)
+{
+  if (ctx->fast)
+    FastPin<RST>::write(val);
+  else
+    digitalWrite(ctx->pins.rst, val);
+}
+
+void N51PGM_ctx_set_clk(n51pgm_ctx *ctx, uint8_t val)
+{
+  if (ctx->fast)
+    FastPin<CLK>::write(val);
+  else
+    digitalWrite(ctx->pins.clk, val);
+}
+
+void N51PGM_ctx_dat_dir(n51pgm_ctx *ctx, uint8_t state)
+{
+  if (ctx->fast)
+    FastPin<DAT>::mode(state);
+  else
+    pinMode(ctx->pins.dat, state ? OUTPUT : INPUT);
+}
+
+void N51PGM_ctx_release_pins(n51pgm_ctx *ctx)
+{
+  pinMode(ctx->pins.clk, INPUT);
+  pinMode(ctx->pins.dat, INPUT);
+  pinMode(ctx->pins.rst, INPUT);
+}
+
+void N51PGM_ctx_set_trigger(n51pgm_ctx *ctx, uint8_t val)
+{
+  if (ctx->pins.trigger >= 0)
+    digitalWrite(ctx->pins.trigger, val);
+}
+
+void N51PGM_ctx_release_rst(n51pgm_ctx *ctx)
+{
+  pinMode(ctx->pins.rst, INPUT);
+}
+
+void N51PGM_ctx_deinit(n51pgm_ctx *ctx, uint8_t leave_reset_high)
+{
+  pinMode(ctx->pins.clk, INPUT);
+  pinMode(ctx->pins.dat, INPUT);
+  if (leave_reset_high){
+    N51PGM_ctx_set_rst(ctx, 1);
+  } else {
+    pinMode(ctx->pins.rst, INPUT);
+  }
+}
+
+int N51PGM_init(void)
+{
+  return N51PGM_ctx_init(&default_ctx);
+}
+
 void N51PGM_set_dat(uint8_t val)
 {
-  digitalWrite(DAT, val);
+  N51PGM_ctx_set_dat(&default_ctx, val);
 }
 
 uint8_t N51PGM_get_dat(void)
 {
-  return digitalRead(DAT);
+  return N51PGM_ctx_get_dat(&default_ctx);
 }
 
 void N51PGM_set_rst(uint8_t val)
 {
-  digitalWrite(RST, val);
+  N51PGM_ctx_set_rst(&default_ctx, val);
 }
 
 void N51PGM_set_clk(uint8_t val)
 {
-  digitalWrite(CLK, val);
+  N51PGM_ctx_set_clk(&default_ctx, val);
 }
 
 void N51PGM_dat_dir(uint8_t state)
 {
-  pinMode(DAT, state ? OUTPUT : INPUT);
+  N51PGM_ctx_dat_dir(&default_ctx, state);
 }
 
 void N51PGM_release_pins(void)
 {
-  pinMode(CLK, INPUT);
-  pinMode(DAT, INPUT);
-  pinMode(RST, INPUT);
+  N51PGM_ctx_release_pins(&default_ctx);
 }
 
 void N51PGM_set_trigger(uint8_t val)
 {
-  /* not implemented */
+  N51PGM_ctx_set_trigger(&default_ctx, val);
 }
 
 void N51PGM_release_rst(void)
 {
-  pinMode(RST, INPUT);
+  N51PGM_ctx_release_rst(&default_ctx);
 }
 
 void N51PGM_deinit(uint8_t leave_reset_high)
 {
-  pinMode(CLK, INPUT);
-  pinMode(DAT, INPUT);
-  if (leave_reset_high){
-    N51PGM_set_rst(1);
-  } else {
-    pinMode(RST, INPUT);
-  }
+  N51PGM_ctx_deinit(&default_ctx, leave_reset_high);
 }
 
 
@@ -95,7 +189,7 @@ void N51PGM_debug_outputf(const char *s, ...)
 #else
 #define DEBUG_OUTPUTF(s, ...)
 #endif
-uint32_t N51PGM_usleep(uint32_t usec)
+uint32_t N51PGM_ctx_usleep(n51pgm_ctx *ctx, uint32_t usec)
 {
   if (usec < 1000) {
     delayMicroseconds(usec);
@@ -112,6 +206,15 @@ uint32_t N51PGM_usleep(uint32_t usec)
   return usec;
 }
 
+uint32_t N51PGM_usleep(uint32_t usec)
+{
+  return N51PGM_ctx_usleep(&default_ctx, usec);
+}
+
+uint64_t N51PGM_ctx_get_time(n51pgm_ctx *ctx){
+    return micros();
+}
+
 uint64_t N51PGM_get_time(){
     return micros();
 }
@@ -24,10 +24,61 @@
 #define CMD_GET_UCID             0xb4 // non-official
 #define CMD_GET_BANDGAP          0xb5 // non-official
 #define CMD_ISP_PAGE_ERASE       0xD5 // non-official
+#define CMD_CRC32_RANGE          0xb6 // non-official
+#define CMD_READ_RANGES          0xb7 // non-official
 
 // Arduino ISP-to-ICP bridge only
 #define CMD_UPDATE_WHOLE_ROM     0xE1 // non-official
 #define CMD_ISP_MASS_ERASE       0xD6 // non-official
+#define CMD_SET_BAUD             0xE2 // non-official
+#define CMD_UPDATE_STREAM        0xE3 // non-official
+#define CMD_UPDATE_COMPRESSED    0xE4 // non-official
+#define CMD_SELECT_TARGET        0xE5 // non-official
+#define CMD_STORE_IMAGE          0xE6 // non-official
+#define CMD_PROGRAM_STORED       0xE7 // non-official
+#define CMD_STORE_INFO           0xE8 // non-official
+
+// CMD_UPDATE_STREAM flags
+#define STREAM_WHOLE_ROM         0x01 // mass erase first, as CMD_UPDATE_WHOLE_ROM
+
+// CMD_UPDATE_COMPRESSED: as CMD_UPDATE_STREAM, but the continuation packets carry the data as a stream of
+// tokens, which may straddle packets. The size, the running checksum and the bytes still to come are
+// those of the decoded data.
+//   0x00-0x7F:         (t + 1) literal bytes follow
+//   0x80-0xBF, lo:     ((t & 0x3F) << 8 | lo) + 1 bytes of 0xFF, left erased
+//   0xC0-0xFF, offset: (t & 0x3F) + 3 bytes copied from offset + 1 bytes back in the decoded data
+#define LZ_WINDOW                256
+
+// CMD_CRC32_RANGE: addr (u32) at 8, len (u32) at 12, block size (u32) at 16, 0 for the whole range.
+// The reply holds the CRC-32 (as zlib's crc32()) of every block of the range, from byte 8.
+#define CRC_RANGE_MAX_BLOCKS     14
+
+// CMD_READ_RANGES: number of ranges at 8, then addr (u16) and len (u16) of every range from 12. The ranges are
+// dumped back to back, as one CMD_READ_ROM of their total length: from byte 8 of the reply, then in the
+// replies to continuation packets.
+#define READ_RANGES_MAX          13
+
+// CMD_SELECT_TARGET: mask of the ICP sockets to select at 8 (bit i: socket i), 0 to keep the selection.
+// The reply holds the number of sockets at 8, the mask selected at 9 and the device ID (u16) of every socket
+// from 12. With several sockets selected, the update and erase commands write to all of them and every other
+// command reads from the lowest one. The ACKs of the update commands and CMD_ISP_MASS_ERASE carry the mask of
+// the selected sockets that dropped out of the command at TARGET_FAILED_OFFSET (their device didn't answer
+// after a mass erase); those are left out for the rest of the command.
+#define MAX_TARGETS              8
+#define TARGET_FAILED_OFFSET     16
+
+// CMD_STORE_IMAGE: keeps an update in one of the bridge's image store slots, to be programmed with
+// CMD_PROGRAM_STORED as often as needed. addr (u32) at 8, size (u32) at 12, flags at 16, slot at 17, length
+// (u32) of the data at 20 and the CRC-32 (as zlib's crc32()) of the image at 24. The data follows in continuation
+// packets, acknowledged as those of CMD_UPDATE_APROM: with the running checksum of the data at 8 and the bytes
+// still to come (u32) at 12. The slot is empty until the last one is in. The ACK of the command itself holds the
+// capacity of a slot (u32) at 8.
+#define STORE_COMPRESSED         0x02 // the data is CMD_UPDATE_COMPRESSED tokens; also STREAM_WHOLE_ROM
+// CMD_PROGRAM_STORED: slot at 8. Erases and writes the selected sockets as the stored update would, then reads
+// back the CRC-32 of the image from each. The reply holds the update checksum at 8, the mask of the sockets whose
+// CRC didn't match at 12 and the dropped out ones at TARGET_FAILED_OFFSET. Fails if the slot is empty.
+// CMD_STORE_INFO: slot at 8. The reply is laid out as the CMD_STORE_IMAGE request that filled the slot, size 0 if
+// it is empty, followed by the number of slots at 28 and the capacity of a slot (u32) at 32.
 
 // ** Unsupported by N76E003 **
 // Dataflash commands (when a chip has the ability to deliniate between data and program flash)
@@ -0,0 +1,189 @@
+// Description: Compile-time pin mapping for the Arduino PGM backend: direct port register access on AVR, ESP8266 and ESP32, the Arduino pin functions elsewhere.
+#pragma once
+
+#include <Arduino.h>
+
+/*
+ * FastPin<pin> drives an Arduino pin number known at compile time with the core's registers instead of
+ * digitalWrite()/digitalRead()/pinMode(), which look the pin up in tables on every call:
+ *
+ *   AVR (ATmega328P and ATmega2560 pin numbering): PORTx/PINx/DDRx, a single sbi/cbi/sbis for ports A-G;
+ *                                                  ports H-L are outside the I/O space, so interrupts are held
+ *                                                  off for their read-modify-write
+ *   ESP8266: GPOS/GPOC/GPI/GPES/GPEC for GPIO 0-15
+ *   ESP32:   the GPIO W1TS/W1TC, IN and ENABLE registers
+ *
+ * Anything else, including GPIO 16 on the ESP8266, goes through the Arduino functions. Either way the pin
+ * must have been set up with pinMode() once, which also selects its GPIO function.
+ *
+ * The host build (host/Arduino.h defines FASTPIN_HOST_AVR) uses the AVR mapping on fake registers that
+ * host/arduino_host.cpp passes on to the simulated target, so the register path runs there too.
+ */
+
+#if defined(__AVR__) || defined(FASTPIN_HOST_AVR)
+
+#if defined(ARDUINO_AVR_MEGA2560)
+// Port and bit of every Arduino pin, as in the core's pins_arduino.h
+#define FASTPIN_AVR_PORTS "EEEEGEHHHH" "BBBBJJHHDD" "DDAAAAAAAA" "CCCCCCCCDG" "GGLLLLLLLL" "BBBBFFFFFF" "FFKKKKKKKK"
+#define FASTPIN_AVR_BITS  "0145533456" "4567101032" "1001234567" "7654321072" "1076543210" "3210012345" "6701234567"
+#else
+#define FASTPIN_AVR_PORTS "DDDDDDDD" "BBBBBB" "CCCCCC"
+#define FASTPIN_AVR_BITS  "01234567" "012345" "012345"
+#endif
+#define FASTPIN_AVR_PIN_COUNT (sizeof(FASTPIN_AVR_PORTS) - 1)
+
+// PINx address (in data space) of a port; DDRx and PORTx follow it
+constexpr uint16_t fastpin_avr_port_addr(char port)
+{
+	return port <= 'G' ? 0x20 + 3 * (port - 'A') : 0x100 + 3 * (port - 'H' - (port > 'I' ? 1 : 0));
+}
+
+constexpr uint16_t fastpin_avr_pin_reg(uint8_t pin)
+{
+	return fastpin_avr_port_addr(FASTPIN_AVR_PORTS[pin]);
+}
+
+constexpr uint8_t fastpin_avr_mask(uint8_t pin)
+{
+	return 1 << (FASTPIN_AVR_BITS[pin] - '0');
+}
+
+#ifdef FASTPIN_HOST_AVR
+#define FASTPIN_REG_READ(addr)       host_avr_reg_read(addr)
+#define FASTPIN_REG_WRITE(addr, val) host_avr_reg_write(addr, val)
+#define FASTPIN_ATOMIC(addr, stmt)   stmt
+#else
+#define FASTPIN_REG_READ(addr)       (*(volatile uint8_t *)(addr))
+#define FASTPIN_REG_WRITE(addr, val) (*(volatile uint8_t *)(addr) = (val))
+#define FASTPIN_ATOMIC(addr, stmt) \
+	if ((addr) >= 0x60) {            \
+		uint8_t sreg = SREG;           \
+		cli();                         \
+		stmt;                          \
+		SREG = sreg;                   \
+	} else {                         \
+		stmt;                          \
+	}
+#endif
+
+template <uint8_t PIN>
+struct FastPin {
+	static_assert(PIN < FASTPIN_AVR_PIN_COUNT, "no such pin on this board");
+	static constexpr uint16_t PINX = fastpin_avr_pin_reg(PIN);
+	static constexpr uint16_t DDRX = PINX + 1;
+	static constexpr uint16_t PORTX = PINX + 2;
+	static constexpr uint8_t MASK = fastpin_avr_mask(PIN);
+
+	static inline void write(uint8_t val)
+	{
+		if (val) {
+			FASTPIN_ATOMIC(PORTX, FASTPIN_REG_WRITE(PORTX, FASTPIN_REG_READ(PORTX) | MASK));
+		} else {
+			FASTPIN_ATOMIC(PORTX, FASTPIN_REG_WRITE(PORTX, FASTPIN_REG_READ(PORTX) & ~MASK));
+		}
+	}
+
+	static inline uint8_t read(void)
+	{
+		return (FASTPIN_REG_READ(PINX) & MASK) ? HIGH : LOW;
+	}
+
+	// as pinMode(): an input also gets its pull-up turned off
+	static inline void mode(uint8_t output)
+	{
+		if (output) {
+			FASTPIN_ATOMIC(DDRX, FASTPIN_REG_WRITE(DDRX, FASTPIN_REG_READ(DDRX) | MASK));
+		} else {
+			FASTPIN_ATOMIC(DDRX, FASTPIN_REG_WRITE(DDRX, FASTPIN_REG_READ(DDRX) & ~MASK));
+			write(LOW);
+		}
+	}
+};
+
+#elif defined(ARDUINO_ARCH_ESP8266)
+
+template <uint8_t PIN>
+struct FastPin {
+	static inline void write(uint8_t val)
+	{
+		if (PIN >= 16)
+			digitalWrite(PIN, val);
+		else if (val)
+			GPOS = 1 << (PIN & 15);
+		else
+			GPOC = 1 << (PIN & 15);
+	}
+
+	static inline uint8_t read(void)
+	{
+		if (PIN >= 16)
+			return digitalRead(PIN);
+		return (GPI >> (PIN & 15)) & 1;
+	}
+
+	static inline void mode(uint8_t output)
+	{
+		if (PIN >= 16)
+			pinMode(PIN, output ? OUTPUT : INPUT);
+		else if (output)
+			GPES = 1 << (PIN & 15);
+		else
+			GPEC = 1 << (PIN & 15);
+	}
+};
+
+#elif defined(ARDUINO_ARCH_ESP32)
+
+#include "soc/soc.h"
+#include "soc/gpio_reg.h"
+
+template <uint8_t PIN>
+struct FastPin {
+	static inline void write(uint8_t val)
+	{
+		if (PIN < 32) {
+			REG_WRITE(val ? GPIO_OUT_W1TS_REG : GPIO_OUT_W1TC_REG, 1UL << (PIN & 31));
+		} else {
+#ifdef GPIO_OUT1_W1TS_REG
+			REG_WRITE(val ? GPIO_OUT1_W1TS_REG : GPIO_OUT1_W1TC_REG, 1UL << (PIN & 31));
+#else
+			digitalWrite(PIN, val);
+#endif
+		}
+	}
+
+	static inline uint8_t read(void)
+	{
+		if (PIN < 32)
+			return (REG_READ(GPIO_IN_REG) >> (PIN & 31)) & 1;
+#ifdef GPIO_IN1_REG
+		return (REG_READ(GPIO_IN1_REG) >> (PIN & 31)) & 1;
+#else
+		return digitalRead(PIN);
+#endif
+	}
+
+	static inline void mode(uint8_t output)
+	{
+		if (PIN < 32) {
+			REG_WRITE(output ? GPIO_ENABLE_W1TS_REG : GPIO_ENABLE_W1TC_REG, 1UL << (PIN & 31));
+		} else {
+#ifdef GPIO_ENABLE1_W1TS_REG
+			REG_WRITE(output ? GPIO_ENABLE1_W1TS_REG : GPIO_ENABLE1_W1TC_REG, 1UL << (PIN & 31));
+#else
+			pinMode(PIN, output ? OUTPUT : INPUT);
+#endif
+		}
+	}
+};
+
+#else
+
+template <uint8_t PIN>
+struct FastPin {
+	static inline void write(uint8_t val) { digitalWrite(PIN, val); }
+	static inline uint8_t read(void) { return digitalRead(PIN); }
+	static inline void mode(uint8_t output) { pinMode(PIN, output ? OUTPUT : INPUT); }
+};
+
+#endif
@@ -0,0 +1,64 @@
+// Description: Minimal Arduino core shim for building the ISP-to-ICP bridge sketch on a Linux host.
+#pragma once
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#define HIGH   1
+#define LOW    0
+#define INPUT  0
+#define OUTPUT 1
+
+// Kept away from the ICP pins in arduino.cpp (on an Uno, the real LED_BUILTIN is the same pin as RST)
+#define LED_BUILTIN 2
+
+typedef uint8_t byte;
+
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t val);
+int digitalRead(uint8_t pin);
+
+// Fake AVR I/O registers (data space addresses) for FastPin in fastpin.h; writes to DDRx and PORTx act on the pins
+// as pinMode() and digitalWrite() would
+#define FASTPIN_HOST_AVR 1
+uint8_t host_avr_reg_read(uint16_t addr);
+void host_avr_reg_write(uint16_t addr, uint8_t val);
+
+// Two more ICP sockets (see nuvo51icp.ino), each wired to a simulated target of its own
+#define EXTRA_TARGET_PINS {{3, 4, 5, -1}, {6, 7, 8, -1}}
+
+// The image store (see nuvo51icp.ino) is kept by arduino_host.cpp, in a file if one is given
+#define IMAGE_STORE_EXTERNAL 1
+#define IMAGE_STORE_SLOTS 4
+void image_store_read(uint32_t addr, uint8_t *buf, uint16_t len);
+void image_store_write(uint32_t addr, const uint8_t *buf, uint16_t len);
+
+unsigned long millis(void);
+unsigned long micros(void);
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+
+/**
+ * Serial port backed by the master side of a pseudo-terminal; open the slave side
+ * (printed on startup) with any serial tool, e.g. nuvoispy.
+ */
+class HostSerial {
+public:
+	void begin(unsigned long baud);
+	void end(void) {}
+	void flush(void);
+	int available(void);
+	int read(void);
+	size_t write(uint8_t b);
+	void println(const char *s);
+	void print(const char *s);
+	operator bool() { return true; }
+
+	unsigned long baud = 115200;
+	int fd = -1;
+};
+
+extern HostSerial Serial;
+extern HostSerial Serial2;
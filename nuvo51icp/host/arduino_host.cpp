@@ -0,0 +1,537 @@
+/*
+ * nuvo51icp, a RPi ICP flasher for the Nuvoton N76E003
+ * https://github.com/steve-m/N76E003-playground
+ *
+ * Copyright (c) 2021 Steve Markgraf <steve@steve-m.de>
+ * Copyright (c) 2023-2024 Nikita Lita
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Host runtime for the ISP-to-ICP bridge sketch (nuvo51icp.ino + arduino.cpp).
+ *
+ * The pins of every ICP socket are wired to a simulated N76E003 (n51_sim.c), Serial is the master side of a pseudo-terminal,
+ * and millis()/micros() follow a virtual clock that advances by:
+ *   - N51SIM_GPIO_LATENCY_NS for every pinMode/digitalWrite/digitalRead and every access to the fake port
+ *     registers FastPin uses (fastpin.h)
+ *   - the requested time (+ N51SIM_SLEEP_OVERHEAD_NS) for every delay
+ *   - the time a byte takes on the wire at the Serial.begin() baud rate (10 bit times), when the sketch reads a
+ *     byte that hasn't fully arrived yet, or writes one while the UART's TX buffer is full
+ *   - real time while waiting for the host to send something
+ * so the reported packet turnaround is what the sketch would need on a board with those characteristics.
+ *
+ * Like a real UART, the serial line runs in the background: bytes the host sends arrive back to back from the
+ * moment the sketch first sees them, whether or not it is reading, and bytes the sketch sends go out of a
+ * TX_BUFFER-byte buffer while it carries on. Since the virtual clock usually runs far ahead of real time, a host
+ * that answers in real time looks slower to the sketch than it is; with N51SIM_REALTIME=1, the sketch waits
+ * for real time to catch up before it looks at the serial port, so the host's own latency counts as it would
+ * with a board.
+ *
+ * The targets' contents can be preloaded with N51SIM_FLASH and N51SIM_CONFIG (see n51_sim.h); each has a UID of its
+ * own. N51SIM_ABSENT (a mask, bit i: socket i) leaves sockets empty.
+ *
+ * The image store starts out erased (0xFF) and is kept in memory, or in the file given with -s, where it outlasts
+ * the process as it would on a board's SPI flash.
+ */
+
+#ifndef ARDUINO
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include "Arduino.h"
+#include "fastpin.h"
+#include "n51_pgm.h"
+#include "n51_sim.h"
+
+// These must match the pins in arduino.cpp
+#define HOST_DAT 11
+#define HOST_CLK 12
+#define HOST_RST 13
+
+typedef struct {
+	n51pgm_pins pins;
+	n51sim_target target;
+	uint8_t rst_val;
+	uint8_t rst_output;
+	uint8_t dat_val;
+} host_socket;
+
+static const n51pgm_pins first_pins = {HOST_DAT, HOST_RST, HOST_CLK, -1};
+static const n51pgm_pins extra_pins[] = EXTRA_TARGET_PINS;
+#define SOCKET_COUNT (1 + sizeof(extra_pins) / sizeof(extra_pins[0]))
+
+#define IDLE_POLL_MS 1
+#define TX_BUFFER 64 // the AVR core's default
+
+void setup();
+void loop();
+
+HostSerial Serial;
+HostSerial Serial2;
+
+static host_socket sockets[SOCKET_COUNT];
+static uint64_t vclock_ns = 0;
+static uint64_t idle_ns = 0;
+static uint32_t gpio_latency_ns = 0;
+static uint32_t sleep_overhead_ns = 0;
+static uint8_t avr_regs[0x110]; // DDRx and PORTx as last written
+static uint8_t *store = NULL; // image store
+static uint32_t store_size = 0;
+static int store_fd = -1;
+static volatile sig_atomic_t stop = 0;
+static uint8_t realtime = 0;
+static uint64_t real_start_ns = 0;
+static uint64_t rx_wire_ns = 0;  // when the last byte read finished arriving
+static uint8_t rx_line_idle = 1; // nothing was waiting the last time the sketch looked
+static uint64_t tx_wire_ns = 0;  // when the last byte written finishes going out
+static uint8_t active = 1;       // the sketch did something since it last looked at the serial port
+
+// statistics
+static uint64_t rx_bytes = 0;
+static uint64_t tx_bytes = 0;
+static uint64_t rx_done_ns = 0;
+static uint64_t turnaround_sum_ns = 0;
+static uint64_t turnaround_max_ns = 0;
+static uint64_t packets = 0;
+
+static uint64_t real_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline void gpio_tick(void)
+{
+	vclock_ns += gpio_latency_ns;
+	for (unsigned int i = 0; i < SOCKET_COUNT; i++)
+		sockets[i].target.now_ns = vclock_ns;
+	active = 1;
+}
+
+static inline uint64_t byte_time_ns(void)
+{
+	return 10ULL * 1000000000ULL / Serial.baud;
+}
+
+// with N51SIM_REALTIME, waits until real time has caught up with the virtual time `ns`
+static void pace(uint64_t ns)
+{
+	if (!realtime)
+		return;
+	uint64_t now = real_ns() - real_start_ns;
+	if (ns > now) {
+		struct timespec ts = {(time_t)((ns - now) / 1000000000ULL), (long)((ns - now) % 1000000000ULL)};
+		nanosleep(&ts, NULL);
+	}
+}
+
+static void update_rst(host_socket *s)
+{
+	// the target's pull-up takes RST high when it isn't driven
+	N51SIM_set_rst(&s->target, s->rst_output ? s->rst_val : 1);
+}
+
+static void pin_mode(uint8_t pin, uint8_t mode)
+{
+	for (unsigned int i = 0; i < SOCKET_COUNT; i++) {
+		host_socket *s = &sockets[i];
+		if (pin == s->pins.dat) {
+			N51SIM_dat_dir(&s->target, mode == OUTPUT);
+			if (mode == OUTPUT)
+				N51SIM_set_dat(&s->target, s->dat_val);
+		} else if (pin == s->pins.rst) {
+			s->rst_output = mode == OUTPUT;
+			update_rst(s);
+		}
+	}
+}
+
+static void pin_write(uint8_t pin, uint8_t val)
+{
+	for (unsigned int i = 0; i < SOCKET_COUNT; i++) {
+		host_socket *s = &sockets[i];
+		if (pin == s->pins.dat) {
+			s->dat_val = val;
+			N51SIM_set_dat(&s->target, val);
+		} else if (pin == s->pins.clk) {
+			N51SIM_set_clk(&s->target, val);
+		} else if (pin == s->pins.rst) {
+			s->rst_val = val;
+			update_rst(s);
+		}
+	}
+}
+
+// the level on a DAT pin
+static int pin_read(uint8_t pin, int *level)
+{
+	for (unsigned int i = 0; i < SOCKET_COUNT; i++) {
+		if (pin == sockets[i].pins.dat) {
+			*level = N51SIM_get_dat(&sockets[i].target);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+// keeps the fake registers in step with the Arduino functions, as on the real chip
+static void latch_bit(uint16_t addr, uint8_t mask, uint8_t val)
+{
+	avr_regs[addr] = val ? avr_regs[addr] | mask : avr_regs[addr] & ~mask;
+}
+
+void pinMode(uint8_t pin, uint8_t mode)
+{
+	gpio_tick();
+	if (pin < FASTPIN_AVR_PIN_COUNT) {
+		latch_bit(fastpin_avr_pin_reg(pin) + 1, fastpin_avr_mask(pin), mode == OUTPUT);
+		if (mode != OUTPUT)
+			latch_bit(fastpin_avr_pin_reg(pin) + 2, fastpin_avr_mask(pin), 0);
+	}
+	pin_mode(pin, mode);
+}
+
+void digitalWrite(uint8_t pin, uint8_t val)
+{
+	gpio_tick();
+	if (pin < FASTPIN_AVR_PIN_COUNT)
+		latch_bit(fastpin_avr_pin_reg(pin) + 2, fastpin_avr_mask(pin), val);
+	pin_write(pin, val);
+}
+
+int digitalRead(uint8_t pin)
+{
+	gpio_tick();
+	int level;
+	if (pin_read(pin, &level))
+		return level;
+	return 0;
+}
+
+uint8_t host_avr_reg_read(uint16_t addr)
+{
+	gpio_tick();
+	uint8_t val = avr_regs[addr];
+	for (uint8_t pin = 0; pin < FASTPIN_AVR_PIN_COUNT; pin++) {
+		// PINx: the outputs read back what they drive, DAT what the target drives
+		if (fastpin_avr_pin_reg(pin) == addr) {
+			int level;
+			if (!pin_read(pin, &level))
+				level = (avr_regs[addr + 2] & fastpin_avr_mask(pin)) != 0;
+			val = level ? val | fastpin_avr_mask(pin) : val & ~fastpin_avr_mask(pin);
+		}
+	}
+	return val;
+}
+
+void host_avr_reg_write(uint16_t addr, uint8_t val)
+{
+	gpio_tick();
+	uint8_t changed = avr_regs[addr] ^ val;
+	avr_regs[addr] = val;
+	for (uint8_t pin = 0; pin < FASTPIN_AVR_PIN_COUNT; pin++) {
+		uint16_t pin_reg = fastpin_avr_pin_reg(pin);
+		uint8_t mask = fastpin_avr_mask(pin);
+		if (!(changed & mask))
+			continue;
+		if (addr == pin_reg + 1)
+			pin_mode(pin, (val & mask) ? OUTPUT : INPUT);
+		else if (addr == pin_reg + 2)
+			pin_write(pin, (val & mask) != 0);
+	}
+}
+
+static void grow_store(uint32_t size)
+{
+	if (size <= store_size)
+		return;
+	store = (uint8_t *)realloc(store, size);
+	if (!store) {
+		perror("realloc");
+		exit(1);
+	}
+	memset(store + store_size, 0xFF, size - store_size);
+	store_size = size;
+}
+
+void image_store_read(uint32_t addr, uint8_t *buf, uint16_t len)
+{
+	grow_store(addr + len);
+	memcpy(buf, store + addr, len);
+}
+
+void image_store_write(uint32_t addr, const uint8_t *buf, uint16_t len)
+{
+	grow_store(addr + len);
+	memcpy(store + addr, buf, len);
+	if (store_fd >= 0 && pwrite(store_fd, buf, len, addr) != len)
+		perror("image store");
+}
+
+static int open_store(const char *path)
+{
+	store_fd = open(path, O_RDWR | O_CREAT, 0644);
+	if (store_fd < 0) {
+		perror(path);
+		return -1;
+	}
+	off_t size = lseek(store_fd, 0, SEEK_END);
+	grow_store(size);
+	if (size > 0 && pread(store_fd, store, size, 0) != size) {
+		perror(path);
+		return -1;
+	}
+	// the part of the file the sketch hasn't written yet reads as erased
+	return 0;
+}
+
+unsigned long millis(void)
+{
+	return vclock_ns / 1000000;
+}
+
+unsigned long micros(void)
+{
+	return vclock_ns / 1000;
+}
+
+void delay(unsigned long ms)
+{
+	vclock_ns += (uint64_t)ms * 1000000 + sleep_overhead_ns;
+	active = 1;
+}
+
+void delayMicroseconds(unsigned int us)
+{
+	vclock_ns += (uint64_t)us * 1000 + sleep_overhead_ns;
+	active = 1;
+}
+
+void HostSerial::begin(unsigned long rate)
+{
+	baud = rate;
+}
+
+void HostSerial::flush(void)
+{
+	if (fd >= 0 && vclock_ns < tx_wire_ns)
+		vclock_ns = tx_wire_ns;
+}
+
+int HostSerial::available(void)
+{
+	if (fd < 0)
+		return 0;
+	pace(vclock_ns);
+	uint8_t was_active = active;
+	active = 0;
+	struct pollfd pfd = {fd, POLLIN, 0};
+	if (poll(&pfd, 1, 0) > 0 && (pfd.revents & POLLIN)) {
+		if (rx_line_idle) {
+			// the host started sending at the latest now
+			rx_line_idle = 0;
+			if (rx_wire_ns < vclock_ns)
+				rx_wire_ns = vclock_ns;
+		}
+		// a sketch that is busy doesn't see the next byte before it is in; one that is only polling will
+		// wait for it in read()
+		return !was_active || rx_wire_ns + byte_time_ns() <= vclock_ns;
+	}
+	rx_line_idle = 1;
+	if (was_active)
+		return 0;
+	// nothing to do yet; wait a bit in real time and account it as idle
+	uint64_t start = real_ns();
+	poll(&pfd, 1, IDLE_POLL_MS);
+	uint64_t waited = real_ns() - start;
+	vclock_ns += waited;
+	idle_ns += waited;
+	if (!(pfd.revents & POLLIN))
+		return 0;
+	rx_line_idle = 0;
+	rx_wire_ns = vclock_ns;
+	return 1;
+}
+
+int HostSerial::read(void)
+{
+	uint8_t b;
+	if (fd < 0 || ::read(fd, &b, 1) != 1)
+		return -1;
+	rx_wire_ns += byte_time_ns();
+	if (vclock_ns < rx_wire_ns)
+		vclock_ns = rx_wire_ns;
+	active = 1;
+	if (++rx_bytes % 64 == 0)
+		rx_done_ns = vclock_ns;
+	return b;
+}
+
+size_t HostSerial::write(uint8_t b)
+{
+	if (fd < 0) {
+		fputc(b, stderr);
+		return 1;
+	}
+	// queue the byte; only wait for the UART if the buffer is full
+	uint64_t bt = byte_time_ns();
+	tx_wire_ns = (tx_wire_ns > vclock_ns ? tx_wire_ns : vclock_ns) + bt;
+	if (tx_wire_ns > vclock_ns + TX_BUFFER * bt)
+		vclock_ns = tx_wire_ns - TX_BUFFER * bt;
+	active = 1;
+	pace(tx_wire_ns);
+	if (::write(fd, &b, 1) != 1)
+		return 0;
+	if (++tx_bytes % 64 == 0 && rx_done_ns) {
+		uint64_t t = tx_wire_ns - rx_done_ns;
+		turnaround_sum_ns += t;
+		if (t > turnaround_max_ns)
+			turnaround_max_ns = t;
+		packets++;
+		rx_done_ns = 0;
+	}
+	return 1;
+}
+
+void HostSerial::print(const char *s)
+{
+	fputs(s, stderr);
+}
+
+void HostSerial::println(const char *s)
+{
+	fprintf(stderr, "%s\n", s);
+}
+
+static int open_pty(const char *link)
+{
+	int fd = posix_openpt(O_RDWR | O_NOCTTY);
+	if (fd < 0 || grantpt(fd) != 0 || unlockpt(fd) != 0) {
+		perror("posix_openpt");
+		return -1;
+	}
+	const char *name = ptsname(fd);
+	// keep the slave side open in raw mode, so the master doesn't see a hangup between clients
+	int slave = open(name, O_RDWR | O_NOCTTY);
+	if (slave >= 0) {
+		struct termios tio;
+		tcgetattr(slave, &tio);
+		cfmakeraw(&tio);
+		tcsetattr(slave, TCSANOW, &tio);
+	}
+	if (link) {
+		unlink(link);
+		if (symlink(name, link) != 0)
+			perror("symlink");
+	}
+	fprintf(stderr, "Bridge serial port: %s\n", link ? link : name);
+	return fd;
+}
+
+static void on_signal(int sig)
+{
+	(void)sig;
+	stop = 1;
+}
+
+static void print_stats(void)
+{
+	fprintf(stderr, "\nVirtual time: %.3f s (%.3f s busy, %.3f s idle)\n", vclock_ns / 1e9,
+		(vclock_ns - idle_ns) / 1e9, idle_ns / 1e9);
+	fprintf(stderr, "Serial: %llu bytes received, %llu bytes sent\n", (unsigned long long)rx_bytes,
+		(unsigned long long)tx_bytes);
+	if (packets)
+		fprintf(stderr, "Packet turnaround: %llu packets, avg %.3f ms, max %.3f ms\n", (unsigned long long)packets,
+			turnaround_sum_ns / 1e6 / packets, turnaround_max_ns / 1e6);
+	for (unsigned int i = 0; i < SOCKET_COUNT; i++) {
+		n51sim_target *t = &sockets[i].target;
+		if (t->present)
+			fprintf(stderr, "Target %u: %u entries, %u commands, %u bytes read, %u bytes written, %u page erases, %u mass erases\n",
+				i, t->entries, t->commands, t->bytes_read, t->bytes_written, t->page_erases, t->mass_erases);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	const char *link = NULL;
+	const char *store_path = NULL;
+	int opt;
+	while ((opt = getopt(argc, argv, "l:s:h")) != -1) {
+		switch (opt) {
+		case 'l':
+			link = optarg;
+			break;
+		case 's':
+			store_path = optarg;
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-l <symlink to create for the serial port>] [-s <image store file>]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (store_path && open_store(store_path) != 0)
+		return 1;
+
+	const char *val = getenv("N51SIM_GPIO_LATENCY_NS");
+	gpio_latency_ns = val ? strtoul(val, NULL, 0) : 0;
+	val = getenv("N51SIM_SLEEP_OVERHEAD_NS");
+	sleep_overhead_ns = val ? strtoul(val, NULL, 0) : 0;
+	val = getenv("N51SIM_REALTIME");
+	realtime = val && atoi(val);
+	real_start_ns = real_ns();
+	val = getenv("N51SIM_ABSENT");
+	uint32_t absent = val ? strtoul(val, NULL, 0) : 0;
+	for (unsigned int i = 0; i < SOCKET_COUNT; i++) {
+		host_socket *s = &sockets[i];
+		s->pins = i == 0 ? first_pins : extra_pins[i - 1];
+		N51SIM_init(&s->target, 0x4E373645 + i);
+		N51SIM_load_env(&s->target);
+		s->target.present = !(absent & (1 << i));
+	}
+
+	Serial.fd = open_pty(link);
+	if (Serial.fd < 0)
+		return 1;
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+
+	setup();
+	while (!stop)
+		loop();
+
+	print_stats();
+	if (link)
+		unlink(link);
+	return 0;
+}
+
+#endif // ARDUINO
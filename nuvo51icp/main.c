@@ -33,12 +33,32 @@
 #include <unistd.h>
 #include <string.h>
 #include <stdbool.h>
+#include <getopt.h>
+#include <signal.h>
+#include <time.h>
 
 #include "n51_icp.h"
+#include "n51_gang.h"
 #include "n51_pgm.h"
+#include "n51_plan.h"
+#include "n51_hostprof.h"
+#include "n51_resetcache.h"
+#include "n51_station.h"
+#include "n51_job.h"
+#include "n51_devcache.h"
 #include "config.h"
 #define N76E003_DEVID	0x3650
 
+#if defined(RPI) && defined(USE_PIGPIO)
+#define LINKED_BACKEND "pigpio"
+#elif defined(RPI)
+#define LINKED_BACKEND "gpiod"
+#elif defined(USE_SIM)
+#define LINKED_BACKEND "sim"
+#else
+#define LINKED_BACKEND NULL // the stub backend isn't worth profiling
+#endif
+
 typedef struct _device_info{
 	uint16_t devid;
 	uint8_t cid;
@@ -75,6 +95,682 @@ config_flags get_default_config() {
 	return *(config_flags *)&blank_cfg;
 }
 
+// Time spent in each phase of a real run, as reported by N51PGM_get_time() (or the gang's clock in gang mode)
+static n51plan_phase cur_phase = N51PLAN_ENTRY;
+static uint64_t phase_start;
+static uint64_t phase_us[N51PLAN_PHASE_COUNT];
+static n51gang_ctx *gang_ctx = NULL;
+
+static uint64_t phase_time(void)
+{
+	return gang_ctx ? N51GANG_get_time(gang_ctx) : N51PGM_get_time();
+}
+
+static void enter_phase(n51plan_phase phase)
+{
+	uint64_t now = phase_time();
+	phase_us[cur_phase] += now - phase_start;
+	phase_start = now;
+	cur_phase = phase;
+}
+
+static void plan_get_device_info(n51plan *plan)
+{
+	N51PLAN_read_device_id(plan);
+	N51PLAN_read_cid(plan);
+	N51PLAN_read_uid(plan);
+	N51PLAN_read_ucid(plan);
+}
+
+/*
+ * Records the operations main() would issue for the given arguments and target config,
+ * assuming an N76E003 is found and verification succeeds. Must be kept in sync with main().
+ */
+static void plan_main_flow(n51plan *plan, config_flags current_config, bool do_reset, int write_aprom, int write_ldrom,
+	bool lock_chip, bool dump_config, int aprom_program_size, int ldrom_program_size)
+{
+	N51PLAN_set_phase(plan, N51PLAN_ENTRY);
+	N51PLAN_init(plan, do_reset);
+	N51PLAN_set_phase(plan, N51PLAN_IDENTIFY);
+	plan_get_device_info(plan);
+	// a locked chip reads back a CID of 0xFF
+	bool cid_ff = current_config.LOCK == 0;
+	if (cid_ff) {
+		N51PLAN_set_phase(plan, N51PLAN_ENTRY);
+		N51PLAN_reentry(plan, 5000, 1000, 10);
+		N51PLAN_set_phase(plan, N51PLAN_IDENTIFY);
+		plan_get_device_info(plan);
+	}
+	N51PLAN_read_flash(plan, CFG_FLASH_ADDR, CFG_FLASH_LEN);
+	if (current_config.LOCK == 0 && write_aprom == 0 && write_ldrom == 0) {
+		fprintf(stderr, "NOTE: Device is locked, the flash would not be read.\n\n");
+		goto out;
+	}
+	if (write_aprom || write_ldrom) {
+		N51PLAN_set_phase(plan, N51PLAN_ERASE);
+		N51PLAN_mass_erase(plan);
+		if (current_config.LOCK == 0 || cid_ff) {
+			N51PLAN_reentry(plan, 5000, 1000, 10);
+		}
+	}
+	if (dump_config)
+		goto out;
+
+	int chosen_ldrom_sz = 0;
+	if (write_ldrom) {
+		chosen_ldrom_sz = (((ldrom_program_size - 1) / 1024) + 1) * 1024;
+		N51PLAN_set_phase(plan, N51PLAN_CONFIG);
+		N51PLAN_write_flash(plan, CFG_FLASH_ADDR, CFG_FLASH_LEN);
+		N51PLAN_set_phase(plan, N51PLAN_WRITE);
+		N51PLAN_write_flash(plan, FLASH_SIZE - chosen_ldrom_sz, ldrom_program_size);
+	}
+	if (write_aprom) {
+		N51PLAN_set_phase(plan, N51PLAN_WRITE);
+		N51PLAN_write_flash(plan, APROM_FLASH_ADDR, aprom_program_size);
+	}
+	if (write_aprom || write_ldrom) {
+		N51PLAN_set_phase(plan, N51PLAN_VERIFY);
+		N51PLAN_read_flash(plan, APROM_FLASH_ADDR, FLASH_SIZE);
+		if (lock_chip) {
+			N51PLAN_set_phase(plan, N51PLAN_CONFIG);
+			N51PLAN_write_flash(plan, CFG_FLASH_ADDR, CFG_FLASH_LEN);
+			N51PLAN_set_phase(plan, N51PLAN_VERIFY);
+		}
+		N51PLAN_read_flash(plan, CFG_FLASH_ADDR, CFG_FLASH_LEN);
+	} else {
+		N51PLAN_set_phase(plan, N51PLAN_READ);
+		N51PLAN_read_flash(plan, CFG_FLASH_ADDR, CFG_FLASH_LEN);
+		N51PLAN_read_flash(plan, APROM_FLASH_ADDR, FLASH_SIZE);
+	}
+out:
+	N51PLAN_set_phase(plan, N51PLAN_EXIT);
+	N51PLAN_exit(plan);
+}
+
+// Directory containing this executable, where the shared libraries are built
+static const char *exe_dir(void)
+{
+	static char path[512];
+	ssize_t len = readlink("/proc/self/exe", path, sizeof(path) - 1);
+	if (len <= 0)
+		return ".";
+	path[len] = '\0';
+	char *slash = strrchr(path, '/');
+	if (slash)
+		*slash = '\0';
+	return path;
+}
+
+static int parse_config_hex(const char *str, uint8_t *cfg)
+{
+	if (strlen(str) != CFG_FLASH_LEN * 2)
+		return -1;
+	for (int i = 0; i < CFG_FLASH_LEN; i++) {
+		unsigned int b;
+		if (sscanf(str + i * 2, "%2x", &b) != 1)
+			return -1;
+		cfg[i] = b;
+	}
+	return 0;
+}
+
+// Parses a comma separated list of DAT GPIOs, one per target
+static int parse_gang_pins(const char *str, n51pgm_gang_pins *pins)
+{
+	pins->clk = -1;
+	pins->rst = -1;
+	pins->count = 0;
+	while (*str) {
+		char *end;
+		long pin = strtol(str, &end, 0);
+		if (end == str || pin < 0 || pins->count == N51PGM_GANG_MAX)
+			return -1;
+		pins->dat[pins->count++] = pin;
+		if (*end == ',')
+			end++;
+		else if (*end)
+			return -1;
+		str = end;
+	}
+	return pins->count > 0 ? 0 : -1;
+}
+
+// Parses a comma separated list of <dat>:<clk>:<rst>[:<trigger>] GPIO sets, one per station
+static int parse_station_pins(const char *str, n51pgm_pins *pins, int *count)
+{
+	*count = 0;
+	while (*str) {
+		int p[4] = {-1, -1, -1, -1};
+		int n = 0;
+		char *end = (char *)str;
+		while (n < 4) {
+			char *start = end;
+			long pin = strtol(start, &end, 0);
+			if (end == start || pin < 0)
+				return -1;
+			p[n++] = pin;
+			if (*end != ':')
+				break;
+			end++;
+		}
+		if (n < 3 || *count == N51ST_MAX_STATIONS)
+			return -1;
+		pins[*count].dat = p[0];
+		pins[*count].clk = p[1];
+		pins[*count].rst = p[2];
+		pins[*count].trigger = p[3];
+		(*count)++;
+		if (*end == ',')
+			end++;
+		else if (*end)
+			return -1;
+		str = end;
+	}
+	return *count > 0 ? 0 : -1;
+}
+
+static uint64_t wall_time_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * Station flow: the same image goes to every station, each running the whole flow on its own pins in its
+ * own thread.
+ */
+static int station_main(const n51pgm_pins *pins, int count, FILE *file, FILE *file_ldrom, bool lock_chip,
+	bool do_reset, uint32_t reset_seq, uint32_t reset_period)
+{
+	static const char *status_names[] = {"OK", "NOT FOUND", "VERIFY FAILED", "NOT RUN"};
+	static uint8_t image[FLASH_SIZE];
+	n51st_job job = {image, 0, 0, lock_chip, -1};
+	int chosen_ldrom_sz = 0;
+
+	memset(image, 0xff, sizeof(image));
+	if (file_ldrom) {
+		uint8_t ldrom_data[LDROM_MAX_SIZE];
+		job.ldrom_size = fread(ldrom_data, 1, LDROM_MAX_SIZE, file_ldrom);
+		chosen_ldrom_sz = (((job.ldrom_size - 1) / 1024) + 1) * 1024;
+		memcpy(&image[FLASH_SIZE - chosen_ldrom_sz], ldrom_data, job.ldrom_size);
+	}
+	if (file)
+		job.aprom_size = fread(image, 1, FLASH_SIZE - chosen_ldrom_sz, file);
+
+	n51station *st = N51ST_create(pins, count, do_reset);
+	if (!st) {
+		fprintf(stderr, "ERROR: Failed to create stations!\n\n");
+		return 1;
+	}
+	N51ST_set_reset_seq(st, reset_seq, reset_period);
+	for (int i = 0; i < count; i++) {
+		job.station = i;
+		N51ST_submit(st, &job);
+	}
+	uint64_t start = wall_time_us();
+	if (N51ST_start(st) != count)
+		fprintf(stderr, "WARNING: Not every station could be initialized\n");
+	int failed = N51ST_finish(st);
+	uint64_t wall = wall_time_us() - start;
+
+	int nresults;
+	const n51st_result *results = N51ST_results(st, &nresults);
+	uint64_t station_sum = 0;
+	fprintf(stderr, "\nStation\tDAT\tDevice ID\tUID\t\t\t\tTime\t\tResult\n");
+	for (int i = 0; i < nresults; i++) {
+		fprintf(stderr, "%d\t%d\t0x%04x\t\t", i, pins[i].dat, results[i].devid);
+		for (int j = 0; j < 12; j++)
+			fprintf(stderr, "%02x", results[i].uid[j]);
+		fprintf(stderr, "\t%.3f s\t%s\n", results[i].time_us / 1e6, status_names[results[i].status]);
+		station_sum += results[i].time_us;
+	}
+	fprintf(stderr, "\n%d of %d stations programmed in %.3f s (%.3f s of station time)\n", nresults - failed, nresults,
+		wall / 1e6, station_sum / 1e6);
+	N51ST_free(st);
+	return failed ? 1 : 0;
+}
+
+/*
+ * Gang flow: the same image goes to every target, in one pass over the shared clock. Targets that aren't
+ * an N76E003 are dropped after identification, targets that fail verification are dropped before locking.
+ */
+static int gang_main(const n51pgm_gang_pins *pins, FILE *file, FILE *file_ldrom, bool lock_chip, bool print_timing,
+	bool do_reset, uint32_t reset_seq, uint32_t reset_period)
+{
+	static uint8_t write_data[FLASH_SIZE], ldrom_data[LDROM_MAX_SIZE];
+	uint32_t devids[N51PGM_GANG_MAX] = {0};
+	uint8_t cids[N51PGM_GANG_MAX] = {0};
+	uint8_t uids[N51PGM_GANG_MAX * 12] = {0};
+	config_flags configs[N51PGM_GANG_MAX];
+	const char *status[N51PGM_GANG_MAX];
+	int aprom_program_size = 0, ldrom_program_size = 0, chosen_ldrom_sz = 0;
+	int ret = 0;
+
+	memset(write_data, 0xff, sizeof(write_data));
+	memset(ldrom_data, 0xff, sizeof(ldrom_data));
+
+	gang_ctx = N51GANG_create(pins);
+	if (!gang_ctx) {
+		fprintf(stderr, "ERROR: Failed to create gang!\n\n");
+		return 1;
+	}
+	gang_ctx->reset_seq = reset_seq;
+	gang_ctx->reset_seq_bit_delay = reset_period;
+	phase_start = N51GANG_get_time(gang_ctx);
+	if (N51GANG_init(gang_ctx, do_reset) != 0) {
+		fprintf(stderr, "ERROR: Failed to initialize ICP!\n\n");
+		N51GANG_free(gang_ctx);
+		gang_ctx = NULL;
+		return 1;
+	}
+	for (int t = 0; t < pins->count; t++)
+		status[t] = "OK";
+
+	enter_phase(N51PLAN_IDENTIFY);
+	N51GANG_read_device_id(gang_ctx, devids);
+	N51GANG_read_cid(gang_ctx, cids);
+	uint32_t locked = 0;
+	for (int t = 0; t < pins->count; t++) {
+		if (cids[t] == 0xFF)
+			locked |= 1u << t;
+	}
+	// some chips are locked, re-enter ICP mode to reload the flash
+	if (locked) {
+		enter_phase(N51PLAN_ENTRY);
+		N51GANG_reentry(gang_ctx, 5000, 1000, 10);
+		enter_phase(N51PLAN_IDENTIFY);
+		N51GANG_read_device_id(gang_ctx, devids);
+		N51GANG_read_cid(gang_ctx, cids);
+	}
+	uint32_t unknown = 0;
+	for (int t = 0; t < pins->count; t++) {
+		// a locked chip may not report its device ID, the mass erase below will unlock it
+		if (devids[t] != N76E003_DEVID && cids[t] != 0xFF) {
+			unknown |= 1u << t;
+			status[t] = "NOT FOUND";
+		}
+	}
+	N51GANG_disable(gang_ctx, unknown);
+	if (!gang_ctx->active) {
+		fprintf(stderr, "ERROR: N76E003 not found on any target!\n\n");
+		ret = 1;
+		goto out;
+	}
+	N51GANG_read_uid(gang_ctx, uids);
+	N51GANG_read_flash(gang_ctx, CFG_FLASH_ADDR, CFG_FLASH_LEN, (uint8_t *)configs);
+
+	/* Erase entire flash */
+	enter_phase(N51PLAN_ERASE);
+	N51GANG_mass_erase(gang_ctx);
+	// we have to reinitialize if any of them was previously locked
+	for (int t = 0; t < pins->count; t++) {
+		if ((gang_ctx->active & (1u << t)) && configs[t].LOCK == 0)
+			locked |= 1u << t;
+	}
+	if (locked)
+		N51GANG_reentry(gang_ctx, 5000, 1000, 10);
+
+	config_flags write_config = get_default_config();
+	if (file_ldrom) {
+		fprintf(stderr, "Programming LDROM...\n");
+		ldrom_program_size = fread(ldrom_data, 1, LDROM_MAX_SIZE, file_ldrom);
+		uint8_t chosen_ldrom_sz_kb = ((ldrom_program_size - 1) / 1024) + 1;
+		chosen_ldrom_sz = chosen_ldrom_sz_kb * 1024;
+		write_config.CBS = 0; // boot from LDROM
+		write_config.LDS = ((7 - chosen_ldrom_sz_kb) & 0x7); // config LDROM size
+		enter_phase(N51PLAN_CONFIG);
+		N51GANG_write_flash(gang_ctx, CFG_FLASH_ADDR, CFG_FLASH_LEN, (uint8_t *)&write_config);
+		enter_phase(N51PLAN_WRITE);
+		N51GANG_write_flash(gang_ctx, FLASH_SIZE - chosen_ldrom_sz, ldrom_program_size, ldrom_data);
+		fprintf(stderr, "Programmed LDROM (%d bytes)\n", ldrom_program_size);
+	}
+
+	if (file) {
+		fprintf(stderr, "Programming APROM...\n");
+		aprom_program_size = fread(write_data, 1, FLASH_SIZE - chosen_ldrom_sz, file);
+		enter_phase(N51PLAN_WRITE);
+		N51GANG_write_flash(gang_ctx, APROM_FLASH_ADDR, aprom_program_size, write_data);
+		fprintf(stderr, "Programmed APROM (%d bytes)\n", aprom_program_size);
+	}
+
+	/* verify flash; targets that don't match are dropped */
+	enter_phase(N51PLAN_VERIFY);
+	memcpy(&write_data[FLASH_SIZE - chosen_ldrom_sz], ldrom_data, chosen_ldrom_sz);
+	uint32_t failed = N51GANG_verify_flash(gang_ctx, APROM_FLASH_ADDR, FLASH_SIZE, write_data);
+	for (int t = 0; t < pins->count; t++) {
+		if (failed & (1u << t))
+			status[t] = "VERIFY FAILED";
+	}
+	// we need to write the lock bits AFTER verifying because we will be unable to read it afterwards
+	if (lock_chip && gang_ctx->active) {
+		write_config.LOCK = 0;
+		enter_phase(N51PLAN_CONFIG);
+		N51GANG_write_flash(gang_ctx, CFG_FLASH_ADDR, CFG_FLASH_LEN, (uint8_t *)&write_config);
+		enter_phase(N51PLAN_VERIFY);
+	}
+	if (gang_ctx->active != gang_ctx->all)
+		ret = 1;
+
+out:
+	fprintf(stderr, "\nTarget\tDAT\tDevice ID\tUID\t\t\t\tResult\n");
+	for (int t = 0; t < pins->count; t++) {
+		fprintf(stderr, "%d\t%d\t0x%04x\t\t", t, pins->dat[t], devids[t]);
+		for (int i = 0; i < 12; i++)
+			fprintf(stderr, "%02x", uids[t * 12 + i]);
+		fprintf(stderr, "\t%s\n", status[t]);
+	}
+	enter_phase(N51PLAN_EXIT);
+	N51GANG_deinit(gang_ctx);
+	if (print_timing) {
+		enter_phase(N51PLAN_EXIT);
+		N51PLAN_print_phase_times("Measured time per phase", phase_us);
+	}
+	N51GANG_free(gang_ctx);
+	gang_ctx = NULL;
+	return ret;
+}
+
+/*
+ * --reset-period=auto: enters with the period of the most recently cached chip, falling back to the
+ * default period if nothing answers, then searches for the shortest period of a chip that isn't cached yet.
+ * Returns N51ICP_init()'s result.
+ */
+static int init_with_reset_cache(uint32_t reset_seq)
+{
+	const char *cache = N51RC_default_path();
+	uint32_t cached_seq, cached_delay;
+	uint8_t uid[12];
+
+	if (N51RC_lookup(cache, NULL, &cached_seq, &cached_delay) == 0)
+		N51ICP_set_reset_seq(cached_seq, cached_delay);
+	else
+		N51ICP_set_reset_seq(reset_seq, RESET_SEQ_BIT_DELAY);
+	if (N51ICP_init(true) != 0)
+		return -1;
+	uint32_t devid = N51ICP_read_device_id();
+	if (devid == 0 || devid == 0xFFFF) {
+		N51ICP_set_reset_seq(reset_seq, RESET_SEQ_BIT_DELAY);
+		N51ICP_entry(true);
+	}
+
+	N51ICP_read_uid(uid);
+	if (N51RC_lookup(cache, uid, &cached_seq, &cached_delay) == 0) {
+		// also makes it the most recent entry, i.e. the first guess for the next run
+		N51RC_store(cache, uid, cached_seq, cached_delay);
+		return 0;
+	}
+	fprintf(stderr, "Searching for the shortest reset sequence period...\n");
+	N51ICP_set_reset_seq(N51ICP_default_ctx()->reset_seq, RESET_SEQ_BIT_DELAY);
+	uint32_t delay = N51ICP_find_reset_delay(RESET_SEQ_BIT_DELAY, 3);
+	if (delay == 0) {
+		// nothing answered, leave it to the device ID check in main()
+		N51ICP_entry(true);
+		return 0;
+	}
+	fprintf(stderr, "Reset sequence period: %u us per bit\n", delay);
+	if (N51RC_store(cache, uid, N51ICP_default_ctx()->reset_seq, delay) != 0)
+		fprintf(stderr, "WARNING: Could not write %s\n", cache ? cache : "the reset period cache");
+	return 0;
+}
+
+/*
+ * --device-cache: opens the chip's cache and turns the session shadow on. On an unlocked chip, also checks
+ * the whole chip against the cache, which leaves it in the shadow for the rest of the session.
+ */
+static n51devcache *open_device_cache(const char *dir, const uint8_t *uid, bool attach)
+{
+	n51devcache *dc = N51DC_open(dir, uid);
+	if (!dc || N51ICP_enable_shadow(1) != 0) {
+		fprintf(stderr, "WARNING: Could not open the device cache, continuing without it\n");
+		N51DC_close(dc, NULL);
+		return NULL;
+	}
+	if (!attach)
+		return dc;
+	int pages = N51DC_attach(dc, N51ICP_default_ctx());
+	if (pages < 0)
+		fprintf(stderr, "NOTE: The chip changed since it was cached, replaced the device cache\n");
+	else
+		fprintf(stderr, "Device cache: %d of %d pages unchanged\n", pages, FLASH_SIZE / PAGE_SIZE);
+	return dc;
+}
+
+// --device-cache: erases and programs only the pages (and config bytes) that don't hold the image yet, going
+// by what N51DC_attach() read in this session. Returns the number of pages rewritten.
+static int write_changed_pages(n51devcache *dc, uint8_t *image, config_flags *config)
+{
+	uint8_t current[FLASH_SIZE], current_cfg[CFG_FLASH_LEN], blank[PAGE_SIZE];
+	int rewritten = 0;
+
+	memset(blank, 0xff, sizeof(blank));
+	// both come from the shadow; the config write below drops it
+	N51ICP_read_flash(CFG_FLASH_ADDR, CFG_FLASH_LEN, current_cfg);
+	N51ICP_read_flash(APROM_FLASH_ADDR, FLASH_SIZE, current);
+	for (uint32_t a = 0; a < FLASH_SIZE; a += PAGE_SIZE) {
+		if (memcmp(&current[a], &image[a], PAGE_SIZE) == 0)
+			continue;
+		enter_phase(N51PLAN_ERASE);
+		N51ICP_page_erase(a);
+		N51DC_erase(dc, a, PAGE_SIZE);
+		if (memcmp(&image[a], blank, PAGE_SIZE) != 0) {
+			enter_phase(N51PLAN_WRITE);
+			N51ICP_write_flash(a, PAGE_SIZE, &image[a]);
+			N51DC_write(dc, a, PAGE_SIZE, &image[a]);
+		}
+		rewritten++;
+	}
+	if (memcmp(current_cfg, config, CFG_FLASH_LEN) != 0) {
+		enter_phase(N51PLAN_CONFIG);
+		N51ICP_page_erase(CFG_FLASH_ADDR);
+		N51DC_erase(dc, CFG_FLASH_ADDR, CFG_FLASH_LEN);
+		N51ICP_write_flash(CFG_FLASH_ADDR, CFG_FLASH_LEN, (uint8_t *)config);
+		N51DC_write(dc, CFG_FLASH_ADDR, CFG_FLASH_LEN, (uint8_t *)config);
+	}
+	return rewritten;
+}
+
+static int job_main(const char *path, bool plan_only, const char *profile_filename, const uint8_t *target_cfg,
+	bool print_timing, uint32_t reset_period)
+{
+	n51job *job = N51JOB_load(path);
+	if (!job)
+		return 1;
+	if (plan_only) {
+		n51_timing_profile prof;
+		N51PLAN_default_profile(&prof);
+		if (profile_filename && N51PLAN_load_profile(profile_filename, &prof) != 0) {
+			N51JOB_free(job);
+			return 1;
+		}
+		prof.reset_seq_bit_us = reset_period;
+		n51plan *plan = N51PLAN_create(&prof);
+		if (plan) {
+			N51JOB_plan(job, plan, ((const config_flags *)target_cfg)->LOCK == 0);
+			N51PLAN_print(plan);
+			N51PLAN_free(plan);
+		}
+		N51JOB_free(job);
+		return plan ? 0 : 1;
+	}
+
+	N51ICP_set_reset_seq(ICP_RESET_SEQ, reset_period);
+	phase_start = N51PGM_get_time();
+	int ret = N51JOB_run(job, enter_phase);
+	if (print_timing && ret >= 0) {
+		enter_phase(N51PLAN_EXIT);
+		N51PLAN_print_phase_times("Measured time per phase", phase_us);
+	}
+	N51JOB_free(job);
+	return ret == 0 ? 0 : 1;
+}
+
+/*
+ * --loop: hot-swap production loop.
+ *
+ * The PGM lines stay claimed and the image is loaded once; for every unit the loop only does the ICP work
+ * (detect, erase, program, verify, lock). The trigger pin signals the result of the last unit to the operator:
+ * low while waiting for or programming a unit, high once it passed, blinking while a failed unit is still
+ * attached.
+ */
+#define LOOP_POLL_INTERVAL 100000 // us between detection/removal polls
+#define LOOP_REMOVAL_POLLS 2      // consecutive polls without the target before it counts as removed
+
+static volatile sig_atomic_t loop_stop = 0;
+
+static void loop_on_signal(int sig)
+{
+	(void)sig;
+	loop_stop = 1;
+}
+
+#define LOOP_EMPTY   0 // nothing answers
+#define LOOP_FOUND   1 // an N76E003
+#define LOOP_UNKNOWN 2 // something answers, but not with the N76E003's device ID (may be locked if its CID is 0xFF)
+
+// Presence check: one entry and the device info, re-entering for a locked chip as main() does
+static int loop_detect(bool do_reset, device_info *devinfo)
+{
+	N51ICP_entry(do_reset);
+	*devinfo = get_device_info();
+	if (devinfo->devid != N76E003_DEVID && devinfo->cid == 0xFF) {
+		N51ICP_reentry(5000, 1000, 10);
+		*devinfo = get_device_info();
+	}
+	if (devinfo->devid == N76E003_DEVID)
+		return LOOP_FOUND;
+	// 0xFFFF is what a floating DAT line reads
+	if (devinfo->devid == 0 || devinfo->devid == 0xFFFF)
+		return LOOP_EMPTY;
+	return LOOP_UNKNOWN;
+}
+
+// Asks the operator whether to mass erase a unit that may be locked, as main() does
+static bool loop_confirm_erase(void)
+{
+	char line[16];
+	fprintf(stderr, "N76E003 not found (may be locked), do you want to attempt a mass erase? (y/N)\n");
+	if (!fgets(line, sizeof(line), stdin))
+		return false;
+	return line[0] == 'y' || line[0] == 'Y';
+}
+
+// Same flow as main(), against the preloaded image. Returns 0 if the unit verified.
+static int loop_program_unit(device_info *devinfo, uint8_t *image, config_flags write_config, int aprom_program_size,
+	int ldrom_program_size, int chosen_ldrom_sz, bool lock_chip, uint8_t *read_data)
+{
+	*devinfo = get_device_info();
+	if (devinfo->cid == 0xFF) {
+		N51ICP_reentry(5000, 1000, 10);
+		*devinfo = get_device_info();
+	}
+	config_flags current_config;
+	N51ICP_read_flash(CFG_FLASH_ADDR, CFG_FLASH_LEN, (uint8_t *)&current_config);
+	N51ICP_mass_erase();
+	if (current_config.LOCK == 0 || devinfo->cid == 0xFF) {
+		N51ICP_reentry(5000, 1000, 10);
+		*devinfo = get_device_info();
+	}
+
+	if (ldrom_program_size) {
+		N51ICP_write_flash(CFG_FLASH_ADDR, CFG_FLASH_LEN, (uint8_t *)&write_config);
+		N51ICP_write_flash(FLASH_SIZE - chosen_ldrom_sz, ldrom_program_size, &image[FLASH_SIZE - chosen_ldrom_sz]);
+	}
+	if (aprom_program_size)
+		N51ICP_write_flash(APROM_FLASH_ADDR, aprom_program_size, image);
+
+	N51ICP_read_flash(APROM_FLASH_ADDR, FLASH_SIZE, read_data);
+	if (memcmp(image, read_data, FLASH_SIZE))
+		return -1;
+	if (lock_chip) {
+		write_config.LOCK = 0;
+		N51ICP_write_flash(CFG_FLASH_ADDR, CFG_FLASH_LEN, (uint8_t *)&write_config);
+	}
+	return 0;
+}
+
+static int loop_main(FILE *file, FILE *file_ldrom, bool lock_chip, bool do_reset, uint32_t reset_seq,
+	uint32_t reset_period, int max_units)
+{
+	static uint8_t image[FLASH_SIZE], read_data[FLASH_SIZE];
+	int aprom_program_size = 0, ldrom_program_size = 0, chosen_ldrom_sz = 0;
+	config_flags write_config = get_default_config();
+
+	memset(image, 0xff, sizeof(image));
+	if (file_ldrom) {
+		uint8_t ldrom_data[LDROM_MAX_SIZE];
+		ldrom_program_size = fread(ldrom_data, 1, LDROM_MAX_SIZE, file_ldrom);
+		uint8_t chosen_ldrom_sz_kb = ((ldrom_program_size - 1) / 1024) + 1;
+		chosen_ldrom_sz = chosen_ldrom_sz_kb * 1024;
+		memcpy(&image[FLASH_SIZE - chosen_ldrom_sz], ldrom_data, ldrom_program_size);
+		write_config.CBS = 0;
+		write_config.LDS = ((7 - chosen_ldrom_sz_kb) & 0x7);
+	}
+	if (file)
+		aprom_program_size = fread(image, 1, FLASH_SIZE - chosen_ldrom_sz, file);
+
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = loop_on_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	N51ICP_set_reset_seq(reset_seq, reset_period);
+	if (N51ICP_init(do_reset) != 0) {
+		fprintf(stderr, "ERROR: Failed to initialize ICP!\n\n");
+		return 1;
+	}
+	fprintf(stderr, "Waiting for targets (APROM %d bytes, LDROM %d bytes%s), Ctrl-C to stop\n", aprom_program_size,
+		ldrom_program_size, lock_chip ? ", locking" : "");
+
+	int units = 0, passed = 0;
+	N51PGM_set_trigger(0);
+	while (!loop_stop && (max_units == 0 || units < max_units)) {
+		device_info devinfo;
+		int found = loop_detect(do_reset, &devinfo);
+		if (found == LOOP_EMPTY) {
+			N51PGM_usleep(LOOP_POLL_INTERVAL);
+			continue;
+		}
+		N51PGM_set_trigger(0);
+		units++;
+		int ret = -1;
+		if (found == LOOP_UNKNOWN && (devinfo.cid != 0xFF || !loop_confirm_erase())) {
+			// report units that can't be programmed instead of passing over them
+			printf("Unit %d: device ID 0x%04x, CID 0x%02x %s\n", units, devinfo.devid, devinfo.cid,
+				devinfo.cid == 0xFF ? "LOCKED, skipped" : "not an N76E003, skipped");
+		} else {
+			uint64_t start = N51PGM_get_time();
+			ret = loop_program_unit(&devinfo, image, write_config, aprom_program_size, ldrom_program_size,
+				chosen_ldrom_sz, lock_chip, read_data);
+			uint64_t elapsed = N51PGM_get_time() - start;
+			if (ret == 0)
+				passed++;
+			printf("Unit %d: UID ", units);
+			for (int i = 0; i < 12; i++)
+				printf("%02x", devinfo.uid[i]);
+			printf(" %s (%.3f s)\n", ret == 0 ? "PASS" : "FAIL", elapsed / 1e6);
+		}
+		fflush(stdout);
+
+		// wait for removal, without re-entering so the unit isn't reset again
+		uint8_t blink = 1;
+		N51PGM_set_trigger(1);
+		for (int gone = 0; gone < LOOP_REMOVAL_POLLS && !loop_stop;) {
+			N51PGM_usleep(LOOP_POLL_INTERVAL);
+			gone = N51ICP_read_device_id() == devinfo.devid ? 0 : gone + 1;
+			if (ret != 0)
+				N51PGM_set_trigger(blink ^= 1);
+		}
+		N51PGM_set_trigger(0);
+	}
+
+	N51ICP_exit();
+	N51PGM_deinit(0);
+	fprintf(stderr, "%d units programmed: %d passed, %d failed\n", units, passed, units - passed);
+	return passed == units ? 0 : 1;
+}
+
 void usage(void)
 {
 	fprintf(stderr,
@@ -87,6 +783,30 @@ void usage(void)
 		"\t[-w <filename> write file to APROM/entire flash (if LDROM is disabled)]\n"
 		"\t[-l <filename> write file to LDROM, enable LDROM, enable boot from LDROM]\n"
 		"\t[-s lock the chip after writing]\n"
+		"\t[-t print the time spent in each phase]\n"
+		"\t[--reset-period=<us>|auto bit period of the ICP reset sequence (default %d us). auto uses the period\n"
+		"\t                        cached for the chip, or searches for the shortest one that works and caches it]\n"
+		"\t[--alt-reset use the alternative reset sequence of earlier nulink firmware revisions]\n"
+		"\t[--no-reset enter ICP mode with a single reset pulse instead of the reset sequence]\n"
+		"\t[--loop[=<count>] production loop: wait for a target, write -w/-l (and -s) to it, verify, wait for it\n"
+		"\t                        to be removed, repeat (until interrupted, or <count> units). The trigger pin\n"
+		"\t                        (GPIO16) goes high when a unit passed and blinks when it failed]\n"
+		"\t[--gang=<dat>,<dat>,... write the same image to several targets at once, one DAT GPIO per target,\n"
+		"\t                        sharing CLK and RST. Only -w, -l and -s can be combined with it]\n"
+		"\t[--stations=<dat>:<clk>:<rst>[:<trigger>],... write the same image to several targets on separate GPIO\n"
+		"\t                        sets, each in its own thread. Only -w, -l, -s and the reset options can be combined with it]\n"
+		"\t[--device-cache[=<dir>] keep the flash contents of every chip read or written, keyed by UID. Each\n"
+		"\t                        visit reads the whole chip back and reports changes made elsewhere; -w/-l\n"
+		"\t                        then only erase, program and verify the pages that change.\n"
+		"\t                        Default dir: ~/.cache/nuvo51icp/devices. For development, not production]\n"
+		"\t[--job=<filename> run the operations listed in a job file (see job-example.txt) in one ICP session.\n"
+		"\t                        Combines with --plan, -t and --reset-period=<us>]\n"
+		"\t[-p, --plan print the ICP command sequence and estimated time per phase, without touching hardware]\n"
+		"\t[--profile=<filename> backend timing profile to use with --plan]\n"
+		"\t[--target-config=<10 hex digits> config bytes of the target to assume with --plan (default FFFFFFFFFF)]\n"
+		"\t[--profile-host[=<dir>] measure GPIO latency and sleep accuracy of the linked backend and of every\n"
+		"\t                        libnuvo51icp-<backend>.so in <dir> (default: next to this program), and\n"
+		"\t                        recommend a backend and bit delay. Does not need a target attached]\n"
 		"\nPinout:\n\n"
 		"                           40-pin header J8\n"
 		" connect 3.3V of MCU ->    3V3  (1) (2)  5V\n"
@@ -97,7 +817,7 @@ void usage(void)
 		"                     |   USB  |\n"
 		"                     |  PORTS |\n"
 		"                     |________|\n\n"
-		"Please refer to the 'pinout' command on your RPi\n");
+		"Please refer to the 'pinout' command on your RPi\n", RESET_SEQ_BIT_DELAY);
 	exit(1);
 }
 
@@ -110,6 +830,22 @@ int main(int argc, char *argv[])
 	int aprom_program_size = 0, ldrom_program_size = 0;
 	bool dump_config = false;
 	bool lock_chip = false;
+	bool plan_only = false;
+	bool print_timing = false;
+	bool gang = false;
+	n51pgm_pins station_pins[N51ST_MAX_STATIONS];
+	int station_count = 0;
+	bool loop = false;
+	int loop_count = 0;
+	n51pgm_gang_pins gang_pins;
+	bool do_reset = true, reset_auto = false;
+	uint32_t reset_seq = ICP_RESET_SEQ, reset_period = RESET_SEQ_BIT_DELAY;
+	char *profile_filename = NULL;
+	char *job_filename = NULL;
+	bool device_cache = false;
+	const char *device_cache_dir = NULL;
+	n51devcache *devcache = NULL;
+	uint8_t target_cfg[CFG_FLASH_LEN] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
 	char *filename = NULL, *filename_ldrom = NULL;
 	FILE *file = NULL, *file_ldrom = NULL;
 	uint8_t read_data[FLASH_SIZE], write_data[FLASH_SIZE], ldrom_data[LDROM_MAX_SIZE];
@@ -122,7 +858,22 @@ int main(int argc, char *argv[])
 		return -1;
 	}
 
-	while ((opt = getopt(argc, argv, "uhsr:w:l:")) != -1) {
+	static const struct option long_options[] = {
+		{"plan", no_argument, NULL, 'p'},
+		{"profile", required_argument, NULL, 'P'},
+		{"target-config", required_argument, NULL, 'C'},
+		{"profile-host", optional_argument, NULL, 'H'},
+		{"gang", required_argument, NULL, 'G'},
+		{"reset-period", required_argument, NULL, 'R'},
+		{"alt-reset", no_argument, NULL, 'A'},
+		{"no-reset", no_argument, NULL, 'N'},
+		{"loop", optional_argument, NULL, 'L'},
+		{"stations", required_argument, NULL, 'S'},
+		{"job", required_argument, NULL, 'J'},
+		{"device-cache", optional_argument, NULL, 'D'},
+		{NULL, 0, NULL, 0}
+	};
+	while ((opt = getopt_long(argc, argv, "uhsptr:w:l:", long_options, NULL)) != -1) {
 		switch (opt) {
 		case 'u':
 			dump_config = true;
@@ -142,6 +893,72 @@ int main(int argc, char *argv[])
 		case 's':
 		  lock_chip = true;
 			break;
+		case 't':
+			print_timing = true;
+			break;
+		case 'p':
+			plan_only = true;
+			break;
+		case 'P':
+			profile_filename = optarg;
+			break;
+		case 'H':
+			return N51PROF_profile_host(optarg ? optarg : exe_dir(), LINKED_BACKEND) == 0 ? 0 : 1;
+		case 'G':
+			if (parse_gang_pins(optarg, &gang_pins) != 0) {
+				fprintf(stderr, "ERROR: Invalid gang DAT pins: %s\n\n", optarg);
+				usage();
+			}
+			gang = true;
+			break;
+		case 'R':
+			if (strcmp(optarg, "auto") == 0) {
+				reset_auto = true;
+			} else {
+				char *end;
+				reset_period = strtoul(optarg, &end, 0);
+				if (*end || reset_period == 0) {
+					fprintf(stderr, "ERROR: Invalid reset period: %s\n\n", optarg);
+					usage();
+				}
+			}
+			break;
+		case 'A':
+			reset_seq = ALT_RESET_SEQ;
+			break;
+		case 'N':
+			do_reset = false;
+			break;
+		case 'J':
+			job_filename = optarg;
+			break;
+		case 'D':
+			device_cache = true;
+			device_cache_dir = optarg ? optarg : N51DC_default_dir();
+			break;
+		case 'S':
+			if (parse_station_pins(optarg, station_pins, &station_count) != 0) {
+				fprintf(stderr, "ERROR: Invalid station pins: %s\n\n", optarg);
+				usage();
+			}
+			break;
+		case 'L':
+			if (optarg) {
+				char *end;
+				loop_count = strtol(optarg, &end, 0);
+				if (*end || loop_count <= 0) {
+					fprintf(stderr, "ERROR: Invalid unit count: %s\n\n", optarg);
+					usage();
+				}
+			}
+			loop = true;
+			break;
+		case 'C':
+			if (parse_config_hex(optarg, target_cfg) != 0) {
+				fprintf(stderr, "ERROR: Invalid target config: %s\n\n", optarg);
+				usage();
+			}
+			break;
 		case 'h':
 		default:
 			fprintf(stderr, "ERROR: Unknown option: %c\n\n", opt);
@@ -156,13 +973,42 @@ int main(int argc, char *argv[])
 		fprintf(stderr, "ERROR: Can't read and write APROM at the same time!\n\n");
 		usage();
 	}
-	if (!read_aprom && !write_aprom && !dump_config) {
+	if (reset_auto && (gang || plan_only || !do_reset)) {
+		fprintf(stderr, "ERROR: --reset-period=auto can't be used with --gang, --plan or --no-reset!\n\n");
+		usage();
+	}
+	if (gang && (read_aprom || dump_config || plan_only || !(write_aprom || write_ldrom))) {
+		fprintf(stderr, "ERROR: Gang mode can only write!\n\n");
+		usage();
+	}
+	if (loop && (read_aprom || dump_config || plan_only || gang || reset_auto || !(write_aprom || write_ldrom))) {
+		fprintf(stderr, "ERROR: The production loop can only write, and can't be combined with --gang or --reset-period=auto!\n\n");
+		usage();
+	}
+	if (station_count && (read_aprom || dump_config || plan_only || gang || loop || reset_auto || !(write_aprom || write_ldrom))) {
+		fprintf(stderr, "ERROR: Stations can only write, and can't be combined with --gang, --loop or --reset-period=auto!\n\n");
+		usage();
+	}
+	if (device_cache && (plan_only || gang || loop || station_count || job_filename)) {
+		fprintf(stderr, "ERROR: --device-cache can't be combined with --plan, --gang, --loop, --stations or --job!\n\n");
+		usage();
+	}
+	if (job_filename && (read_aprom || write_aprom || write_ldrom || lock_chip || dump_config || gang || loop ||
+		station_count || reset_auto || !do_reset || reset_seq != ICP_RESET_SEQ)) {
+		fprintf(stderr, "ERROR: A job file can only be combined with --plan, -t and --reset-period=<us>; "
+			"its operations and entry line replace the other options!\n\n");
+		usage();
+	}
+	if (job_filename)
+		return job_main(job_filename, plan_only, profile_filename, target_cfg, print_timing, reset_period);
+
+	if (!read_aprom && !write_aprom && !dump_config && !gang) {
 		fprintf(stderr, "ERROR: No action specified!\n\n");
 		usage();
 	}
 
 	if (!dump_config) {
-	  if (filename) {
+	  if (filename && (write_aprom || !plan_only)) {
 	  	file = fopen(filename, write_aprom ? "rb" : "wb");
 			if (!file) {
 				fprintf(stderr, "ERROR: Failed to open file: %s!\n\n", filename);
@@ -178,14 +1024,50 @@ int main(int argc, char *argv[])
 		}
 	}
 
-	if (N51ICP_init(true) != 0) {
+	if (plan_only) {
+		n51_timing_profile prof;
+		N51PLAN_default_profile(&prof);
+		if (profile_filename && N51PLAN_load_profile(profile_filename, &prof) != 0)
+			goto err;
+		prof.reset_seq_bit_us = reset_period;
+		if (write_ldrom)
+			ldrom_program_size = fread(ldrom_data, 1, LDROM_MAX_SIZE, file_ldrom);
+		if (write_aprom) {
+			int chosen_ldrom_sz = write_ldrom ? (((ldrom_program_size - 1) / 1024) + 1) * 1024 : 0;
+			aprom_program_size = fread(write_data, 1, FLASH_SIZE - chosen_ldrom_sz, file);
+		}
+		n51plan *plan = N51PLAN_create(&prof);
+		if (!plan)
+			goto err;
+		plan_main_flow(plan, *(config_flags *)target_cfg, do_reset, write_aprom, write_ldrom, lock_chip, dump_config,
+			aprom_program_size, ldrom_program_size);
+		N51PLAN_print(plan);
+		N51PLAN_free(plan);
+		return 0;
+	}
+
+	if (station_count)
+		return station_main(station_pins, station_count, file, file_ldrom, lock_chip, do_reset, reset_seq, reset_period);
+
+	if (loop)
+		return loop_main(file, file_ldrom, lock_chip, do_reset, reset_seq, reset_period, loop_count);
+
+	if (gang)
+		return gang_main(&gang_pins, file, file_ldrom, lock_chip, print_timing, do_reset, reset_seq, reset_period);
+
+	phase_start = N51PGM_get_time();
+	N51ICP_set_reset_seq(reset_seq, reset_period);
+	if ((reset_auto ? init_with_reset_cache(reset_seq) : N51ICP_init(do_reset)) != 0) {
 		fprintf(stderr, "ERROR: Failed to initialize ICP!\n\n");
 		goto err;
 	}
+	enter_phase(N51PLAN_IDENTIFY);
 	device_info devinfo = get_device_info();
 	// chip's locked, re-enter ICP mode to reload the flash
 	if (devinfo.cid == 0xFF) {
+		enter_phase(N51PLAN_ENTRY);
 		N51ICP_reentry(5000, 1000, 10);
+		enter_phase(N51PLAN_IDENTIFY);
 		devinfo = get_device_info();
 	}
 	
@@ -215,9 +1097,20 @@ int main(int argc, char *argv[])
 		goto out_err;
 	}
 
+	// with a cache checked against the whole chip, writing only has to touch the pages that change
+	bool incremental = false;
+	if (device_cache && devinfo.devid == N76E003_DEVID && !dump_config) {
+		bool unlocked = current_config.LOCK != 0 && devinfo.cid != 0xFF;
+		devcache = open_device_cache(device_cache_dir, devinfo.uid, unlocked);
+		incremental = devcache && unlocked && (write_aprom || write_ldrom);
+	}
+
 	/* Erase entire flash */
-	if (write_aprom || write_ldrom) {
+	if ((write_aprom || write_ldrom) && !incremental) {
+		enter_phase(N51PLAN_ERASE);
 		N51ICP_mass_erase();
+		N51DC_erase(devcache, APROM_FLASH_ADDR, FLASH_SIZE);
+		N51DC_erase(devcache, CFG_FLASH_ADDR, CFG_FLASH_LEN);
 		// we have to reinitialize if it was previously locked
 		if (current_config.LOCK == 0 || devinfo.cid == 0xFF){
 			N51ICP_reentry(5000, 1000, 10);
@@ -239,11 +1132,17 @@ int main(int argc, char *argv[])
 		chosen_ldrom_sz = chosen_ldrom_sz_kb * 1024;
 		write_config.CBS = 0; // boot from LDROM
 		write_config.LDS = ((7 - chosen_ldrom_sz_kb) & 0x7); // config LDROM size
-		// write the config
-		N51ICP_write_flash(CFG_FLASH_ADDR, CFG_FLASH_LEN, (uint8_t *)&write_config);
-		/* program LDROM */
-		N51ICP_write_flash(FLASH_SIZE - chosen_ldrom_sz, ldrom_program_size, ldrom_data);
-		fprintf(stderr, "Programmed LDROM (%d bytes)\n", ldrom_program_size);
+		if (!incremental) {
+			// write the config
+			enter_phase(N51PLAN_CONFIG);
+			N51ICP_write_flash(CFG_FLASH_ADDR, CFG_FLASH_LEN, (uint8_t *)&write_config);
+			N51DC_write(devcache, CFG_FLASH_ADDR, CFG_FLASH_LEN, (uint8_t *)&write_config);
+			/* program LDROM */
+			enter_phase(N51PLAN_WRITE);
+			N51ICP_write_flash(FLASH_SIZE - chosen_ldrom_sz, ldrom_program_size, ldrom_data);
+			N51DC_write(devcache, FLASH_SIZE - chosen_ldrom_sz, ldrom_program_size, ldrom_data);
+			fprintf(stderr, "Programmed LDROM (%d bytes)\n", ldrom_program_size);
+		}
 	}
 
 	if (write_aprom) {
@@ -252,12 +1151,24 @@ int main(int argc, char *argv[])
 		aprom_program_size = fread(write_data, 1, aprom_size, file);
 
 		/* program flash */
-		N51ICP_write_flash(APROM_FLASH_ADDR, aprom_program_size, write_data);
-		fprintf(stderr, "Programmed APROM (%d bytes)\n", aprom_program_size);
+		if (!incremental) {
+			enter_phase(N51PLAN_WRITE);
+			N51ICP_write_flash(APROM_FLASH_ADDR, aprom_program_size, write_data);
+			N51DC_write(devcache, APROM_FLASH_ADDR, aprom_program_size, write_data);
+			fprintf(stderr, "Programmed APROM (%d bytes)\n", aprom_program_size);
+		}
+	}
+
+	if (incremental) {
+		memcpy(&write_data[FLASH_SIZE - chosen_ldrom_sz], ldrom_data, chosen_ldrom_sz);
+		int pages = write_changed_pages(devcache, write_data, &write_config);
+		fprintf(stderr, "Programmed APROM (%d bytes) and LDROM (%d bytes): rewrote %d of %d pages, the others "
+			"already held them\n", aprom_program_size, ldrom_program_size, pages, FLASH_SIZE / PAGE_SIZE);
 	}
 
 	if (write_aprom || write_ldrom) {
 		/* verify flash */
+		enter_phase(N51PLAN_VERIFY);
 		N51ICP_read_flash(APROM_FLASH_ADDR, FLASH_SIZE, read_data);
 
 		/* copy the LDROM content in the buffer of the entire flash for
@@ -272,10 +1183,14 @@ int main(int argc, char *argv[])
 		// we need to write the lock bits AFTER verifying because we will be unable to read it afterwards
 		if (lock_chip) {
 			write_config.LOCK = 0;
+			enter_phase(N51PLAN_CONFIG);
 			N51ICP_write_flash(CFG_FLASH_ADDR, CFG_FLASH_LEN, (uint8_t *)&write_config);
+			N51DC_write(devcache, CFG_FLASH_ADDR, CFG_FLASH_LEN, (uint8_t *)&write_config);
+			enter_phase(N51PLAN_VERIFY);
 		}
 		N51ICP_dump_config();
 	} else {
+		enter_phase(N51PLAN_READ);
 		N51ICP_dump_config();
 		N51ICP_read_flash(APROM_FLASH_ADDR, FLASH_SIZE, read_data);
 
@@ -289,10 +1204,17 @@ int main(int argc, char *argv[])
 	}
 
 out:
+	enter_phase(N51PLAN_EXIT);
+	N51DC_close(devcache, N51ICP_default_ctx());
 	N51ICP_exit();
 	N51PGM_deinit(0);
+	if (print_timing) {
+		enter_phase(N51PLAN_EXIT);
+		N51PLAN_print_phase_times("Measured time per phase", phase_us);
+	}
 	return 0;
 out_err:
+	N51DC_close(devcache, N51ICP_default_ctx());
 	N51ICP_exit();
 	N51PGM_deinit(0);
 	err:
@@ -0,0 +1,216 @@
+/*
+ * nuvo51icp, a RPi ICP flasher for the Nuvoton N76E003
+ * https://github.com/steve-m/N76E003-playground
+ *
+ * Copyright (c) 2021 Steve Markgraf <steve@steve-m.de>
+ * Copyright (c) 2023-2024 Nikita Lita
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef ARDUINO
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "n51_daemon.h"
+
+struct _n51d_client {
+	int fd;
+};
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+	while (len) {
+		ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static int read_all(int fd, void *buf, size_t len)
+{
+	uint8_t *p = buf;
+	while (len) {
+		ssize_t n = recv(fd, p, len, 0);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+n51d_client *N51D_connect(const char *path)
+{
+	struct sockaddr_un sa;
+	if (!path)
+		path = N51D_DEFAULT_SOCKET;
+	if (strlen(path) >= sizeof(sa.sun_path))
+		return NULL;
+	n51d_client *client = malloc(sizeof(n51d_client));
+	if (!client)
+		return NULL;
+	client->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (client->fd < 0) {
+		free(client);
+		return NULL;
+	}
+	memset(&sa, 0, sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	strcpy(sa.sun_path, path);
+	if (connect(client->fd, (struct sockaddr *)&sa, sizeof(sa)) != 0) {
+		close(client->fd);
+		free(client);
+		return NULL;
+	}
+	return client;
+}
+
+void N51D_close(n51d_client *client)
+{
+	if (!client)
+		return;
+	close(client->fd);
+	free(client);
+}
+
+int N51D_request(n51d_client *client, uint8_t cmd, uint32_t addr, const void *payload, uint32_t payload_len,
+	void *resp, uint32_t resp_max, uint32_t *resp_len)
+{
+	n51d_req_hdr req = {cmd, 0, 0, addr, payload_len};
+	n51d_resp_hdr hdr;
+	if (cmd == N51D_CMD_READ_FLASH)
+		req.len = resp_max; // the only job whose length is the size of the result
+	if (write_all(client->fd, &req, sizeof(req)) != 0)
+		return -1;
+	if (payload_len && cmd != N51D_CMD_READ_FLASH && write_all(client->fd, payload, payload_len) != 0)
+		return -1;
+	if (read_all(client->fd, &hdr, sizeof(hdr)) != 0)
+		return -1;
+	if (resp_len)
+		*resp_len = hdr.len;
+	// keep what fits, drain the rest so the connection stays in sync
+	uint32_t keep = hdr.len < resp_max ? hdr.len : resp_max;
+	if (keep && read_all(client->fd, resp, keep) != 0)
+		return -1;
+	for (uint32_t left = hdr.len - keep; left > 0;) {
+		uint8_t scratch[256];
+		uint32_t n = left < sizeof(scratch) ? left : sizeof(scratch);
+		if (read_all(client->fd, scratch, n) != 0)
+			return -1;
+		left -= n;
+	}
+	return hdr.status;
+}
+
+int N51D_entry(n51d_client *client, uint8_t do_reset)
+{
+	return N51D_request(client, N51D_CMD_ENTRY, do_reset, NULL, 0, NULL, 0, NULL);
+}
+
+int N51D_reentry(n51d_client *client, uint32_t delay1, uint32_t delay2, uint32_t delay3)
+{
+	uint32_t delays[3] = {delay1, delay2, delay3};
+	return N51D_request(client, N51D_CMD_REENTRY, 0, delays, sizeof(delays), NULL, 0, NULL);
+}
+
+int N51D_exit(n51d_client *client)
+{
+	return N51D_request(client, N51D_CMD_EXIT, 0, NULL, 0, NULL, 0, NULL);
+}
+
+int N51D_read_device_id(n51d_client *client, uint32_t *devid)
+{
+	return N51D_request(client, N51D_CMD_READ_DEVICE_ID, 0, NULL, 0, devid, sizeof(*devid), NULL);
+}
+
+int N51D_read_cid(n51d_client *client, uint8_t *cid)
+{
+	return N51D_request(client, N51D_CMD_READ_CID, 0, NULL, 0, cid, 1, NULL);
+}
+
+int N51D_read_uid(n51d_client *client, uint8_t *buf)
+{
+	return N51D_request(client, N51D_CMD_READ_UID, 0, NULL, 0, buf, 12, NULL);
+}
+
+int N51D_read_ucid(n51d_client *client, uint8_t *buf)
+{
+	return N51D_request(client, N51D_CMD_READ_UCID, 0, NULL, 0, buf, 16, NULL);
+}
+
+int N51D_read_flash(n51d_client *client, uint32_t addr, uint32_t len, uint8_t *data)
+{
+	return N51D_request(client, N51D_CMD_READ_FLASH, addr, NULL, 0, data, len, NULL);
+}
+
+int N51D_write_flash(n51d_client *client, uint32_t addr, uint32_t len, const uint8_t *data)
+{
+	return N51D_request(client, N51D_CMD_WRITE_FLASH, addr, data, len, NULL, 0, NULL);
+}
+
+int N51D_page_erase(n51d_client *client, uint32_t addr)
+{
+	return N51D_request(client, N51D_CMD_PAGE_ERASE, addr, NULL, 0, NULL, 0, NULL);
+}
+
+int N51D_mass_erase(n51d_client *client)
+{
+	return N51D_request(client, N51D_CMD_MASS_ERASE, 0, NULL, 0, NULL, 0, NULL);
+}
+
+int N51D_read_config(n51d_client *client, uint8_t *cfg)
+{
+	return N51D_request(client, N51D_CMD_READ_CONFIG, 0, NULL, 0, cfg, 5, NULL);
+}
+
+int N51D_write_config(n51d_client *client, const uint8_t *cfg)
+{
+	return N51D_request(client, N51D_CMD_WRITE_CONFIG, 0, cfg, 5, NULL, 0, NULL);
+}
+
+int N51D_program(n51d_client *client, const uint8_t *cfg, const uint8_t *image, uint32_t image_len)
+{
+	uint8_t *payload = malloc(5 + image_len);
+	if (!payload)
+		return -1;
+	memcpy(payload, cfg, 5);
+	memcpy(payload + 5, image, image_len);
+	int rc = N51D_request(client, N51D_CMD_PROGRAM, 0, payload, 5 + image_len, NULL, 0, NULL);
+	free(payload);
+	return rc;
+}
+
+#endif // ARDUINO
@@ -0,0 +1,113 @@
+// Description: Job protocol of the nuvo51icpd ICP session daemon, and the C client library that speaks it.
+#pragma once
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * nuvo51icpd owns the GPIO lines and keeps the target in ICP mode between jobs, so a job only costs the
+ * ICP commands it issues (no gpiochip open, reset sequence or exit per call).
+ *
+ * Jobs are sent over a Unix stream socket, one after the other; each gets exactly one response.
+ * All integers are little-endian.
+ *
+ *   request:  n51d_req_hdr, followed by `len` bytes of payload for the jobs that carry data
+ *             (READ_FLASH has no payload, its `len` is the number of bytes to read)
+ *   response: n51d_resp_hdr, followed by `len` bytes of result data
+ *
+ * Any job other than ENTRY and EXIT enters ICP mode first if the target isn't in it (after EXIT, or when
+ * the daemon was started with -n).
+ */
+
+#define N51D_DEFAULT_SOCKET "/tmp/nuvo51icpd.sock"
+#define N51D_PROTOCOL_VERSION 1
+
+// CFG_FLASH_LEN + FLASH_SIZE, the largest payload (a PROGRAM job)
+#define N51D_MAX_PAYLOAD (5 + 18 * 1024)
+
+// Jobs
+#define N51D_CMD_PING             0x00 // -> u32 protocol version
+#define N51D_CMD_ENTRY            0x01 // addr: do_reset
+#define N51D_CMD_REENTRY          0x02 // payload: u32 delay1, delay2, delay3
+#define N51D_CMD_EXIT             0x03 // leaves ICP mode, the target runs until the next job
+#define N51D_CMD_READ_DEVICE_ID   0x04 // -> u32
+#define N51D_CMD_READ_PID         0x05 // -> u32
+#define N51D_CMD_READ_CID         0x06 // -> u8
+#define N51D_CMD_READ_UID         0x07 // -> 12 bytes
+#define N51D_CMD_READ_UCID        0x08 // -> 16 bytes
+#define N51D_CMD_READ_FLASH       0x10 // addr, len -> len bytes
+#define N51D_CMD_WRITE_FLASH      0x11 // addr, payload
+#define N51D_CMD_PAGE_ERASE       0x12 // addr
+#define N51D_CMD_MASS_ERASE       0x13 // re-enters ICP mode afterwards if the target was locked
+#define N51D_CMD_READ_CONFIG      0x14 // -> CFG_FLASH_LEN bytes
+#define N51D_CMD_WRITE_CONFIG     0x15 // payload: CFG_FLASH_LEN bytes; erases the config page first
+/*
+ * payload: CFG_FLASH_LEN config bytes, then the flash image from address 0 (APROM, then LDROM at the end
+ * of the flash as the config places it). Mass erases, writes the config and the image, and verifies both.
+ * If the config has LOCK set (bit 1 of the first byte cleared), the lock is only written after verifying.
+ */
+#define N51D_CMD_PROGRAM          0x16
+
+// Response status
+#define N51D_OK                   0
+#define N51D_ERR_BAD_REQUEST      1 // unknown job or bad length
+#define N51D_ERR_NO_DEVICE        2 // no N76E003 answered after entering ICP mode
+#define N51D_ERR_VERIFY           3 // PROGRAM read back different data
+
+typedef struct _n51d_req_hdr {
+	uint8_t cmd;
+	uint8_t flags; // reserved, 0
+	uint16_t reserved;
+	uint32_t addr;
+	uint32_t len;
+} n51d_req_hdr;
+
+typedef struct _n51d_resp_hdr {
+	uint8_t status;
+	uint8_t reserved[3];
+	uint32_t len;
+} n51d_resp_hdr;
+
+/*
+ * Client library
+ *
+ * Every function returns the response status (N51D_OK, N51D_ERR_*) or -1 if the connection failed.
+ */
+
+typedef struct _n51d_client n51d_client;
+
+// Connects to the daemon at `path` (NULL for N51D_DEFAULT_SOCKET)
+n51d_client *N51D_connect(const char *path);
+void N51D_close(n51d_client *client);
+
+/**
+ * Sends one job and waits for its response.
+ *
+ * @param payload request payload, `payload_len` bytes (may be NULL if 0)
+ * @param resp buffer for the result data, at most `resp_max` bytes are stored; may be NULL
+ * @param resp_len if not NULL, set to the length of the result data the daemon sent
+ */
+int N51D_request(n51d_client *client, uint8_t cmd, uint32_t addr, const void *payload, uint32_t payload_len,
+	void *resp, uint32_t resp_max, uint32_t *resp_len);
+
+int N51D_entry(n51d_client *client, uint8_t do_reset);
+int N51D_reentry(n51d_client *client, uint32_t delay1, uint32_t delay2, uint32_t delay3);
+int N51D_exit(n51d_client *client);
+int N51D_read_device_id(n51d_client *client, uint32_t *devid);
+int N51D_read_cid(n51d_client *client, uint8_t *cid);
+int N51D_read_uid(n51d_client *client, uint8_t *buf);
+int N51D_read_ucid(n51d_client *client, uint8_t *buf);
+int N51D_read_flash(n51d_client *client, uint32_t addr, uint32_t len, uint8_t *data);
+int N51D_write_flash(n51d_client *client, uint32_t addr, uint32_t len, const uint8_t *data);
+int N51D_page_erase(n51d_client *client, uint32_t addr);
+int N51D_mass_erase(n51d_client *client);
+int N51D_read_config(n51d_client *client, uint8_t *cfg);
+int N51D_write_config(n51d_client *client, const uint8_t *cfg);
+int N51D_program(n51d_client *client, const uint8_t *cfg, const uint8_t *image, uint32_t image_len);
+
+#ifdef __cplusplus
+}
+#endif
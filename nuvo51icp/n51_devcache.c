@@ -0,0 +1,228 @@
+/*
+ * nuvo51icp, a RPi ICP flasher for the Nuvoton N76E003
+ * https://github.com/steve-m/N76E003-playground
+ *
+ * Copyright (c) 2021 Steve Markgraf <steve@steve-m.de>
+ * Copyright (c) 2023-2024 Nikita Lita
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef ARDUINO
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "n51_devcache.h"
+
+#define PAGE_COUNT (FLASH_SIZE / PAGE_SIZE)
+
+struct _n51devcache {
+	int fd;
+	uint8_t *map;
+	n51dc_header *hdr;
+	uint8_t *flash;      // in the map
+	uint32_t generation; // generation this session saves as
+};
+
+const char *N51DC_default_dir(void)
+{
+	static char path[512];
+	const char *env = getenv("N51ICP_DEVICE_CACHE");
+	if (env && *env)
+		return env;
+	const char *base = getenv("XDG_CACHE_HOME");
+	if (base && *base) {
+		snprintf(path, sizeof(path), "%s/nuvo51icp/devices", base);
+		return path;
+	}
+	base = getenv("HOME");
+	if (!base || !*base)
+		return NULL;
+	snprintf(path, sizeof(path), "%s/.cache/nuvo51icp/devices", base);
+	return path;
+}
+
+static void make_dirs(const char *path)
+{
+	char dir[512];
+	snprintf(dir, sizeof(dir), "%s", path);
+	for (char *p = dir + 1; *p; p++) {
+		if (*p != '/')
+			continue;
+		*p = '\0';
+		mkdir(dir, 0755);
+		*p = '/';
+	}
+	mkdir(dir, 0755);
+}
+
+static void reset_header(n51dc_header *hdr, const uint8_t *uid)
+{
+	memset(hdr, 0, sizeof(*hdr));
+	hdr->magic = N51DC_MAGIC;
+	hdr->version = N51DC_VERSION;
+	memcpy(hdr->uid, uid, sizeof(hdr->uid));
+}
+
+n51devcache *N51DC_open(const char *dir, const uint8_t *uid)
+{
+	char path[600];
+	if (!dir)
+		return NULL;
+	make_dirs(dir);
+	int len = snprintf(path, sizeof(path), "%s/", dir);
+	for (int i = 0; i < 12; i++)
+		len += snprintf(path + len, sizeof(path) - len, "%02x", uid[i]);
+	snprintf(path + len, sizeof(path) - len, ".cache");
+
+	n51devcache *dc = calloc(1, sizeof(n51devcache));
+	if (!dc)
+		return NULL;
+	dc->fd = open(path, O_RDWR | O_CREAT, 0644);
+	if (dc->fd < 0 || ftruncate(dc->fd, N51DC_FILE_SIZE) != 0) {
+		perror(path);
+		goto err;
+	}
+	dc->map = mmap(NULL, N51DC_FILE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, dc->fd, 0);
+	if (dc->map == MAP_FAILED) {
+		perror(path);
+		goto err;
+	}
+	dc->hdr = (n51dc_header *)dc->map;
+	dc->flash = dc->map + N51DC_FLASH_OFFSET;
+	// a session that didn't finish may have written pages it never got to untrust
+	if (dc->hdr->magic != N51DC_MAGIC || dc->hdr->version != N51DC_VERSION || dc->hdr->open ||
+		memcmp(dc->hdr->uid, uid, sizeof(dc->hdr->uid)) != 0)
+		reset_header(dc->hdr, uid);
+	dc->generation = dc->hdr->generation + 1;
+	dc->hdr->open = 1;
+	msync(dc->map, N51DC_FLASH_OFFSET, MS_SYNC);
+	return dc;
+err:
+	if (dc->fd >= 0)
+		close(dc->fd);
+	free(dc);
+	return NULL;
+}
+
+int N51DC_trusted_pages(const n51devcache *dc)
+{
+	int count = 0;
+	for (int p = 0; p < PAGE_COUNT; p++)
+		count += dc->hdr->page_gen[p] != 0;
+	return count;
+}
+
+int N51DC_attach(n51devcache *dc, n51icp_ctx *ctx)
+{
+	uint8_t flash[FLASH_SIZE], config[CFG_FLASH_LEN];
+	int unchanged = 0, changed = 0;
+
+	N51ICP_ctx_read_flash(ctx, CFG_FLASH_ADDR, CFG_FLASH_LEN, config);
+	N51ICP_ctx_read_flash(ctx, APROM_FLASH_ADDR, FLASH_SIZE, flash);
+	if (dc->hdr->config_known && memcmp(dc->hdr->config, config, CFG_FLASH_LEN) != 0)
+		changed = 1;
+	memcpy(dc->hdr->config, config, CFG_FLASH_LEN);
+	dc->hdr->config_known = 1;
+	for (int p = 0; p < PAGE_COUNT; p++) {
+		uint8_t *cached = &dc->flash[p * PAGE_SIZE];
+		if (memcmp(cached, &flash[p * PAGE_SIZE], PAGE_SIZE) == 0 && dc->hdr->page_gen[p]) {
+			unchanged++;
+			continue;
+		}
+		if (dc->hdr->page_gen[p])
+			changed = 1;
+		memcpy(cached, &flash[p * PAGE_SIZE], PAGE_SIZE);
+		dc->hdr->page_gen[p] = dc->generation;
+	}
+	return changed ? -1 : unchanged;
+}
+
+void N51DC_write(n51devcache *dc, uint32_t addr, uint32_t len, const uint8_t *data)
+{
+	if (!dc)
+		return;
+	if (addr >= CFG_FLASH_ADDR) {
+		for (uint32_t i = 0; dc->hdr->config_known && i < len && addr - CFG_FLASH_ADDR + i < CFG_FLASH_LEN; i++)
+			dc->hdr->config[addr - CFG_FLASH_ADDR + i] &= data[i];
+		return;
+	}
+	for (uint32_t i = 0; i < len && addr + i < FLASH_SIZE; i++) {
+		uint32_t p = (addr + i) / PAGE_SIZE;
+		// what an untrusted page holds now is still unknown
+		if (!dc->hdr->page_gen[p])
+			continue;
+		dc->flash[addr + i] &= data[i];
+		dc->hdr->page_gen[p] = dc->generation;
+	}
+}
+
+void N51DC_erase(n51devcache *dc, uint32_t addr, uint32_t len)
+{
+	if (!dc)
+		return;
+	if (addr >= CFG_FLASH_ADDR) {
+		memset(dc->hdr->config, 0xFF, CFG_FLASH_LEN);
+		dc->hdr->config_known = 1;
+		return;
+	}
+	for (uint32_t a = addr & ~(PAGE_SIZE - 1); a < addr + len && a < FLASH_SIZE; a += PAGE_SIZE) {
+		memset(&dc->flash[a], 0xFF, PAGE_SIZE);
+		dc->hdr->page_gen[a / PAGE_SIZE] = dc->generation;
+	}
+}
+
+void N51DC_save(n51devcache *dc, n51icp_ctx *ctx)
+{
+	uint8_t flash[FLASH_SIZE], valid[PAGE_COUNT];
+	N51ICP_ctx_get_shadow_pages(ctx, flash, valid);
+	for (int p = 0; p < PAGE_COUNT; p++) {
+		uint8_t *cached = &dc->flash[p * PAGE_SIZE];
+		// pages read back this session: what the chip returned wins over what was recorded
+		if (valid[p] && (!dc->hdr->page_gen[p] || memcmp(cached, &flash[p * PAGE_SIZE], PAGE_SIZE) != 0)) {
+			memcpy(cached, &flash[p * PAGE_SIZE], PAGE_SIZE);
+			dc->hdr->page_gen[p] = dc->generation;
+		}
+	}
+	dc->hdr->generation = dc->generation;
+	msync(dc->map, N51DC_FILE_SIZE, MS_SYNC);
+}
+
+void N51DC_close(n51devcache *dc, n51icp_ctx *ctx)
+{
+	if (!dc)
+		return;
+	if (ctx)
+		N51DC_save(dc, ctx);
+	dc->hdr->open = 0;
+	msync(dc->map, N51DC_FILE_SIZE, MS_SYNC);
+	munmap(dc->map, N51DC_FILE_SIZE);
+	close(dc->fd);
+	free(dc);
+}
+
+#endif // ARDUINO
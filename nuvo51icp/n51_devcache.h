@@ -0,0 +1,99 @@
+// Description: Persistent per-chip cache of the flash contents, keyed by UID, that lets incremental programming and verify skip pages that already hold the image.
+#pragma once
+
+#include <stdint.h>
+#include "n51_icp.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Every chip gets one file, <dir>/<24 hex digit UID>.cache, laid out to be mmap()ed:
+ *
+ *   offset 0                  n51dc_header
+ *   offset N51DC_FLASH_OFFSET the flash contents, FLASH_SIZE bytes at their addresses
+ *
+ * A page is trusted when the cache knows what it holds: it was last read from the chip, or written or
+ * erased by a session that recorded it with N51DC_write()/N51DC_erase(). Its entry in page_gen is the
+ * generation of the session that stored its current contents (0 if the page isn't trusted). A session that
+ * never gets to N51DC_close() leaves the open flag set, which drops everything the next time the file is
+ * opened.
+ *
+ * The chip can also be written behind the cache's back (by another programmer, or by its own firmware
+ * through IAP), and the ICP has no command to checksum the flash, so N51DC_attach() reads the whole chip back
+ * and compares it with the cache. The cache doesn't save that read; it lets a write session erase and program
+ * only the pages that changed and verify only those, against contents checked in the same session.
+ */
+#define N51DC_MAGIC           0x4344314E // "N1DC"
+#define N51DC_VERSION         2
+#define N51DC_FLASH_OFFSET    4096
+#define N51DC_FILE_SIZE       (N51DC_FLASH_OFFSET + FLASH_SIZE)
+
+typedef struct _n51dc_header {
+	uint32_t magic;      // N51DC_MAGIC
+	uint32_t version;    // N51DC_VERSION
+	uint32_t generation; // sessions saved so far
+	uint32_t open;       // set while a session has the file open
+	uint8_t uid[12];
+	uint32_t page_gen[FLASH_SIZE / PAGE_SIZE];
+	uint8_t config[CFG_FLASH_LEN];
+	uint8_t config_known; // config holds the chip's config bytes
+} n51dc_header;
+
+typedef struct _n51devcache n51devcache;
+
+/**
+ * The cache directory: $N51ICP_DEVICE_CACHE if set, otherwise $XDG_CACHE_HOME/nuvo51icp/devices
+ * (~/.cache/nuvo51icp/devices). Returns NULL if neither that nor $HOME is set.
+ */
+const char *N51DC_default_dir(void);
+
+/**
+ * Opens (creating it and its directory if needed) and maps the cache file of the chip with the given UID,
+ * and marks it open. A file that is damaged, of another version or was left open starts out empty.
+ *
+ * @return the cache, or NULL on failure
+ */
+n51devcache *N51DC_open(const char *dir, const uint8_t *uid);
+
+/**
+ * Saves what the session learned with N51DC_save() if `ctx` isn't NULL, clears the open flag and unmaps
+ * the file.
+ */
+void N51DC_close(n51devcache *dc, n51icp_ctx *ctx);
+
+/**
+ * Reads the config bytes and the whole flash back through the context, compares them with what the cache
+ * trusts and then stores them, so every page is trusted afterwards. With the shadow enabled
+ * (N51ICP_ctx_enable_shadow()), the read also fills it, and the session's later reads of pages it doesn't
+ * write cost no ICP traffic. Must be called after the last entry into ICP mode and on an unlocked chip.
+ *
+ * @return the number of trusted pages that were unchanged, or -1 if the config or a trusted page had changed
+ */
+int N51DC_attach(n51devcache *dc, n51icp_ctx *ctx);
+
+/**
+ * Records a write of `len` bytes at `addr` (flash or config), as the chip applies it: bits can only be cleared,
+ * so a page that wasn't trusted (nor erased in this session) stays untrusted. Does nothing if `dc` is NULL.
+ */
+void N51DC_write(n51devcache *dc, uint32_t addr, uint32_t len, const uint8_t *data);
+
+/**
+ * Records an erase of the pages in [addr, addr + len) (flash or config). Does nothing if `dc` is NULL.
+ */
+void N51DC_erase(n51devcache *dc, uint32_t addr, uint32_t len);
+
+/**
+ * Stores the pages the context's shadow holds, which were read back from the chip and win over what was
+ * recorded, then syncs the file. Must be called before leaving ICP mode, which drops the shadow.
+ * N51DC_close() calls it.
+ */
+void N51DC_save(n51devcache *dc, n51icp_ctx *ctx);
+
+// Number of trusted pages
+int N51DC_trusted_pages(const n51devcache *dc);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,320 @@
+/*
+ * nuvo51icp, a RPi ICP flasher for the Nuvoton N76E003
+ * https://github.com/steve-m/N76E003-playground
+ *
+ * Copyright (c) 2021 Steve Markgraf <steve@steve-m.de>
+ * Copyright (c) 2023-2024 Nikita Lita
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef ARDUINO
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "config.h"
+#include "n51_gang.h"
+#include "n51_icp.h"
+#include "delay.h"
+
+// to avoid overhead from calling usleep() for 0 us
+#define USLEEP(x) if (x > 0) N51PGM_gang_usleep(ctx->pgm, x)
+
+n51gang_ctx *N51GANG_create(const n51pgm_gang_pins *pins)
+{
+	if (pins->count < 1 || pins->count > N51PGM_GANG_MAX)
+		return NULL;
+	n51gang_ctx *ctx = malloc(sizeof(n51gang_ctx));
+	if (!ctx)
+		return NULL;
+	ctx->pgm = N51PGM_gang_create(pins);
+	if (!ctx->pgm) {
+		free(ctx);
+		return NULL;
+	}
+	ctx->count = pins->count;
+	ctx->all = pins->count == 32 ? 0xFFFFFFFF : (1u << pins->count) - 1;
+	ctx->active = ctx->all;
+	ctx->program_time = PROGRAM_TIME;
+	ctx->page_erase_time = PAGE_ERASE_TIME;
+	ctx->reset_seq = ICP_RESET_SEQ;
+	ctx->reset_seq_bit_delay = RESET_SEQ_BIT_DELAY;
+	return ctx;
+}
+
+void N51GANG_free(n51gang_ctx *ctx)
+{
+	if (!ctx)
+		return;
+	N51PGM_gang_free(ctx->pgm);
+	free(ctx);
+}
+
+void N51GANG_disable(n51gang_ctx *ctx, uint32_t mask)
+{
+	if (!(ctx->active & mask))
+		return;
+	ctx->active &= ~mask;
+	N51PGM_gang_enable(ctx->pgm, ctx->active);
+}
+
+static void N51GANG_bitsend(n51gang_ctx *ctx, uint32_t data, int len, uint32_t udelay)
+{
+	N51PGM_gang_dat_dir(ctx->pgm, 1);
+	int i = len;
+	while (i--) {
+		N51PGM_gang_set_dat(ctx->pgm, ((data >> i) & 1) ? ctx->active : 0);
+		USLEEP(udelay);
+		N51PGM_gang_set_clk(ctx->pgm, 1);
+		USLEEP(udelay);
+		N51PGM_gang_set_clk(ctx->pgm, 0);
+	}
+}
+
+static void N51GANG_send_command(n51gang_ctx *ctx, uint8_t cmd, uint32_t dat)
+{
+	N51GANG_bitsend(ctx, (dat << 6) | cmd, 24, DEFAULT_BIT_DELAY);
+}
+
+static void send_reset_seq(n51gang_ctx *ctx, uint32_t reset_seq, int len)
+{
+	for (int i = 0; i < len + 1; i++) {
+		N51PGM_gang_set_rst(ctx->pgm, (reset_seq >> (len - i)) & 1);
+		USLEEP(ctx->reset_seq_bit_delay);
+	}
+}
+
+/*
+ * Clocks in one byte from every active target. Each DAT sample holds one bit of every target's byte,
+ * so the samples are transposed into `out` (indexed by target) afterwards.
+ */
+static void N51GANG_read_byte(n51gang_ctx *ctx, int end, uint8_t *out)
+{
+	uint32_t samples[8];
+	N51PGM_gang_dat_dir(ctx->pgm, 0);
+	USLEEP(DEFAULT_BIT_DELAY);
+
+	for (int i = 7; i >= 0; i--) {
+		USLEEP(DEFAULT_BIT_DELAY);
+		samples[i] = N51PGM_gang_get_dat(ctx->pgm);
+		N51PGM_gang_set_clk(ctx->pgm, 1);
+		USLEEP(DEFAULT_BIT_DELAY);
+		N51PGM_gang_set_clk(ctx->pgm, 0);
+	}
+
+	N51PGM_gang_dat_dir(ctx->pgm, 1);
+	USLEEP(DEFAULT_BIT_DELAY);
+	N51PGM_gang_set_dat(ctx->pgm, end ? ctx->active : 0);
+	USLEEP(DEFAULT_BIT_DELAY);
+	N51PGM_gang_set_clk(ctx->pgm, 1);
+	USLEEP(DEFAULT_BIT_DELAY);
+	N51PGM_gang_set_clk(ctx->pgm, 0);
+	USLEEP(DEFAULT_BIT_DELAY);
+	N51PGM_gang_set_dat(ctx->pgm, 0);
+
+	for (int t = 0; t < ctx->count; t++) {
+		if (!(ctx->active & (1u << t)))
+			continue;
+		uint8_t data = 0;
+		for (int i = 0; i < 8; i++)
+			data |= ((samples[i] >> t) & 1) << i;
+		out[t] = data;
+	}
+}
+
+static void N51GANG_write_byte(n51gang_ctx *ctx, uint8_t data, uint8_t end, uint32_t delay1, uint32_t delay2)
+{
+	N51GANG_bitsend(ctx, data, 8, DEFAULT_BIT_DELAY);
+
+	N51PGM_gang_set_dat(ctx->pgm, end ? ctx->active : 0);
+	USLEEP(delay1);
+	N51PGM_gang_set_clk(ctx->pgm, 1);
+	USLEEP(delay2);
+	N51PGM_gang_set_dat(ctx->pgm, 0);
+	N51PGM_gang_set_clk(ctx->pgm, 0);
+}
+
+int N51GANG_init(n51gang_ctx *ctx, uint8_t do_reset)
+{
+	int rc = N51PGM_gang_init(ctx->pgm);
+	if (rc < 0) {
+		return rc;
+	} else if (rc != 0) {
+		return -1;
+	}
+	ctx->active = ctx->all;
+	N51PGM_gang_enable(ctx->pgm, ctx->active);
+	N51GANG_entry(ctx, do_reset);
+	return 0;
+}
+
+void N51GANG_entry(n51gang_ctx *ctx, uint8_t do_reset)
+{
+	if (do_reset) {
+		send_reset_seq(ctx, ctx->reset_seq, 24);
+	} else {
+		N51PGM_gang_set_rst(ctx->pgm, 1);
+		USLEEP(5000);
+		N51PGM_gang_set_rst(ctx->pgm, 0);
+		USLEEP(1000);
+	}
+
+	USLEEP(100);
+	N51GANG_bitsend(ctx, ENTRY_BITS, 24, ENTRY_BIT_DELAY);
+	USLEEP(10);
+}
+
+void N51GANG_reentry(n51gang_ctx *ctx, uint32_t delay1, uint32_t delay2, uint32_t delay3)
+{
+	USLEEP(10);
+	if (delay1 > 0) {
+		N51PGM_gang_set_rst(ctx->pgm, 1);
+		USLEEP(delay1);
+	}
+	N51PGM_gang_set_rst(ctx->pgm, 0);
+	USLEEP(delay2);
+	N51GANG_bitsend(ctx, ENTRY_BITS, 24, ENTRY_BIT_DELAY);
+	USLEEP(delay3);
+}
+
+void N51GANG_exit(n51gang_ctx *ctx)
+{
+	N51PGM_gang_set_rst(ctx->pgm, 1);
+	USLEEP(5000);
+	N51PGM_gang_set_rst(ctx->pgm, 0);
+	USLEEP(10000);
+	N51GANG_bitsend(ctx, EXIT_BITS, 24, ENTRY_BIT_DELAY);
+	USLEEP(500);
+	N51PGM_gang_set_rst(ctx->pgm, 1);
+}
+
+void N51GANG_deinit(n51gang_ctx *ctx)
+{
+	// every target gets the exit sequence, including the ones that failed
+	ctx->active = ctx->all;
+	N51PGM_gang_enable(ctx->pgm, ctx->active);
+	N51GANG_exit(ctx);
+	N51PGM_gang_deinit(ctx->pgm, 1);
+}
+
+void N51GANG_read_device_id(n51gang_ctx *ctx, uint32_t *ids)
+{
+	uint8_t lo[N51PGM_GANG_MAX], hi[N51PGM_GANG_MAX];
+	N51GANG_send_command(ctx, N51ICP_CMD_READ_DEVICE_ID, 0);
+	N51GANG_read_byte(ctx, 0, lo);
+	N51GANG_read_byte(ctx, 1, hi);
+	for (int t = 0; t < ctx->count; t++) {
+		if (ctx->active & (1u << t))
+			ids[t] = (hi[t] << 8) | lo[t];
+	}
+}
+
+void N51GANG_read_cid(n51gang_ctx *ctx, uint8_t *cids)
+{
+	N51GANG_send_command(ctx, N51ICP_CMD_READ_CID, 0);
+	N51GANG_read_byte(ctx, 1, cids);
+}
+
+static void read_id_bytes(n51gang_ctx *ctx, uint32_t base, int len, uint8_t *bufs)
+{
+	uint8_t byte[N51PGM_GANG_MAX];
+	for (int i = 0; i < len; i++) {
+		N51GANG_send_command(ctx, N51ICP_CMD_READ_UID, base + i);
+		N51GANG_read_byte(ctx, 1, byte);
+		for (int t = 0; t < ctx->count; t++) {
+			if (ctx->active & (1u << t))
+				bufs[t * len + i] = byte[t];
+		}
+	}
+}
+
+void N51GANG_read_uid(n51gang_ctx *ctx, uint8_t *bufs)
+{
+	read_id_bytes(ctx, 0, 12, bufs);
+}
+
+void N51GANG_read_ucid(n51gang_ctx *ctx, uint8_t *bufs)
+{
+	read_id_bytes(ctx, 0x20, 16, bufs);
+}
+
+void N51GANG_read_flash(n51gang_ctx *ctx, uint32_t addr, uint32_t len, uint8_t *data)
+{
+	uint8_t byte[N51PGM_GANG_MAX];
+	if (len == 0)
+		return;
+	N51GANG_send_command(ctx, N51ICP_CMD_READ_FLASH, addr);
+	for (uint32_t i = 0; i < len; i++) {
+		N51GANG_read_byte(ctx, i == (len - 1), byte);
+		for (int t = 0; t < ctx->count; t++) {
+			if (ctx->active & (1u << t))
+				data[t * len + i] = byte[t];
+		}
+	}
+}
+
+void N51GANG_write_flash(n51gang_ctx *ctx, uint32_t addr, uint32_t len, const uint8_t *data)
+{
+	if (len == 0)
+		return;
+	N51GANG_send_command(ctx, N51ICP_CMD_WRITE_FLASH, addr);
+	for (uint32_t i = 0; i < len; i++)
+		N51GANG_write_byte(ctx, data[i], i == (len - 1), ctx->program_time, 5);
+}
+
+uint32_t N51GANG_verify_flash(n51gang_ctx *ctx, uint32_t addr, uint32_t len, const uint8_t *data)
+{
+	uint8_t byte[N51PGM_GANG_MAX];
+	uint32_t failed = 0;
+	if (len == 0)
+		return 0;
+	N51GANG_send_command(ctx, N51ICP_CMD_READ_FLASH, addr);
+	for (uint32_t i = 0; i < len; i++) {
+		N51GANG_read_byte(ctx, i == (len - 1), byte);
+		for (int t = 0; t < ctx->count; t++) {
+			if ((ctx->active & (1u << t)) && byte[t] != data[i])
+				failed |= 1u << t;
+		}
+	}
+	// only drop the failed targets once the read is finished, so the others see an unchanged bit stream
+	N51GANG_disable(ctx, failed);
+	return failed;
+}
+
+void N51GANG_mass_erase(n51gang_ctx *ctx)
+{
+	N51GANG_send_command(ctx, N51ICP_CMD_MASS_ERASE, 0x3A5A5);
+	N51GANG_write_byte(ctx, 0xff, 1, MASS_ERASE_TIME, 500);
+}
+
+void N51GANG_page_erase(n51gang_ctx *ctx, uint32_t addr)
+{
+	N51GANG_send_command(ctx, N51ICP_CMD_PAGE_ERASE, addr);
+	N51GANG_write_byte(ctx, 0xff, 1, ctx->page_erase_time, 100);
+}
+
+uint64_t N51GANG_get_time(n51gang_ctx *ctx)
+{
+	return N51PGM_gang_get_time(ctx->pgm);
+}
+
+#endif // ARDUINO
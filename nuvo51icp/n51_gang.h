@@ -0,0 +1,71 @@
+// Description: Gang ICP engine: programs several targets sharing CLK and RST, each on its own DAT line, in lockstep.
+#pragma once
+
+#include <stdint.h>
+#include "n51_pgm.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * A gang of targets driven in lockstep.
+ *
+ * Every operation issues the same bit sequence as n51_icp.c, once for all targets. Writes send the same data to
+ * every active target, reads sample every active target on each clock. Targets that fail are removed from the
+ * active mask; their DAT line is released and they are ignored from then on. Bit i of every mask is target i.
+ */
+typedef struct _n51gang_ctx {
+	n51pgm_gang *pgm;
+	int count;
+	uint32_t all;        // every target in the gang
+	uint32_t active;     // targets still being programmed
+	int program_time;    // us, per programmed byte
+	int page_erase_time; // us
+	uint32_t reset_seq;           // as in n51icp_ctx
+	uint32_t reset_seq_bit_delay; // us
+} n51gang_ctx;
+
+n51gang_ctx *N51GANG_create(const n51pgm_gang_pins *pins);
+void N51GANG_free(n51gang_ctx *ctx);
+
+// Claims the pins and enters ICP mode on all targets, all of which start out active.
+int N51GANG_init(n51gang_ctx *ctx, uint8_t do_reset);
+void N51GANG_deinit(n51gang_ctx *ctx);
+
+// Removes the targets in `mask` from the active set
+void N51GANG_disable(n51gang_ctx *ctx, uint32_t mask);
+
+void N51GANG_entry(n51gang_ctx *ctx, uint8_t do_reset);
+void N51GANG_reentry(n51gang_ctx *ctx, uint32_t delay1, uint32_t delay2, uint32_t delay3);
+void N51GANG_exit(n51gang_ctx *ctx);
+
+// Per-target results; entries of inactive targets are left untouched
+void N51GANG_read_device_id(n51gang_ctx *ctx, uint32_t *ids);
+void N51GANG_read_cid(n51gang_ctx *ctx, uint8_t *cids);
+void N51GANG_read_uid(n51gang_ctx *ctx, uint8_t *bufs); // 12 bytes per target
+void N51GANG_read_ucid(n51gang_ctx *ctx, uint8_t *bufs); // 16 bytes per target
+
+// Reads `len` bytes from every active target; target i's data goes to data + i * len
+void N51GANG_read_flash(n51gang_ctx *ctx, uint32_t addr, uint32_t len, uint8_t *data);
+
+// Writes the same `len` bytes to every active target
+void N51GANG_write_flash(n51gang_ctx *ctx, uint32_t addr, uint32_t len, const uint8_t *data);
+
+/**
+ * Reads back `len` bytes from every active target and compares them against `data`.
+ * Targets that don't match are disabled.
+ *
+ * @return the mask of targets that failed
+ */
+uint32_t N51GANG_verify_flash(n51gang_ctx *ctx, uint32_t addr, uint32_t len, const uint8_t *data);
+
+void N51GANG_mass_erase(n51gang_ctx *ctx);
+void N51GANG_page_erase(n51gang_ctx *ctx, uint32_t addr);
+
+// Backend time, in microseconds
+uint64_t N51GANG_get_time(n51gang_ctx *ctx);
+
+#ifdef __cplusplus
+}
+#endif
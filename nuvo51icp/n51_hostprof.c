@@ -0,0 +1,454 @@
+/*
+ * nuvo51icp, a RPi ICP flasher for the Nuvoton N76E003
+ * https://github.com/steve-m/N76E003-playground
+ *
+ * Copyright (c) 2021 Steve Markgraf <steve@steve-m.de>
+ * Copyright (c) 2023-2024 Nikita Lita
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef ARDUINO
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <dlfcn.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/utsname.h>
+
+#include "n51_pgm.h"
+#include "n51_icp.h"
+#include "n51_plan.h"
+#include "n51_hostprof.h"
+
+// Fixed sample counts so that runs are comparable across machines
+#define OP_SAMPLES     20000
+#define OP_WARMUP      1000
+#define MAX_BACKENDS   4
+
+// The shortest half clock period the ICP engine is known to work with
+// (roughly what the pigpio backend produces with its default bit delay)
+#define MIN_HALF_PERIOD_NS 1000
+
+// Oversleeping by more than this during a write risks a failed flash write (see the Pi 5 note in the README)
+#define MAX_SAFE_LATENCY_NS (PROGRAM_TIME * 1000)
+
+enum {
+	OP_SET_DAT,
+	OP_SET_CLK,
+	OP_GET_DAT,
+	OP_DAT_DIR,
+	OP_COUNT
+};
+
+static const char *op_names[OP_COUNT] = {"set_dat", "set_clk", "get_dat", "dat_dir"};
+
+static const struct {
+	uint32_t usec;
+	uint32_t samples;
+} sleep_tests[] = {
+	{1, 2000}, {2, 2000}, {3, 2000}, {5, 2000}, {10, 2000}, {20, 2000},
+	{60, 1000}, {100, 1000}, {500, 400}, {1000, 200}, {5000, 50},
+};
+#define SLEEP_TEST_COUNT (sizeof(sleep_tests) / sizeof(sleep_tests[0]))
+
+static const uint32_t bit_delay_candidates[] = {0, 1, 2, 3, 5, 10};
+#define BIT_DELAY_CANDIDATE_COUNT (sizeof(bit_delay_candidates) / sizeof(bit_delay_candidates[0]))
+
+typedef struct _n51prof_stats {
+	uint32_t min;
+	uint32_t p50;
+	uint32_t p90;
+	uint32_t p99;
+	uint32_t p999;
+	uint32_t max;
+} n51prof_stats;
+
+typedef struct _n51prof_result {
+	const char *name;
+	n51prof_stats op[OP_COUNT];
+	n51prof_stats sleep[SLEEP_TEST_COUNT]; // actual duration, in ns
+	uint8_t sleeps_ok;
+	int32_t bit_delay;                     // recommended bit delay, -1 if none works
+	uint64_t est_us;                       // planned time of a full-flash write and verify
+} n51prof_result;
+
+static inline uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int cmp_u32(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+	return (x > y) - (x < y);
+}
+
+static n51prof_stats get_stats(uint32_t *samples, uint32_t n)
+{
+	n51prof_stats s;
+	qsort(samples, n, sizeof(uint32_t), cmp_u32);
+	s.min = samples[0];
+	s.p50 = samples[n / 2];
+	s.p90 = samples[(uint64_t)n * 90 / 100];
+	s.p99 = samples[(uint64_t)n * 99 / 100];
+	s.p999 = samples[(uint64_t)n * 999 / 1000];
+	s.max = samples[n - 1];
+	return s;
+}
+
+static uint32_t timer_overhead_ns(void)
+{
+	uint32_t best = UINT32_MAX;
+	for (int i = 0; i < 1000; i++) {
+		uint64_t t0 = now_ns();
+		uint64_t t1 = now_ns();
+		if (t1 - t0 < best)
+			best = t1 - t0;
+	}
+	return best;
+}
+
+static uint32_t elapsed(uint64_t t0, uint64_t t1, uint32_t overhead)
+{
+	uint64_t d = t1 - t0;
+	return d > overhead ? (uint32_t)(d - overhead) : 0;
+}
+
+static void measure_ops(const n51pgm_ops *ops, n51prof_result *res, uint32_t *samples, uint32_t overhead)
+{
+	uint64_t t0, t1;
+
+	ops->dat_dir(1);
+	for (int i = 0; i < OP_WARMUP + OP_SAMPLES; i++) {
+		t0 = now_ns();
+		ops->set_dat(i & 1);
+		t1 = now_ns();
+		if (i >= OP_WARMUP)
+			samples[i - OP_WARMUP] = elapsed(t0, t1, overhead);
+	}
+	ops->set_dat(0);
+	res->op[OP_SET_DAT] = get_stats(samples, OP_SAMPLES);
+
+	for (int i = 0; i < OP_WARMUP + OP_SAMPLES; i++) {
+		t0 = now_ns();
+		ops->set_clk(i & 1);
+		t1 = now_ns();
+		if (i >= OP_WARMUP)
+			samples[i - OP_WARMUP] = elapsed(t0, t1, overhead);
+	}
+	ops->set_clk(0);
+	res->op[OP_SET_CLK] = get_stats(samples, OP_SAMPLES);
+
+	ops->dat_dir(0);
+	for (int i = 0; i < OP_WARMUP + OP_SAMPLES; i++) {
+		t0 = now_ns();
+		ops->get_dat();
+		t1 = now_ns();
+		if (i >= OP_WARMUP)
+			samples[i - OP_WARMUP] = elapsed(t0, t1, overhead);
+	}
+	res->op[OP_GET_DAT] = get_stats(samples, OP_SAMPLES);
+
+	for (int i = 0; i < OP_WARMUP + OP_SAMPLES; i++) {
+		t0 = now_ns();
+		ops->dat_dir(!(i & 1));
+		t1 = now_ns();
+		if (i >= OP_WARMUP)
+			samples[i - OP_WARMUP] = elapsed(t0, t1, overhead);
+	}
+	ops->dat_dir(0);
+	res->op[OP_DAT_DIR] = get_stats(samples, OP_SAMPLES);
+}
+
+static void measure_sleeps(const n51pgm_ops *ops, n51prof_result *res, uint32_t *samples, uint32_t overhead)
+{
+	res->sleeps_ok = 1;
+	for (size_t t = 0; t < SLEEP_TEST_COUNT; t++) {
+		uint32_t usec = sleep_tests[t].usec;
+		for (uint32_t i = 0; i < sleep_tests[t].samples; i++) {
+			uint64_t t0 = now_ns();
+			ops->usleep(usec);
+			uint64_t t1 = now_ns();
+			samples[i] = elapsed(t0, t1, overhead);
+		}
+		res->sleep[t] = get_stats(samples, sleep_tests[t].samples);
+		// a backend that doesn't really sleep (e.g. the simulator) can't be used for programming
+		if (usec >= 10 && res->sleep[t].p50 < usec * 500)
+			res->sleeps_ok = 0;
+	}
+}
+
+static const n51prof_stats *sleep_stats_for(const n51prof_result *res, uint32_t usec)
+{
+	for (size_t t = 0; t < SLEEP_TEST_COUNT; t++) {
+		if (sleep_tests[t].usec == usec)
+			return &res->sleep[t];
+	}
+	return NULL;
+}
+
+/*
+ * The engine's clock phases are a pin operation followed by USLEEP(bit delay), so the
+ * shortest half period a bit delay can produce is the fastest op plus the shortest sleep.
+ */
+static void recommend_bit_delay(n51prof_result *res)
+{
+	uint32_t fastest_op = res->op[OP_SET_DAT].min < res->op[OP_SET_CLK].min ? res->op[OP_SET_DAT].min : res->op[OP_SET_CLK].min;
+	res->bit_delay = -1;
+	if (!res->sleeps_ok)
+		return;
+	for (size_t i = 0; i < BIT_DELAY_CANDIDATE_COUNT; i++) {
+		uint32_t d = bit_delay_candidates[i];
+		uint32_t shortest_sleep = 0;
+		if (d > 0)
+			shortest_sleep = sleep_stats_for(res, d)->min;
+		if (fastest_op + shortest_sleep >= MIN_HALF_PERIOD_NS) {
+			res->bit_delay = d;
+			return;
+		}
+	}
+}
+
+static void make_profile(const n51prof_result *res, n51_timing_profile *prof)
+{
+	N51PLAN_default_profile(prof);
+	prof->gpio_latency_ns = res->op[OP_SET_CLK].p50;
+	prof->bit_delay_us = res->bit_delay;
+	if (res->bit_delay > 0) {
+		uint32_t actual = sleep_stats_for(res, res->bit_delay)->p50;
+		prof->sleep_overhead_ns = actual > (uint32_t)res->bit_delay * 1000 ? actual - res->bit_delay * 1000 : 0;
+	}
+}
+
+// Plans the same full-flash write and verify for every backend so the estimates are comparable
+static uint64_t estimate_full_write(const n51prof_result *res)
+{
+	n51_timing_profile prof;
+	make_profile(res, &prof);
+	n51plan *plan = N51PLAN_create(&prof);
+	if (!plan)
+		return 0;
+	N51PLAN_init(plan, 1);
+	N51PLAN_set_phase(plan, N51PLAN_ERASE);
+	N51PLAN_mass_erase(plan);
+	N51PLAN_set_phase(plan, N51PLAN_WRITE);
+	N51PLAN_write_flash(plan, APROM_FLASH_ADDR, FLASH_SIZE);
+	N51PLAN_set_phase(plan, N51PLAN_VERIFY);
+	N51PLAN_read_flash(plan, APROM_FLASH_ADDR, FLASH_SIZE);
+	N51PLAN_set_phase(plan, N51PLAN_EXIT);
+	N51PLAN_exit(plan);
+	uint64_t total = N51PLAN_total_us(plan);
+	N51PLAN_free(plan);
+	return total;
+}
+
+static uint8_t has_safe_latency(const n51prof_result *res)
+{
+	for (int i = 0; i < OP_COUNT; i++) {
+		if (res->op[i].max > MAX_SAFE_LATENCY_NS)
+			return 0;
+	}
+	return 1;
+}
+
+static void print_stats_row(const char *label, const n51prof_stats *s)
+{
+	printf("  %-12s %8u %8u %8u %8u %8u %9u\n", label, s->min, s->p50, s->p90, s->p99, s->p999, s->max);
+}
+
+static void print_result(const n51prof_result *res)
+{
+	printf("\n=== %s ===\n", res->name);
+	printf("  %-12s %8s %8s %8s %8s %8s %9s   (ns)\n", "operation", "min", "p50", "p90", "p99", "p99.9", "max");
+	for (int i = 0; i < OP_COUNT; i++)
+		print_stats_row(op_names[i], &res->op[i]);
+	for (size_t t = 0; t < SLEEP_TEST_COUNT; t++) {
+		char label[16];
+		snprintf(label, sizeof(label), "usleep(%u)", sleep_tests[t].usec);
+		print_stats_row(label, &res->sleep[t]);
+	}
+	if (!res->sleeps_ok)
+		printf("  N51PGM_usleep() does not really sleep, backend can't be used for programming\n");
+	else if (res->bit_delay < 0)
+		printf("  no bit delay up to %u us gives a %u ns half clock period\n",
+			bit_delay_candidates[BIT_DELAY_CANDIDATE_COUNT - 1], MIN_HALF_PERIOD_NS);
+	else
+		printf("  recommended bit delay: %d us, estimated full write + verify: %.2f s\n", res->bit_delay, res->est_us / 1e6);
+	if (!has_safe_latency(res))
+		printf("  WARNING: worst-case pin operation latency exceeds %u ns (e.g. Pi 5 without pcie_aspm=off)\n", MAX_SAFE_LATENCY_NS);
+}
+
+static int load_backend(const char *libdir, const char *name, n51pgm_ops *ops)
+{
+	char path[512];
+	snprintf(path, sizeof(path), "%s/libnuvo51icp-%s.so", libdir, name);
+	void *handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+	if (!handle)
+		return -1;
+	memset(ops, 0, sizeof(*ops));
+	ops->name = name;
+	ops->handle = handle;
+	ops->init = (int (*)(void))dlsym(handle, "N51PGM_init");
+	ops->deinit = (void (*)(uint8_t))dlsym(handle, "N51PGM_deinit");
+	ops->set_dat = (void (*)(uint8_t))dlsym(handle, "N51PGM_set_dat");
+	ops->get_dat = (uint8_t (*)(void))dlsym(handle, "N51PGM_get_dat");
+	ops->set_clk = (void (*)(uint8_t))dlsym(handle, "N51PGM_set_clk");
+	ops->dat_dir = (void (*)(uint8_t))dlsym(handle, "N51PGM_dat_dir");
+	ops->usleep = (uint32_t (*)(uint32_t))dlsym(handle, "N51PGM_usleep");
+	if (!ops->init || !ops->deinit || !ops->set_dat || !ops->get_dat || !ops->set_clk || !ops->dat_dir || !ops->usleep) {
+		fprintf(stderr, "%s: missing PGM symbols\n", path);
+		dlclose(handle);
+		return -1;
+	}
+	return 0;
+}
+
+static void linked_backend(const char *name, n51pgm_ops *ops)
+{
+	ops->name = name;
+	ops->handle = NULL;
+	ops->init = N51PGM_init;
+	ops->deinit = N51PGM_deinit;
+	ops->set_dat = N51PGM_set_dat;
+	ops->get_dat = N51PGM_get_dat;
+	ops->set_clk = N51PGM_set_clk;
+	ops->dat_dir = N51PGM_dat_dir;
+	ops->usleep = N51PGM_usleep;
+}
+
+// Pins the profiler to one CPU and asks for realtime scheduling, so runs are comparable
+static void setup_environment(void)
+{
+	struct utsname u;
+	if (uname(&u) == 0)
+		printf("Host: %s %s %s\n", u.sysname, u.release, u.machine);
+
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(ncpu > 0 ? ncpu - 1 : 0, &set);
+	if (sched_setaffinity(0, sizeof(set), &set) == 0)
+		printf("Pinned to CPU %ld\n", ncpu > 0 ? ncpu - 1 : 0);
+	else
+		printf("Not pinned to a CPU (%s)\n", strerror(errno));
+
+	struct sched_param sp = {.sched_priority = sched_get_priority_max(SCHED_FIFO) / 2};
+	if (sched_setscheduler(0, SCHED_FIFO, &sp) == 0)
+		printf("Realtime scheduling: SCHED_FIFO %d\n", sp.sched_priority);
+	else
+		printf("Realtime scheduling: no (%s)\n", strerror(errno));
+
+	if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0)
+		printf("Memory not locked (%s)\n", strerror(errno));
+
+	printf("Samples: %d per pin operation\n", OP_SAMPLES);
+}
+
+int N51PROF_profile_host(const char *libdir, const char *linked_name)
+{
+	static const char *lib_names[] = {"gpiod", "pigpio", "sim"};
+	n51pgm_ops backends[MAX_BACKENDS];
+	n51prof_result results[MAX_BACKENDS];
+	int nbackends = 0, nresults = 0;
+
+	setup_environment();
+
+	if (linked_name)
+		linked_backend(linked_name, &backends[nbackends++]);
+	for (size_t i = 0; libdir && i < sizeof(lib_names) / sizeof(lib_names[0]); i++) {
+		if (linked_name && strcmp(linked_name, lib_names[i]) == 0)
+			continue;
+		if (load_backend(libdir, lib_names[i], &backends[nbackends]) == 0)
+			nbackends++;
+	}
+	if (nbackends == 0) {
+		fprintf(stderr, "ERROR: No backends found!\n");
+		return -1;
+	}
+
+	uint32_t *samples = malloc(OP_SAMPLES * sizeof(uint32_t));
+	if (!samples)
+		return -1;
+	uint32_t overhead = timer_overhead_ns();
+	printf("Timer overhead: %u ns (subtracted)\n", overhead);
+
+	for (int i = 0; i < nbackends; i++) {
+		n51pgm_ops *ops = &backends[i];
+		if (ops->init() != 0) {
+			fprintf(stderr, "%s: initialization failed, skipping\n", ops->name);
+			ops->deinit(0);
+			continue;
+		}
+		n51prof_result *res = &results[nresults++];
+		memset(res, 0, sizeof(*res));
+		res->name = ops->name;
+		measure_ops(ops, res, samples, overhead);
+		measure_sleeps(ops, res, samples, overhead);
+		ops->deinit(0);
+		recommend_bit_delay(res);
+		if (res->bit_delay >= 0)
+			res->est_us = estimate_full_write(res);
+		print_result(res);
+	}
+	free(samples);
+	for (int i = 0; i < nbackends; i++) {
+		if (backends[i].handle)
+			dlclose(backends[i].handle);
+	}
+	if (nresults == 0)
+		return -1;
+
+	// Prefer backends without dangerous latency spikes, then the fastest planned write
+	const n51prof_result *best = NULL;
+	for (int pass = 0; pass < 2 && !best; pass++) {
+		for (int i = 0; i < nresults; i++) {
+			const n51prof_result *res = &results[i];
+			if (res->bit_delay < 0 || (pass == 0 && !has_safe_latency(res)))
+				continue;
+			if (!best || res->est_us < best->est_us)
+				best = res;
+		}
+	}
+	printf("\n");
+	if (!best) {
+		printf("No usable backend found.\n");
+		return 0;
+	}
+	n51_timing_profile prof;
+	make_profile(best, &prof);
+	printf("Recommended backend: %s, bit delay %d us (build with -DUSER_DEFINED_DEFAULT_DELAY -DDEFAULT_BIT_DELAY=%d)\n",
+		best->name, best->bit_delay, best->bit_delay);
+	printf("\nTiming profile for --plan:\n");
+	printf("gpio_latency_ns = %u\nsleep_overhead_ns = %u\nbit_delay_us = %u\n",
+		prof.gpio_latency_ns, prof.sleep_overhead_ns, prof.bit_delay_us);
+	return 0;
+}
+
+#endif // ARDUINO
@@ -0,0 +1,39 @@
+// Description: Host GPIO latency and sleep accuracy profiler, used to choose a PGM backend and bit delay.
+#pragma once
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * A PGM backend, either the one linked into this binary or one loaded from a libnuvo51icp-<name>.so
+ */
+typedef struct _n51pgm_ops {
+	const char *name;
+	int (*init)(void);
+	void (*deinit)(uint8_t leave_reset_high);
+	void (*set_dat)(uint8_t val);
+	uint8_t (*get_dat)(void);
+	void (*set_clk)(uint8_t val);
+	void (*dat_dir)(uint8_t state);
+	uint32_t (*usleep)(uint32_t usec);
+	void *handle; // dlopen() handle, NULL for the linked backend
+} n51pgm_ops;
+
+/**
+ * Profiles every available backend and prints the results and a recommended backend and bit delay.
+ *
+ * The pins are exercised with RST held low and a constant DAT pattern, so this is safe to run with or
+ * without a target attached.
+ *
+ * @param libdir directory to search for libnuvo51icp-<name>.so, or NULL for none
+ * @param linked_name name of the backend linked into this binary, or NULL to skip it
+ * @return 0 if at least one backend could be profiled, <0 otherwise
+ */
+int N51PROF_profile_host(const char *libdir, const char *linked_name);
+
+#ifdef __cplusplus
+}
+#endif
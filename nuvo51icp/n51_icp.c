@@ -28,73 +28,229 @@
 #include <stdint.h>
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifndef ARDUINO
+#include <pthread.h>
+#endif
 #include "config.h"
 #include "n51_icp.h"
 #include "n51_pgm.h"
 #include "delay.h"
 
-// These are MCU dependent (default for N76E003)
-static int program_time = 20;
-static int page_erase_time = 6000;
-
 // to avoid overhead from calling usleep() for 0 us
-#define USLEEP(x) if (x > 0) N51PGM_usleep(x)
+#define USLEEP(x) if (x > 0) N51PGM_ctx_usleep(ctx->pgm, x)
 
 #ifdef _DEBUG
 #define DEBUG_PRINT(x) N51ICP_outputf(x)
 #else
 #define DEBUG_PRINT(x)
 #endif
-#define ENTRY_BIT_DELAY 60
 
+// Used by the functions without a context argument; program_time and page_erase_time are MCU dependent (default for N76E003)
+static n51icp_ctx default_ctx = {NULL, 0, PROGRAM_TIME, PAGE_ERASE_TIME, ICP_RESET_SEQ, RESET_SEQ_BIT_DELAY, NULL, NULL, NULL};
+
+// A full flash shadow doesn't fit in an AVR's RAM
+#ifndef ARDUINO
+#define SHADOW_FLASH 1
+#else
+#define SHADOW_FLASH 0
+#endif
+
+#define SHADOW_DEVID  0x01
+#define SHADOW_PID    0x02
+#define SHADOW_CID    0x04
+#define SHADOW_UID    0x08
+#define SHADOW_UCID   0x10
+#define SHADOW_CONFIG 0x20
+
+struct _n51icp_shadow {
+	uint8_t valid; // SHADOW_*
+	uint32_t devid;
+	uint32_t pid;
+	uint8_t cid;
+	uint8_t uid[12];
+	uint8_t ucid[16];
+	uint8_t config[CFG_FLASH_LEN];
+#if SHADOW_FLASH
+	uint8_t page_valid[FLASH_SIZE / PAGE_SIZE];
+	uint8_t flash[FLASH_SIZE];
+#endif
+};
+
+static void default_ctx_init(void)
+{
+	default_ctx.pgm = N51PGM_default_ctx();
+}
+
+// Stations may reach the default context from several threads at once
+#ifndef ARDUINO
+static pthread_once_t default_ctx_once = PTHREAD_ONCE_INIT;
+#endif
+
+n51icp_ctx *N51ICP_default_ctx(void)
+{
+#ifndef ARDUINO
+	pthread_once(&default_ctx_once, default_ctx_init);
+#else
+	if (!default_ctx.pgm)
+		default_ctx_init();
+#endif
+	return &default_ctx;
+}
 
+n51icp_ctx *N51ICP_ctx_create(const n51pgm_pins *pins)
+{
+	n51icp_ctx *ctx = malloc(sizeof(n51icp_ctx));
+	if (!ctx)
+		return NULL;
+	ctx->pgm = N51PGM_ctx_create(pins);
+	if (!ctx->pgm) {
+		free(ctx);
+		return NULL;
+	}
+	ctx->owns_pgm = 1;
+	ctx->program_time = PROGRAM_TIME;
+	ctx->page_erase_time = PAGE_ERASE_TIME;
+	ctx->reset_seq = ICP_RESET_SEQ;
+	ctx->reset_seq_bit_delay = RESET_SEQ_BIT_DELAY;
+	ctx->shadow = NULL;
+	ctx->write_hook = NULL;
+	ctx->write_hook_user = NULL;
+	return ctx;
+}
 
-static void N51ICP_bitsend(uint32_t data, int len, uint32_t udelay)
+void N51ICP_ctx_free(n51icp_ctx *ctx)
 {
-	N51PGM_dat_dir(1);
+	if (!ctx || ctx == &default_ctx)
+		return;
+	free(ctx->shadow);
+	if (ctx->owns_pgm)
+		N51PGM_ctx_free(ctx->pgm);
+	free(ctx);
+}
+
+static void N51ICP_bitsend(n51icp_ctx *ctx, uint32_t data, int len, uint32_t udelay)
+{
+	N51PGM_ctx_dat_dir(ctx->pgm, 1);
 	int i = len;
 	while (i--){
-			N51PGM_set_dat((data >> i) & 1);
+			N51PGM_ctx_set_dat(ctx->pgm, (data >> i) & 1);
 			USLEEP(udelay);
-			N51PGM_set_clk(1);
+			N51PGM_ctx_set_clk(ctx->pgm, 1);
 			USLEEP(udelay);
-			N51PGM_set_clk(0);
+			N51PGM_ctx_set_clk(ctx->pgm, 0);
 	}
 }
 
-static void N51ICP_send_command(uint8_t cmd, uint32_t dat)
+static void N51ICP_send_command(n51icp_ctx *ctx, uint8_t cmd, uint32_t dat)
 {
-	N51ICP_bitsend((dat << 6) | cmd, 24, DEFAULT_BIT_DELAY);
+	N51ICP_bitsend(ctx, (dat << 6) | cmd, 24, DEFAULT_BIT_DELAY);
 }
 
-int send_reset_seq(uint32_t reset_seq, int len){
+static int send_reset_seq(n51icp_ctx *ctx, uint32_t reset_seq, int len){
 	for (int i = 0; i < len + 1; i++) {
-		N51PGM_set_rst((reset_seq >> (len - i)) & 1);
-		USLEEP(10000);
+		N51PGM_ctx_set_rst(ctx->pgm, (reset_seq >> (len - i)) & 1);
+		USLEEP(ctx->reset_seq_bit_delay);
 	}
 	return 0;
 }
 
-void N51ICP_send_entry_bits() {
-	N51ICP_bitsend(ENTRY_BITS, 24, ENTRY_BIT_DELAY);
+int N51ICP_ctx_enable_shadow(n51icp_ctx *ctx, uint8_t enable)
+{
+	if (!enable) {
+		free(ctx->shadow);
+		ctx->shadow = NULL;
+		return 0;
+	}
+	if (!ctx->shadow)
+		ctx->shadow = malloc(sizeof(n51icp_shadow));
+	if (!ctx->shadow)
+		return -1;
+	N51ICP_ctx_invalidate_shadow(ctx);
+	return 0;
 }
 
-void N51ICP_send_exit_bits(){
-	N51ICP_bitsend(EXIT_BITS, 24, ENTRY_BIT_DELAY);
+void N51ICP_ctx_invalidate_shadow(n51icp_ctx *ctx)
+{
+	if (!ctx->shadow)
+		return;
+	ctx->shadow->valid = 0;
+#if SHADOW_FLASH
+	memset(ctx->shadow->page_valid, 0, sizeof(ctx->shadow->page_valid));
+#endif
 }
 
-int N51ICP_init(uint8_t do_reset)
+int N51ICP_ctx_get_shadow_pages(n51icp_ctx *ctx, uint8_t *flash, uint8_t *valid)
+{
+	int count = 0;
+	memset(valid, 0, FLASH_SIZE / PAGE_SIZE);
+#if SHADOW_FLASH
+	if (!ctx->shadow)
+		return 0;
+	for (int p = 0; p < FLASH_SIZE / PAGE_SIZE; p++) {
+		if (!ctx->shadow->page_valid[p])
+			continue;
+		memcpy(&flash[p * PAGE_SIZE], &ctx->shadow->flash[p * PAGE_SIZE], PAGE_SIZE);
+		valid[p] = 1;
+		count++;
+	}
+#endif
+	return count;
+}
+
+void N51ICP_ctx_set_shadow_pages(n51icp_ctx *ctx, const uint8_t *flash, const uint8_t *valid)
+{
+#if SHADOW_FLASH
+	if (!ctx->shadow)
+		return;
+	for (int p = 0; p < FLASH_SIZE / PAGE_SIZE; p++) {
+		if (!valid[p])
+			continue;
+		memcpy(&ctx->shadow->flash[p * PAGE_SIZE], &flash[p * PAGE_SIZE], PAGE_SIZE);
+		ctx->shadow->page_valid[p] = 1;
+	}
+#endif
+}
+
+// Drops what a write or erase of [addr, addr + len) may have changed
+static void shadow_invalidate_range(n51icp_ctx *ctx, uint32_t addr, uint32_t len)
+{
+	if (!ctx->shadow)
+		return;
+	if (addr >= CFG_FLASH_ADDR) {
+		// the config decides the lock state, and with it the CID and what can be read
+		N51ICP_ctx_invalidate_shadow(ctx);
+		return;
+	}
+#if SHADOW_FLASH
+	for (uint32_t a = addr & ~(PAGE_SIZE - 1); a < addr + len && a < FLASH_SIZE; a += PAGE_SIZE)
+		ctx->shadow->page_valid[a / PAGE_SIZE] = 0;
+#endif
+}
+
+void N51ICP_ctx_send_entry_bits(n51icp_ctx *ctx) {
+	N51ICP_ctx_invalidate_shadow(ctx);
+	N51ICP_bitsend(ctx, ENTRY_BITS, 24, ENTRY_BIT_DELAY);
+}
+
+void N51ICP_ctx_send_exit_bits(n51icp_ctx *ctx){
+	N51ICP_ctx_invalidate_shadow(ctx);
+	N51ICP_bitsend(ctx, EXIT_BITS, 24, ENTRY_BIT_DELAY);
+}
+
+int N51ICP_ctx_init(n51icp_ctx *ctx, uint8_t do_reset)
 {
 	int rc;
 
-	rc = N51PGM_init();
+	rc = N51PGM_ctx_init(ctx->pgm);
     if (rc < 0) {
 		return rc;
 	} else if (rc != 0){
 		return -1;
 	}
-	N51ICP_entry(do_reset);
-	uint32_t dev_id = N51ICP_read_device_id();
+	N51ICP_ctx_entry(ctx, do_reset);
+	uint32_t dev_id = N51ICP_ctx_read_device_id(ctx);
 	if (dev_id >> 8 == 0x2F){
 		printf("Device ID mismatch: %x\n", dev_id);
 		return -1;
@@ -102,30 +258,30 @@ int N51ICP_init(uint8_t do_reset)
 	return 0;
 }
 
-void N51ICP_entry(uint8_t do_reset) {
+void N51ICP_ctx_entry(n51icp_ctx *ctx, uint8_t do_reset) {
 	if (do_reset) {
-		send_reset_seq(ICP_RESET_SEQ, 24);
+		send_reset_seq(ctx, ctx->reset_seq, 24);
 	} else {
-		N51PGM_set_rst(1);
+		N51PGM_ctx_set_rst(ctx->pgm, 1);
 		USLEEP(5000);
-		N51PGM_set_rst(0);
+		N51PGM_ctx_set_rst(ctx->pgm, 0);
 		USLEEP(1000);
 	}
 	
 	USLEEP(100);
-	N51ICP_send_entry_bits();
+	N51ICP_ctx_send_entry_bits(ctx);
 	USLEEP(10);
 }
 
-void N51ICP_reentry(uint32_t delay1, uint32_t delay2, uint32_t delay3) {
+void N51ICP_ctx_reentry(n51icp_ctx *ctx, uint32_t delay1, uint32_t delay2, uint32_t delay3) {
 	USLEEP(10);
 	if (delay1 > 0) {
-		N51PGM_set_rst(1);
+		N51PGM_ctx_set_rst(ctx->pgm, 1);
 		USLEEP(delay1);
 	}
-	N51PGM_set_rst(0);
+	N51PGM_ctx_set_rst(ctx->pgm, 0);
 	USLEEP(delay2);
-	N51ICP_send_entry_bits();
+	N51ICP_ctx_send_entry_bits(ctx);
 	USLEEP(delay3);
 }
 
@@ -133,18 +289,18 @@ void N51ICP_fullexit_entry_glitch(uint32_t delay1, uint32_t delay2, uint32_t del
 	N51ICP_exit();
 }
 
-void N51ICP_reentry_glitch(uint32_t delay1, uint32_t delay2, uint32_t delay_after_trigger_high, uint32_t delay_before_trigger_low){
+void N51ICP_ctx_reentry_glitch(n51icp_ctx *ctx, uint32_t delay1, uint32_t delay2, uint32_t delay_after_trigger_high, uint32_t delay_before_trigger_low){
 	USLEEP(200);
 	// this bit here it to ensure that the config bytes are read at the correct time (right next to the reset high)
-	N51PGM_set_rst(1);
+	N51PGM_ctx_set_rst(ctx->pgm, 1);
 	USLEEP(delay1);
-	N51PGM_set_rst(0);
+	N51PGM_ctx_set_rst(ctx->pgm, 0);
 	USLEEP(delay2);
 
 	//now we do a the full reentry, set the trigger
-	N51PGM_set_trigger(1);
+	N51PGM_ctx_set_trigger(ctx->pgm, 1);
 	USLEEP(delay_after_trigger_high);
-	N51PGM_set_rst(1);
+	N51PGM_ctx_set_rst(ctx->pgm, 1);
 
 	// by default, we sleep for 280us, the length of the config load
 	if (delay_before_trigger_low == 0) {
@@ -153,163 +309,486 @@ void N51ICP_reentry_glitch(uint32_t delay1, uint32_t delay2, uint32_t delay_afte
 
 	if (delay_before_trigger_low > delay1){
 		USLEEP(delay1);
-		N51PGM_set_rst(0);
+		N51PGM_ctx_set_rst(ctx->pgm, 0);
 		USLEEP(delay_before_trigger_low - delay1);
-		N51PGM_set_trigger(0);
+		N51PGM_ctx_set_trigger(ctx->pgm, 0);
 	} else {
 		USLEEP(delay_before_trigger_low);
-		N51PGM_set_trigger(0);
+		N51PGM_ctx_set_trigger(ctx->pgm, 0);
 		USLEEP(delay1 - delay_before_trigger_low);
-		N51PGM_set_rst(0);
+		N51PGM_ctx_set_rst(ctx->pgm, 0);
 	}
 	USLEEP(delay2);
-	N51ICP_send_entry_bits();
+	N51ICP_ctx_send_entry_bits(ctx);
 	USLEEP(10);
 }
 
-void N51ICP_reentry_glitch_read(uint32_t delay1, uint32_t delay2, uint32_t delay_after_trigger_high, uint32_t delay_before_trigger_low, uint8_t * config_bytes) {
-	N51ICP_reentry_glitch(delay1, delay2, delay_after_trigger_high, delay_before_trigger_low);
-	N51ICP_read_flash(CFG_FLASH_ADDR, CFG_FLASH_LEN, config_bytes);
+void N51ICP_ctx_reentry_glitch_read(n51icp_ctx *ctx, uint32_t delay1, uint32_t delay2, uint32_t delay_after_trigger_high, uint32_t delay_before_trigger_low, uint8_t * config_bytes) {
+	N51ICP_ctx_reentry_glitch(ctx, delay1, delay2, delay_after_trigger_high, delay_before_trigger_low);
+	N51ICP_ctx_read_flash(ctx, CFG_FLASH_ADDR, CFG_FLASH_LEN, config_bytes);
 }
 
-void N51ICP_deinit(void)
+void N51ICP_ctx_deinit(n51icp_ctx *ctx)
 {
-	N51ICP_exit();
-	N51PGM_deinit(1);
+	N51ICP_ctx_exit(ctx);
+	N51PGM_ctx_deinit(ctx->pgm, 1);
 }
 
-void N51ICP_exit(void)
+void N51ICP_ctx_exit(n51icp_ctx *ctx)
 {
-	N51PGM_set_rst(1);
+	N51PGM_ctx_set_rst(ctx->pgm, 1);
 	USLEEP(5000);
-	N51PGM_set_rst(0);
+	N51PGM_ctx_set_rst(ctx->pgm, 0);
 	USLEEP(10000);
-	N51ICP_send_exit_bits();
+	N51ICP_ctx_send_exit_bits(ctx);
 	USLEEP(500);
-	N51PGM_set_rst(1);
+	N51PGM_ctx_set_rst(ctx->pgm, 1);
 }
 
 
-static uint8_t N51ICP_read_byte(int end)
+static uint8_t N51ICP_read_byte(n51icp_ctx *ctx, int end)
 {
-	N51PGM_dat_dir(0);
+	N51PGM_ctx_dat_dir(ctx->pgm, 0);
 	USLEEP(DEFAULT_BIT_DELAY);
 	uint8_t data = 0;
 	int i = 8;
 
 	while (i--) {
 		USLEEP(DEFAULT_BIT_DELAY);
-		int state = N51PGM_get_dat();
-		N51PGM_set_clk(1);
+		int state = N51PGM_ctx_get_dat(ctx->pgm);
+		N51PGM_ctx_set_clk(ctx->pgm, 1);
 		USLEEP(DEFAULT_BIT_DELAY);
-		N51PGM_set_clk(0);
+		N51PGM_ctx_set_clk(ctx->pgm, 0);
 		data |= (state << i);
 	}
 
-	N51PGM_dat_dir(1);
+	N51PGM_ctx_dat_dir(ctx->pgm, 1);
 	USLEEP(DEFAULT_BIT_DELAY);
-	N51PGM_set_dat(end);
+	N51PGM_ctx_set_dat(ctx->pgm, end);
 	USLEEP(DEFAULT_BIT_DELAY);
-	N51PGM_set_clk(1);
+	N51PGM_ctx_set_clk(ctx->pgm, 1);
 	USLEEP(DEFAULT_BIT_DELAY);
-	N51PGM_set_clk(0);
+	N51PGM_ctx_set_clk(ctx->pgm, 0);
 	USLEEP(DEFAULT_BIT_DELAY);
-	N51PGM_set_dat(0);
+	N51PGM_ctx_set_dat(ctx->pgm, 0);
 
 	return data;
 }
 
-static void N51ICP_write_byte(uint8_t data, uint8_t end, uint32_t delay1, uint32_t delay2)
+static void N51ICP_write_byte(n51icp_ctx *ctx, uint8_t data, uint8_t end, uint32_t delay1, uint32_t delay2)
 {
-	N51ICP_bitsend(data, 8, DEFAULT_BIT_DELAY);
+	N51ICP_bitsend(ctx, data, 8, DEFAULT_BIT_DELAY);
 
-	N51PGM_set_dat(end);
+	N51PGM_ctx_set_dat(ctx->pgm, end);
 	USLEEP(delay1);
-	N51PGM_set_clk(1);
+	N51PGM_ctx_set_clk(ctx->pgm, 1);
 	USLEEP(delay2);
-	N51PGM_set_dat(0);
-	N51PGM_set_clk(0);
+	N51PGM_ctx_set_dat(ctx->pgm, 0);
+	N51PGM_ctx_set_clk(ctx->pgm, 0);
 }
 
-uint32_t N51ICP_read_device_id(void)
+// true if the shadow holds `what`; otherwise marks it as about to be filled in
+static uint8_t shadow_hit(n51icp_ctx *ctx, uint8_t what)
 {
-	N51ICP_send_command(N51ICP_CMD_READ_DEVICE_ID, 0);
+	if (!ctx->shadow)
+		return 0;
+	if (ctx->shadow->valid & what)
+		return 1;
+	ctx->shadow->valid |= what;
+	return 0;
+}
+
+uint32_t N51ICP_ctx_read_device_id(n51icp_ctx *ctx)
+{
+	if (shadow_hit(ctx, SHADOW_DEVID))
+		return ctx->shadow->devid;
+	N51ICP_send_command(ctx, N51ICP_CMD_READ_DEVICE_ID, 0);
 
 	uint8_t devid[2];
-	devid[0] = N51ICP_read_byte(0);
-	devid[1] = N51ICP_read_byte(1);
+	devid[0] = N51ICP_read_byte(ctx, 0);
+	devid[1] = N51ICP_read_byte(ctx, 1);
 
-	return (devid[1] << 8) | devid[0];
+	uint32_t id = (devid[1] << 8) | devid[0];
+	if (ctx->shadow)
+		ctx->shadow->devid = id;
+	return id;
 }
 
-uint32_t N51ICP_read_pid(void){
-	N51ICP_send_command(N51ICP_CMD_READ_DEVICE_ID, 2);
+uint32_t N51ICP_ctx_read_pid(n51icp_ctx *ctx){
+	if (shadow_hit(ctx, SHADOW_PID))
+		return ctx->shadow->pid;
+	N51ICP_send_command(ctx, N51ICP_CMD_READ_DEVICE_ID, 2);
 	uint8_t pid[2];
-	pid[0] = N51ICP_read_byte(0);
-	pid[1] = N51ICP_read_byte(1);
-	return (pid[1] << 8) | pid[0];
+	pid[0] = N51ICP_read_byte(ctx, 0);
+	pid[1] = N51ICP_read_byte(ctx, 1);
+	uint32_t id = (pid[1] << 8) | pid[0];
+	if (ctx->shadow)
+		ctx->shadow->pid = id;
+	return id;
 }
 
-uint8_t N51ICP_read_cid(void)
+uint8_t N51ICP_ctx_read_cid(n51icp_ctx *ctx)
 {
-	N51ICP_send_command(N51ICP_CMD_READ_CID, 0);
-	return N51ICP_read_byte(1);
+	if (shadow_hit(ctx, SHADOW_CID))
+		return ctx->shadow->cid;
+	N51ICP_send_command(ctx, N51ICP_CMD_READ_CID, 0);
+	uint8_t cid = N51ICP_read_byte(ctx, 1);
+	if (ctx->shadow)
+		ctx->shadow->cid = cid;
+	return cid;
 }
 
-void N51ICP_read_uid(uint8_t * buf)
+void N51ICP_ctx_read_uid(n51icp_ctx *ctx, uint8_t * buf)
 {
-
+	if (shadow_hit(ctx, SHADOW_UID)) {
+		memcpy(buf, ctx->shadow->uid, 12);
+		return;
+	}
 	for (uint8_t  i = 0; i < 12; i++) {
-		N51ICP_send_command(N51ICP_CMD_READ_UID, i);
-		buf[i] = N51ICP_read_byte(1);
+		N51ICP_send_command(ctx, N51ICP_CMD_READ_UID, i);
+		buf[i] = N51ICP_read_byte(ctx, 1);
 	}
+	if (ctx->shadow)
+		memcpy(ctx->shadow->uid, buf, 12);
 }
 
-void N51ICP_read_ucid(uint8_t * buf)
+void N51ICP_ctx_read_ucid(n51icp_ctx *ctx, uint8_t * buf)
 {
+	if (shadow_hit(ctx, SHADOW_UCID)) {
+		memcpy(buf, ctx->shadow->ucid, 16);
+		return;
+	}
 	for (uint8_t i = 0; i < 16; i++) {
-		N51ICP_send_command(N51ICP_CMD_READ_UID, i + 0x20);
-		buf[i] = N51ICP_read_byte(1);
+		N51ICP_send_command(ctx, N51ICP_CMD_READ_UID, i + 0x20);
+		buf[i] = N51ICP_read_byte(ctx, 1);
 	}
+	if (ctx->shadow)
+		memcpy(ctx->shadow->ucid, buf, 16);
 }
 
-uint32_t N51ICP_read_flash(uint32_t addr, uint32_t len, uint8_t *data)
+static void read_flash_icp(n51icp_ctx *ctx, uint32_t addr, uint32_t len, uint8_t *data)
+{
+	N51ICP_send_command(ctx, N51ICP_CMD_READ_FLASH, addr);
+
+	for (uint32_t i = 0; i < len; i++){
+		data[i] = N51ICP_read_byte(ctx, i == (len-1));
+	}
+}
+
+uint32_t N51ICP_ctx_read_flash(n51icp_ctx *ctx, uint32_t addr, uint32_t len, uint8_t *data)
 {
 	if (len == 0) {
 		return 0;
 	}
-	N51ICP_send_command(N51ICP_CMD_READ_FLASH, addr);
-
-	for (uint32_t i = 0; i < len; i++){
-		data[i] = N51ICP_read_byte(i == (len-1));
+	n51icp_shadow *shadow = ctx->shadow;
+	if (shadow && addr == CFG_FLASH_ADDR && len <= CFG_FLASH_LEN) {
+		if (!shadow_hit(ctx, SHADOW_CONFIG))
+			read_flash_icp(ctx, CFG_FLASH_ADDR, CFG_FLASH_LEN, shadow->config);
+		memcpy(data, shadow->config, len);
+		return addr + len;
+	}
+#if SHADOW_FLASH
+	if (shadow && addr < FLASH_SIZE && len <= FLASH_SIZE - addr) {
+		// runs of cached pages are copied, only the runs in between are read over ICP
+		uint32_t end = addr + len;
+		for (uint32_t a = addr; a < end;) {
+			uint8_t valid = shadow->page_valid[a / PAGE_SIZE];
+			uint32_t b = a;
+			while (b < end && shadow->page_valid[b / PAGE_SIZE] == valid)
+				b = (b / PAGE_SIZE + 1) * PAGE_SIZE;
+			if (b > end)
+				b = end;
+			if (!valid) {
+				read_flash_icp(ctx, a, b - a, &shadow->flash[a]);
+				// only pages that were read in full can be served later
+				for (uint32_t p = a / PAGE_SIZE; p <= (b - 1) / PAGE_SIZE; p++) {
+					if (p * PAGE_SIZE >= a && (p + 1) * PAGE_SIZE <= b)
+						shadow->page_valid[p] = 1;
+				}
+			}
+			memcpy(&data[a - addr], &shadow->flash[a], b - a);
+			a = b;
+		}
+		return end;
 	}
+#endif
+	read_flash_icp(ctx, addr, len, data);
 	return addr + len;
 }
 
-uint32_t N51ICP_write_flash(uint32_t addr, uint32_t len, uint8_t *data)
+uint32_t N51ICP_ctx_write_flash(n51icp_ctx *ctx, uint32_t addr, uint32_t len, uint8_t *data)
 {
 	if (len == 0) {
 		return 0;
 	}
-	N51ICP_send_command(N51ICP_CMD_WRITE_FLASH, addr);
-	int delay1 = program_time;
+	shadow_invalidate_range(ctx, addr, len);
+	N51ICP_send_command(ctx, N51ICP_CMD_WRITE_FLASH, addr);
+	int delay1 = ctx->program_time;
 	for (uint32_t i = 0; i < len; i++) {
-		N51ICP_write_byte(data[i], i == (len-1), delay1, 5);
+		N51ICP_write_byte(ctx, data[i], i == (len-1), delay1, 5);
+		if (ctx->write_hook)
+			ctx->write_hook(ctx->write_hook_user);
 	}
 		
 	return addr + len;
 }
 
+void N51ICP_ctx_mass_erase(n51icp_ctx *ctx)
+{
+	N51ICP_ctx_invalidate_shadow(ctx);
+	N51ICP_send_command(ctx, N51ICP_CMD_MASS_ERASE, 0x3A5A5);
+	N51ICP_write_byte(ctx, 0xff, 1, MASS_ERASE_TIME, 500);
+}
+
+void N51ICP_ctx_page_erase(n51icp_ctx *ctx, uint32_t addr)
+{
+	shadow_invalidate_range(ctx, addr, PAGE_SIZE);
+	N51ICP_send_command(ctx, N51ICP_CMD_PAGE_ERASE, addr);
+	N51ICP_write_byte(ctx, 0xff, 1, ctx->page_erase_time, 100);
+}
+
+static int entry_works(n51icp_ctx *ctx, uint32_t bit_delay, uint32_t devid, int tries)
+{
+	ctx->reset_seq_bit_delay = bit_delay;
+	for (int i = 0; i < tries; i++) {
+		N51ICP_ctx_entry(ctx, 1);
+		if (N51ICP_ctx_read_device_id(ctx) != devid)
+			return 0;
+	}
+	return 1;
+}
+
+uint32_t N51ICP_ctx_find_reset_delay(n51icp_ctx *ctx, uint32_t max_delay, int tries)
+{
+	uint32_t old_delay = ctx->reset_seq_bit_delay;
+	ctx->reset_seq_bit_delay = max_delay;
+	N51ICP_ctx_entry(ctx, 1);
+	uint32_t devid = N51ICP_ctx_read_device_id(ctx);
+	if (devid == 0 || devid == 0xFFFF) {
+		ctx->reset_seq_bit_delay = old_delay;
+		return 0;
+	}
+
+	uint32_t lo = 1, hi = max_delay;
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+		if (entry_works(ctx, mid, devid, tries))
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+
+	uint32_t delay = hi + hi * N51ICP_RESET_SEARCH_MARGIN / 100;
+	if (delay > max_delay)
+		delay = max_delay;
+	ctx->reset_seq_bit_delay = delay;
+	N51ICP_ctx_entry(ctx, 1);
+	return delay;
+}
+
+// Ranges of the random reentry timings, us
+#define RECOVER_DELAY1_MAX 20000
+#define RECOVER_DELAY2_MIN 10
+#define RECOVER_DELAY2_MAX 5000
+#define RECOVER_DELAY3_MIN 10
+#define RECOVER_DELAY3_MAX 2000
+// how long the target runs its firmware after a full exit, us
+#define RECOVER_EXIT_WAIT 500000
+
+// rand_r() state, local to a recovery so the process's rand() and other contexts are left alone;
+// avr-libc's rand_r() takes an unsigned long
+#ifdef __AVR__
+typedef unsigned long rand_state;
+#else
+typedef unsigned int rand_state;
+#endif
+
+static uint32_t rand_between(rand_state *seed, uint32_t lo, uint32_t hi)
+{
+	return lo + (uint32_t)rand_r(seed) % (hi - lo + 1);
+}
+
+// A random value within `width` of `centre`, clamped to [lo, hi]
+static uint32_t rand_around(rand_state *seed, uint32_t centre, uint32_t width, uint32_t lo, uint32_t hi)
+{
+	uint32_t a = centre > lo + width ? centre - width : lo;
+	uint32_t b = centre + width < hi ? centre + width : hi;
+	return a < b ? rand_between(seed, a, b) : a;
+}
+
+static void recover_timing(rand_state *seed, int policy, int n, const n51icp_entry_timing *centre, n51icp_entry_timing *t)
+{
+	t->full_exit = 0;
+	if (policy == N51ICP_RECOVER_SWEEP) {
+		int i = n % N51ICP_RECOVER_EXIT_EVERY;
+		t->delay1 = 8000 + i * 1000;
+		t->delay2 = 1000;
+		t->delay3 = 100 + i * 100;
+	} else if (policy == N51ICP_RECOVER_RANDOM) {
+		t->delay1 = rand_between(seed, 0, RECOVER_DELAY1_MAX);
+		t->delay2 = rand_between(seed, RECOVER_DELAY2_MIN, RECOVER_DELAY2_MAX);
+		t->delay3 = rand_between(seed, RECOVER_DELAY3_MIN, RECOVER_DELAY3_MAX);
+	} else {
+		// the window doubles after every round of attempts, until it covers the whole range
+		int round = n / N51ICP_RECOVER_EXIT_EVERY;
+		uint32_t scale = 1u << (round < 8 ? round : 8);
+		t->delay1 = rand_around(seed, centre->delay1, 100 * scale, 0, RECOVER_DELAY1_MAX);
+		t->delay2 = rand_around(seed, centre->delay2, 20 * scale, RECOVER_DELAY2_MIN, RECOVER_DELAY2_MAX);
+		t->delay3 = rand_around(seed, centre->delay3, 10 * scale, RECOVER_DELAY3_MIN, RECOVER_DELAY3_MAX);
+	}
+}
+
+static uint8_t recover_attempt(n51icp_ctx *ctx, const n51icp_entry_timing *t)
+{
+	if (t->full_exit) {
+		N51ICP_ctx_exit(ctx);
+		USLEEP(RECOVER_EXIT_WAIT);
+		N51ICP_ctx_entry(ctx, 1);
+	} else {
+		N51ICP_ctx_reentry(ctx, t->delay1, t->delay2, t->delay3);
+	}
+	// as N51ICP_ctx_find_reset_delay(): 0xFFFF is what a running target or a floating DAT line reads
+	uint32_t devid = N51ICP_ctx_read_device_id(ctx);
+	return devid != 0 && devid != 0xFFFF;
+}
+
+int N51ICP_ctx_recover_entry(n51icp_ctx *ctx, int policy, uint32_t budget_ms, n51icp_entry_timing *timing)
+{
+	n51icp_entry_timing centre = {8000, 1000, 100, 0}, t;
+	uint64_t start = N51PGM_ctx_get_time(ctx->pgm);
+	int attempts = 0;
+
+	if (timing && (timing->delay1 || timing->delay2 || timing->delay3 || timing->full_exit)) {
+		attempts++;
+		if (recover_attempt(ctx, timing))
+			return attempts;
+		if (!timing->full_exit)
+			centre = *timing;
+	}
+	rand_state seed = (rand_state)start;
+	for (int n = 0; attempts < N51ICP_RECOVER_MAX_ATTEMPTS &&
+			N51PGM_ctx_get_time(ctx->pgm) - start < (uint64_t)budget_ms * 1000;) {
+		if (attempts % (N51ICP_RECOVER_EXIT_EVERY + 1) == N51ICP_RECOVER_EXIT_EVERY) {
+			t.full_exit = 1;
+			t.delay1 = t.delay2 = t.delay3 = 0;
+		} else {
+			recover_timing(&seed, policy, n++, &centre, &t);
+		}
+		attempts++;
+		if (recover_attempt(ctx, &t)) {
+			if (timing)
+				*timing = t;
+			return attempts;
+		}
+	}
+	return -1;
+}
+
+// Default context wrappers
+
+void N51ICP_send_entry_bits() {
+	N51ICP_ctx_send_entry_bits(N51ICP_default_ctx());
+}
+
+void N51ICP_send_exit_bits(){
+	N51ICP_ctx_send_exit_bits(N51ICP_default_ctx());
+}
+
+int N51ICP_init(uint8_t do_reset)
+{
+	return N51ICP_ctx_init(N51ICP_default_ctx(), do_reset);
+}
+
+void N51ICP_entry(uint8_t do_reset) {
+	N51ICP_ctx_entry(N51ICP_default_ctx(), do_reset);
+}
+
+void N51ICP_reentry(uint32_t delay1, uint32_t delay2, uint32_t delay3) {
+	N51ICP_ctx_reentry(N51ICP_default_ctx(), delay1, delay2, delay3);
+}
+
+void N51ICP_reentry_glitch(uint32_t delay1, uint32_t delay2, uint32_t delay_after_trigger_high, uint32_t delay_before_trigger_low){
+	N51ICP_ctx_reentry_glitch(N51ICP_default_ctx(), delay1, delay2, delay_after_trigger_high, delay_before_trigger_low);
+}
+
+void N51ICP_reentry_glitch_read(uint32_t delay1, uint32_t delay2, uint32_t delay_after_trigger_high, uint32_t delay_before_trigger_low, uint8_t * config_bytes) {
+	N51ICP_ctx_reentry_glitch_read(N51ICP_default_ctx(), delay1, delay2, delay_after_trigger_high, delay_before_trigger_low, config_bytes);
+}
+
+void N51ICP_deinit(void)
+{
+	N51ICP_ctx_deinit(N51ICP_default_ctx());
+}
+
+void N51ICP_exit(void)
+{
+	N51ICP_ctx_exit(N51ICP_default_ctx());
+}
+
+uint32_t N51ICP_read_device_id(void)
+{
+	return N51ICP_ctx_read_device_id(N51ICP_default_ctx());
+}
+
+uint32_t N51ICP_read_pid(void){
+	return N51ICP_ctx_read_pid(N51ICP_default_ctx());
+}
+
+uint8_t N51ICP_read_cid(void)
+{
+	return N51ICP_ctx_read_cid(N51ICP_default_ctx());
+}
+
+void N51ICP_read_uid(uint8_t * buf)
+{
+	N51ICP_ctx_read_uid(N51ICP_default_ctx(), buf);
+}
+
+void N51ICP_read_ucid(uint8_t * buf)
+{
+	N51ICP_ctx_read_ucid(N51ICP_default_ctx(), buf);
+}
+
+uint32_t N51ICP_read_flash(uint32_t addr, uint32_t len, uint8_t *data)
+{
+	return N51ICP_ctx_read_flash(N51ICP_default_ctx(), addr, len, data);
+}
+
+uint32_t N51ICP_write_flash(uint32_t addr, uint32_t len, uint8_t *data)
+{
+	return N51ICP_ctx_write_flash(N51ICP_default_ctx(), addr, len, data);
+}
+
 void N51ICP_mass_erase(void)
 {
-	N51ICP_send_command(N51ICP_CMD_MASS_ERASE, 0x3A5A5);
-	N51ICP_write_byte(0xff, 1, 65000, 500);
+	N51ICP_ctx_mass_erase(N51ICP_default_ctx());
+}
+
+void N51ICP_set_reset_seq(uint32_t reset_seq, uint32_t bit_delay)
+{
+	n51icp_ctx *ctx = N51ICP_default_ctx();
+	ctx->reset_seq = reset_seq;
+	ctx->reset_seq_bit_delay = bit_delay;
+}
+
+int N51ICP_enable_shadow(uint8_t enable)
+{
+	return N51ICP_ctx_enable_shadow(N51ICP_default_ctx(), enable);
+}
+
+uint32_t N51ICP_find_reset_delay(uint32_t max_delay, int tries)
+{
+	return N51ICP_ctx_find_reset_delay(N51ICP_default_ctx(), max_delay, tries);
+}
+
+int N51ICP_recover_entry(int policy, uint32_t budget_ms, n51icp_entry_timing *timing)
+{
+	return N51ICP_ctx_recover_entry(N51ICP_default_ctx(), policy, budget_ms, timing);
 }
 
 void N51ICP_page_erase(uint32_t addr)
 {
-	N51ICP_send_command(N51ICP_CMD_PAGE_ERASE, addr);
-	N51ICP_write_byte(0xff, 1, page_erase_time, 100);
+	N51ICP_ctx_page_erase(N51ICP_default_ctx(), addr);
 }
 
 void N51ICP_outputf(const char *s, ...)
@@ -373,10 +852,15 @@ void N51ICP_print_config(config_flags flags){
   }
 }
 
-void N51ICP_dump_config()
+void N51ICP_ctx_dump_config(n51icp_ctx *ctx)
 {
 	config_flags flags;
-	N51ICP_read_flash(CFG_FLASH_ADDR, CFG_FLASH_LEN, (uint8_t *)&flags);
+	N51ICP_ctx_read_flash(ctx, CFG_FLASH_ADDR, CFG_FLASH_LEN, (uint8_t *)&flags);
 	N51ICP_print_config(flags);
 }
+
+void N51ICP_dump_config()
+{
+	N51ICP_ctx_dump_config(N51ICP_default_ctx());
+}
 #endif // PRINT_CONFIG_EN
@@ -25,6 +25,8 @@
  * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
  */
 #pragma once
+#include <stdint.h>
+#include "n51_pgm.h"
 #ifdef PRINT_CONFIG_EN
 #include "config.h"
 #endif
@@ -35,8 +37,16 @@
 #define CFG_FLASH_ADDR		0x30000
 #define CFG_FLASH_LEN		5
 #define LDROM_MAX_SIZE      (4 * 1024)
+#define PAGE_SIZE           128
 #define FLASH_SIZE	        (18 * 1024)
 
+// Default ICP timings, in microseconds (MCU dependent, defaults for N76E003)
+#define ENTRY_BIT_DELAY       60
+#define RESET_SEQ_BIT_DELAY   10000
+#define PROGRAM_TIME          20
+#define PAGE_ERASE_TIME       6000
+#define MASS_ERASE_TIME       65000
+
 // ICP Commands
 #define N51ICP_CMD_READ_UID		    0x04
 #define N51ICP_CMD_READ_CID		    0x0b
@@ -64,6 +74,122 @@
 extern "C" {
 #endif
 
+typedef struct _n51icp_shadow n51icp_shadow;
+
+/**
+ * State for one ICP target: the PGM context its pins are driven through and its MCU dependent timings.
+ *
+ * The N51ICP_ctx_* functions take one of these; the functions without a context argument use
+ * N51ICP_default_ctx(), which drives the PGM backend's default context.
+ */
+typedef struct _n51icp_ctx {
+	n51pgm_ctx *pgm;
+	uint8_t owns_pgm;    // pgm is freed with this context
+	int program_time;    // us, per programmed byte
+	int page_erase_time; // us
+	uint32_t reset_seq;           // ICP_RESET_SEQ, or ALT_RESET_SEQ for chips that expect the older sequence
+	uint32_t reset_seq_bit_delay; // us per bit of the reset sequence
+	n51icp_shadow *shadow;        // NULL unless enabled with N51ICP_ctx_enable_shadow()
+	void (*write_hook)(void *user); // if set, called after every byte N51ICP_ctx_write_flash() programs
+	void *write_hook_user;
+} n51icp_ctx;
+
+/**
+ * Creates an ICP context with its own PGM context on the given pins.
+ *
+ * @param pins pins to use, or NULL for the backend's default pins
+ * @return the new context, or NULL on failure
+ */
+n51icp_ctx *N51ICP_ctx_create(const n51pgm_pins *pins);
+void N51ICP_ctx_free(n51icp_ctx *ctx);
+n51icp_ctx *N51ICP_default_ctx(void);
+
+void N51ICP_ctx_send_entry_bits(n51icp_ctx *ctx);
+void N51ICP_ctx_send_exit_bits(n51icp_ctx *ctx);
+int N51ICP_ctx_init(n51icp_ctx *ctx, uint8_t do_reset);
+void N51ICP_ctx_entry(n51icp_ctx *ctx, uint8_t do_reset);
+void N51ICP_ctx_reentry(n51icp_ctx *ctx, uint32_t delay1, uint32_t delay2, uint32_t delay3);
+void N51ICP_ctx_reentry_glitch(n51icp_ctx *ctx, uint32_t delay1, uint32_t delay2, uint32_t delay_after_trigger_high, uint32_t delay_before_trigger_low);
+void N51ICP_ctx_reentry_glitch_read(n51icp_ctx *ctx, uint32_t delay1, uint32_t delay2, uint32_t delay_after_trigger_high, uint32_t delay_before_trigger_low, uint8_t * config_bytes);
+void N51ICP_ctx_deinit(n51icp_ctx *ctx);
+void N51ICP_ctx_exit(n51icp_ctx *ctx);
+uint32_t N51ICP_ctx_read_device_id(n51icp_ctx *ctx);
+uint32_t N51ICP_ctx_read_pid(n51icp_ctx *ctx);
+uint8_t N51ICP_ctx_read_cid(n51icp_ctx *ctx);
+void N51ICP_ctx_read_uid(n51icp_ctx *ctx, uint8_t * buf);
+void N51ICP_ctx_read_ucid(n51icp_ctx *ctx, uint8_t * buf);
+uint32_t N51ICP_ctx_read_flash(n51icp_ctx *ctx, uint32_t addr, uint32_t len, uint8_t *data);
+uint32_t N51ICP_ctx_write_flash(n51icp_ctx *ctx, uint32_t addr, uint32_t len, uint8_t *data);
+void N51ICP_ctx_mass_erase(n51icp_ctx *ctx);
+void N51ICP_ctx_page_erase(n51icp_ctx *ctx, uint32_t addr);
+
+/**
+ * Finds the shortest reset sequence bit period the attached chip still enters ICP mode with.
+ *
+ * Binary searches between 1 us and `max_delay`; a period is accepted when `tries` entries in a row return
+ * the same device ID as an entry with `max_delay`. The result, plus a N51ICP_RESET_SEARCH_MARGIN percent
+ * margin, is stored in ctx->reset_seq_bit_delay and the chip is left in ICP mode.
+ *
+ * @return the new bit period in us, or 0 if no device answered with `max_delay` (the context is unchanged)
+ */
+uint32_t N51ICP_ctx_find_reset_delay(n51icp_ctx *ctx, uint32_t max_delay, int tries);
+#define N51ICP_RESET_SEARCH_MARGIN 50
+
+// N51ICP_ctx_recover_entry() policies
+#define N51ICP_RECOVER_SWEEP    0 // the reentry timings nuvo51icpy's retry() used to step through, in order
+#define N51ICP_RECOVER_RANDOM   1 // random timings over the whole range
+#define N51ICP_RECOVER_ADAPTIVE 2 // random timings around the hint, spreading out as attempts fail
+
+typedef struct _n51icp_entry_timing {
+	uint32_t delay1;   // us RST is held high before the entry, 0 for none (as in N51ICP_ctx_reentry())
+	uint32_t delay2;   // us RST is held low before the entry bits
+	uint32_t delay3;   // us after the entry bits
+	uint8_t full_exit; // a full exit, a wait and an entry with the reset sequence instead; the delays are unused
+} n51icp_entry_timing;
+
+/**
+ * Tries to get a target whose reset pin is disabled (RPD) into ICP mode. Such a chip doesn't stay in reset
+ * while RST is low, so the entry bits only land in a window its firmware decides. Reentry timings picked by
+ * `policy` are tried one after the other, with a full exit and entry after every N51ICP_RECOVER_EXIT_EVERY
+ * of them, until the device ID reads back as neither 0 nor 0xFFFF (what a running target or a floating DAT line
+ * reads).
+ *
+ * @param timing if not NULL: on entry, a timing to try first (e.g. one this function returned before) and
+ *               the centre of N51ICP_RECOVER_ADAPTIVE, all zeros for none; on success, the timing that worked
+ * @param budget_ms gives up after this much backend time, or after N51ICP_RECOVER_MAX_ATTEMPTS attempts
+ *                  in case the backend's clock doesn't advance
+ * @return the number of attempts it took, or -1 if the budget ran out
+ */
+int N51ICP_ctx_recover_entry(n51icp_ctx *ctx, int policy, uint32_t budget_ms, n51icp_entry_timing *timing);
+#define N51ICP_RECOVER_EXIT_EVERY 5
+#define N51ICP_RECOVER_MAX_ATTEMPTS 10000
+
+/**
+ * Session shadow: while enabled, the device ID, PID, CID, UID, UCID, the config bytes and every flash page
+ * read in full are kept, and reads of them are answered without ICP traffic until something may have
+ * changed them. A write or page erase drops the pages it touches (so a verify still reads the chip back),
+ * and entry, exit, mass erase or any change to the config drops everything.
+ * On the Arduino, only the IDs and config are shadowed.
+ *
+ * @return 0, or -1 if the shadow couldn't be allocated
+ */
+int N51ICP_ctx_enable_shadow(n51icp_ctx *ctx, uint8_t enable);
+void N51ICP_ctx_invalidate_shadow(n51icp_ctx *ctx);
+
+/**
+ * Copies the flash pages the shadow holds to `flash` (FLASH_SIZE bytes, at their addresses) and sets
+ * valid[page] for each of them, clearing the other entries.
+ *
+ * @return the number of pages held; always 0 without a shadow, and on the Arduino
+ */
+int N51ICP_ctx_get_shadow_pages(n51icp_ctx *ctx, uint8_t *flash, uint8_t *valid);
+
+/**
+ * Seeds the shadow with flash pages known from elsewhere (see n51_devcache.h): the pages with valid[page]
+ * set are taken from `flash` and answered like pages read in this session. Does nothing without a shadow.
+ */
+void N51ICP_ctx_set_shadow_pages(n51icp_ctx *ctx, const uint8_t *flash, const uint8_t *valid);
+
 void N51ICP_send_entry_bits();
 void N51ICP_send_exit_bits();
 int N51ICP_init(uint8_t do_reset);
@@ -96,12 +222,17 @@ uint32_t N51ICP_read_flash(uint32_t addr, uint32_t len, uint8_t *data);
 uint32_t N51ICP_write_flash(uint32_t addr, uint32_t len, uint8_t *data);
 void N51ICP_mass_erase(void);
 void N51ICP_page_erase(uint32_t addr);
+void N51ICP_set_reset_seq(uint32_t reset_seq, uint32_t bit_delay);
+uint32_t N51ICP_find_reset_delay(uint32_t max_delay, int tries);
+int N51ICP_recover_entry(int policy, uint32_t budget_ms, n51icp_entry_timing *timing);
+int N51ICP_enable_shadow(uint8_t enable);
 void N51ICP_outputf(const char *fmt, ...);
 
 // disabled for microcontroller targets to avoid storing a large number of strings in flash
 #ifdef PRINT_CONFIG_EN
 void N51ICP_print_config(config_flags flags);
 void N51ICP_dump_config();
+void N51ICP_ctx_dump_config(n51icp_ctx *ctx);
 #endif
 #ifdef __cplusplus
 }
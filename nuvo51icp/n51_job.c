@@ -0,0 +1,565 @@
+/*
+ * nuvo51icp, a RPi ICP flasher for the Nuvoton N76E003
+ * https://github.com/steve-m/N76E003-playground
+ *
+ * Copyright (c) 2021 Steve Markgraf <steve@steve-m.de>
+ * Copyright (c) 2023-2024 Nikita Lita
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef ARDUINO
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+#include "config.h"
+#include "n51_icp.h"
+#include "n51_job.h"
+
+#define CFG_UNKNOWN 0
+#define CFG_ERASED  1
+#define CFG_WRITTEN 2
+
+// LDROM size in bytes selected by the LDS bits of a config
+static uint32_t lds_ldrom_size(const uint8_t *cfg)
+{
+	uint8_t lds = cfg[1] & 0x7;
+	return (lds & 0x4 ? 7 - lds : 4) * 1024;
+}
+
+static int parse_u32(const char *str, uint32_t *val)
+{
+	char *end;
+	if (!*str)
+		return -1;
+	*val = strtoul(str, &end, 0);
+	return *end ? -1 : 0;
+}
+
+static int parse_cfg(const char *str, uint8_t *cfg)
+{
+	if (strlen(str) != CFG_FLASH_LEN * 2)
+		return -1;
+	for (int i = 0; i < CFG_FLASH_LEN; i++) {
+		unsigned int b;
+		if (!isxdigit((unsigned char)str[i * 2]) || !isxdigit((unsigned char)str[i * 2 + 1]) ||
+			sscanf(str + i * 2, "%2x", &b) != 1)
+			return -1;
+		cfg[i] = b;
+	}
+	return 0;
+}
+
+// Reads a whole file (at most `max` bytes) relative to the job file's directory
+static uint8_t *load_file(const char *job_path, const char *name, uint32_t max, uint32_t *len)
+{
+	char path[1024];
+	const char *slash = strrchr(job_path, '/');
+	if (name[0] != '/' && slash)
+		snprintf(path, sizeof(path), "%.*s/%s", (int)(slash - job_path), job_path, name);
+	else
+		snprintf(path, sizeof(path), "%s", name);
+	FILE *f = fopen(path, "rb");
+	if (!f)
+		return NULL;
+	uint8_t *data = malloc(max + 1);
+	if (data) {
+		*len = fread(data, 1, max + 1, f);
+		if (*len == 0 || *len > max) {
+			free(data);
+			data = NULL;
+		}
+	}
+	fclose(f);
+	return data;
+}
+
+static int parse_line(n51job *job, const char *path, int lineno, char *line, int *seen_op)
+{
+	char *argv[4];
+	int argc = 0;
+	char *hash = strchr(line, '#');
+	if (hash)
+		*hash = '\0';
+	for (char *tok = strtok(line, " \t\r\n"); tok; tok = strtok(NULL, " \t\r\n")) {
+		if (argc == 4)
+			goto bad_args;
+		argv[argc++] = tok;
+	}
+	if (argc == 0)
+		return 0;
+
+	if (strcmp(argv[0], "entry") == 0) {
+		if (argc != 2 || *seen_op)
+			goto bad_args;
+		if (strcmp(argv[1], "reset") == 0)
+			job->entry = N51JOB_ENTRY_RESET;
+		else if (strcmp(argv[1], "alt-reset") == 0)
+			job->entry = N51JOB_ENTRY_ALT_RESET;
+		else if (strcmp(argv[1], "no-reset") == 0)
+			job->entry = N51JOB_ENTRY_NO_RESET;
+		else
+			goto bad_args;
+		return 0;
+	}
+	if (strcmp(argv[0], "exit") == 0) {
+		if (argc != 2)
+			goto bad_args;
+		if (strcmp(argv[1], "release") == 0)
+			job->exit = N51JOB_EXIT_RELEASE;
+		else if (strcmp(argv[1], "hold-high") == 0)
+			job->exit = N51JOB_EXIT_HOLD_HIGH;
+		else
+			goto bad_args;
+		*seen_op = 2;
+		return 0;
+	}
+	if (*seen_op == 2) {
+		fprintf(stderr, "ERROR: %s:%d: nothing may follow exit\n", path, lineno);
+		return -1;
+	}
+	if (job->op_count == N51JOB_MAX_OPS) {
+		fprintf(stderr, "ERROR: %s:%d: too many operations (at most %d)\n", path, lineno, N51JOB_MAX_OPS);
+		return -1;
+	}
+	n51job_op *op = &job->ops[job->op_count];
+	memset(op, 0, sizeof(*op));
+	op->line = lineno;
+	*seen_op = 1;
+
+	if (strcmp(argv[0], "erase") == 0) {
+		if (argc != 2)
+			goto bad_args;
+		if (strcmp(argv[1], "none") == 0)
+			return 0;
+		if (strcmp(argv[1], "mass") == 0)
+			op->type = N51JOB_ERASE_MASS;
+		else if (strcmp(argv[1], "pages") == 0)
+			op->type = N51JOB_ERASE_PAGES;
+		else
+			goto bad_args;
+	} else if (strcmp(argv[0], "config") == 0) {
+		if (argc != 2 || parse_cfg(argv[1], op->cfg) != 0)
+			goto bad_args;
+		op->type = N51JOB_CONFIG;
+	} else if (strcmp(argv[0], "write") == 0) {
+		if (argc != 3)
+			goto bad_args;
+		int ldrom = strcmp(argv[1], "ldrom") == 0;
+		if (!ldrom && (parse_u32(argv[1], &op->addr) != 0 || op->addr >= FLASH_SIZE))
+			goto bad_args;
+		op->type = N51JOB_WRITE;
+		op->data = load_file(path, argv[2], ldrom ? LDROM_MAX_SIZE : FLASH_SIZE - op->addr, &op->len);
+		if (!op->data) {
+			fprintf(stderr, "ERROR: %s:%d: can't read %s, or it's empty or doesn't fit\n", path, lineno, argv[2]);
+			return -1;
+		}
+		if (ldrom)
+			op->addr = FLASH_SIZE - (((op->len - 1) / 1024) + 1) * 1024;
+		op->ldrom = ldrom;
+	} else if (strcmp(argv[0], "verify") == 0) {
+		if (argc == 1) {
+			op->type = N51JOB_VERIFY_ALL;
+		} else if (argc == 3 && parse_u32(argv[1], &op->addr) == 0 && parse_u32(argv[2], &op->len) == 0 &&
+			op->len > 0 && op->addr < FLASH_SIZE && op->len <= FLASH_SIZE - op->addr) {
+			op->type = N51JOB_VERIFY;
+		} else {
+			goto bad_args;
+		}
+	} else if (strcmp(argv[0], "lock") == 0) {
+		if (argc != 1)
+			goto bad_args;
+		op->type = N51JOB_LOCK;
+	} else {
+		fprintf(stderr, "ERROR: %s:%d: unknown operation '%s'\n", path, lineno, argv[0]);
+		return -1;
+	}
+	job->op_count++;
+	return 0;
+
+bad_args:
+	fprintf(stderr, "ERROR: %s:%d: invalid '%s' line\n", path, lineno, argv[0]);
+	return -1;
+}
+
+/*
+ * Walks the operations with a model of what the flash holds, rejecting what the chip can't do as written,
+ * and fills in the pages to erase and the config bytes lock writes.
+ */
+static int validate(n51job *job, const char *path)
+{
+	static uint8_t known[FLASH_SIZE], written[FLASH_SIZE];
+	uint8_t cfg[CFG_FLASH_LEN];
+	int cfg_state = CFG_UNKNOWN;
+	int erase_line = 0, lock_line = 0, config_line = 0;
+	int ret = 0;
+
+	memset(known, 0, sizeof(known));
+	memset(written, 0, sizeof(written));
+	memset(cfg, 0xFF, sizeof(cfg));
+	memset(job->erase_pages, 0, sizeof(job->erase_pages));
+	job->erase_config = 0;
+
+	if (job->op_count == 0) {
+		fprintf(stderr, "ERROR: %s: no operations\n", path);
+		return -1;
+	}
+	for (int i = 0; i < job->op_count; i++) {
+		n51job_op *op = &job->ops[i];
+		if (lock_line) {
+			fprintf(stderr, "ERROR: %s:%d: nothing but exit may follow lock (line %d)\n", path, op->line, lock_line);
+			ret = -1;
+		}
+		switch (op->type) {
+		case N51JOB_ERASE_MASS:
+		case N51JOB_ERASE_PAGES:
+			if (erase_line) {
+				fprintf(stderr, "ERROR: %s:%d: only one erase per job (line %d)\n", path, op->line, erase_line);
+				ret = -1;
+				break;
+			}
+			for (int j = 0; j < i; j++) {
+				if (job->ops[j].type == N51JOB_WRITE || job->ops[j].type == N51JOB_CONFIG) {
+					fprintf(stderr, "ERROR: %s:%d: erase must come before any write or config (line %d)\n", path,
+						op->line, job->ops[j].line);
+					ret = -1;
+					break;
+				}
+			}
+			erase_line = op->line;
+			if (op->type == N51JOB_ERASE_MASS) {
+				memset(known, 1, sizeof(known));
+				cfg_state = CFG_ERASED;
+				break;
+			}
+			for (int j = i + 1; j < job->op_count; j++) {
+				const n51job_op *w = &job->ops[j];
+				if (w->type == N51JOB_WRITE) {
+					for (uint32_t p = w->addr / PAGE_SIZE; p <= (w->addr + w->len - 1) / PAGE_SIZE; p++)
+						job->erase_pages[p] = 1;
+				} else if (w->type == N51JOB_CONFIG) {
+					job->erase_config = 1;
+				}
+			}
+			for (uint32_t p = 0; p < FLASH_SIZE / PAGE_SIZE; p++) {
+				if (job->erase_pages[p])
+					memset(&known[p * PAGE_SIZE], 1, PAGE_SIZE);
+			}
+			if (job->erase_config)
+				cfg_state = CFG_ERASED;
+			break;
+		case N51JOB_CONFIG:
+			if (cfg_state != CFG_ERASED) {
+				fprintf(stderr, "ERROR: %s:%d: the config can only be written once, after an erase\n", path, op->line);
+				ret = -1;
+			}
+			memcpy(cfg, op->cfg, CFG_FLASH_LEN);
+			cfg_state = CFG_WRITTEN;
+			config_line = op->line;
+			break;
+		case N51JOB_WRITE:
+			for (uint32_t a = op->addr; a < op->addr + op->len; a++) {
+				if (written[a]) {
+					fprintf(stderr, "ERROR: %s:%d: overlaps an earlier write at 0x%04x\n", path, op->line, a);
+					ret = -1;
+					break;
+				}
+			}
+			memset(&written[op->addr], 1, op->len);
+			memset(&known[op->addr], 1, op->len);
+			break;
+		case N51JOB_VERIFY:
+			for (uint32_t a = op->addr; a < op->addr + op->len; a++) {
+				if (!known[a]) {
+					fprintf(stderr, "ERROR: %s:%d: 0x%04x is neither erased nor written before this verify\n", path,
+						op->line, a);
+					ret = -1;
+					break;
+				}
+			}
+			break;
+		case N51JOB_VERIFY_ALL: {
+			int any = cfg_state == CFG_WRITTEN;
+			for (int j = 0; j < i && !any; j++)
+				any = job->ops[j].type == N51JOB_WRITE;
+			if (!any) {
+				fprintf(stderr, "ERROR: %s:%d: nothing written to verify\n", path, op->line);
+				ret = -1;
+			}
+			break;
+		}
+		case N51JOB_LOCK:
+			// programming can only clear bits, so this only changes LOCK whatever the config holds
+			memcpy(op->cfg, cfg, CFG_FLASH_LEN);
+			op->cfg[0] &= ~0x02;
+			lock_line = op->line;
+			break;
+		}
+	}
+
+	// where the APROM/LDROM boundary ends up, if the job knows the config it leaves behind
+	uint32_t boundary = FLASH_SIZE - lds_ldrom_size(cfg);
+	for (int i = 0; i < job->op_count; i++) {
+		const n51job_op *op = &job->ops[i];
+		if (op->type != N51JOB_WRITE)
+			continue;
+		if (op->ldrom && (cfg_state == CFG_UNKNOWN || op->addr < boundary)) {
+			fprintf(stderr, "ERROR: %s:%d: needs a config line that selects an LDROM of at least %u bytes\n", path,
+				op->line, FLASH_SIZE - op->addr);
+			ret = -1;
+		} else if (cfg_state != CFG_UNKNOWN && op->addr < boundary && op->addr + op->len > boundary) {
+			fprintf(stderr, "ERROR: %s:%d: straddles the APROM/LDROM boundary at 0x%04x set on line %d\n", path,
+				op->line, boundary, config_line);
+			ret = -1;
+		}
+	}
+	return ret;
+}
+
+n51job *N51JOB_load(const char *path)
+{
+	FILE *f = fopen(path, "r");
+	if (!f) {
+		fprintf(stderr, "ERROR: Failed to open job file: %s\n", path);
+		return NULL;
+	}
+	n51job *job = calloc(1, sizeof(n51job));
+	if (!job) {
+		fclose(f);
+		return NULL;
+	}
+	char line[1024];
+	int lineno = 0, seen_op = 0, ret = 0;
+	while (fgets(line, sizeof(line), f)) {
+		lineno++;
+		if (parse_line(job, path, lineno, line, &seen_op) != 0)
+			ret = -1;
+	}
+	fclose(f);
+	if (ret != 0 || validate(job, path) != 0) {
+		N51JOB_free(job);
+		return NULL;
+	}
+	return job;
+}
+
+void N51JOB_free(n51job *job)
+{
+	if (!job)
+		return;
+	for (int i = 0; i < job->op_count; i++)
+		free(job->ops[i].data);
+	free(job);
+}
+
+static void set_phase(void (*phase)(n51plan_phase), n51plan_phase p)
+{
+	if (phase)
+		phase(p);
+}
+
+static int verify_range(uint32_t addr, uint32_t len, const uint8_t *expected, const uint8_t *known, int line)
+{
+	static uint8_t buf[FLASH_SIZE];
+	N51ICP_read_flash(addr, len, buf);
+	for (uint32_t i = 0; i < len; i++) {
+		if ((!known || known[i]) && buf[i] != expected[i]) {
+			fprintf(stderr, "ERROR: Verify on line %d failed at 0x%04x: read 0x%02x, expected 0x%02x\n", line,
+				addr + i, buf[i], expected[i]);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+int N51JOB_run(const n51job *job, void (*phase)(n51plan_phase))
+{
+	// what the flash holds as far as this job knows, updated as it goes
+	static uint8_t expected[FLASH_SIZE], known[FLASH_SIZE];
+	uint8_t cfg[CFG_FLASH_LEN];
+	int cfg_written = 0;
+	int ret = 0;
+
+	memset(known, 0, sizeof(known));
+	memset(expected, 0xFF, sizeof(expected));
+	memset(cfg, 0xFF, sizeof(cfg));
+
+	set_phase(phase, N51PLAN_ENTRY);
+	if (job->entry == N51JOB_ENTRY_ALT_RESET)
+		N51ICP_set_reset_seq(ALT_RESET_SEQ, N51ICP_default_ctx()->reset_seq_bit_delay);
+	if (N51ICP_init(job->entry != N51JOB_ENTRY_NO_RESET) != 0) {
+		fprintf(stderr, "ERROR: Failed to initialize ICP!\n");
+		return -1;
+	}
+	set_phase(phase, N51PLAN_IDENTIFY);
+	uint8_t cid = N51ICP_read_cid();
+	// a locked chip reads back a CID of 0xFF; re-enter to reload the flash
+	if (cid == 0xFF) {
+		set_phase(phase, N51PLAN_ENTRY);
+		N51ICP_reentry(5000, 1000, 10);
+		set_phase(phase, N51PLAN_IDENTIFY);
+	}
+	uint32_t devid = N51ICP_read_device_id();
+	if (devid != N76E003_DEVID) {
+		fprintf(stderr, "ERROR: N76E003 not found (device ID 0x%04x)!\n", devid);
+		ret = -1;
+		goto out;
+	}
+	if (cid == 0xFF && (job->op_count == 0 || job->ops[0].type != N51JOB_ERASE_MASS)) {
+		fprintf(stderr, "ERROR: The chip is locked, the job must start with 'erase mass'!\n");
+		ret = -1;
+		goto out;
+	}
+
+	for (int i = 0; i < job->op_count && ret == 0; i++) {
+		const n51job_op *op = &job->ops[i];
+		switch (op->type) {
+		case N51JOB_ERASE_MASS:
+			set_phase(phase, N51PLAN_ERASE);
+			N51ICP_mass_erase();
+			if (cid == 0xFF)
+				N51ICP_reentry(5000, 1000, 10);
+			memset(known, 1, sizeof(known));
+			break;
+		case N51JOB_ERASE_PAGES:
+			set_phase(phase, N51PLAN_ERASE);
+			for (uint32_t p = 0; p < FLASH_SIZE / PAGE_SIZE; p++) {
+				if (job->erase_pages[p]) {
+					N51ICP_page_erase(p * PAGE_SIZE);
+					memset(&known[p * PAGE_SIZE], 1, PAGE_SIZE);
+				}
+			}
+			if (job->erase_config)
+				N51ICP_page_erase(CFG_FLASH_ADDR);
+			break;
+		case N51JOB_CONFIG:
+			set_phase(phase, N51PLAN_CONFIG);
+			memcpy(cfg, op->cfg, CFG_FLASH_LEN);
+			N51ICP_write_flash(CFG_FLASH_ADDR, CFG_FLASH_LEN, cfg);
+			cfg_written = 1;
+			break;
+		case N51JOB_WRITE:
+			set_phase(phase, N51PLAN_WRITE);
+			N51ICP_write_flash(op->addr, op->len, op->data);
+			memcpy(&expected[op->addr], op->data, op->len);
+			memset(&known[op->addr], 1, op->len);
+			break;
+		case N51JOB_VERIFY:
+			set_phase(phase, N51PLAN_VERIFY);
+			ret = verify_range(op->addr, op->len, &expected[op->addr], &known[op->addr], op->line);
+			break;
+		case N51JOB_VERIFY_ALL:
+			set_phase(phase, N51PLAN_VERIFY);
+			for (int j = 0; j < i && ret == 0; j++) {
+				if (job->ops[j].type == N51JOB_WRITE)
+					ret = verify_range(job->ops[j].addr, job->ops[j].len, job->ops[j].data, NULL, op->line);
+			}
+			if (ret == 0 && cfg_written)
+				ret = verify_range(CFG_FLASH_ADDR, CFG_FLASH_LEN, cfg, NULL, op->line);
+			break;
+		case N51JOB_LOCK:
+			set_phase(phase, N51PLAN_CONFIG);
+			N51ICP_write_flash(CFG_FLASH_ADDR, CFG_FLASH_LEN, (uint8_t *)op->cfg);
+			break;
+		}
+	}
+	if (ret == 0)
+		fprintf(stderr, "Job completed (%d operations)\n", job->op_count);
+
+out:
+	set_phase(phase, N51PLAN_EXIT);
+	N51ICP_exit();
+	N51PGM_deinit(job->exit == N51JOB_EXIT_HOLD_HIGH);
+	return ret;
+}
+
+// Must be kept in sync with N51JOB_run()
+void N51JOB_plan(const n51job *job, n51plan *plan, uint8_t locked)
+{
+	N51PLAN_set_phase(plan, N51PLAN_ENTRY);
+	N51PLAN_init(plan, job->entry != N51JOB_ENTRY_NO_RESET);
+	N51PLAN_set_phase(plan, N51PLAN_IDENTIFY);
+	N51PLAN_read_cid(plan);
+	if (locked) {
+		N51PLAN_set_phase(plan, N51PLAN_ENTRY);
+		N51PLAN_reentry(plan, 5000, 1000, 10);
+		N51PLAN_set_phase(plan, N51PLAN_IDENTIFY);
+	}
+	N51PLAN_read_device_id(plan);
+	if (locked && (job->op_count == 0 || job->ops[0].type != N51JOB_ERASE_MASS)) {
+		fprintf(stderr, "NOTE: The chip is locked, the job would stop here.\n\n");
+		goto out;
+	}
+
+	for (int i = 0; i < job->op_count; i++) {
+		const n51job_op *op = &job->ops[i];
+		switch (op->type) {
+		case N51JOB_ERASE_MASS:
+			N51PLAN_set_phase(plan, N51PLAN_ERASE);
+			N51PLAN_mass_erase(plan);
+			if (locked)
+				N51PLAN_reentry(plan, 5000, 1000, 10);
+			break;
+		case N51JOB_ERASE_PAGES:
+			N51PLAN_set_phase(plan, N51PLAN_ERASE);
+			for (uint32_t p = 0; p < FLASH_SIZE / PAGE_SIZE; p++) {
+				if (job->erase_pages[p])
+					N51PLAN_page_erase(plan, p * PAGE_SIZE);
+			}
+			if (job->erase_config)
+				N51PLAN_page_erase(plan, CFG_FLASH_ADDR);
+			break;
+		case N51JOB_CONFIG:
+		case N51JOB_LOCK:
+			N51PLAN_set_phase(plan, N51PLAN_CONFIG);
+			N51PLAN_write_flash(plan, CFG_FLASH_ADDR, CFG_FLASH_LEN);
+			break;
+		case N51JOB_WRITE:
+			N51PLAN_set_phase(plan, N51PLAN_WRITE);
+			N51PLAN_write_flash(plan, op->addr, op->len);
+			break;
+		case N51JOB_VERIFY:
+			N51PLAN_set_phase(plan, N51PLAN_VERIFY);
+			N51PLAN_read_flash(plan, op->addr, op->len);
+			break;
+		case N51JOB_VERIFY_ALL: {
+			int cfg_written = 0;
+			N51PLAN_set_phase(plan, N51PLAN_VERIFY);
+			for (int j = 0; j < i; j++) {
+				if (job->ops[j].type == N51JOB_WRITE)
+					N51PLAN_read_flash(plan, job->ops[j].addr, job->ops[j].len);
+				else if (job->ops[j].type == N51JOB_CONFIG)
+					cfg_written = 1;
+			}
+			if (cfg_written)
+				N51PLAN_read_flash(plan, CFG_FLASH_ADDR, CFG_FLASH_LEN);
+			break;
+		}
+		}
+	}
+out:
+	N51PLAN_set_phase(plan, N51PLAN_EXIT);
+	N51PLAN_exit(plan);
+}
+
+#endif // ARDUINO
@@ -0,0 +1,94 @@
+// Description: Job files: an ordered list of ICP operations, validated up front and run in a single ICP session.
+#pragma once
+
+#include <stdint.h>
+#include "n51_icp.h"
+#include "n51_plan.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * A job file has one operation per line; '#' starts a comment. Numbers may be decimal or 0x-prefixed hex,
+ * relative file names are relative to the job file. See job-example.txt.
+ *
+ *   entry <reset|alt-reset|no-reset>  how to enter ICP mode (default: reset); must come first
+ *   erase <mass|pages|none>           mass erase, or erase only the pages the job writes; before any write
+ *   config <10 hex digits>            write the config bytes
+ *   write <addr|ldrom> <file>         write a file at addr; ldrom puts it at the end of the flash, rounded to 1 KB
+ *   verify [<addr> <len>]             read back and compare a range, or everything written so far
+ *   lock                              write the config with LOCK cleared; nothing but exit may follow
+ *   exit <release|hold-high>          leave ICP mode and release the pins, or keep driving RST high (default: release)
+ *
+ * Validation rejects jobs the chip can't carry out as written: writes that overlap earlier writes or the
+ * config twice without an erase in between, operations after lock, an LDROM write without a config
+ * that selects an LDROM of that size, or a verify of bytes that were neither erased nor written.
+ */
+
+#define N51JOB_MAX_OPS 64
+
+#define N51JOB_ENTRY_RESET     0
+#define N51JOB_ENTRY_ALT_RESET 1
+#define N51JOB_ENTRY_NO_RESET  2
+
+#define N51JOB_EXIT_RELEASE    0
+#define N51JOB_EXIT_HOLD_HIGH  1
+
+typedef enum _n51job_op_type {
+	N51JOB_ERASE_MASS,
+	N51JOB_ERASE_PAGES,
+	N51JOB_CONFIG,
+	N51JOB_WRITE,
+	N51JOB_VERIFY,     // addr/len range
+	N51JOB_VERIFY_ALL, // every write and config before it
+	N51JOB_LOCK,
+} n51job_op_type;
+
+typedef struct _n51job_op {
+	n51job_op_type type;
+	int line;
+	uint32_t addr;
+	uint32_t len;
+	uint8_t *data;                // N51JOB_WRITE: the file contents
+	uint8_t ldrom;                // N51JOB_WRITE: placed with 'ldrom'
+	uint8_t cfg[CFG_FLASH_LEN];   // N51JOB_CONFIG: the config bytes, N51JOB_LOCK: the bytes written
+} n51job_op;
+
+typedef struct _n51job {
+	uint8_t entry;
+	uint8_t exit;
+	int op_count;
+	n51job_op ops[N51JOB_MAX_OPS];
+	// filled in by validation
+	uint8_t erase_pages[FLASH_SIZE / PAGE_SIZE]; // pages N51JOB_ERASE_PAGES erases
+	uint8_t erase_config;                        // ... and whether it erases the config page
+} n51job;
+
+/**
+ * Parses and validates a job file. Errors are printed with their line number.
+ *
+ * @return the job, or NULL if it can't be read or doesn't validate
+ */
+n51job *N51JOB_load(const char *path);
+void N51JOB_free(n51job *job);
+
+/**
+ * Runs a job on the default ICP context: initializes the PGM backend, enters ICP mode once, carries out
+ * every operation, exits and deinitializes. The reset sequence bit period is the context's.
+ *
+ * @param phase if not NULL, called whenever the job moves on to another phase (for timing)
+ * @return 0 on success, <0 if the target wasn't found or can't run the job, >0 if a verify failed
+ */
+int N51JOB_run(const n51job *job, void (*phase)(n51plan_phase));
+
+/**
+ * Records the operations N51JOB_run() would issue, assuming an N76E003 is found and every verify passes.
+ *
+ * @param locked whether to assume the target is locked
+ */
+void N51JOB_plan(const n51job *job, n51plan *plan, uint8_t locked);
+
+#ifdef __cplusplus
+}
+#endif
@@ -61,6 +61,97 @@ uint64_t N51PGM_get_time(void);
 // Device-specific print function
 void N51PGM_print(const char *msg);
 
+/*
+ * Context API
+ *
+ * Every function above operates on the backend's default context. The N51PGM_ctx_* functions do the same
+ * on an explicit context, so several targets on disjoint sets of pins can be driven from one process,
+ * one thread per context. A context must only be used by one thread at a time.
+ */
+
+// Pins used by a PGM context: GPIO line numbers on the RPi backends, pin numbers on Arduino
+typedef struct _n51pgm_pins {
+	int dat;
+	int rst;
+	int clk;
+	int trigger; // -1 if not connected
+} n51pgm_pins;
+
+// Backend-specific state for one set of pins; the layout is private to the backend
+typedef struct _n51pgm_ctx n51pgm_ctx;
+
+/**
+ * Creates a PGM context. The pins aren't touched until N51PGM_ctx_init().
+ *
+ * @param pins pins to use, or NULL for the backend's default pins
+ * @return the new context, or NULL on failure
+ */
+n51pgm_ctx *N51PGM_ctx_create(const n51pgm_pins *pins);
+
+// Frees a context created with N51PGM_ctx_create(); deinit it first
+void N51PGM_ctx_free(n51pgm_ctx *ctx);
+
+// The context used by the functions without a context argument
+n51pgm_ctx *N51PGM_default_ctx(void);
+
+int N51PGM_ctx_init(n51pgm_ctx *ctx);
+void N51PGM_ctx_deinit(n51pgm_ctx *ctx, uint8_t leave_reset_high);
+void N51PGM_ctx_set_dat(n51pgm_ctx *ctx, uint8_t val);
+uint8_t N51PGM_ctx_get_dat(n51pgm_ctx *ctx);
+void N51PGM_ctx_set_rst(n51pgm_ctx *ctx, uint8_t val);
+void N51PGM_ctx_set_clk(n51pgm_ctx *ctx, uint8_t val);
+void N51PGM_ctx_set_trigger(n51pgm_ctx *ctx, uint8_t val);
+void N51PGM_ctx_dat_dir(n51pgm_ctx *ctx, uint8_t state);
+void N51PGM_ctx_release_pins(n51pgm_ctx *ctx);
+void N51PGM_ctx_release_rst(n51pgm_ctx *ctx);
+uint32_t N51PGM_ctx_usleep(n51pgm_ctx *ctx, uint32_t usec);
+uint64_t N51PGM_ctx_get_time(n51pgm_ctx *ctx);
+
+/*
+ * Gang API (not available on Arduino)
+ *
+ * Several targets share CLK and RST and each has its own DAT line. Every function drives or samples all
+ * enabled DAT lines in a single operation where the backend allows it (one set and one clear register
+ * store with pigpio, one bulk request with gpiod), so the time per edge doesn't grow with the target count.
+ * Bit i of every mask is target i.
+ */
+
+#define N51PGM_GANG_MAX 32
+
+typedef struct _n51pgm_gang_pins {
+	int clk;   // -1 for the backend's default
+	int rst;   // -1 for the backend's default
+	int count; // number of targets
+	int dat[N51PGM_GANG_MAX];
+} n51pgm_gang_pins;
+
+// Backend-specific state for a gang; the layout is private to the backend
+typedef struct _n51pgm_gang n51pgm_gang;
+
+n51pgm_gang *N51PGM_gang_create(const n51pgm_gang_pins *pins);
+void N51PGM_gang_free(n51pgm_gang *gang);
+
+// Claims the pins, with all DAT lines enabled and set to input
+int N51PGM_gang_init(n51pgm_gang *gang);
+void N51PGM_gang_deinit(n51pgm_gang *gang, uint8_t leave_reset_high);
+
+// Only the DAT lines in `mask` are driven from now on; the others are released to high-z
+void N51PGM_gang_enable(n51pgm_gang *gang, uint32_t mask);
+
+// Sets every enabled DAT line to its bit in `vals`
+void N51PGM_gang_set_dat(n51pgm_gang *gang, uint32_t vals);
+
+// Samples every DAT line at once; disabled lines read as 0
+uint32_t N51PGM_gang_get_dat(n51pgm_gang *gang);
+
+// Sets the direction of every enabled DAT line
+void N51PGM_gang_dat_dir(n51pgm_gang *gang, uint8_t state);
+
+void N51PGM_gang_set_clk(n51pgm_gang *gang, uint8_t val);
+void N51PGM_gang_set_rst(n51pgm_gang *gang, uint8_t val);
+uint32_t N51PGM_gang_usleep(n51pgm_gang *gang, uint32_t usec);
+uint64_t N51PGM_gang_get_time(n51pgm_gang *gang);
+
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,507 @@
+/*
+ * nuvo51icp, a RPi ICP flasher for the Nuvoton N76E003
+ * https://github.com/steve-m/N76E003-playground
+ *
+ * Copyright (c) 2021 Steve Markgraf <steve@steve-m.de>
+ * Copyright (c) 2023-2024 Nikita Lita
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef ARDUINO
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "n51_icp.h"
+#include "n51_plan.h"
+#include "delay.h"
+
+#define NO_CMD -1
+
+typedef struct _n51plan_cost {
+	uint64_t pin_ops;
+	uint64_t sleep_us;
+	uint64_t sleeps;
+} n51plan_cost;
+
+typedef struct _n51plan_step {
+	n51plan_phase phase;
+	const char *desc;
+	int cmd;
+	uint32_t addr;
+	uint32_t len;
+	uint64_t time_ns;
+} n51plan_step;
+
+struct _n51plan {
+	n51_timing_profile prof;
+	n51plan_phase phase;
+	n51plan_step *steps;
+	int nsteps;
+	int maxsteps;
+	uint64_t phase_ns[N51PLAN_PHASE_COUNT];
+	// model of the engine's session shadow (N51ICP_ctx_enable_shadow())
+	uint8_t shadow;
+	uint8_t shadow_valid; // bit per read_* kind, as below
+	uint8_t page_valid[FLASH_SIZE / PAGE_SIZE];
+};
+
+#define SHADOW_DEVID  0x01
+#define SHADOW_PID    0x02
+#define SHADOW_CID    0x04
+#define SHADOW_UID    0x08
+#define SHADOW_UCID   0x10
+#define SHADOW_CONFIG 0x20
+
+static const char *phase_names[N51PLAN_PHASE_COUNT] = {
+	"entry", "identify", "erase", "config", "write", "verify", "read", "exit"
+};
+
+void N51PLAN_default_profile(n51_timing_profile *prof)
+{
+	memset(prof, 0, sizeof(*prof));
+	prof->bit_delay_us = DEFAULT_BIT_DELAY;
+	prof->entry_bit_delay_us = ENTRY_BIT_DELAY;
+	prof->reset_seq_bit_us = RESET_SEQ_BIT_DELAY;
+	prof->program_time_us = PROGRAM_TIME;
+	prof->page_erase_time_us = PAGE_ERASE_TIME;
+	prof->mass_erase_time_us = MASS_ERASE_TIME;
+}
+
+int N51PLAN_load_profile(const char *path, n51_timing_profile *prof)
+{
+	static const struct {
+		const char *key;
+		size_t offset;
+	} keys[] = {
+		{"gpio_latency_ns", offsetof(n51_timing_profile, gpio_latency_ns)},
+		{"sleep_overhead_ns", offsetof(n51_timing_profile, sleep_overhead_ns)},
+		{"bit_delay_us", offsetof(n51_timing_profile, bit_delay_us)},
+		{"entry_bit_delay_us", offsetof(n51_timing_profile, entry_bit_delay_us)},
+		{"reset_seq_bit_us", offsetof(n51_timing_profile, reset_seq_bit_us)},
+		{"program_time_us", offsetof(n51_timing_profile, program_time_us)},
+		{"page_erase_time_us", offsetof(n51_timing_profile, page_erase_time_us)},
+		{"mass_erase_time_us", offsetof(n51_timing_profile, mass_erase_time_us)},
+		{"init_us", offsetof(n51_timing_profile, init_us)},
+	};
+	FILE *f = fopen(path, "r");
+	if (!f) {
+		fprintf(stderr, "ERROR: Failed to open profile: %s\n", path);
+		return -1;
+	}
+	char line[128];
+	int lineno = 0;
+	int ret = 0;
+	while (fgets(line, sizeof(line), f)) {
+		lineno++;
+		char key[64];
+		unsigned long val;
+		char *p = line;
+		while (isspace((unsigned char)*p))
+			p++;
+		if (*p == '#' || *p == '\0')
+			continue;
+		if (sscanf(p, "%63[a-z_0-9] = %lu", key, &val) != 2) {
+			fprintf(stderr, "ERROR: %s:%d: expected 'key = value'\n", path, lineno);
+			ret = -1;
+			continue;
+		}
+		size_t i;
+		for (i = 0; i < sizeof(keys) / sizeof(keys[0]); i++) {
+			if (strcmp(keys[i].key, key) == 0) {
+				*(uint32_t *)((uint8_t *)prof + keys[i].offset) = (uint32_t)val;
+				break;
+			}
+		}
+		if (i == sizeof(keys) / sizeof(keys[0])) {
+			fprintf(stderr, "ERROR: %s:%d: unknown key '%s'\n", path, lineno, key);
+			ret = -1;
+		}
+	}
+	fclose(f);
+	return ret;
+}
+
+n51plan *N51PLAN_create(const n51_timing_profile *prof)
+{
+	n51plan *plan = calloc(1, sizeof(n51plan));
+	if (!plan)
+		return NULL;
+	if (prof)
+		plan->prof = *prof;
+	else
+		N51PLAN_default_profile(&plan->prof);
+	return plan;
+}
+
+void N51PLAN_free(n51plan *plan)
+{
+	if (!plan)
+		return;
+	free(plan->steps);
+	free(plan);
+}
+
+void N51PLAN_set_phase(n51plan *plan, n51plan_phase phase)
+{
+	plan->phase = phase;
+}
+
+static void shadow_invalidate(n51plan *plan)
+{
+	plan->shadow_valid = 0;
+	memset(plan->page_valid, 0, sizeof(plan->page_valid));
+}
+
+void N51PLAN_enable_shadow(n51plan *plan, uint8_t enable)
+{
+	plan->shadow = enable;
+	shadow_invalidate(plan);
+}
+
+// Mirrors shadow_invalidate_range() in n51_icp.c
+static void shadow_invalidate_range(n51plan *plan, uint32_t addr, uint32_t len)
+{
+	if (addr >= CFG_FLASH_ADDR) {
+		shadow_invalidate(plan);
+		return;
+	}
+	for (uint32_t a = addr & ~(PAGE_SIZE - 1); a < addr + len && a < FLASH_SIZE; a += PAGE_SIZE)
+		plan->page_valid[a / PAGE_SIZE] = 0;
+}
+
+// Mirrors shadow_hit() in n51_icp.c: true if the read is answered by the shadow, and nothing is recorded
+static uint8_t shadow_hit(n51plan *plan, uint8_t what)
+{
+	if (!plan->shadow)
+		return 0;
+	if (plan->shadow_valid & what)
+		return 1;
+	plan->shadow_valid |= what;
+	return 0;
+}
+
+/*
+ * Cost model; each of these mirrors the static function of the same name in n51_icp.c
+ * and must be kept in sync with it.
+ */
+
+static void cost_sleep(n51plan_cost *c, uint32_t usec)
+{
+	if (usec > 0) {
+		c->sleep_us += usec;
+		c->sleeps++;
+	}
+}
+
+static void cost_bitsend(n51plan_cost *c, int len, uint32_t udelay)
+{
+	c->pin_ops++; // dat_dir
+	while (len--) {
+		c->pin_ops += 3; // set_dat, clk high, clk low
+		cost_sleep(c, udelay);
+		cost_sleep(c, udelay);
+	}
+}
+
+static void cost_send_command(const n51plan *plan, n51plan_cost *c)
+{
+	cost_bitsend(c, 24, plan->prof.bit_delay_us);
+}
+
+static void cost_read_byte(const n51plan *plan, n51plan_cost *c)
+{
+	uint32_t d = plan->prof.bit_delay_us;
+	c->pin_ops++; // dat_dir(0)
+	cost_sleep(c, d);
+	for (int i = 0; i < 8; i++) {
+		cost_sleep(c, d);
+		c->pin_ops += 3; // get_dat, clk high, clk low
+		cost_sleep(c, d);
+	}
+	c->pin_ops += 2; // dat_dir(1), set_dat(end)
+	cost_sleep(c, d);
+	cost_sleep(c, d);
+	c->pin_ops++; // clk high
+	cost_sleep(c, d);
+	c->pin_ops++; // clk low
+	cost_sleep(c, d);
+	c->pin_ops++; // set_dat(0)
+}
+
+static void cost_write_byte(const n51plan *plan, n51plan_cost *c, uint32_t delay1, uint32_t delay2)
+{
+	cost_bitsend(c, 8, plan->prof.bit_delay_us);
+	c->pin_ops++; // set_dat(end)
+	cost_sleep(c, delay1);
+	c->pin_ops++; // clk high
+	cost_sleep(c, delay2);
+	c->pin_ops += 2; // set_dat(0), clk low
+}
+
+static void record(n51plan *plan, const char *desc, int cmd, uint32_t addr, uint32_t len, const n51plan_cost *c, uint64_t extra_ns)
+{
+	if (plan->nsteps == plan->maxsteps) {
+		int newmax = plan->maxsteps ? plan->maxsteps * 2 : 32;
+		n51plan_step *steps = realloc(plan->steps, newmax * sizeof(n51plan_step));
+		if (!steps)
+			return;
+		plan->steps = steps;
+		plan->maxsteps = newmax;
+	}
+	uint64_t ns = c->pin_ops * plan->prof.gpio_latency_ns + c->sleep_us * 1000 + c->sleeps * plan->prof.sleep_overhead_ns + extra_ns;
+	n51plan_step *s = &plan->steps[plan->nsteps++];
+	s->phase = plan->phase;
+	s->desc = desc;
+	s->cmd = cmd;
+	s->addr = addr;
+	s->len = len;
+	s->time_ns = ns;
+	plan->phase_ns[plan->phase] += ns;
+}
+
+void N51PLAN_entry(n51plan *plan, uint8_t do_reset)
+{
+	n51plan_cost c = {0};
+	if (do_reset) {
+		for (int i = 0; i < 25; i++) {
+			c.pin_ops++;
+			cost_sleep(&c, plan->prof.reset_seq_bit_us);
+		}
+		record(plan, "reset sequence", NO_CMD, 0, 25, &c, 0);
+	} else {
+		c.pin_ops++;
+		cost_sleep(&c, 5000);
+		c.pin_ops++;
+		cost_sleep(&c, 1000);
+		record(plan, "reset pulse", NO_CMD, 0, 0, &c, 0);
+	}
+	memset(&c, 0, sizeof(c));
+	shadow_invalidate(plan);
+	cost_sleep(&c, 100);
+	cost_bitsend(&c, 24, plan->prof.entry_bit_delay_us);
+	cost_sleep(&c, 10);
+	record(plan, "entry bits", NO_CMD, 0, 24, &c, 0);
+}
+
+void N51PLAN_init(n51plan *plan, uint8_t do_reset)
+{
+	n51plan_cost c = {0};
+	record(plan, "open GPIO", NO_CMD, 0, 0, &c, (uint64_t)plan->prof.init_us * 1000);
+	N51PLAN_entry(plan, do_reset);
+	N51PLAN_read_device_id(plan);
+}
+
+void N51PLAN_reentry(n51plan *plan, uint32_t delay1, uint32_t delay2, uint32_t delay3)
+{
+	n51plan_cost c = {0};
+	cost_sleep(&c, 10);
+	if (delay1 > 0) {
+		c.pin_ops++;
+		cost_sleep(&c, delay1);
+	}
+	c.pin_ops++;
+	cost_sleep(&c, delay2);
+	shadow_invalidate(plan);
+	cost_bitsend(&c, 24, plan->prof.entry_bit_delay_us);
+	cost_sleep(&c, delay3);
+	record(plan, "reentry", NO_CMD, 0, 0, &c, 0);
+}
+
+void N51PLAN_exit(n51plan *plan)
+{
+	n51plan_cost c = {0};
+	c.pin_ops++;
+	cost_sleep(&c, 5000);
+	c.pin_ops++;
+	cost_sleep(&c, 10000);
+	shadow_invalidate(plan);
+	cost_bitsend(&c, 24, plan->prof.entry_bit_delay_us);
+	cost_sleep(&c, 500);
+	c.pin_ops++;
+	record(plan, "exit", NO_CMD, 0, 0, &c, 0);
+}
+
+static void plan_read(n51plan *plan, const char *desc, uint8_t cmd, uint32_t addr, uint32_t len)
+{
+	n51plan_cost c = {0};
+	cost_send_command(plan, &c);
+	for (uint32_t i = 0; i < len; i++)
+		cost_read_byte(plan, &c);
+	record(plan, desc, cmd, addr, len, &c, 0);
+}
+
+void N51PLAN_read_device_id(n51plan *plan)
+{
+	if (shadow_hit(plan, SHADOW_DEVID))
+		return;
+	plan_read(plan, "read device id", N51ICP_CMD_READ_DEVICE_ID, 0, 2);
+}
+
+void N51PLAN_read_pid(n51plan *plan)
+{
+	if (shadow_hit(plan, SHADOW_PID))
+		return;
+	plan_read(plan, "read pid", N51ICP_CMD_READ_DEVICE_ID, 2, 2);
+}
+
+void N51PLAN_read_cid(n51plan *plan)
+{
+	if (shadow_hit(plan, SHADOW_CID))
+		return;
+	plan_read(plan, "read cid", N51ICP_CMD_READ_CID, 0, 1);
+}
+
+void N51PLAN_read_uid(n51plan *plan)
+{
+	if (shadow_hit(plan, SHADOW_UID))
+		return;
+	n51plan_cost c = {0};
+	for (int i = 0; i < 12; i++) {
+		cost_send_command(plan, &c);
+		cost_read_byte(plan, &c);
+	}
+	record(plan, "read uid", N51ICP_CMD_READ_UID, 0, 12, &c, 0);
+}
+
+void N51PLAN_read_ucid(n51plan *plan)
+{
+	if (shadow_hit(plan, SHADOW_UCID))
+		return;
+	n51plan_cost c = {0};
+	for (int i = 0; i < 16; i++) {
+		cost_send_command(plan, &c);
+		cost_read_byte(plan, &c);
+	}
+	record(plan, "read ucid", N51ICP_CMD_READ_UID, 0x20, 16, &c, 0);
+}
+
+void N51PLAN_read_flash(n51plan *plan, uint32_t addr, uint32_t len)
+{
+	if (len == 0)
+		return;
+	if (plan->shadow && addr == CFG_FLASH_ADDR && len <= CFG_FLASH_LEN) {
+		if (!shadow_hit(plan, SHADOW_CONFIG))
+			plan_read(plan, "read config", N51ICP_CMD_READ_FLASH, CFG_FLASH_ADDR, CFG_FLASH_LEN);
+		return;
+	}
+	if (plan->shadow && addr < FLASH_SIZE && len <= FLASH_SIZE - addr) {
+		uint32_t first = addr / PAGE_SIZE, last = (addr + len - 1) / PAGE_SIZE, p;
+		for (p = first; p <= last && plan->page_valid[p]; p++)
+			;
+		if (p > last)
+			return;
+		for (p = first; p <= last; p++) {
+			if (p * PAGE_SIZE >= addr && (p + 1) * PAGE_SIZE <= addr + len)
+				plan->page_valid[p] = 1;
+		}
+	}
+	plan_read(plan, addr >= CFG_FLASH_ADDR ? "read config" : "read flash", N51ICP_CMD_READ_FLASH, addr, len);
+}
+
+void N51PLAN_write_flash(n51plan *plan, uint32_t addr, uint32_t len)
+{
+	if (len == 0)
+		return;
+	shadow_invalidate_range(plan, addr, len);
+	n51plan_cost c = {0};
+	cost_send_command(plan, &c);
+	for (uint32_t i = 0; i < len; i++)
+		cost_write_byte(plan, &c, plan->prof.program_time_us, 5);
+	record(plan, addr >= CFG_FLASH_ADDR ? "write config" : "write run", N51ICP_CMD_WRITE_FLASH, addr, len, &c, 0);
+}
+
+void N51PLAN_mass_erase(n51plan *plan)
+{
+	shadow_invalidate(plan);
+	n51plan_cost c = {0};
+	cost_send_command(plan, &c);
+	cost_write_byte(plan, &c, plan->prof.mass_erase_time_us, 500);
+	record(plan, "mass erase", N51ICP_CMD_MASS_ERASE, 0x3A5A5, 0, &c, 0);
+}
+
+void N51PLAN_page_erase(n51plan *plan, uint32_t addr)
+{
+	shadow_invalidate_range(plan, addr, PAGE_SIZE);
+	n51plan_cost c = {0};
+	cost_send_command(plan, &c);
+	cost_write_byte(plan, &c, plan->prof.page_erase_time_us, 100);
+	record(plan, "page erase", N51ICP_CMD_PAGE_ERASE, addr, PAGE_SIZE, &c, 0);
+}
+
+uint64_t N51PLAN_phase_us(const n51plan *plan, n51plan_phase phase)
+{
+	return plan->phase_ns[phase] / 1000;
+}
+
+uint64_t N51PLAN_total_us(const n51plan *plan)
+{
+	uint64_t total = 0;
+	for (int i = 0; i < N51PLAN_PHASE_COUNT; i++)
+		total += plan->phase_ns[i];
+	return total / 1000;
+}
+
+void N51PLAN_print_phase_times(const char *title, const uint64_t phase_us[N51PLAN_PHASE_COUNT])
+{
+	uint64_t total = 0;
+	printf("%s:\n", title);
+	for (int i = 0; i < N51PLAN_PHASE_COUNT; i++) {
+		if (phase_us[i] == 0)
+			continue;
+		printf("  %-10s %12llu us\n", phase_names[i], (unsigned long long)phase_us[i]);
+		total += phase_us[i];
+	}
+	printf("  %-10s %12llu us\n", "total", (unsigned long long)total);
+	fflush(stdout);
+}
+
+void N51PLAN_print(const n51plan *plan)
+{
+	const n51_timing_profile *p = &plan->prof;
+	printf("Backend profile: gpio latency %u ns, sleep overhead %u ns, bit delay %u us, program time %u us, "
+		"page erase %u us, mass erase %u us, reset sequence bit %u us\n\n",
+		p->gpio_latency_ns, p->sleep_overhead_ns, p->bit_delay_us, p->program_time_us,
+		p->page_erase_time_us, p->mass_erase_time_us, p->reset_seq_bit_us);
+	printf("  #    phase      operation        cmd   addr     len    est. time\n");
+	for (int i = 0; i < plan->nsteps; i++) {
+		const n51plan_step *s = &plan->steps[i];
+		char cmd[8] = "-";
+		char addr[12] = "-";
+		if (s->cmd != NO_CMD) {
+			snprintf(cmd, sizeof(cmd), "0x%02x", s->cmd);
+			snprintf(addr, sizeof(addr), "0x%05x", s->addr);
+		}
+		printf("  %-4d %-10s %-16s %-5s %-8s %-6u %10.3f ms\n", i, phase_names[s->phase], s->desc, cmd, addr, s->len,
+			s->time_ns / 1000000.0);
+	}
+	printf("\n");
+	uint64_t phase_us[N51PLAN_PHASE_COUNT];
+	for (int i = 0; i < N51PLAN_PHASE_COUNT; i++)
+		phase_us[i] = plan->phase_ns[i] / 1000;
+	N51PLAN_print_phase_times("Estimated time per phase", phase_us);
+}
+
+#endif // ARDUINO
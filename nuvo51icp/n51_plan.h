@@ -0,0 +1,88 @@
+// Description: Dry-run planner and timing model for the ICP engine.
+#pragma once
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Timing characteristics of a host/backend combination.
+ *
+ * The planner counts exactly the pin operations and sleeps that n51_icp.c issues for each operation;
+ * these values turn those counts into time.
+ */
+typedef struct _n51_timing_profile {
+	uint32_t gpio_latency_ns;     // cost of one pin operation (set, get or direction change)
+	uint32_t sleep_overhead_ns;   // extra cost of every non-zero sleep (oversleep, call overhead)
+	uint32_t bit_delay_us;        // delay per clock phase for commands and data (DEFAULT_BIT_DELAY)
+	uint32_t entry_bit_delay_us;  // delay per clock phase for entry/exit bits
+	uint32_t reset_seq_bit_us;    // duration of each bit of the reset sequence
+	uint32_t program_time_us;     // per-byte program time
+	uint32_t page_erase_time_us;
+	uint32_t mass_erase_time_us;
+	uint32_t init_us;             // cost of opening the GPIO backend
+} n51_timing_profile;
+
+typedef enum _n51plan_phase {
+	N51PLAN_ENTRY,
+	N51PLAN_IDENTIFY,
+	N51PLAN_ERASE,
+	N51PLAN_CONFIG,
+	N51PLAN_WRITE,
+	N51PLAN_VERIFY,
+	N51PLAN_READ,
+	N51PLAN_EXIT,
+	N51PLAN_PHASE_COUNT
+} n51plan_phase;
+
+typedef struct _n51plan n51plan;
+
+// Fills in the timings the engine was compiled with and zero host latency.
+void N51PLAN_default_profile(n51_timing_profile *prof);
+
+/**
+ * Loads a backend profile from a text file of `key = value` lines (keys are the n51_timing_profile field names).
+ * Fields that are not present keep their current value. Lines starting with '#' are ignored.
+ *
+ * @return 0 on success, <0 on failure.
+ */
+int N51PLAN_load_profile(const char *path, n51_timing_profile *prof);
+
+n51plan *N51PLAN_create(const n51_timing_profile *prof);
+void N51PLAN_free(n51plan *plan);
+
+// Models the engine's session shadow (N51ICP_ctx_enable_shadow()): reads it would answer aren't recorded
+void N51PLAN_enable_shadow(n51plan *plan, uint8_t enable);
+
+// All following operations are accounted to this phase
+void N51PLAN_set_phase(n51plan *plan, n51plan_phase phase);
+
+// Each of these records the operation of the same name in n51_icp.c
+void N51PLAN_init(n51plan *plan, uint8_t do_reset);
+void N51PLAN_entry(n51plan *plan, uint8_t do_reset);
+void N51PLAN_reentry(n51plan *plan, uint32_t delay1, uint32_t delay2, uint32_t delay3);
+void N51PLAN_exit(n51plan *plan);
+void N51PLAN_read_device_id(n51plan *plan);
+void N51PLAN_read_pid(n51plan *plan);
+void N51PLAN_read_cid(n51plan *plan);
+void N51PLAN_read_uid(n51plan *plan);
+void N51PLAN_read_ucid(n51plan *plan);
+void N51PLAN_read_flash(n51plan *plan, uint32_t addr, uint32_t len);
+void N51PLAN_write_flash(n51plan *plan, uint32_t addr, uint32_t len);
+void N51PLAN_mass_erase(n51plan *plan);
+void N51PLAN_page_erase(n51plan *plan, uint32_t addr);
+
+uint64_t N51PLAN_phase_us(const n51plan *plan, n51plan_phase phase);
+uint64_t N51PLAN_total_us(const n51plan *plan);
+
+// Prints every recorded step followed by the per-phase estimate
+void N51PLAN_print(const n51plan *plan);
+
+// Prints a per-phase time table; also used to report measured times in the same format
+void N51PLAN_print_phase_times(const char *title, const uint64_t phase_us[N51PLAN_PHASE_COUNT]);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,189 @@
+/*
+ * nuvo51icp, a RPi ICP flasher for the Nuvoton N76E003
+ * https://github.com/steve-m/N76E003-playground
+ *
+ * Copyright (c) 2021 Steve Markgraf <steve@steve-m.de>
+ * Copyright (c) 2023-2024 Nikita Lita
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef ARDUINO
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+#include "n51_resetcache.h"
+
+#define UID_LEN 12
+#define MAX_ENTRIES 4096
+
+typedef struct _rc_entry {
+	char uid[UID_LEN * 2 + 1];
+	uint32_t reset_seq;
+	uint32_t bit_delay;
+} rc_entry;
+
+const char *N51RC_default_path(void)
+{
+	static char path[512];
+	const char *env = getenv("N51ICP_RESET_CACHE");
+	if (env && *env)
+		return env;
+	const char *base = getenv("XDG_CACHE_HOME");
+	if (base && *base) {
+		snprintf(path, sizeof(path), "%s/nuvo51icp/reset-periods", base);
+		return path;
+	}
+	base = getenv("HOME");
+	if (!base || !*base)
+		return NULL;
+	snprintf(path, sizeof(path), "%s/.cache/nuvo51icp/reset-periods", base);
+	return path;
+}
+
+static void uid_hex(const uint8_t *uid, char *out)
+{
+	for (int i = 0; i < UID_LEN; i++)
+		sprintf(out + i * 2, "%02x", uid[i]);
+}
+
+// Reads up to `max` entries; returns the number read (0 if the file doesn't exist)
+static int read_entries(const char *path, rc_entry *entries, int max)
+{
+	FILE *f = fopen(path, "r");
+	char line[128];
+	int n = 0;
+	if (!f)
+		return 0;
+	while (n < max && fgets(line, sizeof(line), f)) {
+		rc_entry *e = &entries[n];
+		if (sscanf(line, "%24s %x %u", e->uid, &e->reset_seq, &e->bit_delay) == 3 && strlen(e->uid) == UID_LEN * 2)
+			n++;
+	}
+	fclose(f);
+	return n;
+}
+
+int N51RC_lookup(const char *path, const uint8_t *uid, uint32_t *reset_seq, uint32_t *bit_delay)
+{
+	char key[UID_LEN * 2 + 1];
+	int ret = -1;
+	if (!path)
+		return -1;
+	// too big for a station thread's stack
+	rc_entry *entries = malloc(MAX_ENTRIES * sizeof(rc_entry));
+	if (!entries)
+		return -1;
+	int n = read_entries(path, entries, MAX_ENTRIES);
+	if (uid)
+		uid_hex(uid, key);
+	for (int i = n - 1; i >= 0; i--) {
+		if (!uid || strcmp(entries[i].uid, key) == 0) {
+			*reset_seq = entries[i].reset_seq;
+			*bit_delay = entries[i].bit_delay;
+			ret = 0;
+			break;
+		}
+	}
+	free(entries);
+	return ret;
+}
+
+static void make_parent_dirs(const char *path)
+{
+	char dir[512];
+	snprintf(dir, sizeof(dir), "%s", path);
+	for (char *p = dir + 1; *p; p++) {
+		if (*p != '/')
+			continue;
+		*p = '\0';
+		mkdir(dir, 0755);
+		*p = '/';
+	}
+}
+
+// Writes the entries other than `key`, then `key`'s, to a new file in the same directory and renames it over `path`
+static int rewrite_entries(const char *path, const char *key, uint32_t reset_seq, uint32_t bit_delay)
+{
+	char tmp[520];
+	rc_entry *entries = malloc(MAX_ENTRIES * sizeof(rc_entry));
+	if (!entries)
+		return -1;
+	int n = read_entries(path, entries, MAX_ENTRIES);
+
+	snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path);
+	int fd = mkstemp(tmp);
+	FILE *f = fd < 0 ? NULL : fdopen(fd, "w");
+	if (!f) {
+		if (fd >= 0) {
+			close(fd);
+			remove(tmp);
+		}
+		free(entries);
+		return -1;
+	}
+	fchmod(fd, 0644);
+	// drop the oldest entries once full, so the file doesn't grow without bound
+	int skip = n >= MAX_ENTRIES ? n - MAX_ENTRIES + 1 : 0;
+	for (int i = skip; i < n; i++) {
+		if (strcmp(entries[i].uid, key) != 0)
+			fprintf(f, "%s %06x %u\n", entries[i].uid, entries[i].reset_seq, entries[i].bit_delay);
+	}
+	fprintf(f, "%s %06x %u\n", key, reset_seq, bit_delay);
+	free(entries);
+	if (fclose(f) != 0 || rename(tmp, path) != 0) {
+		remove(tmp);
+		return -1;
+	}
+	return 0;
+}
+
+int N51RC_store(const char *path, const uint8_t *uid, uint32_t reset_seq, uint32_t bit_delay)
+{
+	char key[UID_LEN * 2 + 1];
+	char lock[520];
+	if (!path)
+		return -1;
+	uid_hex(uid, key);
+	make_parent_dirs(path);
+
+	// the cache file itself gets replaced, so writers serialize on a lock file next to it; readers only
+	// ever see a complete file thanks to the rename
+	snprintf(lock, sizeof(lock), "%s.lock", path);
+	int lock_fd = open(lock, O_RDWR | O_CREAT, 0644);
+	if (lock_fd < 0)
+		return -1;
+	if (flock(lock_fd, LOCK_EX) != 0) {
+		close(lock_fd);
+		return -1;
+	}
+	int ret = rewrite_entries(path, key, reset_seq, bit_delay);
+	close(lock_fd);
+	return ret;
+}
+
+#endif // ARDUINO
@@ -0,0 +1,40 @@
+// Description: Per-chip cache of the shortest working ICP reset sequence period, keyed by UID.
+#pragma once
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * The cache is a text file with one line per chip, most recently stored last:
+ *   <24 hex digit UID> <reset sequence, hex> <bit period in us>
+ */
+
+/**
+ * The cache file: $N51ICP_RESET_CACHE if set, otherwise $XDG_CACHE_HOME/nuvo51icp/reset-periods
+ * (~/.cache/nuvo51icp/reset-periods). Returns NULL if neither that nor $HOME is set.
+ */
+const char *N51RC_default_path(void);
+
+/**
+ * Looks up the reset sequence and bit period stored for `uid`, or for the most recently stored chip if
+ * `uid` is NULL.
+ *
+ * @return 0 if found, -1 otherwise
+ */
+int N51RC_lookup(const char *path, const uint8_t *uid, uint32_t *reset_seq, uint32_t *bit_delay);
+
+/**
+ * Stores the reset sequence and bit period for `uid`, replacing any previous entry for it.
+ * Creates the file and its directory if needed. Stores from several threads or processes are serialized
+ * with a flock() on `<path>.lock`, and the file is replaced with a rename, so lookups never see it half written.
+ *
+ * @return 0 on success, -1 on failure
+ */
+int N51RC_store(const char *path, const uint8_t *uid, uint32_t reset_seq, uint32_t bit_delay);
+
+#ifdef __cplusplus
+}
+#endif
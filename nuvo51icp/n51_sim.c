@@ -0,0 +1,327 @@
+/*
+ * nuvo51icp, a RPi ICP flasher for the Nuvoton N76E003
+ * https://github.com/steve-m/N76E003-playground
+ *
+ * Copyright (c) 2021 Steve Markgraf <steve@steve-m.de>
+ * Copyright (c) 2023-2024 Nikita Lita
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef ARDUINO
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "n51_sim.h"
+
+#define SIM_STATE_RUNNING     0 // RST high, chip is running its firmware
+#define SIM_STATE_WAIT_ENTRY  1 // RST low, shifting in entry bits
+#define SIM_STATE_COMMAND     2 // in ICP mode, shifting in a 24-bit command
+#define SIM_STATE_DATA_OUT    3 // clocking out a byte to the host
+#define SIM_STATE_DATA_IN     4 // clocking in a byte from the host
+
+#define MASS_ERASE_KEY 0x3A5A5
+
+void N51SIM_init(n51sim_target *t, uint32_t seed)
+{
+	memset(t, 0, sizeof(*t));
+	memset(t->flash, 0xFF, sizeof(t->flash));
+	memset(t->config, 0xFF, sizeof(t->config));
+	for (int i = 0; i < 12; i++) {
+		t->uid[i] = (uint8_t)((seed >> ((i % 4) * 8)) + i * 0x11);
+	}
+	for (int i = 0; i < 16; i++) {
+		t->ucid[i] = (uint8_t)(t->uid[i % 12] ^ 0x5A);
+	}
+	t->devid = N76E003_DEVID;
+	t->pid = N51SIM_DEFAULT_PID;
+	t->cid = N51SIM_DEFAULT_CID;
+	t->present = 1;
+	t->rst = 1;
+	t->state = SIM_STATE_RUNNING;
+	t->rst_edge_ns = UINT64_MAX;
+	t->shortest_rst_ns = UINT64_MAX;
+}
+
+void N51SIM_load_flash(n51sim_target *t, uint32_t addr, const uint8_t *data, uint32_t len)
+{
+	if (addr >= CFG_FLASH_ADDR) {
+		for (uint32_t i = 0; i < len && addr - CFG_FLASH_ADDR + i < CFG_FLASH_LEN; i++)
+			t->config[addr - CFG_FLASH_ADDR + i] = data[i];
+		return;
+	}
+	for (uint32_t i = 0; i < len && addr + i < FLASH_SIZE; i++)
+		t->flash[addr + i] = data[i];
+}
+
+void N51SIM_load_env(n51sim_target *t)
+{
+	const char *flash_file = getenv("N51SIM_FLASH");
+	if (flash_file && *flash_file) {
+		FILE *f = fopen(flash_file, "rb");
+		if (f) {
+			uint8_t buf[FLASH_SIZE];
+			size_t len = fread(buf, 1, sizeof(buf), f);
+			N51SIM_load_flash(t, APROM_FLASH_ADDR, buf, len);
+			fclose(f);
+		} else {
+			fprintf(stderr, "sim: could not open %s\n", flash_file);
+		}
+	}
+	const char *cfg = getenv("N51SIM_CONFIG");
+	if (cfg && *cfg) {
+		uint8_t bytes[CFG_FLASH_LEN];
+		int i;
+		for (i = 0; i < CFG_FLASH_LEN; i++) {
+			unsigned int b;
+			if (sscanf(cfg + i * 2, "%2x", &b) != 1)
+				break;
+			bytes[i] = b;
+		}
+		if (i == CFG_FLASH_LEN)
+			N51SIM_load_flash(t, CFG_FLASH_ADDR, bytes, CFG_FLASH_LEN);
+		else
+			fprintf(stderr, "sim: invalid N51SIM_CONFIG '%s'\n", cfg);
+	}
+	const char *min_reset = getenv("N51SIM_MIN_RESET_US");
+	if (min_reset && *min_reset)
+		t->min_rst_ns = strtoul(min_reset, NULL, 0) * 1000;
+	const char *window = getenv("N51SIM_ENTRY_WINDOW_US");
+	unsigned int lo, hi;
+	if (window && *window) {
+		if (sscanf(window, "%u,%u", &lo, &hi) == 2 && lo < hi) {
+			t->entry_window_lo_ns = lo * 1000;
+			t->entry_window_hi_ns = hi * 1000;
+		} else {
+			fprintf(stderr, "sim: invalid N51SIM_ENTRY_WINDOW_US '%s'\n", window);
+		}
+	}
+}
+
+uint8_t N51SIM_in_icp(const n51sim_target *t)
+{
+	return t->state >= SIM_STATE_COMMAND;
+}
+
+static uint8_t sim_read(n51sim_target *t, uint8_t cmd, uint32_t addr)
+{
+	switch (cmd) {
+	case N51ICP_CMD_READ_DEVICE_ID:
+		switch (addr) {
+		case 0: return t->devid & 0xFF;
+		case 1: return t->devid >> 8;
+		case 2: return t->pid & 0xFF;
+		case 3: return t->pid >> 8;
+		default: return 0xFF;
+		}
+	case N51ICP_CMD_READ_CID:
+		return t->locked ? 0xFF : t->cid;
+	case N51ICP_CMD_READ_UID:
+		if (addr < 12)
+			return t->uid[addr];
+		if (addr >= 0x20 && addr < 0x30)
+			return t->ucid[addr - 0x20];
+		return 0xFF;
+	case N51ICP_CMD_READ_FLASH:
+		if (addr >= CFG_FLASH_ADDR)
+			return addr - CFG_FLASH_ADDR < CFG_FLASH_LEN ? t->config[addr - CFG_FLASH_ADDR] : 0xFF;
+		if (t->locked || addr >= FLASH_SIZE)
+			return 0xFF;
+		return t->flash[addr];
+	default:
+		return 0xFF;
+	}
+}
+
+static void sim_program(n51sim_target *t, uint8_t cmd, uint32_t addr, uint8_t data)
+{
+	switch (cmd) {
+	case N51ICP_CMD_WRITE_FLASH:
+		t->bytes_written++;
+		if (addr >= CFG_FLASH_ADDR) {
+			if (addr - CFG_FLASH_ADDR < CFG_FLASH_LEN)
+				t->config[addr - CFG_FLASH_ADDR] &= data;
+		} else if (addr < FLASH_SIZE && !t->locked) {
+			t->flash[addr] &= data;
+		}
+		break;
+	case N51ICP_CMD_PAGE_ERASE:
+		t->page_erases++;
+		if (addr >= CFG_FLASH_ADDR) {
+			memset(t->config, 0xFF, sizeof(t->config));
+		} else if (addr < FLASH_SIZE && !t->locked) {
+			memset(&t->flash[addr & ~(uint32_t)(PAGE_SIZE - 1)], 0xFF, PAGE_SIZE);
+		}
+		break;
+	case N51ICP_CMD_MASS_ERASE:
+		if (addr == MASS_ERASE_KEY) {
+			t->mass_erases++;
+			memset(t->flash, 0xFF, sizeof(t->flash));
+			memset(t->config, 0xFF, sizeof(t->config));
+		}
+		break;
+	}
+}
+
+static void sim_start_command(n51sim_target *t)
+{
+	uint32_t bits = t->shift & 0xFFFFFF;
+	t->shift = 0;
+	t->nbits = 0;
+	if (bits == EXIT_BITS) {
+		t->state = SIM_STATE_WAIT_ENTRY;
+		return;
+	}
+	t->commands++;
+	t->cmd = bits & 0x3F;
+	t->addr = bits >> 6;
+	switch (t->cmd) {
+	case N51ICP_CMD_READ_FLASH:
+	case N51ICP_CMD_READ_DEVICE_ID:
+	case N51ICP_CMD_READ_CID:
+	case N51ICP_CMD_READ_UID:
+		t->state = SIM_STATE_DATA_OUT;
+		t->cur_byte = sim_read(t, t->cmd, t->addr);
+		break;
+	case N51ICP_CMD_WRITE_FLASH:
+	case N51ICP_CMD_PAGE_ERASE:
+	case N51ICP_CMD_MASS_ERASE:
+		t->state = SIM_STATE_DATA_IN;
+		break;
+	default:
+		// unknown commands are ignored
+		break;
+	}
+}
+
+static void sim_clock_rising(n51sim_target *t)
+{
+	switch (t->state) {
+	case SIM_STATE_WAIT_ENTRY:
+		if (t->nbits == 0) {
+			t->entry_start_ns = t->now_ns - t->rst_edge_ns;
+			t->nbits = 1;
+		}
+		t->shift = (t->shift << 1) | t->dat;
+		if ((t->shift & 0xFFFFFF) == ENTRY_BITS) {
+			uint8_t accepted = !t->min_rst_ns || t->shortest_rst_ns >= t->min_rst_ns;
+			if (t->entry_window_hi_ns)
+				accepted &= t->entry_start_ns >= t->entry_window_lo_ns && t->entry_start_ns <= t->entry_window_hi_ns;
+			t->shortest_rst_ns = UINT64_MAX;
+			t->shift = 0;
+			t->nbits = 0;
+			if (!accepted) {
+				t->state = SIM_STATE_RUNNING;
+				break;
+			}
+			t->entries++;
+			t->state = SIM_STATE_COMMAND;
+		}
+		break;
+	case SIM_STATE_COMMAND:
+		t->shift = (t->shift << 1) | t->dat;
+		if (++t->nbits == 24)
+			sim_start_command(t);
+		break;
+	case SIM_STATE_DATA_OUT:
+		if (t->nbits++ < 8)
+			break;
+		// 9th clock: the host tells us whether this was the last byte
+		t->bytes_read++;
+		t->nbits = 0;
+		if (t->dat) {
+			t->state = SIM_STATE_COMMAND;
+		} else {
+			t->addr++;
+			t->cur_byte = sim_read(t, t->cmd, t->addr);
+		}
+		break;
+	case SIM_STATE_DATA_IN:
+		if (t->nbits < 8) {
+			t->cur_byte = (t->cur_byte << 1) | t->dat;
+			t->nbits++;
+			break;
+		}
+		sim_program(t, t->cmd, t->addr, t->cur_byte);
+		t->nbits = 0;
+		if (t->dat) {
+			t->state = SIM_STATE_COMMAND;
+		} else {
+			t->addr++;
+		}
+		break;
+	default:
+		break;
+	}
+}
+
+void N51SIM_set_rst(n51sim_target *t, uint8_t val)
+{
+	if (!t->present) {
+		t->rst = val;
+		return;
+	}
+	if (val != t->rst) {
+		if (t->rst_edge_ns != UINT64_MAX && t->now_ns - t->rst_edge_ns < t->shortest_rst_ns)
+			t->shortest_rst_ns = t->now_ns - t->rst_edge_ns;
+		t->rst_edge_ns = t->now_ns;
+	}
+	if (val && !t->rst) {
+		// config bytes are loaded every time the chip comes out of reset
+		t->locked = (t->config[0] & 0x02) == 0;
+		t->state = SIM_STATE_RUNNING;
+	} else if (!val && t->rst) {
+		t->state = SIM_STATE_WAIT_ENTRY;
+		t->shift = 0;
+		t->nbits = 0;
+	}
+	t->rst = val;
+}
+
+void N51SIM_set_clk(n51sim_target *t, uint8_t val)
+{
+	if (t->present && val && !t->clk)
+		sim_clock_rising(t);
+	t->clk = val;
+}
+
+void N51SIM_set_dat(n51sim_target *t, uint8_t val)
+{
+	t->dat = val ? 1 : 0;
+}
+
+void N51SIM_dat_dir(n51sim_target *t, uint8_t host_output)
+{
+	t->host_drives_dat = host_output;
+}
+
+uint8_t N51SIM_get_dat(n51sim_target *t)
+{
+	if (!t->present)
+		return 0;
+	if (t->state == SIM_STATE_DATA_OUT && t->nbits < 8)
+		return (t->cur_byte >> (7 - t->nbits)) & 1;
+	return t->host_drives_dat ? t->dat : 0;
+}
+
+#endif // ARDUINO
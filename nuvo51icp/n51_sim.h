@@ -0,0 +1,110 @@
+// Description: Simulated N76E003 target for host-side testing of the ICP engine.
+#pragma once
+
+#include <stdint.h>
+#include "n51_icp.h"
+
+#define N51SIM_DEFAULT_CID  0xDA
+#define N51SIM_DEFAULT_PID  0x0000
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * A simulated N76E003 as seen from the ICP pins.
+ *
+ * The model decodes the bit stream clocked in on CLK (entry bits, 24-bit commands, 9-clock data bytes)
+ * and responds the way the chip does: flash can only be programmed from 1 to 0, erases set bytes to 0xFF,
+ * and the config bytes (including LOCK) are latched every time RST goes high.
+ */
+typedef struct _n51sim_target {
+	// pin levels driven by the host
+	uint8_t rst;
+	uint8_t clk;
+	uint8_t dat;
+	uint8_t host_drives_dat;
+
+	// 0 if the target is not attached (reads return 0, pin changes are ignored)
+	uint8_t present;
+
+	// chip contents
+	uint8_t flash[FLASH_SIZE];
+	uint8_t config[CFG_FLASH_LEN];
+	uint8_t uid[12];
+	uint8_t ucid[16];
+	uint16_t devid;
+	uint16_t pid;
+	uint8_t cid;
+
+	// protocol state
+	uint8_t state;
+	uint8_t locked;     // latched from config on RST high
+	uint32_t shift;
+	uint8_t nbits;
+	uint8_t cmd;
+	uint32_t addr;
+	uint8_t cur_byte;
+
+	// timing model: the chip ignores the entry bits if any RST level since the previous entry attempt
+	// was held for less than min_rst_ns (0 disables the check)
+	uint64_t now_ns;          // set by the PGM backend before every pin change
+	uint64_t rst_edge_ns;     // time of the last RST change, UINT64_MAX before the first one
+	uint64_t shortest_rst_ns;
+	uint32_t min_rst_ns;
+	// a chip with the reset pin disabled only takes entry bits that start between these times after RST
+	// last went low (entry_window_hi_ns = 0 disables the check)
+	uint32_t entry_window_lo_ns;
+	uint32_t entry_window_hi_ns;
+	uint64_t entry_start_ns;  // RST low time when the first entry bit was clocked in
+
+	// counters, useful for checking how much traffic an operation caused
+	uint32_t entries;
+	uint32_t commands;
+	uint32_t bytes_read;
+	uint32_t bytes_written;
+	uint32_t page_erases;
+	uint32_t mass_erases;
+} n51sim_target;
+
+/**
+ * Initialize a simulated target as a blank, unlocked N76E003 with a UID derived from `seed`.
+ */
+void N51SIM_init(n51sim_target *t, uint32_t seed);
+
+// Pin interface, called by the simulated PGM backend
+void N51SIM_set_rst(n51sim_target *t, uint8_t val);
+void N51SIM_set_clk(n51sim_target *t, uint8_t val);
+void N51SIM_set_dat(n51sim_target *t, uint8_t val);
+void N51SIM_dat_dir(n51sim_target *t, uint8_t host_output);
+uint8_t N51SIM_get_dat(n51sim_target *t);
+
+// Returns 1 if the target is currently in ICP mode
+uint8_t N51SIM_in_icp(const n51sim_target *t);
+
+// The target attached to the default context of the simulated PGM backend (sim.c)
+n51sim_target *N51SIM_pgm_target(void);
+
+// The target on DAT line `index` of a gang created by the simulated PGM backend (sim.c)
+struct _n51pgm_gang;
+n51sim_target *N51SIM_gang_target(struct _n51pgm_gang *gang, int index);
+
+// Loads `len` bytes of flash contents at `addr` (as if previously programmed)
+void N51SIM_load_flash(n51sim_target *t, uint32_t addr, const uint8_t *data, uint32_t len);
+
+/**
+ * Loads the initial target contents from the environment:
+ *   N51SIM_FLASH   file to preload into the simulated flash
+ *   N51SIM_CONFIG  config bytes to preload, as 10 hex digits (e.g. FDFFFFFFFF for a locked chip)
+ *   N51SIM_MIN_RESET_US  shortest RST level (e.g. reset sequence bit) the chip accepts before entry
+ *   N51SIM_ENTRY_WINDOW_US  <lo>,<hi>: models a chip with the reset pin disabled, which only takes entry bits
+ *                  that start between <lo> and <hi> us after RST went low
+ * and, read by the simulated PGM backend (sim.c):
+ *   N51SIM_SWAP    <present ms>,<absent ms>: boards are hot-swapped on this cycle of the virtual clock,
+ *                  each insertion being a new blank chip with its own UID
+ */
+void N51SIM_load_env(n51sim_target *t);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,283 @@
+/*
+ * nuvo51icp, a RPi ICP flasher for the Nuvoton N76E003
+ * https://github.com/steve-m/N76E003-playground
+ *
+ * Copyright (c) 2021 Steve Markgraf <steve@steve-m.de>
+ * Copyright (c) 2023-2024 Nikita Lita
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef ARDUINO
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "config.h"
+#include "n51_icp.h"
+#include "n51_station.h"
+
+#define JOB_QUEUED  0
+#define JOB_RUNNING 1
+#define JOB_DONE    2
+
+typedef struct _station_slot {
+	n51station *st;
+	int index;
+	n51icp_ctx *icp;
+	pthread_t thread;
+	uint8_t running;
+} station_slot;
+
+struct _n51station {
+	int count;
+	uint8_t do_reset;
+	station_slot slots[N51ST_MAX_STATIONS];
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	uint8_t closed;
+	// jobs[i] produces results[i]
+	n51st_job *jobs;
+	uint8_t *job_state;
+	n51st_result *results;
+	int job_count;
+	int job_cap;
+};
+
+n51station *N51ST_create(const n51pgm_pins *pins, int count, uint8_t do_reset)
+{
+	if (count < 1 || count > N51ST_MAX_STATIONS)
+		return NULL;
+	n51station *st = calloc(1, sizeof(n51station));
+	if (!st)
+		return NULL;
+	st->count = count;
+	st->do_reset = do_reset;
+	pthread_mutex_init(&st->lock, NULL);
+	pthread_cond_init(&st->cond, NULL);
+	for (int i = 0; i < count; i++) {
+		st->slots[i].st = st;
+		st->slots[i].index = i;
+		st->slots[i].icp = N51ICP_ctx_create(&pins[i]);
+		if (!st->slots[i].icp) {
+			N51ST_free(st);
+			return NULL;
+		}
+	}
+	return st;
+}
+
+void N51ST_free(n51station *st)
+{
+	if (!st)
+		return;
+	for (int i = 0; i < st->count; i++)
+		N51ICP_ctx_free(st->slots[i].icp);
+	pthread_mutex_destroy(&st->lock);
+	pthread_cond_destroy(&st->cond);
+	free(st->jobs);
+	free(st->job_state);
+	free(st->results);
+	free(st);
+}
+
+void N51ST_set_reset_seq(n51station *st, uint32_t reset_seq, uint32_t bit_delay)
+{
+	for (int i = 0; i < st->count; i++) {
+		st->slots[i].icp->reset_seq = reset_seq;
+		st->slots[i].icp->reset_seq_bit_delay = bit_delay;
+	}
+}
+
+int N51ST_submit(n51station *st, const n51st_job *job)
+{
+	if (job->station >= st->count)
+		return -1;
+	pthread_mutex_lock(&st->lock);
+	if (st->job_count == st->job_cap) {
+		int cap = st->job_cap ? st->job_cap * 2 : 16;
+		n51st_job *jobs = realloc(st->jobs, cap * sizeof(n51st_job));
+		if (jobs)
+			st->jobs = jobs;
+		uint8_t *state = realloc(st->job_state, cap);
+		if (state)
+			st->job_state = state;
+		n51st_result *results = realloc(st->results, cap * sizeof(n51st_result));
+		if (results)
+			st->results = results;
+		if (!jobs || !state || !results) {
+			pthread_mutex_unlock(&st->lock);
+			return -1;
+		}
+		st->job_cap = cap;
+	}
+	int idx = st->job_count++;
+	st->jobs[idx] = *job;
+	st->job_state[idx] = JOB_QUEUED;
+	memset(&st->results[idx], 0, sizeof(n51st_result));
+	st->results[idx].station = -1;
+	st->results[idx].status = N51ST_NOT_RUN;
+	pthread_cond_broadcast(&st->cond);
+	pthread_mutex_unlock(&st->lock);
+	return idx;
+}
+
+// Mirrors the write flow of main(); the caller holds no lock
+static void station_run(n51icp_ctx *ctx, const n51st_job *job, n51st_result *res, uint8_t do_reset, uint8_t *read_data)
+{
+	uint64_t start = N51PGM_ctx_get_time(ctx->pgm);
+
+	N51ICP_ctx_entry(ctx, do_reset);
+	uint8_t cid = N51ICP_ctx_read_cid(ctx);
+	// chip's locked, re-enter ICP mode to reload the flash
+	if (cid == 0xFF)
+		N51ICP_ctx_reentry(ctx, 5000, 1000, 10);
+	res->devid = N51ICP_ctx_read_device_id(ctx);
+	N51ICP_ctx_read_uid(ctx, res->uid);
+	if (res->devid != N76E003_DEVID) {
+		res->status = N51ST_NO_DEVICE;
+		goto out;
+	}
+
+	config_flags current_config;
+	N51ICP_ctx_read_flash(ctx, CFG_FLASH_ADDR, CFG_FLASH_LEN, (uint8_t *)&current_config);
+	N51ICP_ctx_mass_erase(ctx);
+	if (current_config.LOCK == 0 || cid == 0xFF)
+		N51ICP_ctx_reentry(ctx, 5000, 1000, 10);
+
+	config_flags write_config;
+	memset(&write_config, 0xFF, sizeof(write_config));
+	if (job->ldrom_size) {
+		uint32_t ldrom_kb = ((job->ldrom_size - 1) / 1024) + 1;
+		uint32_t ldrom_addr = FLASH_SIZE - ldrom_kb * 1024;
+		write_config.CBS = 0;
+		write_config.LDS = ((7 - ldrom_kb) & 0x7);
+		N51ICP_ctx_write_flash(ctx, CFG_FLASH_ADDR, CFG_FLASH_LEN, (uint8_t *)&write_config);
+		N51ICP_ctx_write_flash(ctx, ldrom_addr, job->ldrom_size, (uint8_t *)&job->image[ldrom_addr]);
+	}
+	if (job->aprom_size)
+		N51ICP_ctx_write_flash(ctx, APROM_FLASH_ADDR, job->aprom_size, (uint8_t *)job->image);
+
+	N51ICP_ctx_read_flash(ctx, APROM_FLASH_ADDR, FLASH_SIZE, read_data);
+	if (memcmp(job->image, read_data, FLASH_SIZE)) {
+		res->status = N51ST_VERIFY;
+		goto out;
+	}
+	// the lock bits go in last, the flash can't be read back afterwards
+	if (job->lock) {
+		write_config.LOCK = 0;
+		N51ICP_ctx_write_flash(ctx, CFG_FLASH_ADDR, CFG_FLASH_LEN, (uint8_t *)&write_config);
+	}
+	res->status = N51ST_OK;
+out:
+	N51ICP_ctx_exit(ctx);
+	res->time_us = N51PGM_ctx_get_time(ctx->pgm) - start;
+}
+
+// Next queued job this station may run, or -1
+static int station_next_job(n51station *st, int index)
+{
+	for (int i = 0; i < st->job_count; i++) {
+		if (st->job_state[i] == JOB_QUEUED && (st->jobs[i].station < 0 || st->jobs[i].station == index))
+			return i;
+	}
+	return -1;
+}
+
+static void *station_worker(void *arg)
+{
+	station_slot *slot = arg;
+	n51station *st = slot->st;
+	uint8_t read_data[FLASH_SIZE];
+
+	pthread_mutex_lock(&st->lock);
+	for (;;) {
+		int idx = station_next_job(st, slot->index);
+		if (idx < 0) {
+			if (st->closed)
+				break;
+			pthread_cond_wait(&st->cond, &st->lock);
+			continue;
+		}
+		st->job_state[idx] = JOB_RUNNING;
+		// the arrays may be reallocated by N51ST_submit() while the job runs
+		n51st_job job = st->jobs[idx];
+		n51st_result res = {slot->index, N51ST_NOT_RUN, 0, {0}, 0};
+		pthread_mutex_unlock(&st->lock);
+
+		station_run(slot->icp, &job, &res, st->do_reset, read_data);
+
+		pthread_mutex_lock(&st->lock);
+		st->results[idx] = res;
+		st->job_state[idx] = JOB_DONE;
+	}
+	pthread_mutex_unlock(&st->lock);
+	return NULL;
+}
+
+int N51ST_start(n51station *st)
+{
+	int running = 0;
+	for (int i = 0; i < st->count; i++) {
+		station_slot *slot = &st->slots[i];
+		if (N51PGM_ctx_init(slot->icp->pgm) != 0)
+			continue;
+		if (pthread_create(&slot->thread, NULL, station_worker, slot) != 0) {
+			N51PGM_ctx_deinit(slot->icp->pgm, 0);
+			continue;
+		}
+		slot->running = 1;
+		running++;
+	}
+	return running;
+}
+
+int N51ST_finish(n51station *st)
+{
+	pthread_mutex_lock(&st->lock);
+	st->closed = 1;
+	pthread_cond_broadcast(&st->cond);
+	pthread_mutex_unlock(&st->lock);
+
+	for (int i = 0; i < st->count; i++) {
+		station_slot *slot = &st->slots[i];
+		if (!slot->running)
+			continue;
+		pthread_join(slot->thread, NULL);
+		N51PGM_ctx_deinit(slot->icp->pgm, 0);
+		slot->running = 0;
+	}
+
+	int failed = 0;
+	for (int i = 0; i < st->job_count; i++) {
+		if (st->results[i].status != N51ST_OK)
+			failed++;
+	}
+	return failed;
+}
+
+const n51st_result *N51ST_results(n51station *st, int *count)
+{
+	*count = st->job_count;
+	return st->results;
+}
+
+#endif // ARDUINO
@@ -0,0 +1,86 @@
+// Description: Multi-station scheduler: programs several targets on independent pin sets concurrently, one worker thread per station.
+#pragma once
+
+#include <stdint.h>
+#include "n51_pgm.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Unlike a gang (n51_gang.h), every station has its own DAT, CLK and RST lines and its own n51icp_ctx, and
+ * runs the whole flow (entry, erase, write, verify, exit) in its own thread at its own pace. While one
+ * station sits in an erase hold, which the RPi backends sleep through with clock_nanosleep(), the others
+ * keep clocking. Not available on the Arduino.
+ *
+ * Jobs are queued with N51ST_submit() and handed to the first free station they may run on; each job
+ * produces one n51st_result.
+ */
+
+#define N51ST_MAX_STATIONS 16
+
+// Result status
+#define N51ST_OK         0
+#define N51ST_NO_DEVICE  1 // no N76E003 answered after entering ICP mode
+#define N51ST_VERIFY     2 // the flash read back different data
+#define N51ST_NOT_RUN    3 // no running station could take the job (its station failed to initialize)
+
+typedef struct _n51st_job {
+	const uint8_t *image; // FLASH_SIZE bytes, 0xFF where nothing is written: APROM from address 0, LDROM at the end
+	                      // of the flash. Verified as a whole; not copied, must stay valid until N51ST_finish()
+	uint32_t aprom_size;  // bytes of APROM to write
+	uint32_t ldrom_size;  // bytes of LDROM to write; if nonzero, the config is set to boot from an LDROM of that size
+	uint8_t lock;         // lock the chip after verifying
+	int station;          // station to run on, -1 for any
+} n51st_job;
+
+typedef struct _n51st_result {
+	int station;     // station that ran the job, -1 if it didn't run
+	int status;      // N51ST_OK, N51ST_NO_DEVICE, ...
+	uint32_t devid;
+	uint8_t uid[12];
+	uint64_t time_us; // time the station spent on the job, by its backend clock
+} n51st_result;
+
+typedef struct _n51station n51station;
+
+/**
+ * Creates a station for every entry of `pins`. Nothing is touched until N51ST_start().
+ *
+ * @param do_reset enter ICP mode with the reset sequence (see N51ICP_entry())
+ */
+n51station *N51ST_create(const n51pgm_pins *pins, int count, uint8_t do_reset);
+void N51ST_free(n51station *st);
+
+// Reset sequence and bit period used by every station (see N51ICP_set_reset_seq()); call before N51ST_start()
+void N51ST_set_reset_seq(n51station *st, uint32_t reset_seq, uint32_t bit_delay);
+
+/**
+ * Claims every station's pins and starts its worker. Stations whose pins can't be claimed don't start;
+ * jobs bound to them end up N51ST_NOT_RUN.
+ *
+ * @return the number of stations running
+ */
+int N51ST_start(n51station *st);
+
+/**
+ * Queues a job. May be called before or after N51ST_start().
+ *
+ * @return the job's index in the result array, or -1 on failure
+ */
+int N51ST_submit(n51station *st, const n51st_job *job);
+
+/**
+ * Waits until every queued job has run, stops the workers and releases the pins.
+ *
+ * @return the number of jobs that didn't end with N51ST_OK
+ */
+int N51ST_finish(n51station *st);
+
+// Results of all submitted jobs, by job index; valid until N51ST_free()
+const n51st_result *N51ST_results(n51station *st, int *count);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,184 @@
+/*
+ * nuvo51icp, a RPi ICP flasher for the Nuvoton N76E003
+ * https://github.com/steve-m/N76E003-playground
+ *
+ * Copyright (c) 2021 Steve Markgraf <steve@steve-m.de>
+ * Copyright (c) 2023-2024 Nikita Lita
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef ARDUINO
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "n51_sweep.h"
+#include "n51_pgm.h"
+
+static uint32_t range_count(const n51sw_range *r)
+{
+	if (r->step == 0 || r->stop <= r->start)
+		return 1;
+	return (r->stop - r->start) / r->step + 1;
+}
+
+static uint32_t range_value(const n51sw_range *r, uint32_t i)
+{
+	return r->start + i * r->step;
+}
+
+uint64_t N51SW_cell_count(const n51sw_spec *spec)
+{
+	if (spec->samples)
+		return spec->samples;
+	return (uint64_t)range_count(&spec->delay1) * range_count(&spec->delay2) *
+		range_count(&spec->delay_after_trigger_high) * range_count(&spec->delay_before_trigger_low);
+}
+
+static void put_u32(FILE *f, uint32_t v)
+{
+	uint8_t b[4] = {v & 0xFF, (v >> 8) & 0xFF, (v >> 16) & 0xFF, v >> 24};
+	fwrite(b, 1, sizeof(b), f);
+}
+
+static void put_range(FILE *f, const n51sw_range *r)
+{
+	put_u32(f, r->start);
+	put_u32(f, r->stop);
+	put_u32(f, r->step);
+}
+
+static void write_header(FILE *f, const n51sw_spec *spec)
+{
+	fwrite("N51SWEEP", 1, 8, f);
+	put_u32(f, N51SW_LOG_VERSION);
+	put_range(f, &spec->delay1);
+	put_range(f, &spec->delay2);
+	put_range(f, &spec->delay_after_trigger_high);
+	put_range(f, &spec->delay_before_trigger_low);
+	put_u32(f, spec->repeats);
+	put_u32(f, spec->samples);
+	put_u32(f, spec->seed);
+}
+
+static void write_cell(FILE *f, const n51sw_cell *c)
+{
+	put_u32(f, c->delay1);
+	put_u32(f, c->delay2);
+	put_u32(f, c->delay_after_trigger_high);
+	put_u32(f, c->delay_before_trigger_low);
+	put_u32(f, c->attempts);
+	put_u32(f, c->other);
+	put_u32(f, c->time_us);
+	fputc(c->bucket_count, f);
+	for (int i = 0; i < c->bucket_count; i++) {
+		fwrite(c->buckets[i].config, 1, CFG_FLASH_LEN, f);
+		put_u32(f, c->buckets[i].count);
+	}
+}
+
+static void count_config(n51sw_cell *c, const uint8_t *cfg)
+{
+	for (int i = 0; i < c->bucket_count; i++) {
+		if (memcmp(c->buckets[i].config, cfg, CFG_FLASH_LEN) == 0) {
+			c->buckets[i].count++;
+			return;
+		}
+	}
+	if (c->bucket_count == N51SW_MAX_BUCKETS) {
+		c->other++;
+		return;
+	}
+	memcpy(c->buckets[c->bucket_count].config, cfg, CFG_FLASH_LEN);
+	c->buckets[c->bucket_count++].count = 1;
+}
+
+static void run_cell(n51icp_ctx *ctx, n51sw_cell *c, uint32_t repeats)
+{
+	uint8_t cfg[CFG_FLASH_LEN];
+	uint64_t start = N51PGM_ctx_get_time(ctx->pgm);
+	for (uint32_t i = 0; i < repeats; i++) {
+		N51ICP_ctx_reentry_glitch_read(ctx, c->delay1, c->delay2, c->delay_after_trigger_high,
+			c->delay_before_trigger_low, cfg);
+		count_config(c, cfg);
+	}
+	c->attempts = repeats;
+	c->time_us = N51PGM_ctx_get_time(ctx->pgm) - start;
+}
+
+int64_t N51SW_run(n51icp_ctx *ctx, const n51sw_spec *spec, const char *log_path,
+	int (*cell)(const n51sw_cell *cell, void *user), void *user)
+{
+	const n51sw_range *ranges[4] = {&spec->delay1, &spec->delay2, &spec->delay_after_trigger_high,
+		&spec->delay_before_trigger_low};
+	uint32_t counts[4], idx[4];
+	if (spec->repeats == 0)
+		return -1;
+	for (int r = 0; r < 4; r++)
+		counts[r] = range_count(ranges[r]);
+
+	FILE *f = fopen(log_path, "wb");
+	if (!f) {
+		perror(log_path);
+		return -1;
+	}
+	write_header(f, spec);
+	// a state of its own, so nothing else that calls rand() changes the cells the seed picks
+	unsigned int seed = spec->seed;
+
+	uint64_t total = N51SW_cell_count(spec);
+	int64_t n;
+	for (n = 0; n < (int64_t)total; n++) {
+		if (spec->samples) {
+			for (int r = 0; r < 4; r++)
+				idx[r] = (uint32_t)rand_r(&seed) % counts[r];
+		} else {
+			// the last delay varies fastest
+			uint64_t rest = n;
+			for (int r = 3; r >= 0; r--) {
+				idx[r] = rest % counts[r];
+				rest /= counts[r];
+			}
+		}
+		n51sw_cell c;
+		memset(&c, 0, sizeof(c));
+		c.delay1 = range_value(ranges[0], idx[0]);
+		c.delay2 = range_value(ranges[1], idx[1]);
+		c.delay_after_trigger_high = range_value(ranges[2], idx[2]);
+		c.delay_before_trigger_low = range_value(ranges[3], idx[3]);
+		run_cell(ctx, &c, spec->repeats);
+		write_cell(f, &c);
+		fflush(f);
+		if (cell && cell(&c, user)) {
+			n++;
+			break;
+		}
+	}
+	if (fclose(f) != 0) {
+		perror(log_path);
+		return -1;
+	}
+	return n;
+}
+
+#endif // ARDUINO
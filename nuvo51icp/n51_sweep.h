@@ -0,0 +1,79 @@
+// Description: Reentry glitch sweep runner: runs N51ICP_ctx_reentry_glitch_read() over a parameter grid or random samples, histograms the config bytes read per cell and logs them.
+#pragma once
+
+#include <stdint.h>
+#include "n51_icp.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Every cell is one combination of the four N51ICP_ctx_reentry_glitch_read() delays, run `repeats` times
+ * back to back (no pause besides the attempt's own reset timing). The config bytes read back are counted
+ * per distinct value, up to N51SW_MAX_BUCKETS values per cell; attempts that return yet another value
+ * are counted as `other`.
+ *
+ * Cells are appended (and flushed) to the log as they complete, so it can be read while the sweep runs.
+ * All integers are little-endian:
+ *
+ *   header: "N51SWEEP", u32 version, then the spec: 4 x (u32 start, stop, step) in n51sw_spec order,
+ *           u32 repeats, u32 samples, u32 seed
+ *   cell:   u32 delay1, delay2, delay_after_trigger_high, delay_before_trigger_low, u32 attempts, u32 other,
+ *           u32 time_us (backend time the cell took), u8 bucket count n, n x (u8 config[5], u32 count)
+ *
+ * read_sweep_log() in nuvoprogpy/nuvo51icpy/lib/libnuvo51icp.py reads it back.
+ */
+
+#define N51SW_LOG_VERSION 1
+#define N51SW_MAX_BUCKETS 16
+
+typedef struct _n51sw_range {
+	uint32_t start;
+	uint32_t stop; // inclusive
+	uint32_t step; // 0: start only
+} n51sw_range;
+
+typedef struct _n51sw_spec {
+	n51sw_range delay1;
+	n51sw_range delay2;
+	n51sw_range delay_after_trigger_high;
+	n51sw_range delay_before_trigger_low;
+	uint32_t repeats; // attempts per cell
+	uint32_t samples; // 0: every cell of the grid; otherwise this many cells picked at random from it
+	uint32_t seed;    // for the random picks
+} n51sw_spec;
+
+typedef struct _n51sw_bucket {
+	uint8_t config[CFG_FLASH_LEN];
+	uint32_t count;
+} n51sw_bucket;
+
+typedef struct _n51sw_cell {
+	uint32_t delay1;
+	uint32_t delay2;
+	uint32_t delay_after_trigger_high;
+	uint32_t delay_before_trigger_low;
+	uint32_t attempts;
+	uint32_t other;
+	uint32_t time_us;
+	uint8_t bucket_count;
+	n51sw_bucket buckets[N51SW_MAX_BUCKETS];
+} n51sw_cell;
+
+// Number of cells the spec runs
+uint64_t N51SW_cell_count(const n51sw_spec *spec);
+
+/**
+ * Runs the sweep on a context that is in ICP mode, appending every cell to the log at `log_path`
+ * (truncated first). The trigger line is driven by every attempt, as in N51ICP_ctx_reentry_glitch().
+ *
+ * @param cell if not NULL, called with every completed cell; returning nonzero stops the sweep
+ * @return the number of cells run, or -1 if the spec is invalid or the log can't be written
+ */
+int64_t N51SW_run(n51icp_ctx *ctx, const n51sw_spec *spec, const char *log_path,
+	int (*cell)(const n51sw_cell *cell, void *user), void *user);
+
+#ifdef __cplusplus
+}
+#endif
@@ -18,16 +18,59 @@
 // 1: leaves Reset pin high after programming
 #define LEAVE_RESET_HIGH 0
 
-#ifdef ARDUINO_AVR_MEGA2560
-#define CACHED_ROM_READ 0
+// Flash pages kept in RAM for dumps and CRCs, PAGE_SIZE + 3 bytes each; 0 to read every packet from the chip.
+// The least recently used page is replaced, and the pages of the next dump packet are read while the current
+// one is being sent.
+// NOTE: If your sketch ends up being too big to fit on the device, you can try lowering this
+#ifndef ROM_CACHE_PAGES
+#if defined(ARDUINO_AVR_MEGA2560)
+#define ROM_CACHE_PAGES 16
+#elif defined(__AVR__)
+#define ROM_CACHE_PAGES 2
+#else
+#define ROM_CACHE_PAGES (FLASH_SIZE / PAGE_SIZE)
 #endif
-// NOTE: If your sketch ends up being too big to fit on the device, you can try setting CACHED_ROM_READ to 0
-#ifndef CACHED_ROM_READ
-#define CACHED_ROM_READ 1
 #endif
 // connection timeout in milliseconds; 0 to disable
 #define CONNECTION_TIMEOUT 0
 
+// ICP sockets besides the one on arduino.cpp's pins (socket 0), as n51pgm_pins entries ({DAT, RST, CLK, -1}).
+// CMD_SELECT_TARGET picks the socket the commands go to, or several: updates and erases are then written to all
+// of them, so a panel of boards shares one serial transfer. Up to MAX_TARGETS sockets in all.
+// #define EXTRA_TARGET_PINS {{46, 44, 42, -1}, {40, 38, 36, -1}}
+
+// Image store (CMD_STORE_IMAGE, CMD_PROGRAM_STORED): IMAGE_STORE_SLOTS updates of up to IMAGE_STORE_SLOT_SIZE bytes of
+// data each, sent once and programmed as often as needed. Kept in RAM, where it is lost when the board resets (as
+// most do when the serial port is opened), unless IMAGE_STORE_EXTERNAL is defined and the board provides
+// image_store_read() and image_store_write(), e.g. on SPI flash or an SD card. 0 slots to leave it out.
+#ifndef IMAGE_STORE_SLOTS
+#if defined(ARDUINO_AVR_MEGA2560)
+#define IMAGE_STORE_SLOTS 1
+#define IMAGE_STORE_SLOT_SIZE 2048 // compressed images only
+#elif defined(__AVR__)
+#define IMAGE_STORE_SLOTS 0
+#else
+#define IMAGE_STORE_SLOTS 1
+#endif
+#endif
+#ifndef IMAGE_STORE_SLOT_SIZE
+#define IMAGE_STORE_SLOT_SIZE FLASH_SIZE
+#endif
+
+// Updates leave runs of at least this many 0xFF bytes unprogrammed (the pages were just erased), starting a new
+// ICP write command after them instead, which costs less
+#define BLANK_RUN_MIN 4
+
+// CMD_UPDATE_STREAM: continuation packets the host may send ahead of their ACKs. They are queued as they come
+// in, also while an earlier one is being programmed, so this many packets of RAM go to the queue.
+#define STREAM_WINDOW 4
+
+// Serial rate the bridge starts at, and falls back to on disconnect
+#define DEFAULT_BAUD_RATE 115200
+// After switching rates with CMD_SET_BAUD, the host has this long (in milliseconds) to repeat the command at the
+// new rate before the bridge falls back to DEFAULT_BAUD_RATE
+#define BAUD_CONFIRM_TIMEOUT 1000
+
 #define DEBUG_VERBOSE 0
 
 #ifndef USING_32BIT_PACKNO
@@ -47,6 +90,8 @@
 #define COMMAND_STATE           4
 #define UPDATING_STATE          5
 #define DUMPING_STATE           6
+#define STREAMING_STATE         7
+#define STORING_STATE           8
 
 uint8_t state;
 unsigned char rx_buf[PACKSIZE];
@@ -58,18 +103,101 @@ uint32_t update_size = 0;
 uint16_t g_update_checksum = 0;
 int dump_addr = 0x0000;
 uint32_t dump_size = 0;
+// Ranges of the current dump, CMD_READ_ROM's only one; dump_addr and dump_size are what is left of the current one
+typedef struct {
+  uint16_t addr;
+  uint16_t size;
+} dump_range;
+dump_range dump_ranges[READ_RANGES_MAX];
+uint8_t dump_range_count = 0;
+uint8_t dump_range_next = 0;
 uint8_t cid;
 uint32_t saved_device_id;
 uint8_t connected = 0;
 uint8_t just_connected = 0;
 unsigned long last_read_time = 0;
 unsigned long curr_time = 0;
+typedef struct {
+  uint16_t checksum; // of the whole packet, for the ACK
+  uint32_t packno;
+  unsigned char data[SEQ_UPDATE_PKT_SIZE];
+} stream_pkt;
+stream_pkt stream_queue[STREAM_WINDOW];
+uint8_t stream_head = 0;
+uint8_t stream_count = 0;
+bool stream_compressed = false;
+// CMD_UPDATE_COMPRESSED decoder: the last LZ_WINDOW decoded bytes, of which lz_pending aren't programmed yet
+uint8_t lz_ring[LZ_WINDOW];
+uint8_t lz_pos = 0;
+uint8_t lz_pending = 0;
+uint8_t lz_state = 0;
+uint8_t lz_token = 0;
+uint8_t lz_left = 0;
+#define LZ_TOKEN   0
+#define LZ_LITERAL 1
+#define LZ_ARG     2
+#define LZ_FLUSH   128 // decoded bytes programmed at once
+#ifdef EXTRA_TARGET_PINS
+const n51pgm_pins extra_target_pins[] = EXTRA_TARGET_PINS;
+#define TARGET_COUNT (1 + sizeof(extra_target_pins) / sizeof(extra_target_pins[0]))
+#else
+#define TARGET_COUNT 1
+#endif
+static_assert(TARGET_COUNT <= MAX_TARGETS, "too many ICP sockets");
+n51icp_ctx *targets[TARGET_COUNT];
+uint8_t selected = 1; // CMD_SELECT_TARGET mask, bit i: socket i
+uint8_t failed = 0;   // selected sockets that dropped out of the current command
+n51icp_ctx *icp;      // the lowest selected socket, which everything is read from
+uint32_t baud_rate = DEFAULT_BAUD_RATE;
+bool baud_unconfirmed = false;
+unsigned long baud_switch_time = 0;
+// rates CMD_SET_BAUD accepts; all of them are exact on a 16 MHz AVR with U2X, unlike 115200
+const uint32_t supported_baud_rates[] = {DEFAULT_BAUD_RATE, 500000, 1000000, 2000000};
+
+#if IMAGE_STORE_SLOTS
+#define STORE_MAGIC 0x5A17
+// Starts every slot of the store, followed by the data
+typedef struct {
+  uint16_t magic;  // STORE_MAGIC once all of the data is in
+  uint8_t flags;   // STREAM_WHOLE_ROM, STORE_COMPRESSED
+  uint8_t reserved;
+  uint32_t addr;
+  uint32_t size;   // of the image
+  uint32_t length; // of the data
+  uint32_t crc;    // of the image
+} stored_image;
+#define STORE_SLOT_ADDR(slot) ((uint32_t)(slot) * (sizeof(stored_image) + IMAGE_STORE_SLOT_SIZE))
+stored_image store_header;  // of the image CMD_STORE_IMAGE is taking in
+uint32_t store_slot_addr = 0; // of the slot it goes to
+uint32_t store_left = 0;      // bytes of its data still to come
+#ifdef IMAGE_STORE_EXTERNAL
+void image_store_read(uint32_t addr, uint8_t *buf, uint16_t len);
+void image_store_write(uint32_t addr, const uint8_t *buf, uint16_t len);
+#else
+uint8_t image_store[STORE_SLOT_ADDR(IMAGE_STORE_SLOTS)];
+
+// implementation specific
+void image_store_read(uint32_t addr, uint8_t *buf, uint16_t len) {
+  memcpy(buf, &image_store[addr], len);
+}
 
-#if CACHED_ROM_READ
-byte read_buff[FLASH_SIZE];
-bool read_buff_valid = false;
-uint8_t LDROM_BUF[LDROM_MAX_SIZE];
-#define INVALIDATE_CACHE read_buff_valid = false
+// implementation specific
+void image_store_write(uint32_t addr, const uint8_t *buf, uint16_t len) {
+  memcpy(&image_store[addr], buf, len);
+}
+#endif
+#endif
+
+#if ROM_CACHE_PAGES
+#define NO_PAGE 0xFF
+typedef struct {
+  uint8_t page;       // flash page held, NO_PAGE if none
+  uint16_t last_used; // cache_tick when last read
+  uint8_t data[PAGE_SIZE];
+} cache_slot;
+cache_slot rom_cache[ROM_CACHE_PAGES];
+uint16_t cache_tick = 0;
+#define INVALIDATE_CACHE invalidate_cache(0, FLASH_SIZE)
 #else
 #define INVALIDATE_CACHE
 #endif
@@ -165,12 +293,25 @@ void disable_connect_led(){
 // implementation specific
 void setup()
 {
-  Serial.begin(115200);
+  Serial.begin(DEFAULT_BAUD_RATE);
   pinMode(BUILTIN_LED, OUTPUT);
   disable_connect_led();
   state = DISCONNECTED_STATE;
   memset(rx_buf, (uint8_t)0xFF, PACKSIZE);
   memset(tx_buf, (uint8_t)0xFF, PACKSIZE);
+#if ROM_CACHE_PAGES
+  for (int i = 0; i < ROM_CACHE_PAGES; i++)
+    rom_cache[i].page = NO_PAGE;
+#endif
+  targets[0] = N51ICP_default_ctx();
+#ifdef EXTRA_TARGET_PINS
+  for (uint8_t i = 1; i < TARGET_COUNT; i++)
+    targets[i] = N51ICP_ctx_create(&extra_target_pins[i - 1]);
+#endif
+  icp = targets[0];
+  // the host asks for the config and IDs before nearly every command
+  for (uint8_t i = 0; i < TARGET_COUNT; i++)
+    N51ICP_ctx_enable_shadow(targets[i], 1);
 
 #ifdef _DEBUG
   delay(100);
@@ -233,8 +374,7 @@ uint16_t get_checksum() {
   return checksum;
 }
 
-uint16_t package_checksum() {
-  uint16_t checksum = get_checksum();
+uint16_t package_checksum(uint16_t checksum) {
   tx_buf[0] = checksum & 0xff;
   tx_buf[1] = (checksum >> 8) & 0xff;
   tx_buf[2] = 0;
@@ -242,10 +382,7 @@ uint16_t package_checksum() {
   return checksum;
 }
 
-void prep_pkt() {
-  // populate header
-  package_checksum();
-  inc_g_packno();
+void put_packno() {
   tx_buf[4] = g_packno & 0xff;
   tx_buf[5] = (g_packno >> 8) & 0xff;
 #ifdef USING_32BIT_PACKNO
@@ -257,17 +394,163 @@ void prep_pkt() {
 #endif
 }
 
+void prep_pkt() {
+  // populate header
+  package_checksum(get_checksum());
+  inc_g_packno();
+  put_packno();
+}
+
 void send_pkt() {
   prep_pkt();
   tx_pkt();
 }
 
 
+#if ROM_CACHE_PAGES
+// Drops the cached pages that overlap the range
+void invalidate_cache(uint32_t addr, uint32_t len) {
+  for (int i = 0; i < ROM_CACHE_PAGES; i++) {
+    uint32_t page_addr = (uint32_t)rom_cache[i].page * PAGE_SIZE;
+    if (rom_cache[i].page != NO_PAGE && page_addr < addr + len && page_addr + PAGE_SIZE > addr)
+      rom_cache[i].page = NO_PAGE;
+  }
+}
+
+// Returns the slot holding the page, NULL if it isn't cached
+cache_slot *cache_find(uint8_t page) {
+  for (int i = 0; i < ROM_CACHE_PAGES; i++) {
+    if (rom_cache[i].page == page)
+      return &rom_cache[i];
+  }
+  return NULL;
+}
+
+// Returns the slot holding the page, reading it into the least recently used one if it isn't cached
+cache_slot *cache_page(uint8_t page) {
+  cache_slot *slot = cache_find(page);
+  if (!slot) {
+    slot = &rom_cache[0];
+    for (int i = 1; i < ROM_CACHE_PAGES && slot->page != NO_PAGE; i++) {
+      if (rom_cache[i].page == NO_PAGE || (uint16_t)(cache_tick - rom_cache[i].last_used) > (uint16_t)(cache_tick - slot->last_used))
+        slot = &rom_cache[i];
+    }
+    N51ICP_ctx_read_flash(icp, (uint32_t)page * PAGE_SIZE, PAGE_SIZE, slot->data);
+    slot->page = page;
+  }
+  slot->last_used = cache_tick++;
+  return slot;
+}
+#endif
+
+// Reads flash through the cache; returns the address after the last byte read
+int read_rom(int addr, int len, uint8_t *buf) {
+#if ROM_CACHE_PAGES
+  while (len > 0) {
+    int offset = addr % PAGE_SIZE;
+    int n = PAGE_SIZE - offset > len ? len : PAGE_SIZE - offset;
+    memcpy(buf, &cache_page(addr / PAGE_SIZE)->data[offset], n);
+    buf += n;
+    addr += n;
+    len -= n;
+  }
+  return addr;
+#else
+  return N51ICP_ctx_read_flash(icp, addr, len, buf);
+#endif
+}
+
+// Reads the pages the next dump packet needs, while the current one is still going out
+void prefetch_dump() {
+#if ROM_CACHE_PAGES
+  if (dump_size == 0)
+    return;
+  int last = dump_addr + (DUMP_DATA_SIZE > dump_size ? dump_size : DUMP_DATA_SIZE) - 1;
+  cache_page(dump_addr / PAGE_SIZE);
+  cache_page(last / PAGE_SIZE);
+#endif
+}
+
+// Whether socket i takes the writes of the current command
+bool target_active(uint8_t i) {
+  return (selected & ~failed) & (1 << i);
+}
+
+int write_flash(int addr, int len, uint8_t *data) {
+#if ROM_CACHE_PAGES
+  invalidate_cache(addr, len);
+#endif
+  for (uint8_t i = 0; i < TARGET_COUNT; i++) {
+    if (target_active(i))
+      N51ICP_ctx_write_flash(targets[i], addr, len, data);
+  }
+  return addr + len;
+}
+
+// Programs the bytes that aren't 0xFF into erased flash, leaving out runs of BLANK_RUN_MIN or more;
+// returns the address after the last byte
+int write_nonblank(int addr, int len, uint8_t *data) {
+  int start = 0; // first byte not programmed or left out yet
+  int i = 0;
+  while (i < len) {
+    if (data[i] != 0xFF) {
+      i++;
+      continue;
+    }
+    int run_end = i;
+    while (run_end < len && data[run_end] == 0xFF)
+      run_end++;
+    if (run_end - i >= BLANK_RUN_MIN || run_end == len) {
+      if (i > start)
+        write_flash(addr + start, i - start, &data[start]);
+      start = run_end;
+    }
+    i = run_end;
+  }
+  if (len > start)
+    write_flash(addr + start, len - start, &data[start]);
+  return addr + len;
+}
+
+// Whether the page is already erased; reads it a few bytes at a time up to the first one that isn't 0xFF
+bool page_blank(n51icp_ctx *ctx, uint32_t addr) {
+  uint8_t chunk[16];
+  addr &= ~(uint32_t)(PAGE_SIZE - 1);
+#if ROM_CACHE_PAGES
+  cache_slot *slot = ctx == icp ? cache_find(addr / PAGE_SIZE) : NULL;
+  if (slot) {
+    for (int i = 0; i < PAGE_SIZE; i++) {
+      if (slot->data[i] != 0xFF)
+        return false;
+    }
+    return true;
+  }
+#endif
+  for (int offset = 0; offset < PAGE_SIZE; offset += sizeof(chunk)) {
+    N51ICP_ctx_read_flash(ctx, addr + offset, sizeof(chunk), chunk);
+    for (uint8_t i = 0; i < sizeof(chunk); i++) {
+      if (chunk[i] != 0xFF)
+        return false;
+    }
+  }
+  return true;
+}
+
+void page_erase(uint32_t addr) {
+#if ROM_CACHE_PAGES
+  invalidate_cache(addr & ~(uint32_t)(PAGE_SIZE - 1), PAGE_SIZE);
+#endif
+  for (uint8_t i = 0; i < TARGET_COUNT; i++) {
+    if (target_active(i))
+      N51ICP_ctx_page_erase(targets[i], addr);
+  }
+}
+
 void update(unsigned char* data, int len)
 {
   int n = len > update_size ? update_size : len;
   DEBUG_PRINT("writing %d bytes to flash at addr 0x%04x\n", n, update_addr);
-  update_addr = N51ICP_write_flash(update_addr, n, data);
+  update_addr = write_nonblank(update_addr, n, data);
   // update the checksum
   for (int i = 0; i < n; i++)
     g_update_checksum += data[i];
@@ -275,33 +558,30 @@ void update(unsigned char* data, int len)
 }
 
 
+// Moves on to the next range that isn't empty once the current one is out; dump_size stays 0 after the last one
+void next_dump_range() {
+  while (dump_size == 0 && dump_range_next < dump_range_count) {
+    dump_addr = dump_ranges[dump_range_next].addr;
+    dump_size = dump_ranges[dump_range_next].size;
+    dump_range_next++;
+  }
+}
+
+// Fills a packet with the next bytes of the dump, across ranges
 void dump()
 {
   unsigned char * data_buf = tx_buf + DUMP_DATA_START;
-  int n = DUMP_DATA_SIZE > dump_size ? dump_size : DUMP_DATA_SIZE;
+  uint32_t filled = 0;
 
   // uint16_t checksum = 0;
 
-#if CACHED_ROM_READ
-  // hack to make reads faster
-  if (!read_buff_valid) {
-    DEBUG_PRINT("Caching rom...\n");
-    // we're going to read the entire thing into memory
-    int read_addr = 0;
-    // dump x bytes at a time
-#define READ_CHUNK FLASH_SIZE
-    for (read_addr = 0; read_addr < FLASH_SIZE; read_addr += READ_CHUNK){
-      N51ICP_read_flash(read_addr, READ_CHUNK, &read_buff[read_addr]);
-      delayMicroseconds(1);
-    }
-    read_buff_valid = true;
+  while (filled < DUMP_DATA_SIZE && dump_size > 0) {
+    uint32_t n = DUMP_DATA_SIZE - filled > dump_size ? dump_size : DUMP_DATA_SIZE - filled;
+    dump_addr = read_rom(dump_addr, n, data_buf + filled);
+    dump_size -= n;
+    filled += n;
+    next_dump_range();
   }
-  memcpy(data_buf, &read_buff[dump_addr], n);
-  dump_addr += n;
-#else
-  dump_addr = N51ICP_read_flash(dump_addr, n, data_buf);
-#endif
-  dump_size -= n;
 }
 
 
@@ -330,6 +610,15 @@ const char * cmd_enum_to_string(int cmd)
     case CMD_GET_UCID: return "CMD_GET_UCID";
     case CMD_ISP_PAGE_ERASE: return "CMD_ISP_PAGE_ERASE";
     case CMD_ISP_MASS_ERASE: return "CMD_ISP_MASS_ERASE";
+    case CMD_SET_BAUD: return "CMD_SET_BAUD";
+    case CMD_UPDATE_STREAM: return "CMD_UPDATE_STREAM";
+    case CMD_UPDATE_COMPRESSED: return "CMD_UPDATE_COMPRESSED";
+    case CMD_CRC32_RANGE: return "CMD_CRC32_RANGE";
+    case CMD_READ_RANGES: return "CMD_READ_RANGES";
+    case CMD_SELECT_TARGET: return "CMD_SELECT_TARGET";
+    case CMD_STORE_IMAGE: return "CMD_STORE_IMAGE";
+    case CMD_PROGRAM_STORED: return "CMD_PROGRAM_STORED";
+    case CMD_STORE_INFO: return "CMD_STORE_INFO";
     default: return "UNKNOWN";
   }
 }
@@ -344,87 +633,254 @@ void fail_pkt(){
   tx_pkt();
 }
 
-bool mass_erase_checked(bool check_device_id = false){
+// Fails the command if every selected socket has dropped out of it
+bool check_targets_left() {
+  if (selected & ~failed)
+    return true;
+  DEBUG_PRINT("No socket left\n");
+  fail_pkt();
+  return false;
+}
+
+void put_failed_targets() {
+  tx_buf[TARGET_FAILED_OFFSET] = failed;
+}
+
+// Mass erases the selected sockets in `mask`; with check_device_id, those whose device doesn't answer afterwards
+// drop out of the command. Returns false, having failed the packet, if no socket is left.
+bool mass_erase_checked(uint8_t mask, bool check_device_id = false){
   INVALIDATE_CACHE;
-  uint8_t cid = N51ICP_read_cid();
-  N51ICP_mass_erase();
-  N51PGM_usleep(500000); // half a second
-  if (cid == 0xFF || cid == 0x00){
-    N51ICP_reentry(5000, 1000, 10);
-  }
-  if (check_device_id){
-    uint32_t devid = N51ICP_read_device_id();
-    if (devid != N76E003_DEVID){
-      N51ICP_reentry(5000, 1000, 10);
-      if (devid != N76E003_DEVID) {
-        DEBUG_PRINT("Failed to find device after mass erase! failing...\n");
-        fail_pkt();
-        return false;
+  uint8_t cids[TARGET_COUNT];
+  for (uint8_t i = 0; i < TARGET_COUNT; i++) {
+    if (!target_active(i) || !(mask & (1 << i)))
+      continue;
+    cids[i] = N51ICP_ctx_read_cid(targets[i]);
+    N51ICP_ctx_mass_erase(targets[i]);
+  }
+  N51PGM_ctx_usleep(icp->pgm, 500000); // half a second, for all of them at once
+  for (uint8_t i = 0; i < TARGET_COUNT; i++) {
+    if (!target_active(i) || !(mask & (1 << i)))
+      continue;
+    n51icp_ctx *ctx = targets[i];
+    if (cids[i] == 0xFF || cids[i] == 0x00){
+      N51ICP_ctx_reentry(ctx, 5000, 1000, 10);
+    }
+    if (check_device_id){
+      uint32_t devid = N51ICP_ctx_read_device_id(ctx);
+      if (devid != N76E003_DEVID){
+        N51ICP_ctx_reentry(ctx, 5000, 1000, 10);
+        devid = N51ICP_ctx_read_device_id(ctx);
+        if (devid != N76E003_DEVID) {
+          DEBUG_PRINT("Failed to find device %d after mass erase!\n", i);
+          failed |= 1 << i;
+        }
       }
     }
   }
-  return true;
+  return check_targets_left();
 }
 
 
-void read_config(config_flags *flags) {
-  N51ICP_read_flash(CFG_FLASH_ADDR, CFG_FLASH_LEN, (uint8_t *)flags);
+void read_config(n51icp_ctx *ctx, config_flags *flags) {
+  N51ICP_ctx_read_flash(ctx, CFG_FLASH_ADDR, CFG_FLASH_LEN, (uint8_t *)flags);
 }
 int get_ldrom_size(config_flags *flags){
   return (flags->LDS < 3 ? 4 : (7 - flags->LDS)) * 1024;
 }
 
-int read_ldrom_size() {
+int read_ldrom_size(n51icp_ctx *ctx) {
   config_flags flags;
-  read_config(&flags);
+  read_config(ctx, &flags);
   return get_ldrom_size(&flags);
 }
 
-void start_dump(int addr, int size){
+// Fails the command if the flash can't be read
+bool check_readable(){
   config_flags flags;
-  read_config(&flags);
-  uint8_t cid = N51ICP_read_cid();
+  read_config(icp, &flags);
+  uint8_t cid = N51ICP_ctx_read_cid(icp);
   if (cid == 0xFF || cid == 0x00){
     // attempt reentry if lock bit is unlocked
     if (flags.LOCK == 1) {
-      N51ICP_reentry(5000, 1000, 10);
-      cid = N51ICP_read_cid(); 
+      N51ICP_ctx_reentry(icp, 5000, 1000, 10);
+      cid = N51ICP_ctx_read_cid(icp); 
     }
     if (cid == 0xFF || cid == 0x00) {
       DEBUG_PRINT("Device is locked, cannot dump\n");
       DEBUG_PRINT("CID is 0x%02x\n", cid);
       DEBUG_PRINT("LOCK bit = %d (%s)\n", flags.LOCK, flags.LOCK ? "unlocked" : "locked");
       fail_pkt();
-      return;
+      return false;
     }
   }
   if (flags.LOCK == 0) {
     DEBUG_PRINT("WARNING: lock bit is locked, but cid indicates still in an unlocked state, attempting dump anyway...\n");
   }
+  return true;
+}
+
+// Dumps the dump_range_count ranges in dump_ranges
+void start_dump_ranges(){
+  if (!check_readable())
+    return;
+  dump_size = 0;
+  dump_range_next = 0;
+  next_dump_range();
 
-  dump_addr = addr;
-  dump_size = size;
-  
   dump();
   if (dump_size > 0)
     state = DUMPING_STATE;
   send_pkt();
+  prefetch_dump();
+}
+
+void start_dump(int addr, int size){
+  dump_ranges[0].addr = addr;
+  dump_ranges[0].size = size;
+  dump_range_count = 1;
+  start_dump_ranges();
+}
+
+// CMD_READ_RANGES: takes the ranges from rx_buf
+void read_ranges(){
+  uint8_t count = rx_buf[8];
+  if (count == 0 || count > READ_RANGES_MAX) {
+    fail_pkt();
+    return;
+  }
+  for (uint8_t i = 0; i < count; i++) {
+    dump_ranges[i].addr = rx_buf[12 + 4 * i] | (rx_buf[13 + 4 * i] << 8);
+    dump_ranges[i].size = rx_buf[14 + 4 * i] | (rx_buf[15 + 4 * i] << 8);
+    if ((uint32_t)dump_ranges[i].addr + dump_ranges[i].size > FLASH_SIZE) {
+      fail_pkt();
+      return;
+    }
+  }
+  dump_range_count = count;
+  start_dump_ranges();
+}
+
+// CRC-32 as zlib's crc32(), bitwise: a table would cost 1 KB of RAM
+uint32_t crc32_update(uint32_t crc, const uint8_t *data, int len) {
+  crc = ~crc;
+  for (int i = 0; i < len; i++) {
+    crc ^= data[i];
+    for (uint8_t bit = 0; bit < 8; bit++)
+      crc = (crc >> 1) ^ (0xEDB88320UL & (0 - (crc & 1)));
+  }
+  return ~crc;
+}
+
+// Replies with the CRC-32 of every `block` bytes of the range, so the host can verify without dumping it
+void crc_range(int addr, uint32_t size, uint32_t block) {
+  if (block == 0)
+    block = size;
+  if (size == 0 || addr + size > FLASH_SIZE || (size + block - 1) / block > CRC_RANGE_MAX_BLOCKS) {
+    fail_pkt();
+    return;
+  }
+  if (!check_readable())
+    return;
+  unsigned char *out = tx_buf + DUMP_DATA_START;
+  while (size > 0) {
+    uint32_t left = block > size ? size : block;
+    uint32_t crc = 0;
+    size -= left;
+    uint8_t chunk[DUMP_DATA_SIZE];
+    while (left > 0) {
+      int n = left > DUMP_DATA_SIZE ? DUMP_DATA_SIZE : left;
+      addr = read_rom(addr, n, chunk);
+      crc = crc32_update(crc, chunk, n);
+      left -= n;
+    }
+    *out++ = crc & 0xff;
+    *out++ = (crc >> 8) & 0xff;
+    *out++ = (crc >> 16) & 0xff;
+    *out++ = (crc >> 24) & 0xff;
+  }
+  send_pkt();
+}
+
+// Points the commands at the sockets in `mask`; reads go to the lowest one
+void select_targets(uint8_t mask) {
+  selected = mask;
+  for (uint8_t i = TARGET_COUNT; i-- > 0;) {
+    if (mask & (1 << i))
+      icp = targets[i];
+  }
+  // the cached pages are the previous socket's
+  INVALIDATE_CACHE;
+}
+
+// CRC-32 of a range of one socket's flash, read past the cache
+uint32_t crc_flash(n51icp_ctx *ctx, uint32_t addr, uint32_t len) {
+  uint8_t chunk[DUMP_DATA_SIZE];
+  uint32_t crc = 0;
+  while (len > 0) {
+    uint32_t n = len > sizeof(chunk) ? sizeof(chunk) : len;
+    N51ICP_ctx_read_flash(ctx, addr, n, chunk);
+    crc = crc32_update(crc, chunk, n);
+    addr += n;
+    len -= n;
+  }
+  return crc;
 }
 
 void reset_buf() {
   rx_bufhead = 0;
 }
+
+// implementation specific
+void set_baud_rate(uint32_t rate) {
+  Serial.flush(); // let the last reply go out at the old rate
+  Serial.end();
+  Serial.begin(rate);
+  baud_rate = rate;
+  reset_buf();
+}
+
+bool is_supported_baud_rate(uint32_t rate) {
+  for (unsigned int i = 0; i < sizeof(supported_baud_rates) / sizeof(supported_baud_rates[0]); i++) {
+    if (supported_baud_rates[i] == rate)
+      return true;
+  }
+  return false;
+}
+
+void fall_back_to_default_baud_rate() {
+  baud_unconfirmed = false;
+  if (baud_rate != DEFAULT_BAUD_RATE) {
+    DEBUG_PRINT("Falling back to %lu baud\n", (unsigned long)DEFAULT_BAUD_RATE);
+    set_baud_rate(DEFAULT_BAUD_RATE);
+  }
+}
+
 void reset_conn() {
   DEBUG_PRINT("Disconnecting...\n");
   if (state > WAITING_FOR_CONNECT_CMD) {
     disable_connect_led();
-    N51ICP_exit();
-    N51PGM_deinit(LEAVE_RESET_HIGH);
+    for (uint8_t i = 0; i < TARGET_COUNT; i++) {
+      N51ICP_ctx_exit(targets[i]);
+      N51PGM_ctx_deinit(targets[i]->pgm, LEAVE_RESET_HIGH);
+    }
   }
   state = DISCONNECTED_STATE;
+  // the next host starts out at the default rate
+  fall_back_to_default_baud_rate();
 }
 
 
+uint32_t get_u32(const unsigned char *buf) {
+  return buf[0] | ((uint32_t)buf[1] << 8) | ((uint32_t)buf[2] << 16) | ((uint32_t)buf[3] << 24);
+}
+
+void put_u32(unsigned char *buf, uint32_t val) {
+  buf[0] = val & 0xff;
+  buf[1] = (val >> 8) & 0xff;
+  buf[2] = (val >> 16) & 0xff;
+  buf[3] = (val >> 24) & 0xff;
+}
+
 void add_g_total_checksum(){
   // Specification is unclear about how long the checksum is supposed to be; we assume 16-bit
   tx_buf[8] = g_update_checksum & 0xff;
@@ -433,37 +889,330 @@ void add_g_total_checksum(){
   tx_buf[11] = 0;
 }
 
+// Reads a byte into rx_buf; returns true once it completes a packet
+bool receive_byte() {
+  int tmp = Serial.read();
+  rx_buf[rx_bufhead++] = tmp;
+  last_read_time = millis(); // the packet timeout runs from the last byte, not the last packet
+  if (state == DISCONNECTED_STATE) {
+    if (tmp != CMD_CONNECT){
+      DEBUG_PRINT("NOCONN: %d\n", tmp);
+      reset_buf();
+      return false;
+    }
+    state = CONNECTING_STATE;
+  } else if (state == CONNECTING_STATE) {
+    if (rx_bufhead < 5) {
+      if (tmp != 0){
+        DEBUG_PRINT("0NOT\n");
+        state = DISCONNECTED_STATE;
+        reset_buf();
+        return false;
+      }
+    } else {
+      state = WAITING_FOR_CONNECT_CMD;
+    }
+  }
+  return rx_bufhead == PACKSIZE;
+}
+
+// Queues the continuation packet in rx_buf for stream_update()
+void stream_push() {
+  stream_pkt *pkt = &stream_queue[(stream_head + stream_count) % STREAM_WINDOW];
+  pkt->checksum = get_checksum();
+  pkt->packno = rx_buf[4] | ((uint32_t)rx_buf[5] << 8) | ((uint32_t)rx_buf[6] << 16) | ((uint32_t)rx_buf[7] << 24);
+  memcpy(pkt->data, &rx_buf[8], SEQ_UPDATE_PKT_SIZE);
+  stream_count++;
+  reset_buf();
+}
+
+// Moves whatever the UART has received into rx_buf without blocking, queueing complete continuation packets;
+// the N51ICP write hook while a stream packet is programmed
+void drain_serial(void *user) {
+  (void)user;
+  while (true) {
+    if (rx_bufhead == PACKSIZE) {
+      // anything but a continuation packet is left to loop()
+      if (stream_count == STREAM_WINDOW || rx_buf[0] != CMD_FORMAT2_CONTINUATION)
+        return;
+      stream_push();
+    }
+    if (!Serial.available())
+      return;
+    rx_buf[rx_bufhead++] = Serial.read();
+    last_read_time = millis();
+  }
+}
+
 bool check_packet_timeout(){
   return curr_time - last_read_time > 500;
 }
 
-void loop()
-{
-  curr_time = millis();
-  if (Serial.available()) {
-    int tmp = Serial.read();
-    rx_buf[rx_bufhead++] = tmp;
-    if (state == DISCONNECTED_STATE) {
-      if (tmp != CMD_CONNECT){
-        DEBUG_PRINT("NOCONN: %d\n", tmp);
-        reset_buf();
-        return;
-      }
-      state = CONNECTING_STATE;
-    } else if (state == CONNECTING_STATE) {
-      if (rx_bufhead < 5) {
-        if (tmp != 0){
-          DEBUG_PRINT("0NOT\n");
-          state = DISCONNECTED_STATE;
-          reset_buf();
-          return;
+// Sets up an update and erases what it will write: everything for CMD_UPDATE_WHOLE_ROM, the pages written for
+// CMD_UPDATE_APROM (everything if the chip is locked). Returns false if the packet has been failed.
+bool begin_update(int addr, uint32_t size, bool whole_rom) {
+  g_update_checksum = 0;
+  update_addr = addr;
+  update_size = size;
+  DEBUG_PRINT("updating %d bytes at addr 0x%04x\n", update_size, update_addr);
+  if (update_size == 0){
+    fail_pkt();
+    return false;
+  }
+  if (whole_rom)
+    return mass_erase_checked(selected, true);
+  uint8_t locked = 0;
+  for (uint8_t i = 0; i < TARGET_COUNT; i++) {
+    if (!target_active(i))
+      continue;
+    n51icp_ctx *ctx = targets[i];
+    config_flags flags;
+    read_config(ctx, &flags);
+    uint8_t cid = N51ICP_ctx_read_cid(ctx);
+    // Specification states that we need to erase the aprom when we receive this command
+    if (flags.LOCK != 0 && cid != 0xFF) {
+      // device is not locked, we need to erase only the areas we're going to write to, unless they already are
+      uint16_t start_addr = update_addr & PAGE_MASK;
+      uint16_t end_addr = update_addr + update_size;
+      for (uint16_t curr_addr = start_addr; curr_addr < end_addr; curr_addr += PAGE_SIZE){
+        if (!page_blank(ctx, curr_addr)) {
+#if ROM_CACHE_PAGES
+          if (ctx == icp)
+            invalidate_cache(curr_addr, PAGE_SIZE);
+#endif
+          N51ICP_ctx_page_erase(ctx, curr_addr);
         }
+      }
+    } else {
+      locked |= 1 << i;
+    }
+  }
+  // locked devices need a mass erase
+  if (locked)
+    return mass_erase_checked(locked, true);
+  return true;
+}
+
+// begin_update() with the address and size in rx_buf
+bool start_update(bool whole_rom) {
+  return begin_update((rx_buf[9] << 8) | rx_buf[8], (rx_buf[13] << 8) | rx_buf[12], whole_rom);
+}
+
+void lz_reset() {
+  memset(lz_ring, 0xFF, LZ_WINDOW);
+  lz_pos = 0;
+  lz_pending = 0;
+  lz_state = LZ_TOKEN;
+}
+
+// Programs the decoded bytes still in the ring
+void lz_flush() {
+  uint8_t start = lz_pos - lz_pending;
+  if (start + lz_pending > LZ_WINDOW) {
+    update(&lz_ring[start], LZ_WINDOW - start);
+    update(lz_ring, lz_pos);
+  } else if (lz_pending > 0) {
+    update(&lz_ring[start], lz_pending);
+  }
+  lz_pending = 0;
+}
+
+void lz_put(uint8_t b) {
+  lz_ring[lz_pos++] = b;
+  if (++lz_pending == LZ_FLUSH)
+    lz_flush();
+}
+
+// A run of 0xFF: the pages are erased, so only the address and checksum move on
+void lz_skip(uint16_t n) {
+  lz_flush();
+  for (uint16_t i = 0; i < n && i < LZ_WINDOW; i++)
+    lz_ring[(uint8_t)(lz_pos + i)] = 0xFF;
+  lz_pos += n;
+  if (n > update_size)
+    n = update_size;
+  update_addr += n;
+  update_size -= n;
+  g_update_checksum += (uint16_t)(0xFFUL * n);
+}
+
+// Decodes (and programs) a packet of CMD_UPDATE_COMPRESSED tokens
+void lz_decode(const unsigned char *data, int len) {
+  for (int i = 0; i < len; i++) {
+    uint8_t b = data[i];
+    if (lz_state == LZ_TOKEN) {
+      lz_token = b;
+      if (b < 0x80) {
+        lz_left = b + 1;
+        lz_state = LZ_LITERAL;
       } else {
-        state = WAITING_FOR_CONNECT_CMD;
+        lz_state = LZ_ARG;
+      }
+    } else if (lz_state == LZ_LITERAL) {
+      lz_put(b);
+      if (--lz_left == 0)
+        lz_state = LZ_TOKEN;
+    } else {
+      lz_state = LZ_TOKEN;
+      if (lz_token < 0xC0) {
+        lz_skip((((uint16_t)lz_token & 0x3F) << 8 | b) + 1);
+      } else {
+        uint8_t from = lz_pos - b - 1;
+        for (uint8_t n = (lz_token & 0x3F) + 3; n > 0; n--)
+          lz_put(lz_ring[from++]);
       }
     }
+  }
+  lz_flush();
+}
+
+// Programs the continuation packet in rx_buf and every one that comes in meanwhile. Each is acknowledged once it
+// is written, with its checksum and number + 1 (the host numbers the packets it sends ahead), the running
+// checksum and the bytes still to come.
+void stream_update() {
+  stream_push();
+  for (uint8_t i = 0; i < TARGET_COUNT; i++)
+    targets[i]->write_hook = drain_serial;
+  while (stream_count > 0) {
+    stream_pkt *pkt = &stream_queue[stream_head];
+    if (stream_compressed)
+      lz_decode(pkt->data, SEQ_UPDATE_PKT_SIZE);
+    else
+      update(pkt->data, SEQ_UPDATE_PKT_SIZE);
+    package_checksum(pkt->checksum);
+    g_packno = pkt->packno + 1;
+    put_packno();
+    add_g_total_checksum();
+    put_failed_targets();
+    tx_buf[12] = update_size & 0xff;
+    tx_buf[13] = (update_size >> 8) & 0xff;
+    tx_buf[14] = (update_size >> 16) & 0xff;
+    tx_buf[15] = (update_size >> 24) & 0xff;
+    tx_pkt();
+    stream_head = (stream_head + 1) % STREAM_WINDOW;
+    stream_count--;
+    drain_serial(NULL);
+  }
+  for (uint8_t i = 0; i < TARGET_COUNT; i++)
+    targets[i]->write_hook = NULL;
+}
+
+#if IMAGE_STORE_SLOTS
+// Sets up CMD_STORE_IMAGE from rx_buf; the slot is emptied until all of the data is in
+void start_store() {
+  uint8_t slot = rx_buf[17];
+  store_header.magic = 0;
+  store_header.flags = rx_buf[16];
+  store_header.reserved = 0;
+  store_header.addr = get_u32(&rx_buf[8]);
+  store_header.size = get_u32(&rx_buf[12]);
+  store_header.length = get_u32(&rx_buf[20]);
+  store_header.crc = get_u32(&rx_buf[24]);
+  DEBUG_PRINT("storing %lu bytes in slot %d\n", (unsigned long)store_header.length, slot);
+  if (slot >= IMAGE_STORE_SLOTS || store_header.size == 0 || store_header.addr + store_header.size > FLASH_SIZE ||
+      store_header.length == 0 || store_header.length > IMAGE_STORE_SLOT_SIZE) {
+    fail_pkt();
+    return;
+  }
+  image_store_write(STORE_SLOT_ADDR(slot), (uint8_t *)&store_header, sizeof(store_header));
+  store_header.magic = STORE_MAGIC;
+  store_slot_addr = STORE_SLOT_ADDR(slot);
+  store_left = store_header.length;
+  g_update_checksum = 0;
+  put_u32(&tx_buf[8], IMAGE_STORE_SLOT_SIZE);
+  state = STORING_STATE;
+  send_pkt();
+}
+
+// Stores the data of a CMD_STORE_IMAGE continuation packet, completing the slot with the last one
+void store_data(unsigned char *data, int len) {
+  int n = (uint32_t)len > store_left ? store_left : len;
+  image_store_write(store_slot_addr + sizeof(store_header) + store_header.length - store_left, data, n);
+  for (int i = 0; i < n; i++)
+    g_update_checksum += data[i];
+  store_left -= n;
+  if (store_left == 0)
+    image_store_write(store_slot_addr, (uint8_t *)&store_header, sizeof(store_header));
+}
 
-    if (rx_bufhead < PACKSIZE) {
+// Replies with the CMD_STORE_IMAGE request that filled the slot
+void store_info(uint8_t slot) {
+  stored_image img;
+  if (slot >= IMAGE_STORE_SLOTS) {
+    fail_pkt();
+    return;
+  }
+  image_store_read(STORE_SLOT_ADDR(slot), (uint8_t *)&img, sizeof(img));
+  if (img.magic != STORE_MAGIC)
+    memset(&img, 0, sizeof(img));
+  put_u32(&tx_buf[8], img.addr);
+  put_u32(&tx_buf[12], img.size);
+  tx_buf[16] = img.flags;
+  tx_buf[17] = slot;
+  tx_buf[18] = 0;
+  tx_buf[19] = 0;
+  put_u32(&tx_buf[20], img.length);
+  put_u32(&tx_buf[24], img.crc);
+  put_u32(&tx_buf[28], IMAGE_STORE_SLOTS);
+  put_u32(&tx_buf[32], IMAGE_STORE_SLOT_SIZE);
+  send_pkt();
+}
+
+// Programs the update in the slot into the selected sockets, as if it had come over the serial port, and checks
+// the CRC-32 of the image on each
+void program_stored(uint8_t slot) {
+  stored_image img;
+  if (slot >= IMAGE_STORE_SLOTS) {
+    fail_pkt();
+    return;
+  }
+  image_store_read(STORE_SLOT_ADDR(slot), (uint8_t *)&img, sizeof(img));
+  if (img.magic != STORE_MAGIC) {
+    DEBUG_PRINT("slot %d is empty\n", slot);
+    fail_pkt();
+    return;
+  }
+  if (!begin_update(img.addr, img.size, img.flags & STREAM_WHOLE_ROM))
+    return;
+  if (img.flags & STORE_COMPRESSED)
+    lz_reset();
+  uint8_t chunk[SEQ_UPDATE_PKT_SIZE];
+  uint32_t addr = STORE_SLOT_ADDR(slot) + sizeof(img);
+  for (uint32_t left = img.length; left > 0;) {
+    uint16_t n = left > sizeof(chunk) ? sizeof(chunk) : left;
+    image_store_read(addr, chunk, n);
+    if (img.flags & STORE_COMPRESSED)
+      lz_decode(chunk, n);
+    else
+      update(chunk, n);
+    addr += n;
+    left -= n;
+  }
+  uint8_t mismatch = 0;
+  for (uint8_t i = 0; i < TARGET_COUNT; i++) {
+    if (target_active(i) && crc_flash(targets[i], img.addr, img.size) != img.crc)
+      mismatch |= 1 << i;
+  }
+  add_g_total_checksum();
+  tx_buf[12] = mismatch;
+  tx_buf[13] = 0;
+  tx_buf[14] = 0;
+  tx_buf[15] = 0;
+  put_failed_targets();
+  send_pkt();
+}
+#endif
+
+void loop()
+{
+  curr_time = millis();
+  if (baud_unconfirmed && curr_time - baud_switch_time > BAUD_CONFIRM_TIMEOUT) {
+    DEBUG_PRINT("No packet at the new rate\n");
+    fall_back_to_default_baud_rate();
+  }
+  // a stream packet may already be complete, drained while the previous one was being programmed
+  if (rx_bufhead == PACKSIZE || Serial.available()) {
+    if (rx_bufhead < PACKSIZE && !receive_byte()) {
       return;
     }
     DEBUG_PRINT("received packet\n");
@@ -478,7 +1227,6 @@ void loop()
     DEBUG_PRINT("\n");
 #endif
     
-    uint8_t cid;
     uint32_t devid;
     uint8_t cmd = rx_buf[0];
     uint32_t seqno = (rx_buf[5] << 8) | rx_buf[4];
@@ -488,6 +1236,16 @@ void loop()
 
     DEBUG_PRINT("received %d-byte packet, %s (0x%02x), seqno 0x%04x, checksum 0x%04x\n", PACKSIZE, cmd_enum_to_string(cmd), cmd, seqno, get_checksum());
 
+    if (baud_unconfirmed) {
+      // The first packet at the new rate has to repeat the CMD_SET_BAUD; anything else is the host failing to
+      // talk at it (or the garbage it turned into), so go back to the rate the host falls back to as well
+      baud_unconfirmed = false;
+      if (cmd != CMD_SET_BAUD || get_u32(&rx_buf[8]) != baud_rate) {
+        fall_back_to_default_baud_rate();
+        return;
+      }
+    }
+
 #if CHECK_SEQUENCE_NO
     if (g_packno != seqno && cmd != CMD_SYNC_PACKNO && cmd != CMD_CONNECT)
     {
@@ -500,23 +1258,45 @@ void loop()
     if (state == WAITING_FOR_SYNCNO && cmd != CMD_SYNC_PACKNO && cmd != CMD_CONNECT) {
       // No syncno command, just skip to command state
       state = COMMAND_STATE;
-    } else if ((state == DUMPING_STATE || state == UPDATING_STATE) && cmd != CMD_FORMAT2_CONTINUATION) {
+    } else if ((state == DUMPING_STATE || state == UPDATING_STATE || state == STREAMING_STATE || state == STORING_STATE) &&
+               cmd != CMD_FORMAT2_CONTINUATION) {
       state = COMMAND_STATE;
+    } else if (state == STREAMING_STATE) {
+      stream_update();
+      if (update_size == 0) {
+        state = COMMAND_STATE;
+      }
+      return;
     } else if (state == DUMPING_STATE) {
       dump();
       if (dump_size == 0)
         state = COMMAND_STATE;
       send_pkt();
+      prefetch_dump();
+      return;
+#if IMAGE_STORE_SLOTS
+    } else if (state == STORING_STATE) {
+      store_data(&rx_buf[8], SEQ_UPDATE_PKT_SIZE);
+      if (store_left == 0) {
+        state = COMMAND_STATE;
+      }
+      add_g_total_checksum();
+      put_u32(&tx_buf[12], store_left);
+      send_pkt();
       return;
+#endif
     } else if (state == UPDATING_STATE) {
       update(&rx_buf[8], SEQ_UPDATE_PKT_SIZE);
       if (update_size == 0) {
         state = COMMAND_STATE;
       }
       add_g_total_checksum();
+      put_failed_targets();
       send_pkt();
       return;
     }
+    // every socket selected takes part in the new command
+    failed = 0;
     switch (cmd) {
       case CMD_CONNECT:
         {
@@ -525,7 +1305,10 @@ void loop()
           INVALIDATE_CACHE;
           if (state == WAITING_FOR_CONNECT_CMD) {
             state = WAITING_FOR_SYNCNO;
-            N51ICP_init(true);
+            for (uint8_t i = 0; i < TARGET_COUNT; i++)
+              N51ICP_ctx_init(targets[i], true);
+            // standard ISP tools only know socket 0
+            select_targets(1);
             enable_connect_led();
           } else if (state == WAITING_FOR_SYNCNO) {
             // Don't send back a packet if we just connected and are waiting for syncno
@@ -544,7 +1327,7 @@ void loop()
         break;
       case CMD_GET_FLASHMODE:
         DEBUG_PRINT("CMD_GET_FLASHMODE\n");
-        read_config(&flags);
+        read_config(icp, &flags);
         if (flags.CBS == 1){
           tx_buf[8] = APMODE;
         } else {
@@ -577,7 +1360,7 @@ void loop()
       case CMD_GET_CID:
         {
         DEBUG_PRINT("CMD_GET_CID\n");
-        uint8_t id = N51ICP_read_cid();
+        uint8_t id = N51ICP_ctx_read_cid(icp);
         DEBUG_PRINT("received cid of 0x%02x\n", id);
         tx_buf[8] = id;
         tx_buf[9] = 0;
@@ -587,7 +1370,7 @@ void loop()
         } break;
       case CMD_GET_UID:
         {
-        N51ICP_read_uid(&tx_buf[8]);
+        N51ICP_ctx_read_uid(icp, &tx_buf[8]);
         DEBUG_PRINT("received uid of ");
         DEBUG_PRINT_BYTEARR(&tx_buf[8], 12);
         send_pkt();
@@ -598,14 +1381,14 @@ void loop()
         // DEBUG_PRINT("received ucid of 0x%08x\n", id);
         // for (int i = 0; i < 16; i++)
         //   rx_buf[8 + i] = (id >> (i * 8)) & 0xff;
-        N51ICP_read_ucid(&tx_buf[8]);
+        N51ICP_ctx_read_ucid(icp, &tx_buf[8]);
         DEBUG_PRINT("received ucid of ");
         DEBUG_PRINT_BYTEARR(&tx_buf[8], 16);
         send_pkt();
         } break;
       case CMD_GET_DEVICEID:
         {
-        uint32_t id = N51ICP_read_device_id();
+        uint32_t id = N51ICP_ctx_read_device_id(icp);
         DEBUG_PRINT("received device id of 0x%04x\n", id);
         tx_buf[8] = id & 0xff;
         tx_buf[9] = (id >> 8) & 0xff;
@@ -615,7 +1398,7 @@ void loop()
         } break;
       case CMD_READ_CONFIG:
         DEBUG_PRINT("CMD_READ_CONFIG\n");
-        N51ICP_read_flash(CFG_FLASH_ADDR, CFG_FLASH_LEN, &tx_buf[8]);
+        N51ICP_ctx_read_flash(icp, CFG_FLASH_ADDR, CFG_FLASH_LEN, &tx_buf[8]);
         // set the rest of the packet to FF
         memset(&tx_buf[8 + CFG_FLASH_LEN], 0xFF, PACKSIZE - 8 - CFG_FLASH_LEN);
         send_pkt();
@@ -631,20 +1414,23 @@ void loop()
           break;
         }
 #endif
-        N51ICP_page_erase(CFG_FLASH_ADDR);
-        N51ICP_write_flash(CFG_FLASH_ADDR, CFG_FLASH_LEN, &rx_buf[8]);
+        page_erase(CFG_FLASH_ADDR);
+        write_flash(CFG_FLASH_ADDR, CFG_FLASH_LEN, &rx_buf[8]);
         send_pkt();
       } break;
       case CMD_ERASE_ALL: // Erase all only erases the AP ROM, so we have to page erase the APROM area
       {
         DEBUG_PRINT("CMD_ERASE_ALL\n");
         INVALIDATE_CACHE;
-        read_config(&flags);
-        int ldrom_size = get_ldrom_size(&flags);
-        DEBUG_PRINT("ldrom_size: %d\n", ldrom_size);
-        DEBUG_PRINT("Erasing %d bytes of APROM\n", FLASH_SIZE - ldrom_size);
-        for (int i = 0; i < FLASH_SIZE - ldrom_size; i += PAGE_SIZE) {
-          N51ICP_page_erase(i);
+        for (uint8_t t = 0; t < TARGET_COUNT; t++) {
+          if (!target_active(t))
+            continue;
+          int ldrom_size = read_ldrom_size(targets[t]);
+          DEBUG_PRINT("ldrom_size: %d\n", ldrom_size);
+          DEBUG_PRINT("Erasing %d bytes of APROM\n", FLASH_SIZE - ldrom_size);
+          for (int i = 0; i < FLASH_SIZE - ldrom_size; i += PAGE_SIZE) {
+            N51ICP_ctx_page_erase(targets[t], i);
+          }
         }
         send_pkt();
       } break;
@@ -653,16 +1439,16 @@ void loop()
         DEBUG_PRINT("CMD_ISP_MASS_ERASE\n");
 
           INVALIDATE_CACHE;
-          if (!mass_erase_checked(false)) break;
+          if (!mass_erase_checked(selected, false)) break;
+          put_failed_targets();
           send_pkt();
         }
         break;
       case CMD_ISP_PAGE_ERASE:
       {
-        INVALIDATE_CACHE;
         int addr = (rx_buf[9] << 8) | rx_buf[8];
         DEBUG_PRINT("CMD_ISP_PAGE_ERASE (addr: %d)\n", addr);
-        N51ICP_page_erase(addr & PAGE_MASK);
+        page_erase(addr & PAGE_MASK);
         send_pkt();
       } break;
       case CMD_RUN_APROM:
@@ -673,6 +1459,23 @@ void loop()
         send_pkt();
         reset_conn();
       } break;
+      case CMD_SET_BAUD: {
+        uint32_t rate = get_u32(&rx_buf[8]);
+        DEBUG_PRINT("CMD_SET_BAUD (rate: %lu)\n", (unsigned long)rate);
+        if (!is_supported_baud_rate(rate))
+          rate = 0;
+        // acknowledged at the current rate with the rate switched to, 0 if refused
+        tx_buf[8] = rate & 0xff;
+        tx_buf[9] = (rate >> 8) & 0xff;
+        tx_buf[10] = (rate >> 16) & 0xff;
+        tx_buf[11] = (rate >> 24) & 0xff;
+        send_pkt();
+        if (rate != 0 && rate != baud_rate) {
+          set_baud_rate(rate);
+          baud_unconfirmed = true;
+          baud_switch_time = millis();
+        }
+      } break;
       case CMD_READ_ROM:
         dump_addr = (rx_buf[9] << 8) | rx_buf[8];
         dump_size = (rx_buf[13] << 8) | rx_buf[12];
@@ -680,59 +1483,92 @@ void loop()
         start_dump(dump_addr, dump_size);
         break;
 
+      case CMD_READ_RANGES:
+        DEBUG_PRINT("CMD_READ_RANGES (count: %d)\n", rx_buf[8]);
+        read_ranges();
+        break;
+
+      case CMD_CRC32_RANGE: {
+        int addr = (rx_buf[9] << 8) | rx_buf[8];
+        uint32_t size = get_u32(&rx_buf[12]);
+        uint32_t block = get_u32(&rx_buf[16]);
+        DEBUG_PRINT("CMD_CRC32_RANGE (addr: %d, size: %lu, block: %lu)\n", addr, (unsigned long)size, (unsigned long)block);
+        crc_range(addr, size, block);
+      } break;
+
       case CMD_UPDATE_WHOLE_ROM:
-        g_update_checksum = 0;
         DEBUG_PRINT("CMD_UPDATE_WHOLE_ROM\n");
-        INVALIDATE_CACHE;
         // preserved_ldrom_sz = 0;
-        if (!mass_erase_checked(true)) break;
-        update_addr = (rx_buf[9] << 8) | rx_buf[8];
-        update_size = (rx_buf[13] << 8) | rx_buf[12];
-        if (update_size == 0){
-          fail_pkt();
-          break;
-        }
-        DEBUG_PRINT("flashing %d bytes\n", update_size);
+        if (!start_update(true)) break;
         update(&rx_buf[16], 48);
         add_g_total_checksum();
+        put_failed_targets();
         if (update_size > 0)
           state = UPDATING_STATE;
         send_pkt();
         break;
 
-      case CMD_UPDATE_APROM: {
-        g_update_checksum = 0;
-        update_addr = (rx_buf[9] << 8) | rx_buf[8];
-        update_size = (rx_buf[13] << 8) | rx_buf[12];
-        DEBUG_PRINT("CMD_UPDATE_APROM (addr: %d, size: %d)\n", update_addr, update_size);
-        if (update_size == 0){
-          fail_pkt();
-          break;
-        }
-        read_config(&flags);
-        
-        cid = N51ICP_read_cid();
-        int ldrom_size = get_ldrom_size(&flags);
-        // Specification states that we need to erase the aprom when we receive this command
-        if (flags.LOCK != 0 && cid != 0xFF) {
-          // device is not locked, we need to erase only the areas we're going to write to
-          uint16_t start_addr = update_addr & PAGE_MASK;
-          uint16_t end_addr = (start_addr + update_size);
-          for (uint16_t curr_addr = update_addr; curr_addr < end_addr; curr_addr += PAGE_SIZE){
-            N51ICP_page_erase(curr_addr);
-          }
-        } else { // device is locked, we'll need to do a mass erase
-          if (!mass_erase_checked(true)) break;
-        }
-        INVALIDATE_CACHE;
-        read_config(&flags);
-        DEBUG_PRINT("flashing %d bytes\n", update_size);
+      case CMD_UPDATE_APROM:
+        DEBUG_PRINT("CMD_UPDATE_APROM\n");
+        if (!start_update(false)) break;
         update(&rx_buf[16], 48);
         add_g_total_checksum();
+        put_failed_targets();
         if (update_size > 0)
           state = UPDATING_STATE;
         send_pkt();
+        break;
+
+      case CMD_UPDATE_STREAM:
+      case CMD_UPDATE_COMPRESSED:
+        DEBUG_PRINT("%s\n", cmd == CMD_UPDATE_STREAM ? "CMD_UPDATE_STREAM" : "CMD_UPDATE_COMPRESSED");
+        if (!start_update(rx_buf[16] & STREAM_WHOLE_ROM)) break;
+        stream_compressed = cmd == CMD_UPDATE_COMPRESSED;
+        if (stream_compressed)
+          lz_reset();
+        stream_head = 0;
+        stream_count = 0;
+        // the data follows in continuation packets, up to STREAM_WINDOW of them unacknowledged
+        tx_buf[8] = STREAM_WINDOW;
+        tx_buf[9] = 0;
+        tx_buf[10] = 0;
+        tx_buf[11] = 0;
+        put_failed_targets();
+        state = STREAMING_STATE;
+        send_pkt();
+        break;
+      case CMD_SELECT_TARGET: {
+        uint8_t mask = rx_buf[8];
+        DEBUG_PRINT("CMD_SELECT_TARGET (mask: 0x%02x)\n", mask);
+        if (mask >> TARGET_COUNT) {
+          fail_pkt();
+          break;
+        }
+        if (mask)
+          select_targets(mask);
+        tx_buf[8] = TARGET_COUNT;
+        tx_buf[9] = selected;
+        tx_buf[10] = 0;
+        tx_buf[11] = 0;
+        for (uint8_t i = 0; i < TARGET_COUNT; i++) {
+          uint32_t id = N51ICP_ctx_read_device_id(targets[i]);
+          tx_buf[12 + 2 * i] = id & 0xff;
+          tx_buf[13 + 2 * i] = (id >> 8) & 0xff;
+        }
+        send_pkt();
       } break;
+#if IMAGE_STORE_SLOTS
+      case CMD_STORE_IMAGE:
+        start_store();
+        break;
+      case CMD_STORE_INFO:
+        store_info(rx_buf[8]);
+        break;
+      case CMD_PROGRAM_STORED:
+        DEBUG_PRINT("CMD_PROGRAM_STORED (slot: %d)\n", rx_buf[8]);
+        program_stored(rx_buf[8]);
+        break;
+#endif
       default:
         DEBUG_PRINT("unknown command 0x%02x\n", cmd);
         fail_pkt();
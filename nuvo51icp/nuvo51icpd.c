@@ -0,0 +1,383 @@
+/*
+ * nuvo51icp, a RPi ICP flasher for the Nuvoton N76E003
+ * https://github.com/steve-m/N76E003-playground
+ *
+ * Copyright (c) 2021 Steve Markgraf <steve@steve-m.de>
+ * Copyright (c) 2023-2024 Nikita Lita
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * nuvo51icpd: keeps one target in ICP mode and runs jobs from clients on a Unix socket (see n51_daemon.h).
+ * Clients are served one at a time, in the order they connect; a client keeps the target for as long as its
+ * connection is open.
+ */
+
+#ifndef ARDUINO
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "n51_icp.h"
+#include "n51_pgm.h"
+#include "n51_daemon.h"
+
+static volatile sig_atomic_t stop = 0;
+static int in_icp = 0;
+static int verbose = 0;
+static uint8_t payload[N51D_MAX_PAYLOAD];
+static uint8_t result[N51D_MAX_PAYLOAD];
+
+static void on_signal(int sig)
+{
+	(void)sig;
+	stop = 1;
+}
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+	while (len) {
+		ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static int read_all(int fd, void *buf, size_t len)
+{
+	uint8_t *p = buf;
+	while (len) {
+		ssize_t n = recv(fd, p, len, 0);
+		if (n < 0 && errno == EINTR && !stop)
+			continue;
+		if (n <= 0)
+			return -1;
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static int is_locked(uint8_t cid)
+{
+	uint8_t cfg[CFG_FLASH_LEN];
+	if (cid == 0xFF)
+		return 1;
+	N51ICP_read_flash(CFG_FLASH_ADDR, CFG_FLASH_LEN, cfg);
+	return (cfg[0] & 0x02) == 0;
+}
+
+// Same entry as main.c: a locked chip needs a reentry before the flash reads correctly
+static int enter_icp(uint8_t do_reset)
+{
+	N51ICP_entry(do_reset);
+	if (N51ICP_read_cid() == 0xFF)
+		N51ICP_reentry(5000, 1000, 10);
+	in_icp = 1;
+	return N51ICP_read_device_id() == 0 ? N51D_ERR_NO_DEVICE : N51D_OK;
+}
+
+static int mass_erase(void)
+{
+	int locked = is_locked(N51ICP_read_cid());
+	N51ICP_mass_erase();
+	// we have to reinitialize if it was previously locked
+	if (locked)
+		N51ICP_reentry(5000, 1000, 10);
+	return N51D_OK;
+}
+
+static int program(const uint8_t *cfg, const uint8_t *image, uint32_t image_len)
+{
+	uint8_t unlocked_cfg[CFG_FLASH_LEN];
+	memcpy(unlocked_cfg, cfg, CFG_FLASH_LEN);
+	unlocked_cfg[0] |= 0x02;
+
+	mass_erase();
+	N51ICP_write_flash(CFG_FLASH_ADDR, CFG_FLASH_LEN, unlocked_cfg);
+	N51ICP_write_flash(APROM_FLASH_ADDR, image_len, (uint8_t *)image);
+
+	N51ICP_read_flash(APROM_FLASH_ADDR, image_len, result);
+	if (memcmp(result, image, image_len) != 0)
+		return N51D_ERR_VERIFY;
+	N51ICP_read_flash(CFG_FLASH_ADDR, CFG_FLASH_LEN, result);
+	if (memcmp(result, unlocked_cfg, CFG_FLASH_LEN) != 0)
+		return N51D_ERR_VERIFY;
+	// we need to write the lock bits AFTER verifying because we will be unable to read it afterwards
+	if (cfg[0] != unlocked_cfg[0])
+		N51ICP_write_flash(CFG_FLASH_ADDR, CFG_FLASH_LEN, (uint8_t *)cfg);
+	return N51D_OK;
+}
+
+static int run_job(const n51d_req_hdr *req, uint32_t *out_len)
+{
+	uint32_t u32;
+	*out_len = 0;
+
+	switch (req->cmd) {
+	case N51D_CMD_PING:
+		u32 = N51D_PROTOCOL_VERSION;
+		memcpy(result, &u32, 4);
+		*out_len = 4;
+		return N51D_OK;
+	case N51D_CMD_ENTRY:
+		return enter_icp(req->addr != 0);
+	case N51D_CMD_EXIT:
+		if (in_icp)
+			N51ICP_exit();
+		in_icp = 0;
+		return N51D_OK;
+	default:
+		break;
+	}
+
+	if (!in_icp) {
+		int rc = enter_icp(1);
+		if (rc != N51D_OK)
+			return rc;
+	}
+
+	switch (req->cmd) {
+	case N51D_CMD_REENTRY: {
+		uint32_t delays[3];
+		if (req->len != sizeof(delays))
+			return N51D_ERR_BAD_REQUEST;
+		memcpy(delays, payload, sizeof(delays));
+		N51ICP_reentry(delays[0], delays[1], delays[2]);
+		return N51D_OK;
+	}
+	case N51D_CMD_READ_DEVICE_ID:
+		u32 = N51ICP_read_device_id();
+		memcpy(result, &u32, 4);
+		*out_len = 4;
+		return N51D_OK;
+	case N51D_CMD_READ_PID:
+		u32 = N51ICP_read_pid();
+		memcpy(result, &u32, 4);
+		*out_len = 4;
+		return N51D_OK;
+	case N51D_CMD_READ_CID:
+		result[0] = N51ICP_read_cid();
+		*out_len = 1;
+		return N51D_OK;
+	case N51D_CMD_READ_UID:
+		N51ICP_read_uid(result);
+		*out_len = 12;
+		return N51D_OK;
+	case N51D_CMD_READ_UCID:
+		N51ICP_read_ucid(result);
+		*out_len = 16;
+		return N51D_OK;
+	case N51D_CMD_READ_FLASH:
+		N51ICP_read_flash(req->addr, req->len, result);
+		*out_len = req->len;
+		return N51D_OK;
+	case N51D_CMD_WRITE_FLASH:
+		N51ICP_write_flash(req->addr, req->len, payload);
+		return N51D_OK;
+	case N51D_CMD_PAGE_ERASE:
+		N51ICP_page_erase(req->addr);
+		return N51D_OK;
+	case N51D_CMD_MASS_ERASE:
+		return mass_erase();
+	case N51D_CMD_READ_CONFIG:
+		N51ICP_read_flash(CFG_FLASH_ADDR, CFG_FLASH_LEN, result);
+		*out_len = CFG_FLASH_LEN;
+		return N51D_OK;
+	case N51D_CMD_WRITE_CONFIG:
+		if (req->len != CFG_FLASH_LEN)
+			return N51D_ERR_BAD_REQUEST;
+		N51ICP_page_erase(CFG_FLASH_ADDR);
+		N51ICP_write_flash(CFG_FLASH_ADDR, CFG_FLASH_LEN, payload);
+		return N51D_OK;
+	case N51D_CMD_PROGRAM:
+		if (req->len < CFG_FLASH_LEN || req->len > CFG_FLASH_LEN + FLASH_SIZE)
+			return N51D_ERR_BAD_REQUEST;
+		return program(payload, payload + CFG_FLASH_LEN, req->len - CFG_FLASH_LEN);
+	default:
+		return N51D_ERR_BAD_REQUEST;
+	}
+}
+
+// Runs one job from the client; returns -1 if the connection should be closed
+static int serve_job(int fd)
+{
+	n51d_req_hdr req;
+	n51d_resp_hdr resp;
+	uint32_t out_len;
+
+	if (read_all(fd, &req, sizeof(req)) != 0)
+		return -1;
+	memset(&resp, 0, sizeof(resp));
+	if (req.len > N51D_MAX_PAYLOAD) {
+		// can't resynchronize after an oversized payload
+		resp.status = N51D_ERR_BAD_REQUEST;
+		write_all(fd, &resp, sizeof(resp));
+		return -1;
+	}
+	if (req.cmd != N51D_CMD_READ_FLASH && req.len && read_all(fd, payload, req.len) != 0)
+		return -1;
+
+	uint64_t start = N51PGM_get_time();
+	resp.status = run_job(&req, &out_len);
+	resp.len = out_len;
+	if (verbose)
+		fprintf(stderr, "job 0x%02x addr 0x%05x len %u: status %u, %llu us\n", req.cmd, req.addr, req.len,
+			resp.status, (unsigned long long)(N51PGM_get_time() - start));
+	if (write_all(fd, &resp, sizeof(resp)) != 0 || (out_len && write_all(fd, result, out_len) != 0))
+		return -1;
+	return 0;
+}
+
+static int open_socket(const char *path)
+{
+	struct sockaddr_un sa;
+	if (strlen(path) >= sizeof(sa.sun_path)) {
+		fprintf(stderr, "ERROR: Socket path too long: %s\n", path);
+		return -1;
+	}
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) {
+		perror("socket");
+		return -1;
+	}
+	memset(&sa, 0, sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	strcpy(sa.sun_path, path);
+	unlink(path);
+	if (bind(fd, (struct sockaddr *)&sa, sizeof(sa)) != 0 || listen(fd, 8) != 0) {
+		perror(path);
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"nuvo51icpd, keeps an N76E003 in ICP mode and runs jobs from clients on a Unix socket\n\n"
+		"Usage:\n"
+		"\t[-h print this help]\n"
+		"\t[-S <path> socket to listen on (default " N51D_DEFAULT_SOCKET ")]\n"
+		"\t[-n don't enter ICP mode until the first job]\n"
+		"\t[-i <seconds> leave ICP mode after this long without a job, so the target runs (default: never)]\n"
+		"\t[-v log every job and its duration]\n");
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *path = N51D_DEFAULT_SOCKET;
+	int enter_now = 1;
+	int idle_timeout_s = 0;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "S:ni:vh")) != -1) {
+		switch (opt) {
+		case 'S':
+			path = optarg;
+			break;
+		case 'n':
+			enter_now = 0;
+			break;
+		case 'i':
+			idle_timeout_s = atoi(optarg);
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		default:
+			usage();
+		}
+	}
+
+	if (N51PGM_init() != 0) {
+		fprintf(stderr, "ERROR: Failed to initialize PGM!\n");
+		return 1;
+	}
+	// repeated ID and config reads between jobs are answered without ICP traffic
+	N51ICP_enable_shadow(1);
+	// after N51PGM_init(), as pigpio installs its own handlers
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	if (enter_now && enter_icp(1) != N51D_OK)
+		fprintf(stderr, "WARNING: No device found, will retry on the first job\n");
+
+	int listen_fd = open_socket(path);
+	if (listen_fd < 0)
+		goto out;
+	fprintf(stderr, "Listening on %s\n", path);
+
+	int client_fd = -1;
+	while (!stop) {
+		struct pollfd pfd = {client_fd >= 0 ? client_fd : listen_fd, POLLIN, 0};
+		int rc = poll(&pfd, 1, in_icp && idle_timeout_s > 0 ? idle_timeout_s * 1000 : -1);
+		if (rc < 0)
+			continue; // EINTR
+		if (rc == 0) {
+			N51ICP_exit();
+			in_icp = 0;
+			if (verbose)
+				fprintf(stderr, "idle, left ICP mode\n");
+			continue;
+		}
+		if (client_fd < 0) {
+			client_fd = accept(listen_fd, NULL, NULL);
+			continue;
+		}
+		if (serve_job(client_fd) != 0) {
+			close(client_fd);
+			client_fd = -1;
+		}
+	}
+
+	if (client_fd >= 0)
+		close(client_fd);
+	close(listen_fd);
+	unlink(path);
+out:
+	if (in_icp)
+		N51ICP_exit();
+	N51PGM_deinit(0);
+	return 0;
+}
+
+#endif // ARDUINO
@@ -1,5 +1,9 @@
 #ifdef RPI
 #include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
 #include <pigpio.h>
 
 #include "n51_pgm.h"
@@ -16,30 +20,68 @@
 #define GPIO_TRIGGER 16
 #define MAX_BUSY_DELAY 300
 
-int N51PGM_init(void)
+struct _n51pgm_ctx {
+    n51pgm_pins pins;
+    int initialized;
+};
+
+static n51pgm_ctx default_ctx = {{GPIO_DAT, GPIO_RST, GPIO_CLK, GPIO_TRIGGER}, 0};
+
+// pigpio is initialized once per process, for the first context, and terminated with the last one
+static pthread_mutex_t init_lock = PTHREAD_MUTEX_INITIALIZER;
+static int init_count = 0;
+
+n51pgm_ctx *N51PGM_ctx_create(const n51pgm_pins *pins)
+{
+    n51pgm_ctx *ctx = calloc(1, sizeof(n51pgm_ctx));
+    if (!ctx)
+        return NULL;
+    ctx->pins = pins ? *pins : default_ctx.pins;
+    return ctx;
+}
+
+void N51PGM_ctx_free(n51pgm_ctx *ctx)
+{
+    if (ctx != &default_ctx)
+        free(ctx);
+}
+
+n51pgm_ctx *N51PGM_default_ctx(void)
+{
+    return &default_ctx;
+}
+
+int N51PGM_ctx_init(n51pgm_ctx *ctx)
 {
     #ifdef DEBUG
     print_caps();
     #endif
 
-    if (gpioInitialise() < 0)
+    pthread_mutex_lock(&init_lock);
+    if (init_count == 0 && gpioInitialise() < 0)
     {
+        pthread_mutex_unlock(&init_lock);
         N51PGM_print("pigpio initialization failed\n");
         return -1;
     }
+    init_count++;
+    ctx->initialized = 1;
+    pthread_mutex_unlock(&init_lock);
 
-    int ret = gpioSetMode(GPIO_DAT, PI_INPUT);
-    ret |= gpioSetMode(GPIO_CLK, PI_OUTPUT);
-    ret |= gpioSetMode(GPIO_TRIGGER, PI_OUTPUT);
-    ret |= gpioSetMode(GPIO_RST, PI_OUTPUT);
+    int ret = gpioSetMode(ctx->pins.dat, PI_INPUT);
+    ret |= gpioSetMode(ctx->pins.clk, PI_OUTPUT);
+    if (ctx->pins.trigger >= 0)
+        ret |= gpioSetMode(ctx->pins.trigger, PI_OUTPUT);
+    ret |= gpioSetMode(ctx->pins.rst, PI_OUTPUT);
     if (ret != 0)
     {
         N51PGM_print("Setting GPIO modes failed\n");
         return ret;
     }
-    ret |= gpioWrite(GPIO_RST, 0);
-    ret |= gpioWrite(GPIO_TRIGGER, 0);
-    ret |= gpioWrite(GPIO_CLK, 0);
+    ret |= gpioWrite(ctx->pins.rst, 0);
+    if (ctx->pins.trigger >= 0)
+        ret |= gpioWrite(ctx->pins.trigger, 0);
+    ret |= gpioWrite(ctx->pins.clk, 0);
     if (ret != 0)
     {
         N51PGM_print("Setting GPIO values failed\n");
@@ -48,76 +90,98 @@ int N51PGM_init(void)
     return 0;
 }
 
-void N51PGM_set_dat(uint8_t val)
+void N51PGM_ctx_set_dat(n51pgm_ctx *ctx, uint8_t val)
 {
-    gpioWrite(GPIO_DAT, val);
+    gpioWrite(ctx->pins.dat, val);
 }
 
-uint8_t N51PGM_get_dat(void)
+uint8_t N51PGM_ctx_get_dat(n51pgm_ctx *ctx)
 {
-    return gpioRead(GPIO_DAT);
+    return gpioRead(ctx->pins.dat);
 }
 
-void N51PGM_set_rst(uint8_t val)
+void N51PGM_ctx_set_rst(n51pgm_ctx *ctx, uint8_t val)
 {
-    gpioWrite(GPIO_RST, val);
+    gpioWrite(ctx->pins.rst, val);
 }
 
-void N51PGM_set_clk(uint8_t val)
+void N51PGM_ctx_set_clk(n51pgm_ctx *ctx, uint8_t val)
 {
-    gpioWrite(GPIO_CLK, val);
+    gpioWrite(ctx->pins.clk, val);
 }
 
-void N51PGM_dat_dir(uint8_t state)
+void N51PGM_ctx_dat_dir(n51pgm_ctx *ctx, uint8_t state)
 {
-    if (gpioSetMode(GPIO_DAT, state ? PI_OUTPUT : PI_INPUT) < 0){
+    if (gpioSetMode(ctx->pins.dat, state ? PI_OUTPUT : PI_INPUT) < 0){
         N51PGM_print("Setting data directions failed\n");
     }
 }
 
 // There's no "high-z" setting; this just turns them into inputs and sets the pull-up/down resistors to off, so it is effectively high-z
-void N51PGM_release_non_reset_pins(void) {
-    gpioSetMode(GPIO_DAT, PI_INPUT);
-    gpioSetMode(GPIO_CLK, PI_INPUT);
-    gpioSetMode(GPIO_TRIGGER, PI_INPUT);
-    gpioSetPullUpDown(GPIO_DAT, PI_PUD_OFF);
-    gpioSetPullUpDown(GPIO_CLK, PI_PUD_OFF);
-    gpioSetPullUpDown(GPIO_TRIGGER, PI_PUD_OFF);
+static void release_non_reset_pins(n51pgm_ctx *ctx) {
+    gpioSetMode(ctx->pins.dat, PI_INPUT);
+    gpioSetMode(ctx->pins.clk, PI_INPUT);
+    gpioSetPullUpDown(ctx->pins.dat, PI_PUD_OFF);
+    gpioSetPullUpDown(ctx->pins.clk, PI_PUD_OFF);
+    if (ctx->pins.trigger >= 0) {
+        gpioSetMode(ctx->pins.trigger, PI_INPUT);
+        gpioSetPullUpDown(ctx->pins.trigger, PI_PUD_OFF);
+    }
 }
 
-void N51PGM_release_rst(void) {
-    gpioSetMode(GPIO_RST, PI_INPUT);
-    gpioSetPullUpDown(GPIO_TRIGGER, PI_PUD_OFF);
+void N51PGM_ctx_release_rst(n51pgm_ctx *ctx) {
+    gpioSetMode(ctx->pins.rst, PI_INPUT);
+    gpioSetPullUpDown(ctx->pins.rst, PI_PUD_OFF);
 }
 
-void N51PGM_release_pins(void) {
-    N51PGM_release_non_reset_pins();
-    N51PGM_release_rst();
+void N51PGM_ctx_release_pins(n51pgm_ctx *ctx) {
+    release_non_reset_pins(ctx);
+    N51PGM_ctx_release_rst(ctx);
 }
 
-void N51PGM_set_trigger(uint8_t val)
+void N51PGM_ctx_set_trigger(n51pgm_ctx *ctx, uint8_t val)
 {
-    gpioWrite(GPIO_TRIGGER, val);
+    if (ctx->pins.trigger >= 0)
+        gpioWrite(ctx->pins.trigger, val);
 }
 
-void N51PGM_deinit(uint8_t leave_reset_high)
+void N51PGM_ctx_deinit(n51pgm_ctx *ctx, uint8_t leave_reset_high)
 {
     if (!leave_reset_high) {
-        N51PGM_release_pins();
+        N51PGM_ctx_release_pins(ctx);
     } else {
-        gpioWrite(GPIO_RST, 1);
-        N51PGM_release_non_reset_pins();
+        gpioWrite(ctx->pins.rst, 1);
+        release_non_reset_pins(ctx);
     }
-    N51PGM_release_non_reset_pins();
-    gpioTerminate();
+    pthread_mutex_lock(&init_lock);
+    if (ctx->initialized) {
+        ctx->initialized = 0;
+        if (--init_count == 0)
+            gpioTerminate();
+    }
+    pthread_mutex_unlock(&init_lock);
 }
 
-uint32_t N51PGM_usleep(uint32_t usec)
+uint32_t N51PGM_ctx_usleep(n51pgm_ctx *ctx, uint32_t usec)
 {   
     unsigned long waited = 0;
     if (usec == 0){
         return 0;
     }
+    if (usec > MAX_BUSY_DELAY) {
+        // same as rpi.c: long holds sleep to an absolute deadline instead of gpioDelay()'s relative sleep
+        struct timespec deadline;
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += usec / 1000000;
+        deadline.tv_nsec += (usec % 1000000) * 1000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR)
+            ;
+        return usec;
+    }
     // because of the limitations of the gpioDelay function (>100us sleeps are real sleeps, which can sleep for 60+ additional us), we have to break this up
     if (usec > 101 && usec <= MAX_BUSY_DELAY) {
         for (; usec > 100; usec -= 100){
@@ -131,8 +195,71 @@ uint32_t N51PGM_usleep(uint32_t usec)
     return waited;
 }
 
-uint64_t N51PGM_get_time(){
-    return gpioTick();
+// gpioTick() is only valid after gpioInitialise() and wraps every ~72 minutes
+uint64_t N51PGM_ctx_get_time(n51pgm_ctx *ctx){
+    struct timespec curr_time;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &curr_time);
+    return (curr_time.tv_sec * 1000000) + (curr_time.tv_nsec / 1000);
+}
+
+int N51PGM_init(void)
+{
+    return N51PGM_ctx_init(&default_ctx);
+}
+
+void N51PGM_deinit(uint8_t leave_reset_high)
+{
+    N51PGM_ctx_deinit(&default_ctx, leave_reset_high);
+}
+
+void N51PGM_set_dat(uint8_t val)
+{
+    N51PGM_ctx_set_dat(&default_ctx, val);
+}
+
+uint8_t N51PGM_get_dat(void)
+{
+    return N51PGM_ctx_get_dat(&default_ctx);
+}
+
+void N51PGM_set_rst(uint8_t val)
+{
+    N51PGM_ctx_set_rst(&default_ctx, val);
+}
+
+void N51PGM_set_clk(uint8_t val)
+{
+    N51PGM_ctx_set_clk(&default_ctx, val);
+}
+
+void N51PGM_set_trigger(uint8_t val)
+{
+    N51PGM_ctx_set_trigger(&default_ctx, val);
+}
+
+void N51PGM_dat_dir(uint8_t state)
+{
+    N51PGM_ctx_dat_dir(&default_ctx, state);
+}
+
+void N51PGM_release_pins(void)
+{
+    N51PGM_ctx_release_pins(&default_ctx);
+}
+
+void N51PGM_release_rst(void)
+{
+    N51PGM_ctx_release_rst(&default_ctx);
+}
+
+uint32_t N51PGM_usleep(uint32_t usec)
+{
+    return N51PGM_ctx_usleep(&default_ctx, usec);
+}
+
+uint64_t N51PGM_get_time(void)
+{
+    return N51PGM_ctx_get_time(&default_ctx);
 }
 
 void N51PGM_print(const char *msg)
@@ -140,5 +267,175 @@ void N51PGM_print(const char *msg)
 	fprintf(stderr, "%s", msg);
 }
 
+// All lines of a gang must be in bank 0 (GPIO 0-31), so every edge is one set and/or one clear register store
+struct _n51pgm_gang {
+    n51pgm_gang_pins pins;
+    uint32_t enabled;      // targets
+    uint32_t enabled_bits; // GPIO bits of the enabled targets' DAT lines
+    int initialized;
+};
+
+static uint32_t gang_bits(n51pgm_gang *gang, uint32_t targets)
+{
+    uint32_t bits = 0;
+    for (int i = 0; i < gang->pins.count; i++) {
+        if (targets & (1u << i))
+            bits |= 1u << gang->pins.dat[i];
+    }
+    return bits;
+}
+
+n51pgm_gang *N51PGM_gang_create(const n51pgm_gang_pins *pins)
+{
+    if (pins->count <= 0 || pins->count > N51PGM_GANG_MAX)
+        return NULL;
+    n51pgm_gang *gang = calloc(1, sizeof(n51pgm_gang));
+    if (!gang)
+        return NULL;
+    gang->pins = *pins;
+    if (gang->pins.clk < 0)
+        gang->pins.clk = GPIO_CLK;
+    if (gang->pins.rst < 0)
+        gang->pins.rst = GPIO_RST;
+    for (int i = 0; i < gang->pins.count; i++) {
+        if (gang->pins.dat[i] < 0 || gang->pins.dat[i] > 31) {
+            N51PGM_print("Gang DAT lines must be GPIO 0-31\n");
+            free(gang);
+            return NULL;
+        }
+    }
+    return gang;
+}
+
+void N51PGM_gang_free(n51pgm_gang *gang)
+{
+    free(gang);
+}
+
+int N51PGM_gang_init(n51pgm_gang *gang)
+{
+    pthread_mutex_lock(&init_lock);
+    if (init_count == 0 && gpioInitialise() < 0)
+    {
+        pthread_mutex_unlock(&init_lock);
+        N51PGM_print("pigpio initialization failed\n");
+        return -1;
+    }
+    init_count++;
+    gang->initialized = 1;
+    pthread_mutex_unlock(&init_lock);
+
+    gang->enabled = gang->pins.count == 32 ? 0xFFFFFFFF : (1u << gang->pins.count) - 1;
+    gang->enabled_bits = gang_bits(gang, gang->enabled);
+    int ret = gpioSetMode(gang->pins.clk, PI_OUTPUT);
+    ret |= gpioSetMode(gang->pins.rst, PI_OUTPUT);
+    for (int i = 0; i < gang->pins.count; i++)
+        ret |= gpioSetMode(gang->pins.dat[i], PI_INPUT);
+    if (ret != 0)
+    {
+        N51PGM_print("Setting GPIO modes failed\n");
+        return ret;
+    }
+    ret |= gpioWrite(gang->pins.rst, 0);
+    ret |= gpioWrite(gang->pins.clk, 0);
+    if (ret != 0)
+    {
+        N51PGM_print("Setting GPIO values failed\n");
+        return ret;
+    }
+    return 0;
+}
+
+void N51PGM_gang_deinit(n51pgm_gang *gang, uint8_t leave_reset_high)
+{
+    for (int i = 0; i < gang->pins.count; i++) {
+        gpioSetMode(gang->pins.dat[i], PI_INPUT);
+        gpioSetPullUpDown(gang->pins.dat[i], PI_PUD_OFF);
+    }
+    gpioSetMode(gang->pins.clk, PI_INPUT);
+    gpioSetPullUpDown(gang->pins.clk, PI_PUD_OFF);
+    if (leave_reset_high) {
+        gpioWrite(gang->pins.rst, 1);
+    } else {
+        gpioSetMode(gang->pins.rst, PI_INPUT);
+        gpioSetPullUpDown(gang->pins.rst, PI_PUD_OFF);
+    }
+    pthread_mutex_lock(&init_lock);
+    if (gang->initialized) {
+        gang->initialized = 0;
+        if (--init_count == 0)
+            gpioTerminate();
+    }
+    pthread_mutex_unlock(&init_lock);
+}
+
+void N51PGM_gang_enable(n51pgm_gang *gang, uint32_t mask)
+{
+    for (int i = 0; i < gang->pins.count; i++) {
+        if ((gang->enabled & ~mask) & (1u << i)) {
+            gpioSetMode(gang->pins.dat[i], PI_INPUT);
+            gpioSetPullUpDown(gang->pins.dat[i], PI_PUD_OFF);
+        }
+    }
+    gang->enabled = mask;
+    gang->enabled_bits = gang_bits(gang, mask);
+}
+
+void N51PGM_gang_set_dat(n51pgm_gang *gang, uint32_t vals)
+{
+    vals &= gang->enabled;
+    // the common case: every target gets the same bit
+    if (vals == 0) {
+        gpioWrite_Bits_0_31_Clear(gang->enabled_bits);
+        return;
+    }
+    if (vals == gang->enabled) {
+        gpioWrite_Bits_0_31_Set(gang->enabled_bits);
+        return;
+    }
+    uint32_t set_bits = gang_bits(gang, vals);
+    gpioWrite_Bits_0_31_Set(set_bits);
+    gpioWrite_Bits_0_31_Clear(gang->enabled_bits & ~set_bits);
+}
+
+uint32_t N51PGM_gang_get_dat(n51pgm_gang *gang)
+{
+    uint32_t levels = gpioRead_Bits_0_31();
+    uint32_t vals = 0;
+    for (int i = 0; i < gang->pins.count; i++) {
+        if (gang->enabled & (1u << i))
+            vals |= ((levels >> gang->pins.dat[i]) & 1) << i;
+    }
+    return vals;
+}
+
+void N51PGM_gang_dat_dir(n51pgm_gang *gang, uint8_t state)
+{
+    for (int i = 0; i < gang->pins.count; i++) {
+        if (gang->enabled & (1u << i))
+            gpioSetMode(gang->pins.dat[i], state ? PI_OUTPUT : PI_INPUT);
+    }
+}
+
+void N51PGM_gang_set_clk(n51pgm_gang *gang, uint8_t val)
+{
+    gpioWrite(gang->pins.clk, val);
+}
+
+void N51PGM_gang_set_rst(n51pgm_gang *gang, uint8_t val)
+{
+    gpioWrite(gang->pins.rst, val);
+}
+
+uint32_t N51PGM_gang_usleep(n51pgm_gang *gang, uint32_t usec)
+{
+    return N51PGM_ctx_usleep(&default_ctx, usec);
+}
+
+uint64_t N51PGM_gang_get_time(n51pgm_gang *gang)
+{
+    return N51PGM_ctx_get_time(&default_ctx);
+}
+
 
-#endif // RPI
\ No newline at end of file
+#endif // RPI
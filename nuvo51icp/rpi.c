@@ -30,7 +30,9 @@
 #include <unistd.h>
 #include <gpiod.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <errno.h>
+#include <time.h>
 
 #include "n51_pgm.h"
 
@@ -47,40 +49,66 @@
 
 
 #define CONSUMER "nuvo51icp"
-struct gpiod_chip *chip;
-struct gpiod_line *dat_line, *rst_line, *clk_line, *trigger_line;
 
+// Every context opens the chip and requests its lines itself, so contexts on disjoint lines are independent
+struct _n51pgm_ctx {
+	n51pgm_pins pins;
+	struct gpiod_chip *chip;
+	struct gpiod_line *dat_line, *rst_line, *clk_line, *trigger_line;
+};
 
+static n51pgm_ctx default_ctx = {{GPIO_DAT, GPIO_RST, GPIO_CLK, GPIO_TRIGGER}};
 
-int N51PGM_init(void)
+n51pgm_ctx *N51PGM_ctx_create(const n51pgm_pins *pins)
+{
+	n51pgm_ctx *ctx = calloc(1, sizeof(n51pgm_ctx));
+	if (!ctx)
+		return NULL;
+	ctx->pins = pins ? *pins : default_ctx.pins;
+	return ctx;
+}
+
+void N51PGM_ctx_free(n51pgm_ctx *ctx)
+{
+	if (ctx != &default_ctx)
+		free(ctx);
+}
+
+n51pgm_ctx *N51PGM_default_ctx(void)
+{
+	return &default_ctx;
+}
+
+int N51PGM_ctx_init(n51pgm_ctx *ctx)
 {
 	int ret;
 	// Pi 5 compatibility: check for the existence of gpiochip4
-	chip = gpiod_chip_open_by_name("gpiochip4");
-	if (!chip) {
+	ctx->chip = gpiod_chip_open_by_name("gpiochip4");
+	if (!ctx->chip) {
 		// Pi 3-4
-		chip = gpiod_chip_open_by_name("gpiochip0");
+		ctx->chip = gpiod_chip_open_by_name("gpiochip0");
 	}
-	if (!chip)
+	if (!ctx->chip)
 	{
 		fprintf(stderr, "Open chip failed\n");
 		return -ENOENT;
 	}
 
-	dat_line = gpiod_chip_get_line(chip, GPIO_DAT);
-	rst_line = gpiod_chip_get_line(chip, GPIO_RST);
-	clk_line = gpiod_chip_get_line(chip, GPIO_CLK);
-	trigger_line = gpiod_chip_get_line(chip, GPIO_TRIGGER);
-	if (!dat_line || !clk_line || !rst_line || !trigger_line)
+	ctx->dat_line = gpiod_chip_get_line(ctx->chip, ctx->pins.dat);
+	ctx->rst_line = gpiod_chip_get_line(ctx->chip, ctx->pins.rst);
+	ctx->clk_line = gpiod_chip_get_line(ctx->chip, ctx->pins.clk);
+	ctx->trigger_line = ctx->pins.trigger >= 0 ? gpiod_chip_get_line(ctx->chip, ctx->pins.trigger) : NULL;
+	if (!ctx->dat_line || !ctx->clk_line || !ctx->rst_line || (ctx->pins.trigger >= 0 && !ctx->trigger_line))
 	{
 		fprintf(stderr, "Error getting required GPIO lines!\n");
 		return -ENOENT;
 	}
 
-	ret = gpiod_line_request_input(dat_line, CONSUMER);
-	ret |= gpiod_line_request_output(rst_line, CONSUMER, 0);
-	ret |= gpiod_line_request_output(clk_line, CONSUMER, 0);
-	ret |= gpiod_line_request_output(trigger_line, CONSUMER, 0);
+	ret = gpiod_line_request_input(ctx->dat_line, CONSUMER);
+	ret |= gpiod_line_request_output(ctx->rst_line, CONSUMER, 0);
+	ret |= gpiod_line_request_output(ctx->clk_line, CONSUMER, 0);
+	if (ctx->trigger_line)
+		ret |= gpiod_line_request_output(ctx->trigger_line, CONSUMER, 0);
 
 	if (ret < 0)
 	{
@@ -91,40 +119,40 @@ int N51PGM_init(void)
 	return 0;
 }
 
-void N51PGM_set_dat(uint8_t val)
+void N51PGM_ctx_set_dat(n51pgm_ctx *ctx, uint8_t val)
 {
-	if (gpiod_line_set_value(dat_line, val) < 0)
+	if (gpiod_line_set_value(ctx->dat_line, val) < 0)
 		fprintf(stderr, "Setting data line failed\n");
 }
 
-uint8_t N51PGM_get_dat(void)
+uint8_t N51PGM_ctx_get_dat(n51pgm_ctx *ctx)
 {
-	int ret = gpiod_line_get_value(dat_line);
+	int ret = gpiod_line_get_value(ctx->dat_line);
 	if (ret < 0)
 		fprintf(stderr, "Getting data line failed\n");
 	return ret;
 }
 
-void N51PGM_set_rst(uint8_t val)
+void N51PGM_ctx_set_rst(n51pgm_ctx *ctx, uint8_t val)
 {
-	if (gpiod_line_set_value(rst_line, val) < 0)
+	if (gpiod_line_set_value(ctx->rst_line, val) < 0)
 		fprintf(stderr, "Setting reset line failed\n");
 }
 
-void N51PGM_set_clk(uint8_t val)
+void N51PGM_ctx_set_clk(n51pgm_ctx *ctx, uint8_t val)
 {
-	if (gpiod_line_set_value(clk_line, val) < 0)
+	if (gpiod_line_set_value(ctx->clk_line, val) < 0)
 		fprintf(stderr, "Setting clock line failed\n");
 }
 
-void N51PGM_dat_dir(uint8_t state)
+void N51PGM_ctx_dat_dir(n51pgm_ctx *ctx, uint8_t state)
 {
 	// gpiod_line_release(dat_line);
 	int ret;
 	if (state)
-		ret = gpiod_line_set_direction_output(dat_line, 0);
+		ret = gpiod_line_set_direction_output(ctx->dat_line, 0);
 	else
-		ret = gpiod_line_set_direction_input(dat_line);
+		ret = gpiod_line_set_direction_input(ctx->dat_line);
 
 	if (ret < 0)
 		fprintf(stderr, "Setting data directions failed\n");
@@ -132,14 +160,26 @@ void N51PGM_dat_dir(uint8_t state)
 
 
 
-uint32_t N51PGM_usleep(uint32_t usec)
+uint32_t N51PGM_ctx_usleep(n51pgm_ctx *ctx, uint32_t usec)
 {
 	if (usec == 0)
 		return 0;
 
 	if (usec > MAX_BUSY_DELAY)
 	{
-		return usleep(usec);
+		// long holds (erase, reset sequence) sleep to an absolute deadline, so the core is free for other
+		// contexts' threads and a wakeup interrupted by a signal doesn't restart the whole wait
+		struct timespec deadline;
+		clock_gettime(CLOCK_MONOTONIC, &deadline);
+		deadline.tv_sec += usec / 1000000;
+		deadline.tv_nsec += (usec % 1000000) * 1000;
+		if (deadline.tv_nsec >= 1000000000) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000;
+		}
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR)
+			;
+		return usec;
 	}
     uint64_t start_time = N51PGM_get_time();
 	uint64_t curr_time;
@@ -193,65 +233,304 @@ int get_prev_flags(struct gpiod_line * line){
 }
 #define LOWER_FLAG_MASK (GPIOD_LINE_REQUEST_FLAG_OPEN_DRAIN | GPIOD_LINE_REQUEST_FLAG_OPEN_SOURCE | GPIOD_LINE_REQUEST_FLAG_ACTIVE_LOW)
 
-void N51PGM_release_pin(struct gpiod_line * line){
-	if (!line || !chip){
+static void release_pin(n51pgm_ctx *ctx, struct gpiod_line ** line){
+	if (!*line || (ctx && !ctx->chip)){
 		return;
 	}
-	int flags = (get_prev_flags(line) & LOWER_FLAG_MASK) | GPIOD_LINE_REQUEST_FLAG_BIAS_DISABLE;
-	gpiod_line_set_config(line, GPIOD_LINE_REQUEST_DIRECTION_INPUT, flags, 0);
-	gpiod_line_release(line);
+	int flags = (get_prev_flags(*line) & LOWER_FLAG_MASK) | GPIOD_LINE_REQUEST_FLAG_BIAS_DISABLE;
+	gpiod_line_set_config(*line, GPIOD_LINE_REQUEST_DIRECTION_INPUT, flags, 0);
+	gpiod_line_release(*line);
+	*line = NULL;
 }
 
-void N51PGM_release_non_reset_pins(void){
-	if (dat_line) {
+static void release_non_reset_pins(n51pgm_ctx *ctx){
+	if (ctx->dat_line) {
 		DEBUG_PRINT("Releasing dat line\n");
-		N51PGM_release_pin(dat_line);
+		release_pin(ctx, &ctx->dat_line);
 	}
-	if (clk_line) {
+	if (ctx->clk_line) {
 		DEBUG_PRINT("Releasing clk line\n");
-		N51PGM_release_pin(clk_line);
+		release_pin(ctx, &ctx->clk_line);
 	}
-	if (trigger_line) {
+	if (ctx->trigger_line) {
 		DEBUG_PRINT("Releasing trigger line\n");
-		N51PGM_release_pin(trigger_line);
+		release_pin(ctx, &ctx->trigger_line);
 	}
 }
 
-void N51PGM_release_rst(void) {
-	if (rst_line) {
+void N51PGM_ctx_release_rst(n51pgm_ctx *ctx) {
+	if (ctx->rst_line) {
 		DEBUG_PRINT("Releasing rst line\n");
-		N51PGM_release_pin(rst_line);
+		release_pin(ctx, &ctx->rst_line);
 	}
 }
 
-void N51PGM_release_pins(void){
-	N51PGM_release_non_reset_pins();
-	N51PGM_release_rst();
+void N51PGM_ctx_release_pins(n51pgm_ctx *ctx){
+	release_non_reset_pins(ctx);
+	N51PGM_ctx_release_rst(ctx);
 }
 
-void N51PGM_deinit(uint8_t leave_reset_high)
+void N51PGM_ctx_deinit(n51pgm_ctx *ctx, uint8_t leave_reset_high)
 {
 	if (leave_reset_high){
-		N51PGM_set_rst(1);
-		N51PGM_release_non_reset_pins();
+		N51PGM_ctx_set_rst(ctx, 1);
+		release_non_reset_pins(ctx);
 	} else {
-		N51PGM_release_pins();
+		N51PGM_ctx_release_pins(ctx);
 	}
-	if (chip) {
-		gpiod_chip_close(chip);
+	if (ctx->chip) {
+		gpiod_chip_close(ctx->chip);
+		ctx->chip = NULL;
 	}
 }
 
 
-uint64_t N51PGM_get_time(){
+uint64_t N51PGM_ctx_get_time(n51pgm_ctx *ctx){
 	struct timespec curr_time;
 	clock_gettime(CLOCK_MONOTONIC_RAW, &curr_time);
 	return (curr_time.tv_sec * 1000000) + (curr_time.tv_nsec / 1000);
 }
 
-void N51PGM_set_trigger(uint8_t val){
-	if (gpiod_line_set_value(trigger_line, val) < 0)
+void N51PGM_ctx_set_trigger(n51pgm_ctx *ctx, uint8_t val){
+	if (!ctx->trigger_line)
+		return;
+	if (gpiod_line_set_value(ctx->trigger_line, val) < 0)
 		fprintf(stderr, "Setting trigger line failed\n");
 }
 
+// The enabled DAT lines of a gang are requested together, so each gang operation on them is a single ioctl
+struct _n51pgm_gang {
+	n51pgm_gang_pins pins;
+	struct gpiod_chip *chip;
+	struct gpiod_line *clk_line, *rst_line;
+	struct gpiod_line_bulk dat_bulk;
+	int bulk_target[N51PGM_GANG_MAX]; // target of each line in dat_bulk
+	uint32_t enabled;
+};
+
+n51pgm_gang *N51PGM_gang_create(const n51pgm_gang_pins *pins)
+{
+	if (pins->count <= 0 || pins->count > N51PGM_GANG_MAX)
+		return NULL;
+	n51pgm_gang *gang = calloc(1, sizeof(n51pgm_gang));
+	if (!gang)
+		return NULL;
+	gang->pins = *pins;
+	if (gang->pins.clk < 0)
+		gang->pins.clk = GPIO_CLK;
+	if (gang->pins.rst < 0)
+		gang->pins.rst = GPIO_RST;
+	gpiod_line_bulk_init(&gang->dat_bulk);
+	return gang;
+}
+
+void N51PGM_gang_free(n51pgm_gang *gang)
+{
+	free(gang);
+}
+
+static int gang_request_dat(n51pgm_gang *gang, uint32_t mask)
+{
+	gpiod_line_bulk_init(&gang->dat_bulk);
+	for (int i = 0; i < gang->pins.count; i++) {
+		if (!(mask & (1u << i)))
+			continue;
+		struct gpiod_line *line = gpiod_chip_get_line(gang->chip, gang->pins.dat[i]);
+		if (!line) {
+			fprintf(stderr, "Error getting GPIO line %d!\n", gang->pins.dat[i]);
+			return -ENOENT;
+		}
+		gang->bulk_target[gpiod_line_bulk_num_lines(&gang->dat_bulk)] = i;
+		gpiod_line_bulk_add(&gang->dat_bulk, line);
+	}
+	gang->enabled = mask;
+	if (gpiod_line_bulk_num_lines(&gang->dat_bulk) == 0)
+		return 0;
+	if (gpiod_line_request_bulk_input(&gang->dat_bulk, CONSUMER) < 0) {
+		fprintf(stderr, "Request data lines failed\n");
+		return -ENOENT;
+	}
+	return 0;
+}
+
+static void gang_release_dat(n51pgm_gang *gang)
+{
+	if (gpiod_line_bulk_num_lines(&gang->dat_bulk) == 0)
+		return;
+	gpiod_line_set_direction_input_bulk(&gang->dat_bulk);
+	gpiod_line_release_bulk(&gang->dat_bulk);
+	gpiod_line_bulk_init(&gang->dat_bulk);
+}
+
+int N51PGM_gang_init(n51pgm_gang *gang)
+{
+	gang->chip = gpiod_chip_open_by_name("gpiochip4");
+	if (!gang->chip)
+		gang->chip = gpiod_chip_open_by_name("gpiochip0");
+	if (!gang->chip) {
+		fprintf(stderr, "Open chip failed\n");
+		return -ENOENT;
+	}
+	gang->clk_line = gpiod_chip_get_line(gang->chip, gang->pins.clk);
+	gang->rst_line = gpiod_chip_get_line(gang->chip, gang->pins.rst);
+	if (!gang->clk_line || !gang->rst_line) {
+		fprintf(stderr, "Error getting required GPIO lines!\n");
+		return -ENOENT;
+	}
+	int ret = gpiod_line_request_output(gang->rst_line, CONSUMER, 0);
+	ret |= gpiod_line_request_output(gang->clk_line, CONSUMER, 0);
+	if (ret < 0) {
+		fprintf(stderr, "Request line as output failed\n");
+		return -ENOENT;
+	}
+	return gang_request_dat(gang, gang->pins.count == 32 ? 0xFFFFFFFF : (1u << gang->pins.count) - 1);
+}
+
+void N51PGM_gang_deinit(n51pgm_gang *gang, uint8_t leave_reset_high)
+{
+	gang_release_dat(gang);
+	release_pin(NULL, &gang->clk_line);
+	if (leave_reset_high) {
+		gpiod_line_set_value(gang->rst_line, 1);
+	} else {
+		release_pin(NULL, &gang->rst_line);
+	}
+	if (gang->chip) {
+		gpiod_chip_close(gang->chip);
+		gang->chip = NULL;
+	}
+}
+
+void N51PGM_gang_enable(n51pgm_gang *gang, uint32_t mask)
+{
+	if (mask == gang->enabled)
+		return;
+	gang_release_dat(gang);
+	gang_request_dat(gang, mask);
+}
+
+void N51PGM_gang_set_dat(n51pgm_gang *gang, uint32_t vals)
+{
+	int values[N51PGM_GANG_MAX];
+	unsigned int n = gpiod_line_bulk_num_lines(&gang->dat_bulk);
+	if (n == 0)
+		return;
+	for (unsigned int i = 0; i < n; i++)
+		values[i] = (vals >> gang->bulk_target[i]) & 1;
+	if (gpiod_line_set_value_bulk(&gang->dat_bulk, values) < 0)
+		fprintf(stderr, "Setting data lines failed\n");
+}
+
+uint32_t N51PGM_gang_get_dat(n51pgm_gang *gang)
+{
+	int values[N51PGM_GANG_MAX];
+	unsigned int n = gpiod_line_bulk_num_lines(&gang->dat_bulk);
+	uint32_t vals = 0;
+	if (n == 0)
+		return 0;
+	if (gpiod_line_get_value_bulk(&gang->dat_bulk, values) < 0) {
+		fprintf(stderr, "Getting data lines failed\n");
+		return 0;
+	}
+	for (unsigned int i = 0; i < n; i++)
+		vals |= (uint32_t)(values[i] & 1) << gang->bulk_target[i];
+	return vals;
+}
+
+void N51PGM_gang_dat_dir(n51pgm_gang *gang, uint8_t state)
+{
+	int values[N51PGM_GANG_MAX] = {0};
+	int ret;
+	if (gpiod_line_bulk_num_lines(&gang->dat_bulk) == 0)
+		return;
+	if (state)
+		ret = gpiod_line_set_direction_output_bulk(&gang->dat_bulk, values);
+	else
+		ret = gpiod_line_set_direction_input_bulk(&gang->dat_bulk);
+	if (ret < 0)
+		fprintf(stderr, "Setting data directions failed\n");
+}
+
+void N51PGM_gang_set_clk(n51pgm_gang *gang, uint8_t val)
+{
+	if (gpiod_line_set_value(gang->clk_line, val) < 0)
+		fprintf(stderr, "Setting clock line failed\n");
+}
+
+void N51PGM_gang_set_rst(n51pgm_gang *gang, uint8_t val)
+{
+	if (gpiod_line_set_value(gang->rst_line, val) < 0)
+		fprintf(stderr, "Setting reset line failed\n");
+}
+
+uint32_t N51PGM_gang_usleep(n51pgm_gang *gang, uint32_t usec)
+{
+	return N51PGM_ctx_usleep(&default_ctx, usec);
+}
+
+uint64_t N51PGM_gang_get_time(n51pgm_gang *gang)
+{
+	return N51PGM_ctx_get_time(&default_ctx);
+}
+
+int N51PGM_init(void)
+{
+	return N51PGM_ctx_init(&default_ctx);
+}
+
+void N51PGM_deinit(uint8_t leave_reset_high)
+{
+	N51PGM_ctx_deinit(&default_ctx, leave_reset_high);
+}
+
+void N51PGM_set_dat(uint8_t val)
+{
+	N51PGM_ctx_set_dat(&default_ctx, val);
+}
+
+uint8_t N51PGM_get_dat(void)
+{
+	return N51PGM_ctx_get_dat(&default_ctx);
+}
+
+void N51PGM_set_rst(uint8_t val)
+{
+	N51PGM_ctx_set_rst(&default_ctx, val);
+}
+
+void N51PGM_set_clk(uint8_t val)
+{
+	N51PGM_ctx_set_clk(&default_ctx, val);
+}
+
+void N51PGM_set_trigger(uint8_t val)
+{
+	N51PGM_ctx_set_trigger(&default_ctx, val);
+}
+
+void N51PGM_dat_dir(uint8_t state)
+{
+	N51PGM_ctx_dat_dir(&default_ctx, state);
+}
+
+void N51PGM_release_pins(void)
+{
+	N51PGM_ctx_release_pins(&default_ctx);
+}
+
+void N51PGM_release_rst(void)
+{
+	N51PGM_ctx_release_rst(&default_ctx);
+}
+
+uint32_t N51PGM_usleep(uint32_t usec)
+{
+	return N51PGM_ctx_usleep(&default_ctx, usec);
+}
+
+uint64_t N51PGM_get_time(void)
+{
+	return N51PGM_ctx_get_time(&default_ctx);
+}
+
 #endif
@@ -0,0 +1,416 @@
+/*
+ * nuvo51icp, a RPi ICP flasher for the Nuvoton N76E003
+ * https://github.com/steve-m/N76E003-playground
+ *
+ * Copyright (c) 2021 Steve Markgraf <steve@steve-m.de>
+ * Copyright (c) 2023-2024 Nikita Lita
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * PGM device file backed by a simulated N76E003 (see n51_sim.c) and a virtual clock.
+ *
+ * Nothing here touches real hardware or really sleeps: every pin operation advances the clock by
+ * N51SIM_GPIO_LATENCY_NS and every sleep by its duration plus N51SIM_SLEEP_OVERHEAD_NS, so the
+ * time reported by N51PGM_get_time() is what the same sequence would cost on a host with that latency.
+ * Every context gets its own target and clock.
+ *
+ * Environment variables:
+ *   N51SIM_GPIO_LATENCY_NS    cost of a single pin operation (default 0)
+ *   N51SIM_SLEEP_OVERHEAD_NS  extra cost of each non-zero sleep (default 0)
+ *   N51SIM_FLASH, N51SIM_CONFIG  initial target contents (see N51SIM_load_env())
+ */
+
+#ifndef ARDUINO
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "n51_pgm.h"
+#include "n51_sim.h"
+
+// The pin map is only recorded
+struct _n51pgm_ctx {
+	n51pgm_pins pins;
+	n51sim_target target;
+	uint8_t target_initialized;
+	uint64_t sim_time_ns;
+	uint32_t gpio_latency_ns;
+	uint32_t sleep_overhead_ns;
+	// hot-swap model (N51SIM_SWAP): a new blank board is attached for swap_present_ns out of every swap_cycle_ns
+	uint64_t swap_present_ns;
+	uint64_t swap_cycle_ns;
+	uint64_t swap_slot;
+};
+
+static n51pgm_ctx default_ctx = {{0, 0, 0, -1}};
+
+static uint32_t env_u32(const char *name, uint32_t def)
+{
+	const char *val = getenv(name);
+	if (!val || !*val)
+		return def;
+	return (uint32_t)strtoul(val, NULL, 0);
+}
+
+static n51sim_target *ctx_target(n51pgm_ctx *ctx)
+{
+	if (!ctx->target_initialized) {
+		N51SIM_init(&ctx->target, 0x4E373645);
+		N51SIM_load_env(&ctx->target);
+		ctx->target_initialized = 1;
+	}
+	return &ctx->target;
+}
+
+n51sim_target *N51SIM_pgm_target(void)
+{
+	return ctx_target(&default_ctx);
+}
+
+n51pgm_ctx *N51PGM_ctx_create(const n51pgm_pins *pins)
+{
+	n51pgm_ctx *ctx = calloc(1, sizeof(n51pgm_ctx));
+	if (!ctx)
+		return NULL;
+	ctx->pins = pins ? *pins : default_ctx.pins;
+	return ctx;
+}
+
+void N51PGM_ctx_free(n51pgm_ctx *ctx)
+{
+	if (ctx != &default_ctx)
+		free(ctx);
+}
+
+n51pgm_ctx *N51PGM_default_ctx(void)
+{
+	return &default_ctx;
+}
+
+static void sim_swap(n51pgm_ctx *ctx)
+{
+	uint64_t slot = ctx->sim_time_ns / ctx->swap_cycle_ns;
+	uint8_t present = ctx->sim_time_ns % ctx->swap_cycle_ns < ctx->swap_present_ns;
+	if (present && slot != ctx->swap_slot) {
+		n51sim_target *t = &ctx->target;
+		uint8_t rst = t->rst, clk = t->clk, dat = t->dat, host_drives_dat = t->host_drives_dat;
+		N51SIM_init(t, 0x4E373645 + (uint32_t)slot);
+		N51SIM_load_env(t);
+		t->rst = rst;
+		t->clk = clk;
+		t->dat = dat;
+		t->host_drives_dat = host_drives_dat;
+		ctx->swap_slot = slot;
+	}
+	ctx->target.present = present;
+}
+
+static inline void sim_tick(n51pgm_ctx *ctx)
+{
+	ctx->sim_time_ns += ctx->gpio_latency_ns;
+	ctx->target.now_ns = ctx->sim_time_ns;
+	if (ctx->swap_cycle_ns)
+		sim_swap(ctx);
+}
+
+int N51PGM_ctx_init(n51pgm_ctx *ctx)
+{
+	ctx->gpio_latency_ns = env_u32("N51SIM_GPIO_LATENCY_NS", 0);
+	ctx->sleep_overhead_ns = env_u32("N51SIM_SLEEP_OVERHEAD_NS", 0);
+	const char *swap = getenv("N51SIM_SWAP");
+	unsigned int present_ms, absent_ms;
+	if (swap && sscanf(swap, "%u,%u", &present_ms, &absent_ms) == 2 && present_ms + absent_ms > 0) {
+		ctx->swap_present_ns = (uint64_t)present_ms * 1000000;
+		ctx->swap_cycle_ns = (uint64_t)(present_ms + absent_ms) * 1000000;
+		ctx->swap_slot = 0;
+	}
+	n51sim_target *target = ctx_target(ctx);
+	N51SIM_dat_dir(target, 0);
+	N51SIM_set_clk(target, 0);
+	N51SIM_set_rst(target, 0);
+	return 0;
+}
+
+void N51PGM_ctx_set_dat(n51pgm_ctx *ctx, uint8_t val)
+{
+	sim_tick(ctx);
+	N51SIM_set_dat(&ctx->target, val);
+}
+
+uint8_t N51PGM_ctx_get_dat(n51pgm_ctx *ctx)
+{
+	sim_tick(ctx);
+	return N51SIM_get_dat(&ctx->target);
+}
+
+void N51PGM_ctx_set_rst(n51pgm_ctx *ctx, uint8_t val)
+{
+	sim_tick(ctx);
+	N51SIM_set_rst(&ctx->target, val);
+}
+
+void N51PGM_ctx_set_clk(n51pgm_ctx *ctx, uint8_t val)
+{
+	sim_tick(ctx);
+	N51SIM_set_clk(&ctx->target, val);
+}
+
+void N51PGM_ctx_set_trigger(n51pgm_ctx *ctx, uint8_t val)
+{
+	sim_tick(ctx);
+}
+
+void N51PGM_ctx_dat_dir(n51pgm_ctx *ctx, uint8_t state)
+{
+	sim_tick(ctx);
+	N51SIM_dat_dir(&ctx->target, state);
+}
+
+void N51PGM_ctx_release_pins(n51pgm_ctx *ctx)
+{
+	N51SIM_dat_dir(&ctx->target, 0);
+}
+
+void N51PGM_ctx_release_rst(n51pgm_ctx *ctx)
+{
+	// the target's pull-up takes RST high when released
+	N51SIM_set_rst(&ctx->target, 1);
+}
+
+void N51PGM_ctx_deinit(n51pgm_ctx *ctx, uint8_t leave_reset_high)
+{
+	if (leave_reset_high)
+		N51PGM_ctx_set_rst(ctx, 1);
+	else
+		N51PGM_ctx_release_pins(ctx);
+	N51PGM_ctx_release_rst(ctx);
+}
+
+uint32_t N51PGM_ctx_usleep(n51pgm_ctx *ctx, uint32_t usec)
+{
+	if (usec == 0)
+		return 0;
+	ctx->sim_time_ns += (uint64_t)usec * 1000 + ctx->sleep_overhead_ns;
+	return usec;
+}
+
+uint64_t N51PGM_ctx_get_time(n51pgm_ctx *ctx)
+{
+	return ctx->sim_time_ns / 1000;
+}
+
+int N51PGM_init(void)
+{
+	return N51PGM_ctx_init(&default_ctx);
+}
+
+void N51PGM_deinit(uint8_t leave_reset_high)
+{
+	N51PGM_ctx_deinit(&default_ctx, leave_reset_high);
+}
+
+void N51PGM_set_dat(uint8_t val)
+{
+	N51PGM_ctx_set_dat(&default_ctx, val);
+}
+
+uint8_t N51PGM_get_dat(void)
+{
+	return N51PGM_ctx_get_dat(&default_ctx);
+}
+
+void N51PGM_set_rst(uint8_t val)
+{
+	N51PGM_ctx_set_rst(&default_ctx, val);
+}
+
+void N51PGM_set_clk(uint8_t val)
+{
+	N51PGM_ctx_set_clk(&default_ctx, val);
+}
+
+void N51PGM_set_trigger(uint8_t val)
+{
+	N51PGM_ctx_set_trigger(&default_ctx, val);
+}
+
+void N51PGM_dat_dir(uint8_t state)
+{
+	N51PGM_ctx_dat_dir(&default_ctx, state);
+}
+
+void N51PGM_release_pins(void)
+{
+	N51PGM_ctx_release_pins(&default_ctx);
+}
+
+void N51PGM_release_rst(void)
+{
+	N51PGM_ctx_release_rst(&default_ctx);
+}
+
+uint32_t N51PGM_usleep(uint32_t usec)
+{
+	return N51PGM_ctx_usleep(&default_ctx, usec);
+}
+
+uint64_t N51PGM_get_time(void)
+{
+	return N51PGM_ctx_get_time(&default_ctx);
+}
+
+void N51PGM_print(const char *msg)
+{
+	fprintf(stderr, "%s", msg);
+}
+
+// Gang of simulated targets on one virtual clock; every gang operation costs a single pin operation
+struct _n51pgm_gang {
+	n51pgm_gang_pins pins;
+	uint32_t enabled;
+	uint64_t sim_time_ns;
+	uint32_t gpio_latency_ns;
+	uint32_t sleep_overhead_ns;
+	n51sim_target targets[];
+};
+
+static inline void gang_tick(n51pgm_gang *gang)
+{
+	gang->sim_time_ns += gang->gpio_latency_ns;
+	for (int i = 0; i < gang->pins.count; i++)
+		gang->targets[i].now_ns = gang->sim_time_ns;
+}
+
+n51pgm_gang *N51PGM_gang_create(const n51pgm_gang_pins *pins)
+{
+	if (pins->count <= 0 || pins->count > N51PGM_GANG_MAX)
+		return NULL;
+	n51pgm_gang *gang = calloc(1, sizeof(n51pgm_gang) + pins->count * sizeof(n51sim_target));
+	if (!gang)
+		return NULL;
+	gang->pins = *pins;
+	for (int i = 0; i < pins->count; i++) {
+		N51SIM_init(&gang->targets[i], 0x4E373645 + i);
+		N51SIM_load_env(&gang->targets[i]);
+	}
+	return gang;
+}
+
+void N51PGM_gang_free(n51pgm_gang *gang)
+{
+	free(gang);
+}
+
+// The simulated target behind DAT line `index` of a gang
+n51sim_target *N51SIM_gang_target(n51pgm_gang *gang, int index)
+{
+	return &gang->targets[index];
+}
+
+int N51PGM_gang_init(n51pgm_gang *gang)
+{
+	gang->gpio_latency_ns = env_u32("N51SIM_GPIO_LATENCY_NS", 0);
+	gang->sleep_overhead_ns = env_u32("N51SIM_SLEEP_OVERHEAD_NS", 0);
+	gang->enabled = gang->pins.count == 32 ? 0xFFFFFFFF : (1u << gang->pins.count) - 1;
+	for (int i = 0; i < gang->pins.count; i++) {
+		N51SIM_dat_dir(&gang->targets[i], 0);
+		N51SIM_set_clk(&gang->targets[i], 0);
+		N51SIM_set_rst(&gang->targets[i], 0);
+	}
+	return 0;
+}
+
+void N51PGM_gang_deinit(n51pgm_gang *gang, uint8_t leave_reset_high)
+{
+	for (int i = 0; i < gang->pins.count; i++) {
+		N51SIM_dat_dir(&gang->targets[i], 0);
+		N51SIM_set_rst(&gang->targets[i], 1);
+	}
+}
+
+void N51PGM_gang_enable(n51pgm_gang *gang, uint32_t mask)
+{
+	for (int i = 0; i < gang->pins.count; i++) {
+		if ((gang->enabled & ~mask) & (1u << i))
+			N51SIM_dat_dir(&gang->targets[i], 0);
+	}
+	gang->enabled = mask;
+}
+
+void N51PGM_gang_set_dat(n51pgm_gang *gang, uint32_t vals)
+{
+	gang_tick(gang);
+	for (int i = 0; i < gang->pins.count; i++) {
+		if (gang->enabled & (1u << i))
+			N51SIM_set_dat(&gang->targets[i], (vals >> i) & 1);
+	}
+}
+
+uint32_t N51PGM_gang_get_dat(n51pgm_gang *gang)
+{
+	uint32_t vals = 0;
+	gang_tick(gang);
+	for (int i = 0; i < gang->pins.count; i++) {
+		if (gang->enabled & (1u << i))
+			vals |= (uint32_t)N51SIM_get_dat(&gang->targets[i]) << i;
+	}
+	return vals;
+}
+
+void N51PGM_gang_dat_dir(n51pgm_gang *gang, uint8_t state)
+{
+	gang_tick(gang);
+	for (int i = 0; i < gang->pins.count; i++) {
+		if (gang->enabled & (1u << i))
+			N51SIM_dat_dir(&gang->targets[i], state);
+	}
+}
+
+void N51PGM_gang_set_clk(n51pgm_gang *gang, uint8_t val)
+{
+	gang_tick(gang);
+	for (int i = 0; i < gang->pins.count; i++)
+		N51SIM_set_clk(&gang->targets[i], val);
+}
+
+void N51PGM_gang_set_rst(n51pgm_gang *gang, uint8_t val)
+{
+	gang_tick(gang);
+	for (int i = 0; i < gang->pins.count; i++)
+		N51SIM_set_rst(&gang->targets[i], val);
+}
+
+uint32_t N51PGM_gang_usleep(n51pgm_gang *gang, uint32_t usec)
+{
+	if (usec == 0)
+		return 0;
+	gang->sim_time_ns += (uint64_t)usec * 1000 + gang->sleep_overhead_ns;
+	return usec;
+}
+
+uint64_t N51PGM_gang_get_time(n51pgm_gang *gang)
+{
+	return gang->sim_time_ns / 1000;
+}
+
+#endif // ARDUINO
@@ -30,89 +30,189 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
 
-static int8_t dat_dir = -1;
-static int8_t dat = -1;
-static int8_t rst = -1;
-static int8_t clk = -1;
-static uint8_t pgm_init_done = false;
+#include "n51_pgm.h"
 
-int N51PGM_init(void)
+struct _n51pgm_ctx {
+	n51pgm_pins pins;
+	int8_t dat_dir;
+	int8_t dat;
+	int8_t rst;
+	int8_t clk;
+	uint8_t pgm_init_done;
+};
+
+static n51pgm_ctx default_ctx = {{0, 0, 0, -1}, -1, -1, -1, -1, false};
+
+n51pgm_ctx *N51PGM_ctx_create(const n51pgm_pins *pins)
+{
+	n51pgm_ctx *ctx = malloc(sizeof(n51pgm_ctx));
+	if (!ctx)
+		return NULL;
+	*ctx = default_ctx;
+	if (pins)
+		ctx->pins = *pins;
+	return ctx;
+}
+
+void N51PGM_ctx_free(n51pgm_ctx *ctx)
+{
+	if (ctx != &default_ctx)
+		free(ctx);
+}
+
+n51pgm_ctx *N51PGM_default_ctx(void)
 {
+	return &default_ctx;
+}
+
+int N51PGM_ctx_init(n51pgm_ctx *ctx)
+{
+	ctx->pgm_init_done = true;
 	return 0;
 }
 
-void N51PGM_set_dat(uint8_t val)
+void N51PGM_ctx_set_dat(n51pgm_ctx *ctx, uint8_t val)
 {
-	if (dat_dir == 1) {
+	if (ctx->dat_dir == 1) {
 		printf("%d", val);
-		dat = val;
+		ctx->dat = val;
 	} else {
 		printf("N51PGM_set_dat() called while dat_dir == 0\n");
 	}
 	
 }
 
-uint8_t N51PGM_get_dat(void)
+uint8_t N51PGM_ctx_get_dat(n51pgm_ctx *ctx)
 {
-	if (dat_dir == 0){
-		return dat;
+	if (ctx->dat_dir == 0){
+		return ctx->dat;
 	} else {
 		printf("N51PGM_get_dat() called while dat_dir == 1\n");
 		return 0;
 	}
 }
 
-void N51PGM_set_rst(uint8_t val)
+void N51PGM_ctx_set_rst(n51pgm_ctx *ctx, uint8_t val)
 {
-	rst = val;
+	ctx->rst = val;
 }
 
-void N51PGM_set_clk(uint8_t val)
+void N51PGM_ctx_set_clk(n51pgm_ctx *ctx, uint8_t val)
 {
-	clk = val;
+	ctx->clk = val;
 }
 
-void N51PGM_dat_dir(uint8_t state)
+void N51PGM_ctx_dat_dir(n51pgm_ctx *ctx, uint8_t state)
 {
-	dat_dir = state;
+	ctx->dat_dir = state;
 }
 
-void N51PGM_deinit(uint8_t leave_reset_high)
+void N51PGM_ctx_deinit(n51pgm_ctx *ctx, uint8_t leave_reset_high)
 {
 	if (leave_reset_high)
-		N51PGM_set_rst(1);
+		N51PGM_ctx_set_rst(ctx, 1);
 	else{
-		rst = -1;
+		ctx->rst = -1;
 	}
-	clk = -1;
-	dat = -1;
-	dat_dir = -1;
-	pgm_init_done = false;
+	ctx->clk = -1;
+	ctx->dat = -1;
+	ctx->dat_dir = -1;
+	ctx->pgm_init_done = false;
+
+}
+
+void N51PGM_ctx_release_pins(n51pgm_ctx *ctx)
+{
+	ctx->rst = -1;
+	ctx->clk = -1;
+	ctx->dat = -1;
+	ctx->dat_dir = -1;
+}
+
+void N51PGM_ctx_release_rst(n51pgm_ctx *ctx)
+{
+	ctx->rst = -1;
+}
+
+void N51PGM_ctx_set_trigger(n51pgm_ctx *ctx, uint8_t val)
+{
+	printf("N51PGM_set_trigger() called\n");
+}
+
+uint32_t N51PGM_ctx_usleep(n51pgm_ctx *ctx, uint32_t usec)
+{
+	return usec;
+}
+
+// A real clock, so that loops bounded by backend time (e.g. N51ICP_ctx_recover_entry()) still end
+uint64_t N51PGM_ctx_get_time(n51pgm_ctx *ctx)
+{
+	struct timespec curr_time;
+	clock_gettime(CLOCK_MONOTONIC, &curr_time);
+	return (curr_time.tv_sec * 1000000ULL) + (curr_time.tv_nsec / 1000);
+}
+
+int N51PGM_init(void)
+{
+	return N51PGM_ctx_init(&default_ctx);
+}
+
+void N51PGM_deinit(uint8_t leave_reset_high)
+{
+	N51PGM_ctx_deinit(&default_ctx, leave_reset_high);
+}
+
+void N51PGM_set_dat(uint8_t val)
+{
+	N51PGM_ctx_set_dat(&default_ctx, val);
+}
+
+uint8_t N51PGM_get_dat(void)
+{
+	return N51PGM_ctx_get_dat(&default_ctx);
+}
+
+void N51PGM_set_rst(uint8_t val)
+{
+	N51PGM_ctx_set_rst(&default_ctx, val);
+}
+
+void N51PGM_set_clk(uint8_t val)
+{
+	N51PGM_ctx_set_clk(&default_ctx, val);
+}
 
+void N51PGM_dat_dir(uint8_t state)
+{
+	N51PGM_ctx_dat_dir(&default_ctx, state);
 }
 
 void N51PGM_release_pins(void)
 {
-	rst = -1;
-	clk = -1;
-	dat = -1;
-	dat_dir = -1;
+	N51PGM_ctx_release_pins(&default_ctx);
 }
 
 void N51PGM_release_rst(void)
 {
-	rst = -1;
+	N51PGM_ctx_release_rst(&default_ctx);
 }
 
-void N51PGM_set_trigger(void)
+void N51PGM_set_trigger(uint8_t val)
 {
-	printf("N51PGM_set_trigger() called\n");
+	N51PGM_ctx_set_trigger(&default_ctx, val);
 }
 
 uint32_t N51PGM_usleep(uint32_t usec)
 {
-	return usec;
+	return N51PGM_ctx_usleep(&default_ctx, usec);
+}
+
+uint64_t N51PGM_get_time(void)
+{
+	return N51PGM_ctx_get_time(&default_ctx);
 }
 
 void N51PGM_print(const char *msg)
@@ -120,4 +220,71 @@ void N51PGM_print(const char *msg)
 	printf("%s", msg);
 }
 
+struct _n51pgm_gang {
+	n51pgm_gang_pins pins;
+	uint32_t enabled;
+};
+
+n51pgm_gang *N51PGM_gang_create(const n51pgm_gang_pins *pins)
+{
+	if (pins->count <= 0 || pins->count > N51PGM_GANG_MAX)
+		return NULL;
+	n51pgm_gang *gang = calloc(1, sizeof(n51pgm_gang));
+	if (gang)
+		gang->pins = *pins;
+	return gang;
+}
+
+void N51PGM_gang_free(n51pgm_gang *gang)
+{
+	free(gang);
+}
+
+int N51PGM_gang_init(n51pgm_gang *gang)
+{
+	gang->enabled = gang->pins.count == 32 ? 0xFFFFFFFF : (1u << gang->pins.count) - 1;
+	return 0;
+}
+
+void N51PGM_gang_deinit(n51pgm_gang *gang, uint8_t leave_reset_high)
+{
+}
+
+void N51PGM_gang_enable(n51pgm_gang *gang, uint32_t mask)
+{
+	gang->enabled = mask;
+}
+
+void N51PGM_gang_set_dat(n51pgm_gang *gang, uint32_t vals)
+{
+	printf("[%08x]", vals & gang->enabled);
+}
+
+uint32_t N51PGM_gang_get_dat(n51pgm_gang *gang)
+{
+	return 0;
+}
+
+void N51PGM_gang_dat_dir(n51pgm_gang *gang, uint8_t state)
+{
+}
+
+void N51PGM_gang_set_clk(n51pgm_gang *gang, uint8_t val)
+{
+}
+
+void N51PGM_gang_set_rst(n51pgm_gang *gang, uint8_t val)
+{
+}
+
+uint32_t N51PGM_gang_usleep(n51pgm_gang *gang, uint32_t usec)
+{
+	return usec;
+}
+
+uint64_t N51PGM_gang_get_time(n51pgm_gang *gang)
+{
+	return N51PGM_ctx_get_time(NULL);
+}
+
 #endif
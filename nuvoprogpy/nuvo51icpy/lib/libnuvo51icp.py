@@ -1,4 +1,5 @@
 import ctypes
+import struct
 
 # get dir of this file
 import os
@@ -25,6 +26,80 @@ def override_signals():
     signal.signal(signal.SIGTERM, catch_ctrlc)
 
 
+# N51ICP_recover_entry() policies
+N51ICP_RECOVER_SWEEP = 0
+N51ICP_RECOVER_RANDOM = 1
+N51ICP_RECOVER_ADAPTIVE = 2
+
+
+class N51EntryTiming(ctypes.Structure):
+    _fields_ = [
+        ("delay1", ctypes.c_uint32),
+        ("delay2", ctypes.c_uint32),
+        ("delay3", ctypes.c_uint32),
+        ("full_exit", ctypes.c_uint8),
+    ]
+
+
+class N51SweepRange(ctypes.Structure):
+    _fields_ = [
+        ("start", ctypes.c_uint32),
+        ("stop", ctypes.c_uint32),
+        ("step", ctypes.c_uint32),
+    ]
+
+
+class N51SweepSpec(ctypes.Structure):
+    _fields_ = [
+        ("delay1", N51SweepRange),
+        ("delay2", N51SweepRange),
+        ("delay_after_trigger_high", N51SweepRange),
+        ("delay_before_trigger_low", N51SweepRange),
+        ("repeats", ctypes.c_uint32),
+        ("samples", ctypes.c_uint32),
+        ("seed", ctypes.c_uint32),
+    ]
+
+
+SWEEP_DELAYS = ("delay1", "delay2", "delay_after_trigger_high", "delay_before_trigger_low")
+
+
+def read_sweep_log(path: str):
+    """
+    Reads a log written by N51SW_run() (see n51_sweep.h)
+
+    Returns (spec, cells): spec is a dict with a (start, stop, step) tuple per delay and repeats, samples and
+    seed; every cell is a dict with the four delays, attempts, other, time_us and buckets, a dict mapping the
+    config bytes read back to how often they were. A cell cut short at the end (sweep still running) is left out.
+    """
+    with open(path, "rb") as f:
+        data = f.read()
+    if data[:8] != b"N51SWEEP":
+        raise ValueError("%s is not a sweep log" % path)
+    version, = struct.unpack_from("<I", data, 8)
+    if version != 1:
+        raise ValueError("Unsupported sweep log version %d" % version)
+    fields = struct.unpack_from("<15I", data, 12)
+    spec = {name: tuple(fields[i * 3:i * 3 + 3]) for i, name in enumerate(SWEEP_DELAYS)}
+    spec["repeats"], spec["samples"], spec["seed"] = fields[12:15]
+    off = 12 + 15 * 4
+    cells = []
+    while off + 29 <= len(data):
+        values = struct.unpack_from("<7IB", data, off)
+        n = values[7]
+        if off + 29 + n * 9 > len(data):
+            break
+        cell = dict(zip(SWEEP_DELAYS + ("attempts", "other", "time_us"), values[:7]))
+        cell["buckets"] = {}
+        off += 29
+        for _ in range(n):
+            cfg = bytes(data[off:off + 5])
+            cell["buckets"][cfg], = struct.unpack_from("<I", data, off + 5)
+            off += 9
+        cells.append(cell)
+    return spec, cells
+
+
 class LibICP:
     def __init__(self, libname="gpiod"):
         # Load the shared library
@@ -97,6 +172,26 @@ class LibICP:
         self.lib.N51ICP_page_erase.argtypes = [ctypes.c_uint32]
         self.lib.N51ICP_page_erase.restype = None
 
+        self.lib.N51ICP_set_reset_seq.argtypes = [ctypes.c_uint32, ctypes.c_uint32]
+        self.lib.N51ICP_set_reset_seq.restype = None
+
+        self.lib.N51ICP_find_reset_delay.argtypes = [ctypes.c_uint32, ctypes.c_int]
+        self.lib.N51ICP_find_reset_delay.restype = ctypes.c_uint32
+
+        self.lib.N51ICP_enable_shadow.argtypes = [ctypes.c_uint8]
+        self.lib.N51ICP_enable_shadow.restype = ctypes.c_int
+
+        self.lib.N51ICP_recover_entry.argtypes = [
+            ctypes.c_int, ctypes.c_uint32, ctypes.POINTER(N51EntryTiming)]
+        self.lib.N51ICP_recover_entry.restype = ctypes.c_int
+
+        self.lib.N51ICP_default_ctx.argtypes = []
+        self.lib.N51ICP_default_ctx.restype = ctypes.c_void_p
+
+        self.lib.N51SW_run.argtypes = [ctypes.c_void_p, ctypes.POINTER(N51SweepSpec), ctypes.c_char_p,
+                                       ctypes.c_void_p, ctypes.c_void_p]
+        self.lib.N51SW_run.restype = ctypes.c_int64
+
         # Wrapper functions
 
     def send_entry_bits(self) -> None:
@@ -181,6 +276,41 @@ class LibICP:
     def page_erase(self, addr):
         self.lib.N51ICP_page_erase(ctypes.c_uint32(addr))
 
+    def set_reset_seq(self, reset_seq=0x9e1cb6, bit_delay=10000):
+        """Sets the reset sequence (ICP_RESET_SEQ or ALT_RESET_SEQ) and its bit period in us for the next entry"""
+        self.lib.N51ICP_set_reset_seq(ctypes.c_uint32(reset_seq), ctypes.c_uint32(bit_delay))
+
+    def find_reset_delay(self, max_delay=10000, tries=3) -> int:
+        """Finds and sets the shortest working reset sequence bit period; returns it, or 0 if no device answered"""
+        return int(self.lib.N51ICP_find_reset_delay(ctypes.c_uint32(max_delay), ctypes.c_int(tries)))
+
+    def enable_shadow(self, enable=True) -> bool:
+        """Answers repeated ID, config and flash reads from a session shadow until a write, erase or re-entry"""
+        return self.lib.N51ICP_enable_shadow(ctypes.c_uint8(enable)) == 0
+
+    def recover_entry(self, policy=N51ICP_RECOVER_ADAPTIVE, budget_ms=10000, timing: N51EntryTiming = None):
+        """Searches for a reentry timing that gets a chip with the reset pin disabled into ICP mode, trying
+        `timing` first; returns (attempts, the timing that worked), or (-1, None) if the budget ran out"""
+        found = N51EntryTiming()
+        if timing is not None:
+            found = N51EntryTiming(timing.delay1, timing.delay2, timing.delay3, timing.full_exit)
+        attempts = self.lib.N51ICP_recover_entry(ctypes.c_int(policy), ctypes.c_uint32(budget_ms), ctypes.byref(found))
+        if attempts < 0:
+            return -1, None
+        return attempts, found
+
+    def sweep_reentry_glitch(self, log_path: str, delay1=(5000, 5000, 0), delay2=(1000, 1000, 0),
+                             delay_after_trigger_high=(0, 0, 0), delay_before_trigger_low=(280, 280, 0),
+                             repeats=10, samples=0, seed=0) -> int:
+        """Runs reentry_glitch_read() `repeats` times for every (start, stop, step) combination of the delays
+        (or `samples` random ones), natively and back to back, and logs a histogram of the config bytes read
+        per combination to `log_path` (read it with read_sweep_log()). Returns the number of combinations run,
+        -1 on failure"""
+        spec = N51SweepSpec(N51SweepRange(*delay1), N51SweepRange(*delay2), N51SweepRange(*delay_after_trigger_high),
+                            N51SweepRange(*delay_before_trigger_low), repeats, samples, seed)
+        return int(self.lib.N51SW_run(self.lib.N51ICP_default_ctx(), ctypes.byref(spec),
+                                      log_path.encode(), None, None))
+
 class LibPGM:
     def __init__(self, libname="gpiod"):
         # Load the shared library
@@ -292,3 +422,292 @@ class LibPGM:
     # Device-specific print function
     def print(self, msg):
         self.lib.N51PGM_print(ctypes.c_char_p(msg.encode()))
+
+
+class N51PlanPhase:
+    ENTRY = 0
+    IDENTIFY = 1
+    ERASE = 2
+    CONFIG = 3
+    WRITE = 4
+    VERIFY = 5
+    READ = 6
+    EXIT = 7
+    COUNT = 8
+
+
+class N51TimingProfile(ctypes.Structure):
+    _fields_ = [
+        ("gpio_latency_ns", ctypes.c_uint32),
+        ("sleep_overhead_ns", ctypes.c_uint32),
+        ("bit_delay_us", ctypes.c_uint32),
+        ("entry_bit_delay_us", ctypes.c_uint32),
+        ("reset_seq_bit_us", ctypes.c_uint32),
+        ("program_time_us", ctypes.c_uint32),
+        ("page_erase_time_us", ctypes.c_uint32),
+        ("mass_erase_time_us", ctypes.c_uint32),
+        ("init_us", ctypes.c_uint32),
+    ]
+
+
+class LibPlan:
+    """
+    Bindings for the dry-run planner (n51_plan.h)
+    """
+
+    def __init__(self, libname="gpiod"):
+        self.libname = libname
+        if libname.lower() == "pigpio":
+            self.lib = ctypes.CDLL(dir_path + "/libnuvo51icp-pigpio.so")
+        elif libname.lower() == "gpiod":
+            self.lib = ctypes.CDLL(dir_path + "/libnuvo51icp-gpiod.so")
+        else:
+            raise ValueError(
+                "Unknown lib: %s\nMust be either 'pigpio' or 'gpiod'" % libname)
+
+        self.lib.N51PLAN_default_profile.argtypes = [ctypes.POINTER(N51TimingProfile)]
+        self.lib.N51PLAN_default_profile.restype = None
+
+        self.lib.N51PLAN_load_profile.argtypes = [ctypes.c_char_p, ctypes.POINTER(N51TimingProfile)]
+        self.lib.N51PLAN_load_profile.restype = ctypes.c_int
+
+        self.lib.N51PLAN_create.argtypes = [ctypes.POINTER(N51TimingProfile)]
+        self.lib.N51PLAN_create.restype = ctypes.c_void_p
+
+        self.lib.N51PLAN_free.argtypes = [ctypes.c_void_p]
+        self.lib.N51PLAN_free.restype = None
+
+        self.lib.N51PLAN_set_phase.argtypes = [ctypes.c_void_p, ctypes.c_int]
+        self.lib.N51PLAN_set_phase.restype = None
+
+        self.lib.N51PLAN_enable_shadow.argtypes = [ctypes.c_void_p, ctypes.c_uint8]
+        self.lib.N51PLAN_enable_shadow.restype = None
+
+        for name in ["N51PLAN_exit", "N51PLAN_read_device_id", "N51PLAN_read_pid", "N51PLAN_read_cid",
+                     "N51PLAN_read_uid", "N51PLAN_read_ucid", "N51PLAN_mass_erase"]:
+            getattr(self.lib, name).argtypes = [ctypes.c_void_p]
+            getattr(self.lib, name).restype = None
+
+        self.lib.N51PLAN_init.argtypes = [ctypes.c_void_p, ctypes.c_uint8]
+        self.lib.N51PLAN_init.restype = None
+
+        self.lib.N51PLAN_entry.argtypes = [ctypes.c_void_p, ctypes.c_uint8]
+        self.lib.N51PLAN_entry.restype = None
+
+        self.lib.N51PLAN_reentry.argtypes = [ctypes.c_void_p, ctypes.c_uint32, ctypes.c_uint32, ctypes.c_uint32]
+        self.lib.N51PLAN_reentry.restype = None
+
+        self.lib.N51PLAN_read_flash.argtypes = [ctypes.c_void_p, ctypes.c_uint32, ctypes.c_uint32]
+        self.lib.N51PLAN_read_flash.restype = None
+
+        self.lib.N51PLAN_write_flash.argtypes = [ctypes.c_void_p, ctypes.c_uint32, ctypes.c_uint32]
+        self.lib.N51PLAN_write_flash.restype = None
+
+        self.lib.N51PLAN_page_erase.argtypes = [ctypes.c_void_p, ctypes.c_uint32]
+        self.lib.N51PLAN_page_erase.restype = None
+
+        self.lib.N51PLAN_total_us.argtypes = [ctypes.c_void_p]
+        self.lib.N51PLAN_total_us.restype = ctypes.c_uint64
+
+        self.lib.N51PLAN_phase_us.argtypes = [ctypes.c_void_p, ctypes.c_int]
+        self.lib.N51PLAN_phase_us.restype = ctypes.c_uint64
+
+        self.lib.N51PLAN_print.argtypes = [ctypes.c_void_p]
+        self.lib.N51PLAN_print.restype = None
+
+    def default_profile(self) -> N51TimingProfile:
+        prof = N51TimingProfile()
+        self.lib.N51PLAN_default_profile(ctypes.byref(prof))
+        return prof
+
+    def load_profile(self, path: str, prof: N51TimingProfile) -> bool:
+        return self.lib.N51PLAN_load_profile(path.encode(), ctypes.byref(prof)) == 0
+
+
+class PlanICP:
+    """
+    Drop-in replacement for LibICP that records the operations into a plan instead of touching hardware.
+
+    It keeps a model of the target's flash so that reads (and therefore verification) return what a real
+    target would, and picks the phase each operation is accounted to from the operation itself.
+    """
+
+    def __init__(self, libname="gpiod", profile: str = "", target_config: bytes = bytes([0xFF] * 5)):
+        self.planlib = LibPlan(libname)
+        self.lib = self.planlib.lib
+        prof = self.planlib.default_profile()
+        if profile and not self.planlib.load_profile(profile, prof):
+            raise ValueError("Could not load timing profile %s" % profile)
+        self.plan = self.lib.N51PLAN_create(ctypes.byref(prof))
+        self.flash = bytearray([0xFF] * 18 * 1024)
+        self.config = bytearray(target_config)
+        self.locked = (self.config[0] & 0x02) == 0
+        self.written = False
+
+    def __del__(self):
+        if getattr(self, "plan", None):
+            self.lib.N51PLAN_free(self.plan)
+            self.plan = None
+
+    def _phase(self, phase):
+        self.lib.N51PLAN_set_phase(self.plan, phase)
+
+    def _reload_config(self):
+        self.locked = (self.config[0] & 0x02) == 0
+
+    def print_plan(self):
+        self.lib.N51PLAN_print(self.plan)
+
+    def total_us(self) -> int:
+        return int(self.lib.N51PLAN_total_us(self.plan))
+
+    def enable_shadow(self, enable=True) -> bool:
+        self.lib.N51PLAN_enable_shadow(self.plan, ctypes.c_uint8(enable))
+        return True
+
+    def send_entry_bits(self) -> None:
+        pass
+
+    def send_exit_bits(self) -> None:
+        pass
+
+    def init(self, do_reset=True) -> bool:
+        self._phase(N51PlanPhase.ENTRY)
+        self.lib.N51PLAN_init(self.plan, ctypes.c_uint8(do_reset))
+        self._reload_config()
+        return True
+
+    def entry(self, do_reset=True) -> None:
+        self._phase(N51PlanPhase.ENTRY)
+        self.lib.N51PLAN_entry(self.plan, ctypes.c_uint8(do_reset))
+        self._reload_config()
+
+    def reentry(self, delay1=5000, delay2=1000, delay3=10):
+        self._phase(N51PlanPhase.ENTRY)
+        self.lib.N51PLAN_reentry(self.plan, delay1, delay2, delay3)
+        if delay1 > 0:
+            self._reload_config()
+
+    def reentry_glitch(self, delay1=5000, delay2=1000, delay_after_trigger_high=0, delay_before_trigger_low=280) -> None:
+        raise NotImplementedError("Glitching cannot be planned")
+
+    def reentry_glitch_read(self, delay1=5000, delay2=1000, delay_after_trigger_high=0, delay_before_trigger_low=280) -> bytes:
+        raise NotImplementedError("Glitching cannot be planned")
+
+    def deinit(self):
+        self.exit()
+
+    def exit(self):
+        self._phase(N51PlanPhase.EXIT)
+        self.lib.N51PLAN_exit(self.plan)
+        self._reload_config()
+
+    def read_device_id(self):
+        self._phase(N51PlanPhase.IDENTIFY)
+        self.lib.N51PLAN_read_device_id(self.plan)
+        return 0x3650
+
+    def read_pid(self):
+        self._phase(N51PlanPhase.IDENTIFY)
+        self.lib.N51PLAN_read_pid(self.plan)
+        return 0
+
+    def read_cid(self):
+        self._phase(N51PlanPhase.IDENTIFY)
+        self.lib.N51PLAN_read_cid(self.plan)
+        return 0xFF if self.locked else 0xDA
+
+    def read_uid(self):
+        self._phase(N51PlanPhase.IDENTIFY)
+        self.lib.N51PLAN_read_uid(self.plan)
+        return bytes(12)
+
+    def read_ucid(self):
+        self._phase(N51PlanPhase.IDENTIFY)
+        self.lib.N51PLAN_read_ucid(self.plan)
+        return bytes(16)
+
+    def read_flash(self, addr, length):
+        if addr >= 0x30000:
+            self._phase(N51PlanPhase.IDENTIFY if not self.written else N51PlanPhase.VERIFY)
+            self.lib.N51PLAN_read_flash(self.plan, addr, length)
+            return bytes(self.config[addr - 0x30000:addr - 0x30000 + length])
+        self._phase(N51PlanPhase.VERIFY if self.written else N51PlanPhase.READ)
+        self.lib.N51PLAN_read_flash(self.plan, addr, length)
+        if self.locked:
+            return bytes([0xFF] * length)
+        return bytes(self.flash[addr:addr + length])
+
+    def write_flash(self, addr, data) -> int:
+        self.written = True
+        if addr >= 0x30000:
+            self._phase(N51PlanPhase.CONFIG)
+            for i, b in enumerate(data):
+                self.config[addr - 0x30000 + i] &= b
+        else:
+            self._phase(N51PlanPhase.WRITE)
+            if not self.locked:
+                for i, b in enumerate(data):
+                    self.flash[addr + i] &= b
+        self.lib.N51PLAN_write_flash(self.plan, addr, len(data))
+        return addr + len(data)
+
+    def mass_erase(self):
+        self._phase(N51PlanPhase.ERASE)
+        self.lib.N51PLAN_mass_erase(self.plan)
+        self.flash[:] = bytes([0xFF] * len(self.flash))
+        self.config[:] = bytes([0xFF] * 5)
+
+    def page_erase(self, addr):
+        self._phase(N51PlanPhase.CONFIG if addr >= 0x30000 else N51PlanPhase.ERASE)
+        self.lib.N51PLAN_page_erase(self.plan, addr)
+        if addr >= 0x30000:
+            self.config[:] = bytes([0xFF] * 5)
+        elif not self.locked:
+            page = addr & ~127
+            self.flash[page:page + 128] = bytes([0xFF] * 128)
+
+
+class PlanPGM:
+    """
+    No-op stand-in for LibPGM, used together with PlanICP
+    """
+
+    def __init__(self, libname="gpiod"):
+        self.libname = libname
+
+    def init(self) -> bool:
+        return True
+
+    def deinit(self, leave_reset_high=True):
+        pass
+
+    def set_dat(self, val):
+        pass
+
+    def get_dat(self) -> int:
+        return 0
+
+    def set_rst(self, val):
+        pass
+
+    def set_clk(self, val):
+        pass
+
+    def dat_dir(self, state):
+        pass
+
+    def release_pins(self):
+        pass
+
+    def release_rst(self):
+        pass
+
+    def set_trigger(self, val):
+        pass
+
+    def usleep(self, usec):
+        return usec
+
+    def print(self, msg):
+        print(msg, end="")
@@ -0,0 +1,201 @@
+import socket
+import struct
+
+# Job protocol of nuvo51icpd, see nuvo51icp/n51_daemon.h
+DEFAULT_SOCKET = "/tmp/nuvo51icpd.sock"
+
+
+class N51DaemonCmd:
+    PING = 0x00
+    ENTRY = 0x01
+    REENTRY = 0x02
+    EXIT = 0x03
+    READ_DEVICE_ID = 0x04
+    READ_PID = 0x05
+    READ_CID = 0x06
+    READ_UID = 0x07
+    READ_UCID = 0x08
+    READ_FLASH = 0x10
+    WRITE_FLASH = 0x11
+    PAGE_ERASE = 0x12
+    MASS_ERASE = 0x13
+    READ_CONFIG = 0x14
+    WRITE_CONFIG = 0x15
+    PROGRAM = 0x16
+
+
+class N51DaemonStatus:
+    OK = 0
+    BAD_REQUEST = 1
+    NO_DEVICE = 2
+    VERIFY = 3
+
+
+class DaemonError(Exception):
+    def __init__(self, cmd, status):
+        super().__init__("nuvo51icpd job 0x%02x failed with status %d" % (cmd, status))
+        self.cmd = cmd
+        self.status = status
+
+
+REQ_HDR = struct.Struct("<BBHII")
+RESP_HDR = struct.Struct("<BxxxI")
+
+
+class DaemonICP:
+    """
+    Drop-in replacement for LibICP that runs every operation as a job on a running nuvo51icpd.
+
+    The daemon keeps the target in ICP mode between jobs, so init() only connects to it and
+    deinit() only disconnects; use entry() and exit() to actually enter or leave ICP mode.
+    """
+
+    def __init__(self, path: str = DEFAULT_SOCKET):
+        self.path = path
+        self.sock = None
+
+    def __del__(self):
+        self.deinit()
+
+    def _recv(self, length) -> bytes:
+        buf = bytearray()
+        while len(buf) < length:
+            chunk = self.sock.recv(length - len(buf))
+            if not chunk:
+                raise ConnectionError("nuvo51icpd closed the connection")
+            buf += chunk
+        return bytes(buf)
+
+    def request(self, cmd, addr=0, payload: bytes = bytes(), read_len=0) -> bytes:
+        if not self.sock:
+            raise ConnectionError("Not connected to nuvo51icpd")
+        length = read_len if cmd == N51DaemonCmd.READ_FLASH else len(payload)
+        self.sock.sendall(REQ_HDR.pack(cmd, 0, 0, addr, length) + payload)
+        status, resp_len = RESP_HDR.unpack(self._recv(RESP_HDR.size))
+        data = self._recv(resp_len) if resp_len else bytes()
+        if status != N51DaemonStatus.OK:
+            raise DaemonError(cmd, status)
+        return data
+
+    def send_entry_bits(self) -> None:
+        raise NotImplementedError("Raw entry bits are not available through nuvo51icpd")
+
+    def send_exit_bits(self) -> None:
+        raise NotImplementedError("Raw exit bits are not available through nuvo51icpd")
+
+    def init(self, do_reset=True) -> bool:
+        if self.sock:
+            return True
+        try:
+            self.sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+            self.sock.connect(self.path)
+            self.request(N51DaemonCmd.PING)
+        except OSError:
+            self.deinit()
+            return False
+        return True
+
+    def entry(self, do_reset=True) -> None:
+        self.request(N51DaemonCmd.ENTRY, 1 if do_reset else 0)
+
+    def reentry(self, delay1=5000, delay2=1000, delay3=10):
+        self.request(N51DaemonCmd.REENTRY, 0, struct.pack("<III", delay1, delay2, delay3))
+
+    def reentry_glitch(self, delay1=5000, delay2=1000, delay_after_trigger_high=0, delay_before_trigger_low=280) -> None:
+        raise NotImplementedError("Glitching is not available through nuvo51icpd")
+
+    def reentry_glitch_read(self, delay1=5000, delay2=1000, delay_after_trigger_high=0, delay_before_trigger_low=280) -> bytes:
+        raise NotImplementedError("Glitching is not available through nuvo51icpd")
+
+    def deinit(self):
+        if self.sock:
+            self.sock.close()
+            self.sock = None
+
+    def exit(self):
+        self.request(N51DaemonCmd.EXIT)
+
+    def read_device_id(self):
+        return struct.unpack("<I", self.request(N51DaemonCmd.READ_DEVICE_ID))[0]
+
+    def read_pid(self):
+        return struct.unpack("<I", self.request(N51DaemonCmd.READ_PID))[0]
+
+    def read_cid(self):
+        return self.request(N51DaemonCmd.READ_CID)[0]
+
+    def read_uid(self):
+        return self.request(N51DaemonCmd.READ_UID)
+
+    def read_ucid(self):
+        return self.request(N51DaemonCmd.READ_UCID)
+
+    def read_flash(self, addr, length):
+        return self.request(N51DaemonCmd.READ_FLASH, addr, read_len=length)
+
+    def write_flash(self, addr, data) -> int:
+        self.request(N51DaemonCmd.WRITE_FLASH, addr, bytes(data))
+        return addr + len(data)
+
+    def mass_erase(self):
+        self.request(N51DaemonCmd.MASS_ERASE)
+
+    def page_erase(self, addr):
+        self.request(N51DaemonCmd.PAGE_ERASE, addr)
+
+    def program(self, config: bytes, image: bytes) -> bool:
+        """
+        Mass erases, writes config and image (from address 0) and verifies them in a single job
+        """
+        try:
+            self.request(N51DaemonCmd.PROGRAM, 0, bytes(config) + bytes(image))
+        except DaemonError as e:
+            if e.status == N51DaemonStatus.VERIFY:
+                return False
+            raise
+        return True
+
+
+class DaemonPGM:
+    """
+    Stand-in for LibPGM, used together with DaemonICP: the pins belong to the daemon
+    """
+
+    def __init__(self, path: str = DEFAULT_SOCKET):
+        self.path = path
+
+    def init(self) -> bool:
+        return True
+
+    def deinit(self, leave_reset_high=True):
+        pass
+
+    def set_dat(self, val):
+        raise NotImplementedError("The pins belong to nuvo51icpd")
+
+    def get_dat(self) -> int:
+        raise NotImplementedError("The pins belong to nuvo51icpd")
+
+    def set_rst(self, val):
+        raise NotImplementedError("The pins belong to nuvo51icpd")
+
+    def set_clk(self, val):
+        raise NotImplementedError("The pins belong to nuvo51icpd")
+
+    def dat_dir(self, state):
+        raise NotImplementedError("The pins belong to nuvo51icpd")
+
+    def release_pins(self):
+        pass
+
+    def release_rst(self):
+        pass
+
+    def set_trigger(self, val):
+        raise NotImplementedError("The pins belong to nuvo51icpd")
+
+    def usleep(self, usec):
+        return usec
+
+    def print(self, msg):
+        print(msg, end="")
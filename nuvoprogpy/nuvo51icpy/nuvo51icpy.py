@@ -20,8 +20,9 @@ import os
 try:
     from ..config import DeviceInfo, ConfigFlags
     from ..config import *
-    from .lib.libnuvo51icp import LibICP, LibPGM
+    from .lib.libnuvo51icp import LibICP, LibPGM, PlanICP, PlanPGM
     from .lib.libnuvo51icp import *
+    from .lib.libnuvo51icpd import DaemonICP, DaemonPGM, DEFAULT_SOCKET as DAEMON_SOCKET
 except Exception as e:
     # Hack to allow running nuvo51icpy.py directly from the command line
     if __name__ == "__main__":
@@ -29,8 +30,9 @@ except Exception as e:
         if not os.path.isfile(os.path.join(os.path.dirname(os.path.realpath(__file__)), "..", "config.py")):
             raise e
 
-    from lib.libnuvo51icp import LibICP, LibPGM
+    from lib.libnuvo51icp import LibICP, LibPGM, PlanICP, PlanPGM
     from lib.libnuvo51icp import *
+    from lib.libnuvo51icpd import DaemonICP, DaemonPGM, DEFAULT_SOCKET as DAEMON_SOCKET
 
     sys.path.append(os.path.join(
         os.path.dirname(os.path.realpath(__file__)), ".."))
@@ -83,6 +85,10 @@ class Nuvo51ICP:
     ldrom_max_size = LDROM_MAX_SIZE
     aprom_addr = APROM_ADDR
     config_flash_addr = CFG_FLASH_ADDR
+    # Backend time N51ICP_recover_entry() may spend per round of retry(), and the reentry timing that last got
+    # a target into ICP mode, which the next retry() tries first
+    recover_budget_ms = 10000
+    recover_timing = None
 
     @property
     def can_write_ldrom(self):
@@ -105,6 +111,7 @@ class Nuvo51ICP:
         """
         self.library = library
         self.icp = LibICP(library)
+        self.icp.enable_shadow()
         self.pgm = LibPGM(library)
         self._enter_no_init = _enter_no_init
         self.deinit_reset_high = _deinit_reset_high
@@ -151,10 +158,49 @@ class Nuvo51ICP:
         It is often a crapshoot to get it into ICP Programming mode as it will not stay in a reset state when nRST is low and will reboot itself
         So, we have to keep trying at random intervals to try and catch it in a reset state
 
+        The search runs natively (N51ICP_recover_entry), starting from the timing that worked last time, for
+        up to recover_budget_ms per round; the PGM module is reinitialized between rounds.
+
         #### Returns:
             bool:
                 False if the device is not found, True otherwise
         """
+        if not hasattr(self.icp, "recover_entry"):
+            return self._retry_reentry()
+        max_reinit = 2
+        self.print_vb("No device found, searching for a reentry timing...")
+        try:
+            for reinit_tries in range(max_reinit):
+                attempts, timing = self.icp.recover_entry(
+                    N51ICP_RECOVER_ADAPTIVE, self.recover_budget_ms, Nuvo51ICP.recover_timing)
+                if attempts > 0:
+                    if timing.full_exit:
+                        self.print_vb("Connected after %d attempts (full exit and entry)!" % attempts)
+                    else:
+                        self.print_vb("Connected after %d attempts (reentry %d/%d/%d us)!" % (
+                            attempts, timing.delay1, timing.delay2, timing.delay3))
+                    Nuvo51ICP.recover_timing = timing
+                    return True
+                self.print_vb("Attempting reinitialization...")
+                self.icp.deinit()
+                time.sleep(0.5)
+                self.icp.init()
+                if self.icp.read_device_id() != 0:
+                    self.print_vb("Connected!")
+                    return True
+        except KeyboardInterrupt:
+            eprint("Retry aborted!")
+        except Exception as e:
+            eprint("Retry error!")
+            raise e
+        eprint("Retry failed!")
+        return False
+
+    def _retry_reentry(self) -> bool:
+        """
+        retry() for ICP backends without a native search (the session daemon): steps through reentry
+        timings from Python
+        """
         max_reentry = 5
         max_reinit = 2
         max_fullexit = 3
@@ -770,6 +816,110 @@ class Nuvo51ICP:
         return self.program_data(aprom_data, ldrom_data, config=config, ldrom_config_override=ldrom_override)
 
 
+class Nuvo51ICPPlanner(Nuvo51ICP):
+    """
+    Nuvo51ICP that records the ICP operations it would issue instead of touching hardware.
+
+    Use it exactly like Nuvo51ICP, then call print_plan() to get the command sequence and the
+    estimated time per phase for the given backend timing profile and target config.
+    """
+
+    def __init__(self, silent=False, library: str = "gpiod", profile: str = "", target_config: bytes = bytes([0xFF] * CFG_FLASH_LEN)):
+        """
+        Nuvo51ICPPlanner constructor
+        ------
+
+        #### Keyword args:
+            library: ["pigpio"|"gpiod"] (="gpiod"):
+                The library the plan is computed for (only used to load the planner)
+            profile: str (=""):
+                Backend timing profile file (see nuvo51icp/timing-profile-example.txt)
+            target_config: bytes (=FF FF FF FF FF):
+                The config bytes of the target to assume
+        """
+        self.library = library
+        self.icp = PlanICP(library, profile, target_config)
+        self.icp.enable_shadow()
+        self.pgm = PlanPGM(library)
+        self._enter_no_init = None
+        self.deinit_reset_high = False
+        self.initialized = False
+        self.silent = silent
+        self.pad_data = True
+
+    def dump_flash_to_file(self, read_file: str) -> bool:
+        # same reads as Nuvo51ICP.dump_flash_to_file, without creating any files
+        self._fail_if_not_init()
+        config = self.read_config()
+        if config.get_ldrom_size() > 0:
+            self.read_flash(self.flash_size - config.get_ldrom_size(), config.get_ldrom_size())
+        self.read_flash(self.aprom_addr, config.get_aprom_size())
+        return True
+
+    def print_plan(self):
+        sys.stdout.flush()
+        self.icp.print_plan()
+
+
+class Nuvo51ICPClient(Nuvo51ICP):
+    """
+    Nuvo51ICP that runs every operation as a job on a running nuvo51icpd (see nuvo51icp/n51_daemon.h).
+
+    The daemon keeps the target in ICP mode between jobs, so init() and close() only connect and
+    disconnect; the reset sequence and exit are skipped unless explicitly requested.
+    """
+
+    def __init__(self, silent=False, socket_path: str = DAEMON_SOCKET):
+        """
+        Nuvo51ICPClient constructor
+        ------
+
+        #### Keyword args:
+            socket_path: str (=/tmp/nuvo51icpd.sock):
+                The socket nuvo51icpd listens on
+        """
+        self.library = "nuvo51icpd"
+        self.socket_path = socket_path
+        self.icp = DaemonICP(socket_path)
+        self.pgm = DaemonPGM(socket_path)
+        self._enter_no_init = None
+        self.deinit_reset_high = False
+        self.initialized = False
+        self.silent = silent
+        self.pad_data = True
+
+    def init(self, do_reset_seq=True, check_device=True, retry=True):
+        if not self.icp.init():
+            raise PGMInitException("ERROR: Could not connect to nuvo51icpd at %s" % self.socket_path)
+        super().init(do_reset_seq, check_device, retry)
+
+    def close(self):
+        # leave the target in ICP mode for the next client
+        self.initialized = False
+        self.icp.deinit()
+
+    def program_image(self, image: bytes, config: ConfigFlags) -> bool:
+        """
+        Programs a complete flash image in a single job: mass erase, config, image from address 0, verify.
+
+        #### Keyword args:
+            image: bytes:
+                The flash contents from address 0 (APROM, then LDROM at the end of the flash as `config` places it)
+            config: ConfigFlags:
+                The configuration flags to program; a lock is only written after verifying
+        """
+        self._fail_if_not_init()
+        if len(image) > self.flash_size:
+            eprint("ERROR: Image larger than the flash size of {}".format(self.flash_size))
+            return False
+        self.print_vb("Programming image ({} bytes)...".format(len(image)))
+        if not self.icp.program(config.to_bytes(), image):
+            self.print_vb("Verification failed.")
+            return False
+        self.print_vb("Image programmed and verified.")
+        return True
+
+
 def print_usage():
     print("nuvo51icpy, a RPi ICP flasher for the Nuvoton N76E003")
     print("written by Nikita Lita\n")
@@ -787,6 +937,10 @@ def print_usage():
     print("\t                                        * look at 'config-example.json' for the format")
     print("Options:")
     print("\t-s, --silent                      silence all output except for errors")
+    print("\t-p, --plan                        do not touch the hardware; print the ICP command sequence and estimated time per phase")
+    print("\t--profile=<filename>              backend timing profile to use with --plan")
+    print("\t--target-config=<hex>             config bytes of the target to assume with --plan (default FFFFFFFFFF)")
+    print("\t--daemon=<socket>                 run the operations on a running nuvo51icpd (default socket: %s)" % DAEMON_SOCKET)
     print("Pinout:\n")
     print("                           40-pin header J8")
     print(" connect 3.3V of MCU ->    3V3  (1) (2)  5V")
@@ -809,7 +963,8 @@ def exit_with_code(message, num, usage=True):
 def main() -> int:
     argv = sys.argv[1:]
     try:
-        opts, _ = getopt.getopt(argv, "hur:w:l:seb:c:")
+        opts, _ = getopt.getopt(argv, "hur:w:l:seb:c:p", ["help", "status", "read=", "write=", "ldrom=", "silent",
+                                                            "mass-erase", "config=", "plan", "profile=", "target-config=", "daemon="])
     except getopt.GetoptError:
         return exit_with_code("Invalid command line arguments. Please refer to the usage documentation.", 2)
 
@@ -822,6 +977,10 @@ def main() -> int:
     ldrom_file = ""
     config_file = ""
     silent = False
+    plan_cmd = False
+    profile_file = ""
+    target_config = bytes([0xFF] * CFG_FLASH_LEN)
+    daemon_socket = ""
     main_cmds = 0
     if len(opts) == 0:
         print_usage()
@@ -848,6 +1007,19 @@ def main() -> int:
             config_file = arg
         elif opt == "-s" or opt == "--silent":
             silent = True
+        elif opt == "-p" or opt == "--plan":
+            plan_cmd = True
+        elif opt == "--profile":
+            profile_file = arg
+        elif opt == "--target-config":
+            try:
+                target_config = bytes.fromhex(arg)
+            except ValueError:
+                target_config = bytes()
+            if len(target_config) != CFG_FLASH_LEN:
+                return exit_with_code("ERROR: --target-config must be %d hex bytes.\n\n" % CFG_FLASH_LEN, 2)
+        elif opt == "--daemon":
+            daemon_socket = arg
         else:
             print_usage()
             return 2
@@ -876,55 +1048,66 @@ def main() -> int:
     else:
         write_config = None
 
-    with Nuvo51ICP(silent=silent) as nuvo:
-        devinfo = nuvo.get_device_info()
-        did_mass_erase = False
-        if not nuvo.is_valid_device_id(devinfo.device_id):
-            if is_writing and nuvo._needs_unlock():
-                print("Device not found, chip may be locked, Do you want to attempt a mass erase? (y/N)")
-                if input() == "y" or input() == "Y":
-                    if not nuvo.mass_erase():
-                        return exit_with_code("Mass erase failed! Exiting...", 2, False)
-                    did_mass_erase = True
-                    devinfo = nuvo.get_device_info()
-                    eprint(devinfo)
-                else:
-                    return exit_with_code("Device not found! Exiting...", 2, False)
-                if not nuvo.is_valid_device_id(devinfo.device_id):
-                    return exit_with_code("ERROR: Unsupported device ID: 0x%04X (mass erase failed!)\n\n" % devinfo.device_id, 2, False)
-            else:
-                if devinfo.device_id == 0:
-                    return exit_with_code("ERROR: Device not found, please check your connections.\n\n", 2, False)
-                return exit_with_code("ERROR: Unsupported device ID: 0x%04X (chip may be locked)\n\n" % devinfo.device_id, 2, False)
-        if not did_mass_erase and mass_erase_cmd:
-            if not nuvo.mass_erase():
-                return exit_with_code("Mass erase failed! Exiting...", 2, False)
+    if plan_cmd:
+        nuvo_obj = Nuvo51ICPPlanner(silent=silent, profile=profile_file, target_config=target_config)
+    elif daemon_socket:
+        nuvo_obj = Nuvo51ICPClient(silent=silent, socket_path=daemon_socket)
+    else:
+        nuvo_obj = Nuvo51ICP(silent=silent)
+    try:
+        with nuvo_obj as nuvo:
             devinfo = nuvo.get_device_info()
-            eprint(devinfo)
-            print("Mass erase successful.")
-        # process commands
-        if status_cmd:
-            print(devinfo)
-            cfg = nuvo.read_config()
-            if not cfg:
-                return exit_with_code("Config read failed!!", 1, False)
-            cfg.print_config()
+            did_mass_erase = False
+            if not nuvo.is_valid_device_id(devinfo.device_id):
+                if is_writing and nuvo._needs_unlock():
+                    print("Device not found, chip may be locked, Do you want to attempt a mass erase? (y/N)")
+                    if input() == "y" or input() == "Y":
+                        if not nuvo.mass_erase():
+                            return exit_with_code("Mass erase failed! Exiting...", 2, False)
+                        did_mass_erase = True
+                        devinfo = nuvo.get_device_info()
+                        eprint(devinfo)
+                    else:
+                        return exit_with_code("Device not found! Exiting...", 2, False)
+                    if not nuvo.is_valid_device_id(devinfo.device_id):
+                        return exit_with_code("ERROR: Unsupported device ID: 0x%04X (mass erase failed!)\n\n" % devinfo.device_id, 2, False)
+                else:
+                    if devinfo.device_id == 0:
+                        return exit_with_code("ERROR: Device not found, please check your connections.\n\n", 2, False)
+                    return exit_with_code("ERROR: Unsupported device ID: 0x%04X (chip may be locked)\n\n" % devinfo.device_id, 2, False)
+            if not did_mass_erase and mass_erase_cmd:
+                if not nuvo.mass_erase():
+                    return exit_with_code("Mass erase failed! Exiting...", 2, False)
+                devinfo = nuvo.get_device_info()
+                eprint(devinfo)
+                print("Mass erase successful.")
+            # process commands
+            if status_cmd:
+                print(devinfo)
+                cfg = nuvo.read_config()
+                if not cfg:
+                    return exit_with_code("Config read failed!!", 1, False)
+                cfg.print_config()
+                return 0
+            elif read_cmd:
+                print(devinfo)
+                cfg = nuvo.read_config()
+                cfg.print_config()
+                print()
+                if nuvo._needs_unlock():
+                    return exit_with_code("Error: Chip is locked, cannot read flash", 1, False)
+                nuvo.dump_flash_to_file(read_file)
+                # remove extension from read_file
+                config_file = read_file.rsplit(".", 1)[0] + "-config.json"
+                if not plan_cmd:
+                    cfg.to_json_file(config_file)
+            elif ldrom_file or write_file or config_file:
+                if not nuvo.program(write_file, ldrom_file, write_config, not(config_file != "")):
+                    return exit_with_code("Programming failed!!", 1, False)
             return 0
-        elif read_cmd:
-            print(devinfo)
-            cfg = nuvo.read_config()
-            cfg.print_config()
-            print()
-            if nuvo._needs_unlock():
-                return exit_with_code("Error: Chip is locked, cannot read flash", 1, False)
-            nuvo.dump_flash_to_file(read_file)
-            # remove extension from read_file
-            config_file = read_file.rsplit(".", 1)[0] + "-config.json"
-            cfg.to_json_file(config_file)
-        elif ldrom_file or write_file or config_file:
-            if not nuvo.program(write_file, ldrom_file, write_config, not(config_file != "")):
-                return exit_with_code("Programming failed!!", 1, False)
-        return 0
+    finally:
+        if plan_cmd:
+            nuvo_obj.print_plan()
 
 
 try:
@@ -28,6 +28,7 @@
 # SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 
 
+import collections
 import getopt
 import os
 import platform
@@ -35,6 +36,7 @@ import sys
 import serial
 import time
 import math
+import zlib
 
 try:
     from ..nuvoprog import NuvoProg
@@ -75,10 +77,44 @@ CMD_GET_CID           =  0xb3 # non-official
 CMD_GET_UCID          =  0xb4 # non-official
 CMD_GET_BANDGAP       =  0xb5 # non-official
 CMD_ISP_PAGE_ERASE    =  0xD5 # non-official
+CMD_CRC32_RANGE       =  0xb6 # non-official
+CMD_READ_RANGES       =  0xb7 # non-official
 
 # Arduino ISP-to-ICP bridge only
 CMD_UPDATE_WHOLE_ROM  =  0xE1 # non-official
 CMD_ISP_MASS_ERASE    =  0xD6 # non-official
+CMD_SET_BAUD          =  0xE2 # non-official
+CMD_UPDATE_STREAM     =  0xE3 # non-official
+CMD_UPDATE_COMPRESSED =  0xE4 # non-official
+CMD_SELECT_TARGET     =  0xE5 # non-official
+CMD_STORE_IMAGE       =  0xE6 # non-official
+CMD_PROGRAM_STORED    =  0xE7 # non-official
+CMD_STORE_INFO        =  0xE8 # non-official
+
+# CMD_UPDATE_STREAM flags
+STREAM_WHOLE_ROM = 0x01 # mass erase first, as CMD_UPDATE_WHOLE_ROM
+
+# CMD_UPDATE_COMPRESSED tokens, see compress_image()
+LZ_WINDOW = 256
+LZ_MIN_MATCH = 3
+LZ_MAX_MATCH = 0x3f + LZ_MIN_MATCH
+LZ_MAX_LITERALS = 0x80
+LZ_MAX_SKIP = 0x4000
+LZ_MIN_SKIP = 3 # shorter runs of 0xFF are cheaper as literals or matches
+LZ_MAX_CHAIN = 32 # earlier positions with the same 3 bytes tried per match
+
+# CMD_CRC32_RANGE replies with at most this many block CRCs
+CRC_RANGE_MAX_BLOCKS = 14
+
+# CMD_READ_RANGES takes at most this many (addr, len) ranges
+READ_RANGES_MAX = 13
+
+# CMD_SELECT_TARGET: sockets a bridge may have, and the byte of the update ACKs with the mask of the sockets that dropped out
+MAX_TARGETS = 8
+TARGET_FAILED_OFFSET = 16
+
+# CMD_STORE_IMAGE flags, besides STREAM_WHOLE_ROM
+STORE_COMPRESSED = 0x02 # the data is compress_image() tokens
 
 # ** Unsupported by N76E003 **
 # Dataflash commands (when a chip has the ability to deliniate between data and program flash)
@@ -114,6 +150,7 @@ PKT_SEQ_SIZE = 4
 PKT_HEADER_END = 8
 PACKSIZE = 64
 SEQ_UPDATE_PKT_SIZE = 56
+PAGE_SIZE = 128 # flash page size
 
 DUMP_PKT_CHECKSUM_START = PKT_HEADER_END
 DUMP_PKT_CHECKSUM_SIZE = 0  # disabled for now
@@ -121,12 +158,18 @@ DUMP_DATA_START = (DUMP_PKT_CHECKSUM_START + DUMP_PKT_CHECKSUM_SIZE)
 DUMP_DATA_SIZE = (PACKSIZE - DUMP_DATA_START)
 
 DEFAULT_SER_BAUD = 115200
+# Rates the ISP-to-ICP bridge is asked to switch to with CMD_SET_BAUD, fastest first
+BRIDGE_FAST_RATES = [2000000, 1000000, 500000]
+DEFAULT_STREAM_WINDOW = 8 # update packets kept in flight with CMD_UPDATE_STREAM; the bridge may allow fewer
+BAUD_CONFIRM_TIMEOUT = 1.0 # the bridge falls back to its default rate after this long without a packet at the new one
 DEFAULT_SER_TIMEOUT = 0.1  # 100ms
 RESET_TIMEOUT = 0.5 # 500ms
 FORMAT2_TIMEOUT = 0.2 # 200ms
 ERASE_TIMEOUT = 8.5 # 8500 ms
 PAGE_ERASE_TIMEOUT = 0.2 # 200ms
 READ_ROM_TIMEOUT = 2 # 2000ms
+CRC_RANGE_TIMEOUT = 3 # 3000ms, the LDROM computes the CRCs bitwise
+PROGRAM_STORED_TIMEOUT = 20 # 20000ms per socket for CMD_PROGRAM_STORED to write and CRC the whole flash, on top of the erase
 
 DEFAULT_UNIX_PORT = "/dev/ttyACM0"
 DEFAULT_WIN_PORT = "COM1"
@@ -187,12 +230,30 @@ def cmd_to_str(cmd):
         return "CMD_GET_UCID"
     elif cmd == CMD_GET_BANDGAP:
         return "CMD_GET_BANDGAP"
+    elif cmd == CMD_CRC32_RANGE:
+        return "CMD_CRC32_RANGE"
+    elif cmd == CMD_READ_RANGES:
+        return "CMD_READ_RANGES"
     elif cmd == CMD_ISP_PAGE_ERASE:
         return "CMD_ISP_PAGE_ERASE"
     elif cmd == CMD_UPDATE_WHOLE_ROM:
         return "CMD_UPDATE_WHOLE_ROM"
     elif cmd == CMD_ISP_MASS_ERASE:
         return "CMD_ISP_MASS_ERASE"
+    elif cmd == CMD_SET_BAUD:
+        return "CMD_SET_BAUD"
+    elif cmd == CMD_UPDATE_STREAM:
+        return "CMD_UPDATE_STREAM"
+    elif cmd == CMD_UPDATE_COMPRESSED:
+        return "CMD_UPDATE_COMPRESSED"
+    elif cmd == CMD_SELECT_TARGET:
+        return "CMD_SELECT_TARGET"
+    elif cmd == CMD_STORE_IMAGE:
+        return "CMD_STORE_IMAGE"
+    elif cmd == CMD_PROGRAM_STORED:
+        return "CMD_PROGRAM_STORED"
+    elif cmd == CMD_STORE_INFO:
+        return "CMD_STORE_INFO"
     elif cmd == CMD_UPDATE_DATAFLASH:
         return "CMD_UPDATE_DATAFLASH"
     elif cmd == CMD_ERASE_SPIFLASH:
@@ -238,6 +299,97 @@ def calc_checksum(data):
         txsum += data[i]
     return txsum & 0xffff
 
+def compress_image(data):
+    """
+    Encodes data as CMD_UPDATE_COMPRESSED tokens: runs of 0xFF (left erased by the bridge), copies of up to
+    LZ_MAX_MATCH bytes from the last LZ_WINDOW bytes, and literals
+
+    #### Returns:
+        bytes: the token stream
+    """
+    out = bytearray()
+    literals = bytearray()
+    recent = {}
+
+    def flush_literals():
+        for i in range(0, len(literals), LZ_MAX_LITERALS):
+            chunk = literals[i:i + LZ_MAX_LITERALS]
+            out.append(len(chunk) - 1)
+            out.extend(chunk)
+        literals.clear()
+
+    def remember(pos):
+        if pos + LZ_MIN_MATCH <= len(data):
+            recent.setdefault(bytes(data[pos:pos + LZ_MIN_MATCH]), []).append(pos)
+
+    pos = 0
+    while pos < len(data):
+        run = 0
+        while pos + run < len(data) and run < LZ_MAX_SKIP and data[pos + run] == 0xff:
+            run += 1
+        if run >= LZ_MIN_SKIP:
+            flush_literals()
+            out.extend([0x80 | ((run - 1) >> 8), (run - 1) & 0xff])
+            for i in range(pos, pos + run):
+                remember(i)
+            pos += run
+            continue
+        best_len = 0
+        best_from = 0
+        for start in reversed(recent.get(bytes(data[pos:pos + LZ_MIN_MATCH]), [])[-LZ_MAX_CHAIN:]):
+            if pos - start > LZ_WINDOW:
+                break
+            length = 0
+            while pos + length < len(data) and length < LZ_MAX_MATCH and data[start + length] == data[pos + length]:
+                length += 1
+            if length > best_len:
+                best_len = length
+                best_from = start
+        if best_len >= LZ_MIN_MATCH:
+            flush_literals()
+            out.extend([0xc0 | (best_len - LZ_MIN_MATCH), pos - best_from - 1])
+            for i in range(pos, pos + best_len):
+                remember(i)
+            pos += best_len
+            continue
+        literals.append(data[pos])
+        remember(pos)
+        pos += 1
+    flush_literals()
+    return bytes(out)
+
+def compressed_progress(stream, packet_size):
+    """
+    Returns how many decoded bytes the bridge has after every packet_size bytes of a compress_image() stream
+    """
+    decoded = []
+    total = 0
+    pos = 0
+    left = 0 # literals still to come
+    token = None
+    for boundary in range(packet_size, len(stream) + packet_size, packet_size):
+        while pos < min(boundary, len(stream)):
+            if left > 0:
+                step = min(left, boundary - pos)
+                total += step
+                left -= step
+                pos += step
+            elif token is None:
+                token = stream[pos]
+                pos += 1
+                if token < 0x80:
+                    left = token + 1
+                    token = None
+            else:
+                if token < 0xc0:
+                    total += ((token & 0x3f) << 8 | stream[pos]) + 1
+                else:
+                    total += (token & 0x3f) + LZ_MIN_MATCH
+                token = None
+                pos += 1
+        decoded.append(total)
+    return decoded
+
 class ISPPacket:
     seq_num = 0
     _first = 0
@@ -284,7 +436,7 @@ class ACKPacket(ISPPacket):
 
     
 class NuvoISP(NuvoProg):
-    def __init__(self, serial_rate=DEFAULT_SER_BAUD, serial_timeout=DEFAULT_SER_TIMEOUT, serial_port=(DEFAULT_WIN_PORT if platform.system() == "Windows" else DEFAULT_UNIX_PORT), silent=False):
+    def __init__(self, serial_rate=DEFAULT_SER_BAUD, serial_timeout=DEFAULT_SER_TIMEOUT, serial_port=(DEFAULT_WIN_PORT if platform.system() == "Windows" else DEFAULT_UNIX_PORT), silent=False, fast_rates=BRIDGE_FAST_RATES, stream_window=DEFAULT_STREAM_WINDOW, compress=True, targets=None):
         """
         NuvoISP constructor
         ------
@@ -294,10 +446,21 @@ class NuvoISP(NuvoProg):
             serial_timeout (float): Serial timeout in seconds
             serial_port (str): Serial port to use (default = "COM1" on Windows, "/dev/ttyACM0" on *nix)
             silent (bool): If True, suppresses all output
+            fast_rates (list): Serial baud rates to try switching to after connecting to the ISP-to-ICP bridge, fastest first; empty to stay at serial_rate
+            stream_window (int): Update packets to keep in flight when writing through the ISP-to-ICP bridge; 1 to wait for every ACK
+            compress (bool): If True, writes through the ISP-to-ICP bridge are sent compressed
+            targets (list): ICP sockets of the ISP-to-ICP bridge to program at once (see select_targets()); None for socket 0 only
 
         """
         self.ser = None
         self.silent = silent
+        self.fast_rates = fast_rates
+        self.stream_window = stream_window
+        self.compress = compress
+        self.targets = targets
+        self.target_count = 1
+        self.selected_targets = 1
+        self.failed_targets = 0 # selected sockets that dropped out of the last update
         self.serial_rate = serial_rate
         self.serial_timeout = serial_timeout
         self.serial_port = serial_port
@@ -436,8 +599,17 @@ class NuvoISP(NuvoProg):
         # don't bother reading the response
         time.sleep(max(self.serial_timeout, RESET_TIMEOUT))
         self.flush_serial()
+        # the bridge goes back to its default rate on disconnect
+        self._set_link_rate(self.serial_rate)
         self._connected = False
 
+    def _set_link_rate(self, rate):
+        # not through the serial_rate setter: reopening the port resets most Arduinos
+        if self.ser.baudrate != rate:
+            self.ser.flush()
+            self.ser.baudrate = rate
+        self.ser.reset_input_buffer()
+
     def _cmd_packet(self, cmd, data=bytes()):
         return ISPPacket(cmd, 0, data)
 
@@ -514,16 +686,73 @@ class NuvoISP(NuvoProg):
                 # self.print_vb("Received sequence number: " + str(rx_pkt.seq_num))
             self.flush_serial()
 
-    def _connect(self, retry=True):
-        self._connect_req(retry)
+    def _sync_packno(self):
         data = pack_u32(1)
         # ++seq_num when send_cmd is called, so we need to reset it here
         self.seq_num = 0
-        success, rx_pkt = self.send_cmd(self._cmd_packet(CMD_SYNC_PACKNO, data), max_timeout=1, fail_on_checksum_error=False)
-        if not success or (CHECK_SEQUENCE_NO and rx_pkt.seq_num != 2): 
+        try:
+            success, rx_pkt = self.send_cmd(self._cmd_packet(CMD_SYNC_PACKNO, data), max_timeout=1, fail_on_checksum_error=False)
+        except TimeoutError:
+            return False
+        return success and (not CHECK_SEQUENCE_NO or rx_pkt.seq_num == 2)
+
+    def _connect(self, retry=True):
+        self._connect_req(retry)
+        if not self._sync_packno():
             raise Exception("Failed to sync sequence number")
         self.fw_ver = self.get_fwver()
         self._connected = True
+        if self.is_icp_bridge:
+            self._negotiate_rate()
+
+    def _try_rate(self, rate):
+        """
+        Asks the bridge to switch to `rate`, switches the serial port along and confirms it by repeating the request at the new rate
+
+        #### Returns:
+            bool: True if both sides are at `rate`
+        """
+        try:
+            _, rx_pkt = self.send_cmd(self._cmd_packet(CMD_SET_BAUD, pack_u32(rate)))
+        except (TimeoutError, ChecksumError):
+            return False
+        if unpack_u32(rx_pkt.data[0:4]) != rate:
+            return False  # refused
+        self._set_link_rate(rate)
+        try:
+            _, rx_pkt = self.send_cmd(self._cmd_packet(CMD_SET_BAUD, pack_u32(rate)))
+            if unpack_u32(rx_pkt.data[0:4]) == rate:
+                return True
+        except (TimeoutError, ChecksumError):
+            pass
+        return False
+
+    def _negotiate_rate(self):
+        """
+        Switches the ISP-to-ICP bridge and the serial port to the fastest of `fast_rates` that both handle
+
+        #### Returns:
+            int: The rate in use afterwards
+        """
+        for rate in self.fast_rates:
+            if rate <= self.serial_rate:
+                continue
+            if self._try_rate(rate):
+                self.print_vb("Switched to {} baud".format(rate))
+                return rate
+            # The bridge falls back to its default rate if it didn't get the repeated request; follow it.
+            # If it did get it and only the reply was lost, it is still at `rate`.
+            self._set_link_rate(self.serial_rate)
+            time.sleep(BAUD_CONFIRM_TIMEOUT + RESET_TIMEOUT)
+            self._set_link_rate(self.serial_rate)
+            if self._sync_packno():
+                continue
+            self._set_link_rate(rate)
+            if self._sync_packno():
+                self.print_vb("Switched to {} baud".format(rate))
+                return rate
+            raise Exception("Lost the connection while switching to {} baud".format(rate))
+        return self.serial_rate
 
     def _send_cmd(self, tx: ISPPacket, max_timeout=None):
         tx.seq_num = self.seq_num
@@ -604,6 +833,8 @@ class NuvoISP(NuvoProg):
         elif self.supports_extended_cmds:
             revision_string = " (custom ISP LDROM, supports extended commands)"
         self.print_vb("ISP firmware version: " + hex(self.fw_ver) + revision_string)
+        if self.targets:
+            self._select_requested_targets(check_for_device)
         # check device id
         if check_for_device:
             dev_id = self.get_device_id()
@@ -614,6 +845,64 @@ class NuvoISP(NuvoProg):
                 self._disconnect()
                 raise NoDevice("Unsupported device ID: " + hex(dev_id))
 
+    def _select_requested_targets(self, check_for_device):
+        mask = 0
+        for target in self.targets:
+            mask |= 1 << target
+        ids = self.select_targets(mask)
+        if ids is None:
+            self._disconnect()
+            raise ExtendedCmdsNotSupported("This bridge doesn't have sockets {}".format(", ".join(str(t) for t in self.targets)))
+        if not check_for_device:
+            return
+        missing = [t for t in self.targets if ids[t] != N76E003_DEVID]
+        if missing:
+            eprint("No device in socket(s) {}, leaving them out".format(", ".join(str(t) for t in missing)))
+            if len(missing) == len(self.targets):
+                self._disconnect()
+                raise NoDevice("Device not found, please check your connections!")
+            for t in missing:
+                mask &= ~(1 << t)
+            self.select_targets(mask)
+
+    def select_targets(self, mask):
+        """
+        Points the commands at the ISP-to-ICP bridge's ICP sockets in `mask` (bit i: socket i). With several
+        selected, updates and erases are written to all of them at once and everything else is read from the lowest one.
+
+        #### Returns:
+            list: the device ID of every socket of the bridge, or None if it doesn't have the sockets (or the command)
+        """
+        self._fail_if_not_init()
+        self._fail_if_not_icp_bridge()
+        success, rx_pkt = self.send_cmd(self._cmd_packet(CMD_SELECT_TARGET, bytes([mask])), fail_on_checksum_error=False)
+        if not success:
+            return None
+        self.target_count = rx_pkt.data[0]
+        self.selected_targets = rx_pkt.data[1]
+        return [unpack_u16(rx_pkt.data[4 + 2 * i:]) for i in range(self.target_count)]
+
+    def _each_selected_target(self):
+        """
+        Selects every socket of the current selection that hasn't dropped out on its own in turn, yielding its number,
+        and the whole selection again afterwards. Yields None once if at most one socket is selected.
+        """
+        selection = self.selected_targets
+        sockets = [i for i in range(self.target_count) if selection & ~self.failed_targets & (1 << i)]
+        if len(sockets) <= 1:
+            yield None
+            return
+        try:
+            for i in sockets:
+                self.select_targets(1 << i)
+                yield i
+        finally:
+            self.select_targets(selection)
+
+    def _note_failed_targets(self, rx_pkt: ACKPacket):
+        if self.target_count > 1:
+            self.failed_targets |= rx_pkt.data[TARGET_FAILED_OFFSET - PKT_HEADER_END]
+
     def close(self):
         if self.ser and self.is_serial_open():
             if self._connected:
@@ -692,8 +981,169 @@ class NuvoISP(NuvoProg):
         self._fail_if_not_extended()
         self.send_cmd(self._cmd_packet(CMD_ISP_PAGE_ERASE, bytes([addr & 0xff, (addr >> 8) & 0xff])), max(PAGE_ERASE_TIMEOUT, self.serial_timeout))
 
+    def _stream_update(self, addr, data, size, whole_rom, compressed=False):
+        """
+        Programs through the ISP-to-ICP bridge with CMD_UPDATE_STREAM: the data goes out in continuation packets
+        without waiting for each ACK, so the bridge can program one while the next one arrives.
+        With `compressed`, CMD_UPDATE_COMPRESSED sends it encoded with compress_image() instead.
+
+        #### Returns:
+            bool: True if every ACK matched, None if the bridge doesn't support the command
+        """
+        data = bytes(data[:size])
+        if compressed:
+            payload = compress_image(data)
+            compressed = len(payload) < size
+        if compressed:
+            decoded = compressed_progress(payload, SEQ_UPDATE_PKT_SIZE)
+        else:
+            payload = data
+            decoded = [min(size, (k + 1) * SEQ_UPDATE_PKT_SIZE) for k in range((size + SEQ_UPDATE_PKT_SIZE - 1) // SEQ_UPDATE_PKT_SIZE)]
+        start = pack_u32(addr) + pack_u32(size) + pack_u32(STREAM_WHOLE_ROM if whole_rom else 0)
+        cmd = CMD_UPDATE_COMPRESSED if compressed else CMD_UPDATE_STREAM
+        success, rx_pkt = self.send_cmd(self._cmd_packet(cmd, start), max_timeout=max(ERASE_TIMEOUT, self.serial_timeout), fail_on_checksum_error=False)
+        if not success:
+            return None
+        self._note_failed_targets(rx_pkt)
+        window = max(1, min(self.stream_window, unpack_u32(rx_pkt.data)))
+        timeout = max(FORMAT2_TIMEOUT, self.serial_timeout)
+        # every packet and every ACK take a sequence number, so packet k is base + 2k + 1 and its ACK base + 2k + 2
+        base = self.seq_num
+        count = len(decoded)
+        in_flight = collections.deque()
+        sent = 0
+        acked = 0
+        txsum = 0
+        while acked < count:
+            while sent < count and len(in_flight) < window:
+                sdata = payload[sent * SEQ_UPDATE_PKT_SIZE:(sent + 1) * SEQ_UPDATE_PKT_SIZE]
+                tx_pkt = self._cmd_packet(CMD_FORMAT2_CONTINUATION, sdata + bytes(SEQ_UPDATE_PKT_SIZE - len(sdata)))
+                self.seq_num = base + 2 * sent + 1
+                self._send_cmd(tx_pkt, timeout)
+                in_flight.append(tx_pkt)
+                sent += 1
+            tx_pkt = in_flight.popleft()
+            if not self._wait_for_packet(timeout):
+                raise TimeoutError("Device unresponsive while streaming, aborting!")
+            rx_pkt = ACKPacket.from_bytes(self.read_serial(PACKSIZE))
+            if tx_pkt.checksum != rx_pkt.checksum:
+                raise ChecksumError("Invalid checksum received!")
+            if CHECK_SEQUENCE_NO and rx_pkt.seq_num != (tx_pkt.seq_num + 1) & 0xffff:
+                raise ChecksumError("Invalid sequence number received!")
+            self._note_failed_targets(rx_pkt)
+            # the running checksum and the bytes still to come are those of the decoded data
+            txsum = (txsum + calc_checksum(data[decoded[acked - 1] if acked > 0 else 0:decoded[acked]])) & 0xffff
+            update_checksum = unpack_u16(rx_pkt.data)
+            remaining = unpack_u32(rx_pkt.data[4:8])
+            if update_checksum != txsum or remaining != size - decoded[acked]:
+                eprint("\nChecksum mismatch: {} != {}".format(update_checksum, txsum))
+                # let the bridge finish the packets still in flight and drop their ACKs
+                time.sleep(timeout * len(in_flight))
+                self.ser.reset_input_buffer()
+                self.seq_num = base + 2 * sent
+                return False
+            acked += 1
+            self.update_progress_bar("Programming Rom", decoded[acked - 1], size)
+        self.seq_num = base + 2 * count
+        self.update_progress_bar("Programming Rom", size, size)
+        return True
+
+    def store_info(self, slot=0):
+        """
+        Reads what a slot of the ISP-to-ICP bridge's image store holds
+
+        #### Returns:
+            dict: addr, size, flags, length and crc of the stored update (size 0 if the slot is empty), and the
+            number of slots and the capacity of one; None if the bridge has no image store
+        """
+        self._fail_if_not_init()
+        self._fail_if_not_icp_bridge()
+        success, rx_pkt = self.send_cmd(self._cmd_packet(CMD_STORE_INFO, bytes([slot])), fail_on_checksum_error=False)
+        if not success:
+            return None
+        d = rx_pkt.data
+        return {"addr": unpack_u32(d[0:]), "size": unpack_u32(d[4:]), "flags": d[8], "length": unpack_u32(d[12:]),
+                "crc": unpack_u32(d[16:]), "slots": unpack_u32(d[20:]), "capacity": unpack_u32(d[24:])}
+
+    def store_image(self, data, addr=APROM_ADDR, slot=0, whole_rom=False):
+        """
+        Keeps an update in a slot of the ISP-to-ICP bridge's image store, for program_stored() to write as often as
+        needed. It is sent compressed when that is smaller, and not at all if the slot already holds it.
+
+        #### Returns:
+            bool: True if the slot holds the update, False if the upload failed, None if the bridge has no image
+            store or the update doesn't fit in a slot
+        """
+        info = self.store_info(slot)
+        if info is None or slot >= info["slots"]:
+            return None
+        data = bytes(data)
+        crc = zlib.crc32(data)
+        flags = STREAM_WHOLE_ROM if whole_rom else 0
+        if (info["addr"], info["size"], info["crc"], info["flags"] & STREAM_WHOLE_ROM) == (addr, len(data), crc, flags):
+            self.print_vb("Image already in slot {} of the bridge's store.".format(slot))
+            return True
+        payload = compress_image(data)
+        if len(payload) < len(data):
+            flags |= STORE_COMPRESSED
+        else:
+            payload = data
+        if len(payload) > info["capacity"]:
+            return None
+        start = pack_u32(addr) + pack_u32(len(data)) + bytes([flags, slot, 0, 0]) + pack_u32(len(payload)) + pack_u32(crc)
+        success, _ = self.send_cmd(self._cmd_packet(CMD_STORE_IMAGE, start), fail_on_checksum_error=False)
+        if not success:
+            return None
+        timeout = max(FORMAT2_TIMEOUT, self.serial_timeout)
+        txsum = 0
+        for pos in range(0, len(payload), SEQ_UPDATE_PKT_SIZE):
+            self.update_progress_bar("Storing image", pos, len(payload))
+            sdata = payload[pos:pos + SEQ_UPDATE_PKT_SIZE]
+            txsum = (txsum + calc_checksum(sdata)) & 0xffff
+            _, rx_pkt = self.send_cmd(self._cmd_packet(CMD_FORMAT2_CONTINUATION, sdata + bytes(SEQ_UPDATE_PKT_SIZE - len(sdata))), max_timeout=timeout)
+            update_checksum = unpack_u16(rx_pkt.data)
+            remaining = unpack_u32(rx_pkt.data[4:8])
+            if update_checksum != txsum or remaining != len(payload) - pos - len(sdata):
+                eprint("\nChecksum mismatch while storing: {} != {}".format(update_checksum, txsum))
+                return False
+        self.update_progress_bar("Storing image", len(payload), len(payload))
+        return True
+
+    def program_stored(self, slot=0):
+        """
+        Has the ISP-to-ICP bridge write the update in a slot of its image store (see store_image()) into the selected
+        sockets, and check the CRC of the result on each
+
+        #### Returns:
+            bool: True if every socket still in matches, None if the bridge can't (or the slot is empty)
+        """
+        self._fail_if_not_init()
+        self._fail_if_not_icp_bridge()
+        self.failed_targets = 0
+        sockets = bin(self.selected_targets).count("1") if self.target_count > 1 else 1
+        timeout = max(ERASE_TIMEOUT + PROGRAM_STORED_TIMEOUT * sockets, self.serial_timeout)
+        success, rx_pkt = self.send_cmd(self._cmd_packet(CMD_PROGRAM_STORED, bytes([slot])), max_timeout=timeout, fail_on_checksum_error=False)
+        if not success:
+            return None
+        self._note_failed_targets(rx_pkt)
+        mismatch = rx_pkt.data[4]
+        if mismatch:
+            eprint("CRC mismatch in socket(s) {} after programming".format(
+                ", ".join(str(i) for i in range(MAX_TARGETS) if mismatch & (1 << i))))
+            return False
+        return True
+
     def update_flash(self, addr, data, size, update_dataflash=False):
         self._fail_if_not_init()
+        self.failed_targets = 0
+        if self.is_icp_bridge and self.compress:
+            result = self._stream_update(addr, data, size, update_dataflash, compressed=True)
+            if result is not None:
+                return result
+        if self.is_icp_bridge and self.stream_window > 1:
+            result = self._stream_update(addr, data, size, update_dataflash)
+            if result is not None:
+                return result
         flen = size
         ipos = 0
         addr_pckd = pack_u32(addr)
@@ -724,6 +1174,7 @@ class NuvoISP(NuvoProg):
                 txsum += sdata[i]
             txsum &= 0xffff
             _, rx_pkt = self.send_cmd(self._cmd_packet(cmd_name, data_to_send), max_timeout=timeout)
+            self._note_failed_targets(rx_pkt)
             update_checksum = unpack_u16(rx_pkt.data)
             if update_checksum != txsum:
                 eprint("\nChecksum mismatch: {} != {}".format(update_checksum, txsum))
@@ -766,6 +1217,67 @@ class NuvoISP(NuvoProg):
             addr += step_size
         return data
 
+    def dump_ranges(self, ranges) -> list:
+        """
+        Reads several flash ranges with CMD_READ_RANGES: up to READ_RANGES_MAX of them per command, streamed back
+        to back, so sparse ranges don't cost a command each
+
+        #### Args:
+            ranges (list): (addr, length) of every range
+
+        #### Returns:
+            list: the bytes of every range, or None if the firmware doesn't support CMD_READ_RANGES
+        """
+        self._fail_if_not_init()
+        self._fail_if_not_extended()
+        result = []
+        total = sum(length for _, length in ranges)
+        done = 0
+        for i in range(0, len(ranges), READ_RANGES_MAX):
+            batch = ranges[i:i + READ_RANGES_MAX]
+            size = sum(length for _, length in batch)
+            if size == 0:
+                result += [bytes()] * len(batch)
+                continue
+            request = bytes([len(batch), 0, 0, 0]) + b"".join(pack_u16(addr) + pack_u16(length) for addr, length in batch)
+            success, rx = self.send_cmd(self._cmd_packet(CMD_READ_RANGES, request), max(READ_ROM_TIMEOUT, self.serial_timeout), fail_on_checksum_error=False)
+            if not success:
+                return None
+            data = rx.data[:size]
+            while len(data) < size:
+                self.update_progress_bar("Dumping...", done + len(data), total)
+                _, rx = self.send_cmd(self._cmd_packet(CMD_FORMAT2_CONTINUATION), max(FORMAT2_TIMEOUT, self.serial_timeout))
+                data += rx.data[:size - len(data)]
+            done += size
+            pos = 0
+            for _, length in batch:
+                result.append(data[pos:pos + length])
+                pos += length
+        return result
+
+    def crc32_range(self, start_addr, length, block_size=0):
+        """
+        Has the firmware compute the CRC-32 (as zlib.crc32()) of a flash range, block_size bytes at a time
+
+        #### Args:
+            start_addr (int): first address of the range
+            length (int): bytes in the range
+            block_size (int): bytes per CRC, 0 for one CRC of the whole range; at most CRC_RANGE_MAX_BLOCKS blocks
+
+        #### Returns:
+            list: the CRC of every block, or None if the firmware doesn't support CMD_CRC32_RANGE
+        """
+        self._fail_if_not_init()
+        self._fail_if_not_extended()
+        blocks = 1 if block_size == 0 else (length + block_size - 1) // block_size
+        if length == 0 or blocks > CRC_RANGE_MAX_BLOCKS:
+            raise ValueError("Range must be split in 1 to {} blocks".format(CRC_RANGE_MAX_BLOCKS))
+        success, rx = self.send_cmd(self._cmd_packet(CMD_CRC32_RANGE, pack_u32(start_addr) + pack_u32(length) + pack_u32(block_size)),
+                                    max(CRC_RANGE_TIMEOUT, self.serial_timeout), fail_on_checksum_error=False)
+        if not success:
+            return None
+        return [unpack_u32(rx.data[i * 4:]) for i in range(blocks)]
+
     def dump_flash_to_file(self, read_file) -> bool:
         self._fail_if_not_init()
         self._fail_if_not_extended()
@@ -858,7 +1370,7 @@ class NuvoISP(NuvoProg):
             ldrom_data = bytes()
         return curr_config, ldrom_data
 
-    def program_data(self, aprom_data, ldrom_data=None, config: ConfigFlags = None, ldrom_config_override=True, verify_flash=None, _lock=False) -> bool:
+    def program_data(self, aprom_data, ldrom_data=None, config: ConfigFlags = None, ldrom_config_override=True, verify_flash=None, _lock=False, use_store=False) -> bool:
         self._fail_if_not_init()
         update_flashrom = False
         read_config = self.read_config()
@@ -891,7 +1403,16 @@ class NuvoISP(NuvoProg):
         combined_data = aprom_data + ldrom_data
         self.print_vb("Programming Rom (%d KB)..." % (len(combined_data) / 1024))
         # no need to erase, as the update commands will do it for us
-        verified_success = self.update_flash(APROM_ADDR, combined_data, len(combined_data), update_flashrom)
+        verified_success = None
+        if use_store and self.is_icp_bridge:
+            # through slot 0 of the bridge's image store, so the same image isn't sent again next time
+            stored = self.store_image(combined_data, APROM_ADDR, 0, update_flashrom)
+            if stored:
+                verified_success = self.program_stored(0)
+            elif stored is None:
+                eprint("The bridge can't store this image, sending it instead")
+        if verified_success is None:
+            verified_success = self.update_flash(APROM_ADDR, combined_data, len(combined_data), update_flashrom)
         self.write_config(write_config)
 
         if not verified_success:
@@ -902,29 +1423,38 @@ class NuvoISP(NuvoProg):
                 self.write_config(write_config)
             return False
         self.print_vb("ROM programmed.")
+        dropped_out = self.failed_targets
+        if dropped_out:
+            eprint("No device in socket(s) {} after the mass erase, not programmed".format(
+                ", ".join(str(i) for i in range(self.target_count) if dropped_out & (1 << i))))
         if verify_flash is None: # vs. False
             verify_flash = self.supports_extended_cmds
         if verify_flash:
             self._fail_if_not_extended()
-            self.print_vb("Verifying ROM data...")
-            if not self.verify_flash(combined_data, report_unmatched_bytes=True, rom_size=len(combined_data)):
-                self.print_vb("Verification failed.")
-                return False
-            self.print_vb("ROM data verified.")
-            # check that the config was really written correctly (do this AFTER verifying the flash because the device may be locked after programming)
-            # self._disconnect()
-            # self._connect()
-            new_config = self.read_config()
-            if str(new_config) != str(write_config):
-                eprint("Config verification failed.")
-                if not self.silent:
-                    self.print_vb("Expected:")
-                    write_config.print_config()
-                    self.print_vb("Got:")
-                    new_config.print_config()
-                return False
-            self.print_vb("Config verified.")
+            for socket in self._each_selected_target():
+                if socket is not None:
+                    self.print_vb("Socket {}:".format(socket))
+                self.print_vb("Verifying ROM data...")
+                if not self.verify_flash(combined_data, report_unmatched_bytes=True, rom_size=len(combined_data)):
+                    self.print_vb("Verification failed.")
+                    return False
+                self.print_vb("ROM data verified.")
+                # check that the config was really written correctly (do this AFTER verifying the flash because the device may be locked after programming)
+                # self._disconnect()
+                # self._connect()
+                new_config = self.read_config()
+                if str(new_config) != str(write_config):
+                    eprint("Config verification failed.")
+                    if not self.silent:
+                        self.print_vb("Expected:")
+                        write_config.print_config()
+                        self.print_vb("Got:")
+                        new_config.print_config()
+                    return False
+                self.print_vb("Config verified.")
             verified_success = True
+        if dropped_out:
+            return False
 
         self.print_vb("\nResulting Device info:")
         devinfo = self.get_device_info()
@@ -937,7 +1467,7 @@ class NuvoISP(NuvoProg):
         self.print_vb("Finished programming!\n")
         return True
 
-    def program(self, write_file, ldrom_file=None, config: ConfigFlags = None, ldrom_override=True, _no_ldrom=False, _lock=False) -> bool:
+    def program(self, write_file, ldrom_file=None, config: ConfigFlags = None, ldrom_override=True, _no_ldrom=False, _lock=False, use_store=False) -> bool:
         """
         Program the device with the given files and config.
         ------
@@ -947,6 +1477,7 @@ class NuvoISP(NuvoProg):
         If ldrom_file is not specified, the LDROM will not be updated.
         If config is not specified, the default config for the given aprom and ldrom files will be used.
         If ldrom_override is False, the chosen configuration will not be overridden.
+        If use_store is True, the image is kept in the ISP-to-ICP bridge's image store and programmed from there.
 
 
         """
@@ -976,7 +1507,7 @@ class NuvoISP(NuvoProg):
         aprom_data = wf.read()
         wf.close()
 
-        return self.program_data(aprom_data, ldrom_data, config=config, verify_flash=None, ldrom_config_override=ldrom_override, _lock=_lock)
+        return self.program_data(aprom_data, ldrom_data, config=config, verify_flash=None, ldrom_config_override=ldrom_override, _lock=_lock, use_store=use_store)
 
     def verify_flash(self, data, report_unmatched_bytes=False, addr=APROM_ADDR, rom_size=FLASH_SIZE) -> bool:
         """
@@ -993,21 +1524,39 @@ class NuvoISP(NuvoProg):
                 True if the data matches the flash, False otherwise
         """
         self._fail_if_not_init()
-        read_data = self.dump_flash()
-        if read_data == None:
-            return False
-        read_data = read_data[addr:rom_size]
-
-        if len(read_data) > len(data):
+        length = rom_size - addr
+        if length > len(data):
             return False
+        # Compare CRCs of the range first, and read back only the blocks that differ
+        block_size = -(-length // (CRC_RANGE_MAX_BLOCKS * PAGE_SIZE)) * PAGE_SIZE
+        crcs = self.crc32_range(addr, length, block_size) if length > 0 else []
+        if crcs is None:
+            # the firmware can't, read it all back
+            blocks = [(addr, length)]
+        else:
+            blocks = []
+            for i, crc in enumerate(crcs):
+                start = i * block_size
+                size = min(block_size, length - start)
+                if crc != zlib.crc32(data[start:start + size]):
+                    if not report_unmatched_bytes:
+                        return False
+                    blocks.append((addr + start, size))
         result = True
         byte_errors = 0
-        for i in range(len(read_data)):
-            if read_data[i] != data[i]:
-                if not report_unmatched_bytes:
-                    return False
-                result = False
-                byte_errors += 1
+        # the blocks that differ in one go if the firmware can
+        reads = self.dump_ranges(blocks) if len(blocks) > 1 else None
+        if reads is None:
+            reads = [self.dump_flash(start, size) for start, size in blocks]
+        for (start, size), read_data in zip(blocks, reads):
+            if read_data == None:
+                return False
+            for i in range(len(read_data)):
+                if read_data[i] != data[start - addr + i]:
+                    if not report_unmatched_bytes:
+                        return False
+                    result = False
+                    byte_errors += 1
         if not result:
             eprint("Verification failed. %d byte errors." % byte_errors)
         return result
@@ -1020,6 +1569,7 @@ def print_usage():
     print("\t-h, --help:                       print this help")
     print("\t-p, --port=<port>                 serial port to use (default: {} on *nix, {} on windows)".format(DEFAULT_UNIX_PORT, DEFAULT_WIN_PORT))
     print("\t-b, --baud=<baudrate>             baudrate to use (default: 115200)")
+    print("\t-x, --no-fast-baud                stay at the --baud rate with the Arduino ISP-to-ICP bridge instead of switching to up to 2000000")
     print("\t-u, --status:                     print the connected device info and configuration and exit.")
     print("\t-r, --read=<filename>             read entire flash to file")
     print("\t-w, --write=<filename>            write file to APROM")
@@ -1028,12 +1578,14 @@ def print_usage():
     print("\t-k, --lock                        lock the chip after programming (default: False)")
     print("\t-c, --config <filename>           use config file for writing (overrides --lock)")
     print("\t-s, --silent                      silence all output except for errors")
+    print("\t-t, --targets=<n,n,...>           ICP sockets of the Arduino ISP-to-ICP bridge to write to at once (default: 0)")
+    print("\t-S, --store                       keep the image in the Arduino ISP-to-ICP bridge and program it from there (sent only if it changed)")
 
 def main() -> int:
     argv = sys.argv[1:]
     try:
-        opts, _ = getopt.getopt(argv, "hp:b:ur:w:l:sc:nk", [
-                                "help", "port=", "baud=", "status", "read=", "write=", "ldrom=", "silent", "config=", "no-ldrom", "lock"])
+        opts, _ = getopt.getopt(argv, "hp:b:xur:w:l:sc:nkt:S", [
+                                "help", "port=", "baud=", "no-fast-baud", "status", "read=", "write=", "ldrom=", "silent", "config=", "no-ldrom", "lock", "targets=", "store"])
     except getopt.GetoptError:
         eprint("Invalid command line arguments. Please refer to the usage documentation.")
         print_usage()
@@ -1043,6 +1595,7 @@ def main() -> int:
     if (platform.system() == "Windows"):
         port = DEFAULT_WIN_PORT
     baud = DEFAULT_SER_BAUD
+    fast_rates = BRIDGE_FAST_RATES
     config_dump_cmd = False
     read = False
     read_file = ""
@@ -1053,6 +1606,8 @@ def main() -> int:
     lock_chip = False
     silent = False
     no_ldrom = False
+    targets = None
+    use_store = False
 
     brown_out_voltage: float = 2.2
     if len(opts) == 0:
@@ -1066,6 +1621,8 @@ def main() -> int:
             port = arg
         elif opt == "-b" or opt == "--baud":
             baud = int(arg)
+        elif opt == "-x" or opt == "--no-fast-baud":
+            fast_rates = []
         elif opt == "-u" or opt == "--status":
             config_dump_cmd = True
         elif opt == "-r" or opt == "--read":
@@ -1084,6 +1641,17 @@ def main() -> int:
             no_ldrom = True
         elif opt == "-k" or opt == "--lock":
             lock_chip = True
+        elif opt == "-t" or opt == "--targets":
+            try:
+                targets = sorted(set(int(t) for t in arg.split(",")))
+            except ValueError:
+                targets = None
+            if not targets or targets[0] < 0 or targets[-1] >= MAX_TARGETS:
+                eprint("ERROR: --targets takes socket numbers from 0 to {}.\n\n".format(MAX_TARGETS - 1))
+                print_usage()
+                return 2
+        elif opt == "-S" or opt == "--store":
+            use_store = True
         else:
             print_usage()
             return 2
@@ -1135,7 +1703,7 @@ def main() -> int:
             eprint("Error: Could not read config file")
             return 1
     try:
-        with NuvoISP(serial_port=port, serial_rate=baud, silent=silent) as nuvo:
+        with NuvoISP(serial_port=port, serial_rate=baud, silent=silent, fast_rates=fast_rates, targets=targets) as nuvo:
 
             devinfo = nuvo.get_device_info()
 
@@ -1170,7 +1738,7 @@ def main() -> int:
                 config_file = read_file.rsplit(".", 1)[0] + "-config.json"
                 read_config.to_json_file(config_file)
             elif write:
-                if not nuvo.program(write_file, ldrom_file, write_config, _no_ldrom=no_ldrom, _lock=lock_chip):
+                if not nuvo.program(write_file, ldrom_file, write_config, _no_ldrom=no_ldrom, _lock=lock_chip, use_store=use_store):
                     eprint("Programming failed!!")
                     return 1
     except KeyboardInterrupt: